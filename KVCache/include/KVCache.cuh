@@ -27,6 +27,8 @@
 #include <atomic>
 #include <functional>
 #include <iostream>
+#include <memory>
+#include <vector>
 #include <shared_mutex>
 #include <ImportantDefinitions.cuh>
 #include <tbb/concurrent_vector.h>
@@ -238,6 +240,57 @@ namespace kvgpu {
     };
 
 
+    template<typename K>
+    struct BucketModel : public Model<K> {
+
+        BucketModel() : value(16000) {
+
+        }
+
+        /**
+         * Caches hash < v like SimplModel
+         * @param v
+         */
+        explicit BucketModel(int v) : value(v) {
+
+        }
+
+        /**
+         * Caches the keys whose hash % buckets->size() is a set bucket, the buckets are shared by the copies and must
+         * not change afterwards
+         * @param buckets
+         */
+        explicit BucketModel(std::shared_ptr<const std::vector<bool>> buckets) : value(0), buckets(std::move(buckets)) {
+
+        }
+
+        BucketModel(const BucketModel<K> &other) {
+            value = other.value;
+            buckets = other.buckets;
+        }
+
+        /**
+         * Return true if should be cached
+         * @param key
+         * @param hash
+         * @return
+         */
+        bool operator()(K key, unsigned hash) const {
+            if (!buckets)
+                return hash < value;
+            return (*buckets)[hash % buckets->size()];
+        }
+
+        /// the cached buckets, null for a threshold model
+        std::shared_ptr<const std::vector<bool>> getBuckets() const {
+            return buckets;
+        }
+
+    private:
+        int value;
+        std::shared_ptr<const std::vector<bool>> buckets;
+    };
+
     /**
      * KVCache caches keys and values
      * K is the key type
@@ -274,17 +327,15 @@ namespace kvgpu {
     public:
         /**
          * Creates cache
+         * @param sets number of sets, SETS unless the cache shares its memory with others
          */
-        KVCache() : log_requests(new tbb::concurrent_vector<int>(N * SETS)),
-                    log_hash(new tbb::concurrent_vector<unsigned>(N * SETS)),
-                    log_keys(new tbb::concurrent_vector<K>(N * SETS)),
-                    log_values(new tbb::concurrent_vector<V>(N * SETS)),
-                    log_size(N * SETS),
-                    map(new LockingPair<K, V> *[SETS]),
-                    mtx(new mutex[SETS]),
-                    nodes(new std::atomic<Node_t *>[SETS]),
-                    expansions(0) {
-            for (int i = 0; i < SETS; i++) {
+        explicit KVCache(unsigned sets = SETS) : log_size(N * sets),
+                                                 sets(sets),
+                                                 map(new LockingPair<K, V> *[sets]),
+                                                 mtx(new mutex[sets]),
+                                                 nodes(new std::atomic<Node_t *>[sets]),
+                                                 expansions(0) {
+            for (int i = 0; i < sets; i++) {
                 nodes[i] = nullptr;
                 map[i] = new LockingPair<K, V>[N];
                 for (int j = 0; j < N; j++) {
@@ -299,16 +350,12 @@ namespace kvgpu {
          * Removes cache
          */
         ~KVCache() {
-            for (int i = 0; i < SETS; i++) {
+            for (int i = 0; i < sets; i++) {
                 delete[] map[i];
             }
             delete[] map;
             delete[] nodes;
             delete[] mtx;
-            delete log_requests;
-            delete log_hash;
-            delete log_keys;
-            delete log_values;
         }
 
 
@@ -319,15 +366,53 @@ namespace kvgpu {
          * @return
          */
         std::pair<LockingPair<K, V> *, locktype> get(K key, unsigned hash, const Model<K> &mfn) {
-            unsigned setIdx = hash % SETS;
+            locktype unique = lock_set(set_index(hash));
+            LockingPair<K, V> *pair = get_locked(key, hash, mfn);
+            return {pair, std::move(unique)};
+        }
+
+        /**
+         * Returns the set a hash maps to
+         * @param hash
+         * @return
+         */
+        unsigned set_index(unsigned hash) const {
+            return hash % sets;
+        }
+
+        /**
+         * Takes the unique lock of a set so that several get_locked calls on it only lock once
+         * @param setIdx
+         * @return
+         */
+        locktype lock_set(unsigned setIdx) {
+            return locktype(mtx[setIdx]);
+        }
+
+        /**
+         * Prefetches the first bucket and lock of a set ahead of a lock_set / get_locked
+         * @param setIdx
+         */
+        void prefetch_set(unsigned setIdx) {
+            __builtin_prefetch(&mtx[setIdx], 1);
+            __builtin_prefetch(map[setIdx], 1);
+        }
+
+        /**
+         * Same as get, but the caller must already hold lock_set(set_index(hash))
+         * @param key
+         * @param hash
+         * @return
+         */
+        LockingPair<K, V> *get_locked(K key, unsigned hash, const Model<K> &mfn) {
+            unsigned setIdx = set_index(hash);
             LockingPair<K, V> *set = map[setIdx];
-            locktype unique(mtx[setIdx]);
 
             LockingPair<K, V> *firstInvalidPair = nullptr;
 
             for (unsigned i = 0; i < N; i++) {
                 if (set[i].valid != 0 && compare(set[i].key, key) == 0) {
-                    return {&set[i], std::move(unique)};
+                    return &set[i];
                 } else if (!firstInvalidPair && (set[i].valid == 0 || !mfn(set[i].key, hash))) {
                     set[i].valid = 0;
                     firstInvalidPair = &set[i];
@@ -339,7 +424,7 @@ namespace kvgpu {
                 set = node->set;
                 for (unsigned i = 0; i < N; i++) {
                     if (set[i].valid != 0 && compare(set[i].key, key) == 0) {
-                        return {&set[i], std::move(unique)};
+                        return &set[i];
                     } else if (!firstInvalidPair && (set[i].valid == 0 || !mfn(set[i].key, hash))) {
                         set[i].valid = 0;
                         firstInvalidPair = &set[i];
@@ -351,10 +436,6 @@ namespace kvgpu {
 
             if (!firstInvalidPair) {
                 int tmploc = log_size.fetch_add(N);
-                log_requests->grow_to_at_least(log_size);
-                log_hash->grow_to_at_least(log_size);
-                log_keys->grow_to_at_least(log_size);
-                log_values->grow_to_at_least(log_size);
                 prevNode->next = new Node_t(tmploc);
                 expansions++;
                 node = prevNode->next;
@@ -364,7 +445,7 @@ namespace kvgpu {
             firstInvalidPair->valid = 2;
             firstInvalidPair->key = key;
 
-            return {firstInvalidPair, std::move(unique)};
+            return firstInvalidPair;
         }
 
         /**
@@ -374,7 +455,7 @@ namespace kvgpu {
          * @return
          */
         std::pair<LockingPair<K, V> *, sharedlocktype> fast_get(K key, unsigned hash, const Model<K> &mfn) {
-            unsigned setIdx = hash % SETS;
+            unsigned setIdx = hash % sets;
             LockingPair<K, V> *set = map[setIdx];
             sharedlocktype sharedlock(mtx[setIdx]);
 
@@ -402,7 +483,7 @@ namespace kvgpu {
 
         std::pair<LockingPair<K, V> *, locktype>
         get_with_log(K key, unsigned hash, const Model<K> &mfn, size_t &logLoc) {
-            unsigned setIdx = hash % SETS;
+            unsigned setIdx = hash % sets;
             LockingPair<K, V> *set = map[setIdx];
             locktype unique(mtx[setIdx]);
 
@@ -436,10 +517,6 @@ namespace kvgpu {
 
             if (!firstInvalidPair) {
                 int tmploc = log_size.fetch_add(N);
-                log_requests->grow_to_at_least(log_size);
-                log_hash->grow_to_at_least(log_size);
-                log_keys->grow_to_at_least(log_size);
-                log_values->grow_to_at_least(log_size);
                 prevNode->next = new Node_t(tmploc);
                 expansions++;
                 node = prevNode->next;
@@ -456,7 +533,7 @@ namespace kvgpu {
         template<typename H>
         void scan_and_evict(const Model<K> &mfn, const H &hfn, std::unique_lock<std::mutex> modelLock) {
 
-            for (int setIdx = 0; setIdx < SETS; setIdx++) {
+            for (int setIdx = 0; setIdx < sets; setIdx++) {
                 LockingPair<K, V> *set = map[setIdx];
                 locktype unique(mtx[setIdx]);
 
@@ -484,8 +561,8 @@ namespace kvgpu {
             return N;
         }
 
-        constexpr size_t getSETS() {
-            return SETS;
+        size_t getSETS() const {
+            return sets;
         }
 
         void stat() {
@@ -493,13 +570,11 @@ namespace kvgpu {
             //std::cout << "Footprint without expansions: " << (sizeof(*this) + sizeof(LockingPair<K,V>) * SETS * N) / 1024.0 / 1024.0 << " MB" << std::endl;
         }
 
-        tbb::concurrent_vector<int> *log_requests;
-        tbb::concurrent_vector<unsigned> *log_hash;
-        tbb::concurrent_vector<K> *log_keys;
-        tbb::concurrent_vector<V> *log_values;
+        /// number of log locations handed out, the log itself lives with the model epoch writing to it
         std::atomic_size_t log_size;
 
     private:
+        unsigned sets;
         LockingPair<K, V> **map;
         mutex *mtx;
         std::atomic<Node_t *> *nodes;
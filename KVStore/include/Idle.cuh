@@ -0,0 +1,156 @@
+/*
+ * Copyright (c) 2020-2021 dePaul Miller (dsm220@lehigh.edu)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#ifndef KVGPU_IDLE_CUH
+#define KVGPU_IDLE_CUH
+
+/// idle threads park on a futex after backing off, false keeps them busy waiting, must be set before the KVStore is made
+bool IDLE_PARK = true;
+/// how long an idle thread keeps polling at full speed
+int IDLE_SPIN_US = 20;
+/// how long it then polls with pause in between before it parks
+int IDLE_PAUSE_US = 200;
+
+/**
+ * Tells the core a spin-wait loop is running, the pause instruction where there is one
+ */
+inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    _mm_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield" ::: "memory");
+#else
+    asm volatile("" ::: "memory");
+#endif
+}
+
+/**
+ * Where idle consumers of a queue park and its producers wake them. A producer only makes the wake up system call
+ * when a consumer said it parked, so a busy queue costs one load per push.
+ */
+struct parking_t {
+
+    parking_t() : seq(0), parked(0) {}
+
+    parking_t(const parking_t &) = delete;
+
+    /**
+     * Sleeps unless ready returns true, at most timeoutMs
+     * @param ready
+     * @param timeoutMs
+     */
+    template<typename F>
+    void park(F &&ready, int timeoutMs = 100) {
+        uint32_t s = seq.load();
+        parked.fetch_add(1);
+        // a push that missed the parked count is seen here
+        if (!ready()) {
+            timespec ts{timeoutMs / 1000, (timeoutMs % 1000) * 1000000L};
+            syscall(SYS_futex, reinterpret_cast<uint32_t *>(&seq), FUTEX_WAIT_PRIVATE, s, &ts, nullptr, 0);
+        }
+        parked.fetch_sub(1);
+    }
+
+    /**
+     * Wakes n parked consumers, call after making the work visible
+     * @param n
+     */
+    void wake(int n = 1) {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (parked.load() == 0)
+            return;
+        seq.fetch_add(1);
+        syscall(SYS_futex, reinterpret_cast<uint32_t *>(&seq), FUTEX_WAKE_PRIVATE, n, nullptr, nullptr, 0);
+    }
+
+    void wakeAll() {
+        wake(INT_MAX);
+    }
+
+    bool hasParked() const {
+        return parked.load() != 0;
+    }
+
+    std::atomic<uint32_t> seq;
+    std::atomic_int parked;
+};
+
+/**
+ * Idle strategy of one consumer thread. Once it runs out of work it spins for IDLE_SPIN_US, then polls with pause
+ * for IDLE_PAUSE_US and then parks until a producer wakes it, after which it spins again.
+ */
+struct backoff_t {
+
+    backoff_t() : idle(false) {}
+
+    /// the consumer found work
+    void reset() {
+        idle = false;
+    }
+
+    /**
+     * The consumer found no work, backs off for one poll or parks
+     * @param p where to park
+     * @param ready true if work arrived, checked once more before parking
+     */
+    template<typename F>
+    void wait(parking_t &p, F &&ready) {
+        if (!IDLE_PARK)
+            return;
+        auto now = std::chrono::steady_clock::now();
+        if (!idle) {
+            idle = true;
+            since = now;
+            return;
+        }
+        auto elapsed = now - since;
+        if (elapsed < std::chrono::microseconds(IDLE_SPIN_US))
+            return;
+        if (elapsed < std::chrono::microseconds(IDLE_SPIN_US + IDLE_PAUSE_US)) {
+            for (int i = 0; i < 16; ++i) {
+                cpu_relax();
+            }
+            return;
+        }
+        p.park(ready);
+        since = std::chrono::steady_clock::now();
+    }
+
+    bool idle;
+    std::chrono::steady_clock::time_point since;
+};
+
+#endif //KVGPU_IDLE_CUH
@@ -26,8 +26,16 @@
 #include <KVCache.cuh>
 #include <Slab.cuh>
 #include <StandardSlabDefinitions.cuh>
+#include "OrderedIndex.cuh"
+#include "PipelineTrace.cuh"
+#include "WriteAheadLog.cuh"
+#include "SpillTier.cuh"
+#include "Idle.cuh"
+#include "Placement.cuh"
 #include <mutex>
+#include <thread>
 #include <iostream>
+#include <algorithm>
 #include <tbb/concurrent_queue.h>
 #include <tbb/concurrent_vector.h>
 
@@ -36,8 +44,26 @@
 
 int SLAB_SIZE = 1000000;
 
+/// keep an ordered index of the keys so ranges can be scanned, must be set before the KVStore is made
+bool ORDERED_INDEX = false;
+
+/// write-ahead log file for INSERTs and REMOVEs, no log when empty, must be set before the KVStore is made
+std::string WAL_FILE = "";
+/// how often the write-ahead log is committed
+int WAL_COMMIT_INTERVAL_US = 200;
+
+/// segment files of the spill tier are named after this, no spill tier when empty, must be set before the KVStore is made
+std::string SPILL_FILE = "";
+/// size a spill segment is sealed at
+int SPILL_SEGMENT_MB = 64;
+/// keys a backend holds before the INSERTs bound for it go to the spill tier
+size_t SPILL_BACKEND_KEYS = 1 << 26;
+
 const int MAX_ATTEMPTS = 1;
 
+/// how many cache fills ahead the write-back prefetches the set it will lock
+const int WRITEBACK_PREFETCH_DISTANCE = 8;
+
 struct PartitionedSlabUnifiedConfig {
     int size;
     int gpu;
@@ -50,13 +76,27 @@ const std::vector<PartitionedSlabUnifiedConfig> STANDARD_CONFIG = {{SLAB_SIZE, 0
 template<typename K, typename V>
 class Cache {
 public:
-    typedef kvgpu::KVCache<K, V, 1000000, 8> type;
+    /// sets of the cache of a store
+    static const unsigned SETS = 1000000;
+    typedef kvgpu::KVCache<K, V, SETS, 8> type;
+};
+
+/**
+ * Where a store keeps its files and how large its cache is, the defaults come from the globals
+ */
+struct store_options_t {
+    /// write-ahead log, none when empty
+    std::string walFile = WAL_FILE;
+    /// spill segments are named after this, no spill tier when empty
+    std::string spillFile = SPILL_FILE;
+    /// sets of the cache, 0 for all the sets of Cache<K, V>::type
+    unsigned cacheSets = 0;
 };
 
 template<typename V>
 struct ResultsBuffers {
 
-    explicit ResultsBuffers(int s) : requestIDs(new int[s]), resultValues(new V[s]), size(s), retryGPU(false) {
+    explicit ResultsBuffers(int s) : requestIDs(new int[s]), resultValues(new V[s]), size(s) {
         for (int i = 0; i < size; i++)
             requestIDs[i] = -1;
     }
@@ -71,14 +111,12 @@ struct ResultsBuffers {
     volatile int *requestIDs;
     volatile V *resultValues;
     int size;
-    bool retryGPU;
 };
 
 template<>
 struct ResultsBuffers<data_t> {
 
-    explicit ResultsBuffers(int s) : requestIDs(new int[s]), resultValues(new volatile data_t *[s]), size(s),
-                                     retryGPU(false) {
+    explicit ResultsBuffers(int s) : requestIDs(new int[s]), resultValues(new volatile data_t *[s]), size(s) {
         for (int i = 0; i < size; i++) {
             requestIDs[i] = -1;
             resultValues[i] = nullptr;
@@ -99,16 +137,223 @@ struct ResultsBuffers<data_t> {
     volatile int *requestIDs;
     volatile data_t **resultValues;
     int size;
-    bool retryGPU;
 };
 
+/**
+ * Credits a client holds on one backend queue.
+ * One is taken before a BatchData is enqueued and the Slabs thread gives it back once the BatchData has been written
+ * back, so a client never has more than its credits in flight on a queue.
+ */
+struct credit_t {
+
+    explicit credit_t(int c) : available(c) {}
+
+    credit_t(const credit_t &) = delete;
+
+    /// yields until a credit is available and takes it
+    void acquire() {
+        int c = available.load(std::memory_order_relaxed);
+        while (true) {
+            if (c > 0) {
+                if (available.compare_exchange_weak(c, c - 1, std::memory_order_acquire, std::memory_order_relaxed))
+                    return;
+            } else {
+                std::this_thread::yield();
+                c = available.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    void release() {
+        available.fetch_add(1, std::memory_order_release);
+    }
+
+    std::atomic_int available;
+};
+
+/**
+ * Lets one thread wait for everything that entered before it without holding off what enters after.
+ * Entries count in the current phase, synchronize flips the phase and waits for the old one to empty.
+ */
+struct grace_t {
+
+    grace_t() : phase(0) {
+        active[0] = 0;
+        active[1] = 0;
+    }
+
+    grace_t(const grace_t &) = delete;
+
+    /// counts the caller in the current phase until leave and returns that phase
+    int enter() {
+        while (true) {
+            int p = phase.load();
+            active[p]++;
+            // a synchronize that flipped in between may already have seen the old phase empty
+            if (phase.load() == p)
+                return p;
+            active[p]--;
+        }
+    }
+
+    void leave(int p) {
+        active[p]--;
+    }
+
+    /// returns once everything that entered before the call has left
+    void synchronize() {
+        std::unique_lock<std::mutex> l(mtx);
+        int p = phase.load();
+        phase = 1 - p;
+        while (active[p].load() != 0) {
+            std::this_thread::yield();
+        }
+    }
+
+    std::atomic_int phase;
+    std::atomic_int active[2];
+    /// one synchronize at a time
+    std::mutex mtx;
+};
+
+/// stripes the keys written are ordered by, a power of two
+const int WRITE_STRIPES = 1 << 16;
+
+struct write_order_t;
+
+/**
+ * The turns a batch took on the stripes of the keys it writes. The batch waits for them before it writes anything and
+ * each turn passes to the next batch in line once these are dropped.
+ */
+struct write_turns_t {
+
+    write_turns_t() : order(nullptr) {}
+
+    write_turns_t(const write_turns_t &) = delete;
+
+    write_turns_t(write_turns_t &&other) noexcept: order(other.order), tickets(std::move(other.tickets)) {
+        other.tickets.clear();
+    }
+
+    write_turns_t &operator=(write_turns_t &&other) noexcept {
+        release();
+        order = other.order;
+        tickets = std::move(other.tickets);
+        other.tickets.clear();
+        return *this;
+    }
+
+    ~write_turns_t() {
+        release();
+    }
+
+    /// returns once the batches that took turns on these stripes earlier are done with them
+    inline void wait() const;
+
+    write_order_t *order;
+    /// stripe and place in its line
+    std::vector<std::pair<int, uint64_t>> tickets;
+
+private:
+    inline void release();
+};
+
+/**
+ * Orders concurrent batches writing the same keys. A batch takes a turn on the stripes of the keys it writes as its
+ * writes are logged and holds it while they are indexed, spilled, written to the cache and queued to the backends, so
+ * each of them sees the writes to a key in the same order. Turns on all the stripes of a batch are taken at once under
+ * their locks so batches cannot deadlock on them, and a batch waiting for its log records to be durable holds only its
+ * place in line.
+ */
+struct write_order_t {
+
+    write_order_t() : stripes(new std::mutex[WRITE_STRIPES]), next(new uint64_t[WRITE_STRIPES]()),
+                      serving(new std::atomic<uint64_t>[WRITE_STRIPES]), seq(0) {
+        for (int i = 0; i < WRITE_STRIPES; ++i) {
+            serving[i] = 0;
+        }
+    }
+
+    write_order_t(const write_order_t &) = delete;
+
+    /**
+     * Takes turns on the stripes of the INSERTs and REMOVEs in reqs, calling logged while no other batch can take a
+     * turn on them so whatever logged numbers follows the turns. The turns are waited for with wait and held until the
+     * turns returned are dropped.
+     * @param reqs
+     * @param hash
+     * @param logged
+     * @return
+     */
+    template<typename Requests, typename H, typename F>
+    write_turns_t take(const Requests &reqs, const H &hash, F &&logged) {
+        std::vector<int> ids;
+        for (auto &r : reqs) {
+            if (r.requestInteger == REQUEST_INSERT || r.requestInteger == REQUEST_REMOVE) {
+                size_t h = hash(r.key);
+                ids.push_back((h ^ (h >> 16)) & (WRITE_STRIPES - 1));
+            }
+        }
+        std::sort(ids.begin(), ids.end());
+        ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+        std::vector<std::unique_lock<std::mutex>> held;
+        held.reserve(ids.size());
+        for (int id : ids) {
+            held.emplace_back(stripes[id]);
+        }
+        logged();
+        write_turns_t turns;
+        turns.order = this;
+        turns.tickets.reserve(ids.size());
+        for (int id : ids) {
+            turns.tickets.push_back({id, next[id]++});
+        }
+        return turns;
+    }
+
+    /**
+     * Numbers a batch holding its turns, the numbers of the batches writing a key grow in the order they write it
+     * @return
+     */
+    uint64_t stamp() {
+        return ++seq;
+    }
+
+    /// taken to hand out turns
+    std::unique_ptr<std::mutex[]> stripes;
+    /// the next turn of each stripe, under its lock
+    std::unique_ptr<uint64_t[]> next;
+    /// the turn of each stripe being served
+    std::unique_ptr<std::atomic<uint64_t>[]> serving;
+    std::atomic<uint64_t> seq;
+};
+
+void write_turns_t::wait() const {
+    for (auto &t : tickets) {
+        while (order->serving[t.first].load() != t.second) {
+            std::this_thread::yield();
+        }
+    }
+}
+
+void write_turns_t::release() {
+    // a turn is only passed on once it came, whether or not it was waited for
+    wait();
+    for (auto &t : tickets) {
+        order->serving[t.first]++;
+    }
+    tickets.clear();
+}
+
 template<typename K, typename V>
 struct BatchData {
     BatchData(int rbStart, std::shared_ptr<ResultsBuffers<V>> rb, int s) : keys(s), values(s), requests(s), hashes(s),
                                                                            requestID(s),
-                                                                           handleInCache(s), resBuf(rb),
-                                                                           resBufStart(rbStart), size(s), idx(0),
-                                                                           flush(false) {
+                                                                           handleInCache(s), dupStart(s), dupCount(s),
+                                                                           resBuf(rb), resBufStart(rbStart), dupBase(0),
+                                                                           size(s), idx(0), flush(false),
+                                                                           credit(nullptr), start(0), phase(-1),
+                                                                           seq(0) {
         for (int i = 0; i < s; i++) {
             handleInCache[i] = false;
         }
@@ -122,20 +367,37 @@ struct BatchData {
     std::vector<unsigned> hashes;
     std::vector<int> requestID;
     std::vector<bool> handleInCache;
+    /// duplicates of entry i are dupIDs[dupStart[i], dupStart[i] + dupCount[i]) and answered at dupBase + dupStart[i]
+    std::vector<int> dupStart;
+    std::vector<int> dupCount;
+    std::shared_ptr<const std::vector<int>> dupIDs;
     std::shared_ptr<ResultsBuffers<V>> resBuf;
     int resBufStart;
+    int dupBase;
     int size;
     int idx;
     bool flush;
+    std::shared_ptr<credit_t> credit;
+    /// tsc_clock_t ticks when the client took the batch, 0 for log drains which are not timed
+    uint64_t start;
+    /// Slabs::backends phase the batch was enqueued in, -1 if it was pushed without Slabs::push
+    int phase;
+    /// model of the epoch the batch was placed under, the cache fills of its write back follow it
+    std::shared_ptr<const kvgpu::Model<K>> model;
+    /// write_order_t::stamp of the client batch when there is a spill tier, 0 for log drains and loads
+    uint64_t seq;
 };
 
 template<typename K>
 struct BatchData<K, data_t> {
     BatchData(int rbStart, std::shared_ptr<ResultsBuffers<data_t>> &rb, int s) : keys(s), values(s), requests(s),
                                                                                  hashes(s), requestID(s),
-                                                                                 handleInCache(s), resBuf(rb),
-                                                                                 resBufStart(rbStart), size(s), idx(0),
-                                                                                 flush(false) {
+                                                                                 handleInCache(s), dupStart(s),
+                                                                                 dupCount(s), resBuf(rb),
+                                                                                 resBufStart(rbStart), dupBase(0),
+                                                                                 size(s), idx(0), flush(false),
+                                                                                 credit(nullptr), start(0), phase(-1),
+                                                                                 seq(0) {
         for (int i = 0; i < s; i++) {
             handleInCache[i] = false;
         }
@@ -149,21 +411,171 @@ struct BatchData<K, data_t> {
     std::vector<unsigned> hashes;
     std::vector<int> requestID;
     std::vector<bool> handleInCache;
+    /// duplicates of entry i are dupIDs[dupStart[i], dupStart[i] + dupCount[i]) and answered at dupBase + dupStart[i]
+    std::vector<int> dupStart;
+    std::vector<int> dupCount;
+    std::shared_ptr<const std::vector<int>> dupIDs;
     std::shared_ptr<ResultsBuffers<data_t>> resBuf;
     int resBufStart;
+    int dupBase;
     int size;
     int idx;
     bool flush;
+    std::shared_ptr<credit_t> credit;
+    /// tsc_clock_t ticks when the client took the batch, 0 for log drains which are not timed
+    uint64_t start;
+    /// Slabs::backends phase the batch was enqueued in, -1 if it was pushed without Slabs::push
+    int phase;
+    /// model of the epoch the batch was placed under, the cache fills of its write back follow it
+    std::shared_ptr<const kvgpu::Model<K>> model;
+    /// write_order_t::stamp of the client batch when there is a spill tier, 0 for log drains and loads
+    uint64_t seq;
 };
 
-struct StatData {
-    std::chrono::high_resolution_clock::time_point timestampEnd;
-    std::chrono::high_resolution_clock::time_point timestampWriteBack;
-    std::chrono::high_resolution_clock::time_point timestampStartBatch;
-    std::chrono::high_resolution_clock::time_point timestampDequeueToBatch;
-    float duration;
-    int size;
-    int timesGoingToCache;
+/**
+ * Answers the in-batch duplicates of a GET with the value its first occurrence got.
+ * slot is where the first duplicate is answered and ids holds the request ids of the count duplicates
+ */
+template<typename V>
+void respond_to_duplicates(ResultsBuffers<V> &rb, int slot, const int *ids, int count, V value) {
+    for (int k = 0; k < count; ++k) {
+        rb.resultValues[slot + k] = value;
+        asm volatile("":: : "memory");
+        rb.requestIDs[slot + k] = ids[k];
+    }
+}
+
+/**
+ * Answers the in-batch duplicates of a GET, each gets its own copy of value since the ResultsBuffers owns them
+ */
+inline void respond_to_duplicates(ResultsBuffers<data_t> &rb, int slot, const int *ids, int count, const data_t *value) {
+    for (int k = 0; k < count; ++k) {
+        data_t *cpy = nullptr;
+        if (value) {
+            cpy = new data_t(value->size);
+            memcpy(cpy->data, value->data, cpy->size);
+        }
+        rb.resultValues[slot + k] = cpy;
+        asm volatile("":: : "memory");
+        rb.requestIDs[slot + k] = ids[k];
+    }
+}
+
+template<typename K, typename V>
+void respond_to_duplicates(BatchData<K, V> *bd, int i, V value) {
+    if (bd->dupCount[i] > 0) {
+        respond_to_duplicates(*bd->resBuf, bd->dupBase + bd->dupStart[i], bd->dupIDs->data() + bd->dupStart[i],
+                              bd->dupCount[i], value);
+    }
+}
+
+template<typename K>
+void respond_to_duplicates(BatchData<K, data_t> *bd, int i, const data_t *value) {
+    if (bd->dupCount[i] > 0) {
+        respond_to_duplicates(*bd->resBuf, bd->dupBase + bd->dupStart[i], bd->dupIDs->data() + bd->dupStart[i],
+                              bd->dupCount[i], value);
+    }
+}
+
+/**
+ * The model a batch runs under and the log its cache-tier writes go to.
+ * change_model publishes a new epoch, the old one is drained to the backend once no batch runs under it anymore and
+ * backend work of the new epoch holds off until ready so it queues behind that drain.
+ */
+template<typename K, typename V, typename M>
+struct ModelEpoch {
+
+    ModelEpoch(std::shared_ptr<M> m, size_t logSize, bool r) : model(std::move(m)), log_requests(logSize),
+                                                                log_hash(logSize), log_keys(logSize),
+                                                                log_values(logSize), active(0), ready(r) {}
+
+    ModelEpoch(const ModelEpoch<K, V, M> &) = delete;
+
+    /**
+     * Records a cache-tier write at the log location of its cache entry
+     * @param logLoc
+     * @param request
+     * @param hash
+     * @param key
+     * @param value
+     */
+    void log(size_t logLoc, int request, unsigned hash, K key, V value) {
+        if (logLoc >= log_requests.size()) {
+            log_requests.grow_to_at_least(logLoc + 1);
+            log_hash.grow_to_at_least(logLoc + 1);
+            log_keys.grow_to_at_least(logLoc + 1);
+            log_values.grow_to_at_least(logLoc + 1);
+        }
+        log_requests[logLoc] = request;
+        log_hash[logLoc] = hash;
+        log_keys[logLoc] = key;
+        log_values[logLoc] = value;
+    }
+
+    std::shared_ptr<M> model;
+    tbb::concurrent_vector<int> log_requests;
+    tbb::concurrent_vector<unsigned> log_hash;
+    tbb::concurrent_vector<K> log_keys;
+    tbb::concurrent_vector<V> log_values;
+    /// batches running under this epoch
+    std::atomic_int active;
+    /// the log of the previous epoch has been enqueued to the backend
+    std::atomic_bool ready;
+};
+
+/**
+ * Holds the current ModelEpoch, readers never block and a change only waits for the batches it replaced
+ */
+template<typename K, typename V, typename M>
+struct PublishedModel {
+
+    explicit PublishedModel(std::shared_ptr<ModelEpoch<K, V, M>> e) : current(std::move(e)) {}
+
+    /**
+     * Returns the current epoch and counts the caller as running under it until leave
+     * @return
+     */
+    std::shared_ptr<ModelEpoch<K, V, M>> enter() {
+        while (true) {
+            auto e = std::atomic_load(&current);
+            e->active++;
+            // a change that published in between may already have seen active == 0
+            if (std::atomic_load(&current) == e)
+                return e;
+            e->active--;
+        }
+    }
+
+    void leave(const std::shared_ptr<ModelEpoch<K, V, M>> &e) {
+        e->active--;
+    }
+
+    std::shared_ptr<ModelEpoch<K, V, M>> load() const {
+        return std::atomic_load(&current);
+    }
+
+    /**
+     * Publishes e and returns the epoch it replaces
+     * @param e
+     * @return
+     */
+    std::shared_ptr<ModelEpoch<K, V, M>> publish(std::shared_ptr<ModelEpoch<K, V, M>> e) {
+        return std::atomic_exchange(&current, std::move(e));
+    }
+
+    std::shared_ptr<ModelEpoch<K, V, M>> current;
+    /// one change at a time
+    std::mutex mtx;
+};
+
+/**
+ * A write-back entry that has to be filled into the cache.
+ * set is the cache set, wb indexes writeBack and i is the position in that BatchData
+ */
+struct CacheFill {
+    unsigned set;
+    int wb;
+    int i;
 };
 
 template<typename K, typename V, typename M>
@@ -174,10 +586,17 @@ struct Slabs {
     typedef tbb::concurrent_queue<BatchData<K, V> *> q_t;
 
     Slabs(const std::vector<PartitionedSlabUnifiedConfig> &config, std::shared_ptr<typename Cache<K, V>::type> cache,
-          std::shared_ptr<M> m) : numslabs(config.size()), slabs(new SlabUnified<K, V>[numslabs]),
-                                  gpu_qs(new q_t[numslabs]), done(false),
-                                  mops(new tbb::concurrent_vector<StatData>[numslabs]), _cache(cache), ops(0), load(0),
-                                  model(m) {
+          std::shared_ptr<PublishedModel<K, V, M>> m,
+          std::shared_ptr<SpillTier<K, V>> sp = nullptr) : numslabs(config.size()),
+                                                        slabs(new SlabUnified<K, V>[numslabs]),
+                                                        gpu_qs(new q_t[numslabs]), done(false),
+                                                        trace(std::make_shared<PipelineTracer>(numslabs)),
+                                                        _cache(cache), ops(0), load(0), models(m),
+                                                        spill(sp), parking(new parking_t[numslabs]),
+                                                        resident(new std::atomic<int64_t>[numslabs]) {
+        for (int i = 0; i < numslabs; ++i) {
+            resident[i] = 0;
+        }
         for (int i = 0; i < config.size(); i++) {
             cudaStream_t *stream = new cudaStream_t();
             *stream = config[i].stream;
@@ -185,6 +604,7 @@ struct Slabs {
         }
         for (int i = 0; i < numslabs; ++i) {
             threads.push_back(std::thread([this](int tid) {
+                BACKEND_CPUS.pin();
                 K *keys = slabs[tid].getBatchKeys();
                 V *values = slabs[tid].getBatchValues();
                 int *requests = slabs[tid].getBatchRequests();
@@ -195,6 +615,13 @@ struct Slabs {
                 std::vector<std::pair<int, BatchData<K, V> *>> writeBack;
                 writeBack.reserve(THREADS_PER_BLOCK * BLOCKS / 512);
 
+                std::vector<CacheFill> cacheFills;
+                cacheFills.reserve(THREADS_PER_BLOCK * BLOCKS);
+
+                std::vector<int> spilled;
+
+                backoff_t backoff;
+
                 int index = THREADS_PER_BLOCK * BLOCKS;
                 while (!done.load()) {
                     writeBack.clear();
@@ -205,7 +632,7 @@ struct Slabs {
 
                     BatchData<K, V> *res;
 
-                    auto timestampWriteToBatch = std::chrono::high_resolution_clock::now();
+                    uint64_t timestampWriteToBatch = tsc_clock_t::now();
 
                     if (holdonto) {
                         //std::cerr << "Hold onto set " << tid << std::endl;
@@ -226,6 +653,7 @@ struct Slabs {
                     while (attempts < MAX_ATTEMPTS && index < THREADS_PER_BLOCK * BLOCKS) {
                         if (this->gpu_qs[tid].try_pop(res)) {
                             load--;
+                            trace->recordQueueWait(tid, res->start, tsc_clock_t::now());
                             //std::cerr << "Got a batch on handler thread " << tid << "\n";
                             if (res->idx + index > THREADS_PER_BLOCK * BLOCKS) {
                                 //std::cerr << "Cannot add any more to batch " << tid << "\n";
@@ -248,51 +676,114 @@ struct Slabs {
                         }
                     }
 
+                    if (index == 0) {
+                        backoff.wait(parking[tid], [&]() { return !gpu_qs[tid].empty() || done.load(); });
+                        continue;
+                    }
+                    backoff.reset();
+
                     if (index > 0) {
 
                         //std::cerr << "Batching " << tid << "\n";
 
-                        auto timestampStartBatch = std::chrono::high_resolution_clock::now();
+                        uint64_t timestampStartBatch = tsc_clock_t::now();
 
                         float t;
 
                         this->slabs[tid].diy_batch(t, ceil(index / 512.0), 512);
 
-                        auto timestampWriteBack = std::chrono::high_resolution_clock::now();
-                        int timesGoingToCache = 0;
-                        for (auto &wb : writeBack) {
+                        uint64_t timestampWriteBack = tsc_clock_t::now();
 
-                            int rbLoc = wb.second->resBufStart;
+                        // GETs the backend did not find may have been spilled
+                        if (spill) {
+                            count_resident(tid, values, requests, index);
+                            spilled.clear();
+                            spill->resolve(keys, values, requests, index, spilled);
+                            supersede(writeBack, keys, requests);
+                        }
 
-                            for (int i = 0; i < wb.second->idx; ++i) {
+                        // respond to everything that does not touch the cache and collect the cache fills
+                        cacheFills.clear();
+                        uint64_t answered = tsc_clock_t::now();
+                        for (int w = 0; w < writeBack.size(); ++w) {
 
-                                if (wb.second->handleInCache[i]) {
-                                    timesGoingToCache++;
-                                    auto cacheRes = _cache->get(wb.second->keys[i], wb.second->hashes[i],
-                                                                *(this->model));
-                                    if (cacheRes.first->valid == 1) {
-                                        wb.second->resBuf->resultValues[rbLoc + i] = cacheRes.first->value;
-                                    } else {
-                                        cacheRes.first->valid = 1;
-                                        cacheRes.first->value = values[wb.first + i];
-                                        cacheRes.first->deleted = (values[wb.first + i] == EMPTY<V>::value);
-                                    }
-                                    asm volatile("":: : "memory");
+                            BatchData<K, V> *bd = writeBack[w].second;
+                            int rbLoc = bd->resBufStart;
 
-                                    wb.second->resBuf->requestIDs[rbLoc + i] = wb.second->requestID[i];
+                            for (int i = 0; i < bd->idx; ++i) {
 
+                                if (bd->handleInCache[i]) {
+                                    cacheFills.push_back({_cache->set_index(bd->hashes[i]), w, i});
                                 } else {
-                                    wb.second->resBuf->resultValues[rbLoc + i] = values[wb.first + i];
+                                    bd->resBuf->resultValues[rbLoc + i] = values[writeBack[w].first + i];
+                                    respond_to_duplicates(bd, i, values[writeBack[w].first + i]);
                                     asm volatile("":: : "memory");
-                                    wb.second->resBuf->requestIDs[rbLoc + i] = wb.second->requestID[i];
+                                    bd->resBuf->requestIDs[rbLoc + i] = bd->requestID[i];
+                                    record_latency(bd->requests[i], LATENCY_BACKEND, bd->start, answered,
+                                                   1 + bd->dupCount[i]);
                                 }
                             }
+                        }
+                        int timesGoingToCache = cacheFills.size();
+
+                        // group the fills by set so each set lock is taken once
+                        std::stable_sort(cacheFills.begin(), cacheFills.end(),
+                                         [](const CacheFill &lhs, const CacheFill &rhs) {
+                                             return lhs.set < rhs.set;
+                                         });
+
+                        kvgpu::locktype setLock;
+                        for (size_t f = 0; f < cacheFills.size(); ++f) {
+
+                            if (f + WRITEBACK_PREFETCH_DISTANCE < cacheFills.size()) {
+                                _cache->prefetch_set(cacheFills[f + WRITEBACK_PREFETCH_DISTANCE].set);
+                            }
+
+                            CacheFill &fill = cacheFills[f];
+                            if (f == 0 || cacheFills[f - 1].set != fill.set) {
+                                setLock = _cache->lock_set(fill.set);
+                            }
+
+                            BatchData<K, V> *bd = writeBack[fill.wb].second;
+                            int rbLoc = bd->resBufStart;
+                            int i = fill.i;
+
+                            auto cacheRes = _cache->get_locked(bd->keys[i], bd->hashes[i], *bd->model);
+                            V result = values[writeBack[fill.wb].first + i];
+                            if (cacheRes->valid == 1) {
+                                result = cacheRes->value;
+                            } else {
+                                cacheRes->valid = 1;
+                                cacheRes->value = result;
+                                cacheRes->deleted = (result == EMPTY<V>::value);
+                            }
+                            bd->resBuf->resultValues[rbLoc + i] = result;
+                            respond_to_duplicates(bd, i, result);
+                            asm volatile("":: : "memory");
+
+                            bd->resBuf->requestIDs[rbLoc + i] = bd->requestID[i];
+                        }
+                        if (setLock.owns_lock()) {
+                            setLock.unlock();
+                        }
+
+                        uint64_t filled = tsc_clock_t::now();
+                        for (auto &fill : cacheFills) {
+                            BatchData<K, V> *bd = writeBack[fill.wb].second;
+                            record_latency(bd->requests[fill.i], LATENCY_MISS_FILL, bd->start, filled,
+                                           1 + bd->dupCount[fill.i]);
+                        }
+
+                        for (auto &wb : writeBack) {
+                            if (wb.second->credit)
+                                wb.second->credit->release();
+                            if (wb.second->phase >= 0)
+                                backends.leave(wb.second->phase);
                             delete wb.second;
                         }
 
-                        mops[tid].push_back(
-                                {std::chrono::high_resolution_clock::now(), timestampWriteBack, timestampStartBatch,
-                                 timestampWriteToBatch, t, index, timesGoingToCache});
+                        trace->recordBatch(tid, {tsc_clock_t::now(), timestampWriteBack, timestampStartBatch,
+                                                 timestampWriteToBatch, t, index, timesGoingToCache});
 
                         ops += index;
                         //std::cerr << "Batched " << tid << "\n";
@@ -306,19 +797,65 @@ struct Slabs {
     ~Slabs() {
         std::cerr << "Slabs deleted\n";
         done = true;
+        for (int i = 0; i < numslabs; ++i) {
+            parking[i].wakeAll();
+        }
         for (auto &t : threads) {
             if (t.joinable())
                 t.join();
         }
         delete[] gpu_qs;
         delete[] slabs;
-        delete[] mops;
     }
 
-    void clearMops() {
-        for (int i = 0; i < numslabs; i++) {
-            mops[i].clear();
+    /**
+     * True once backend queue i holds SPILL_BACKEND_KEYS keys, client batches then spill the INSERTs bound for it
+     * @param i
+     * @return
+     */
+    bool full(int i) const {
+        return spill && resident[i].load(std::memory_order_relaxed) >= (int64_t) SPILL_BACKEND_KEYS;
+    }
+
+    /**
+     * Keys backend queue i can take before it is full, at most SPILL_BACKEND_KEYS and below 0 once it is past full
+     * @param i
+     * @return
+     */
+    int64_t room(int i) const {
+        return (int64_t) SPILL_BACKEND_KEYS - resident[i].load(std::memory_order_relaxed);
+    }
+
+    /**
+     * Counts the keys backend queue i gained and lost in a round from what the backend answered,
+     * an INSERT that replaced nothing adds one and a REMOVE that found a value takes one
+     */
+    void count_resident(int i, const V *values, const int *requests, int n) {
+        int64_t delta = 0;
+        for (int p = 0; p < n; ++p) {
+            if (requests[p] == REQUEST_INSERT && values[p] == EMPTY<V>::value)
+                delta++;
+            else if (requests[p] == REQUEST_REMOVE && values[p] != EMPTY<V>::value)
+                delta--;
         }
+        resident[i] += delta;
+    }
+
+    /// spilled records older than the INSERTs the backend applied this round are garbage now
+    template<typename WB>
+    void supersede(const WB &writeBack, const K *keys, const int *requests) {
+        for (auto &wb : writeBack) {
+            if (wb.second->seq == 0)
+                continue;
+            for (int i = 0; i < wb.second->idx; ++i) {
+                if (requests[wb.first + i] == REQUEST_INSERT)
+                    spill->supersede(keys[wb.first + i], wb.second->seq);
+            }
+        }
+    }
+
+    void clearMops() {
+        trace->reset();
         ops = 0;
     }
 
@@ -326,16 +863,50 @@ struct Slabs {
         return ops;
     }
 
+    /**
+     * Enqueues b on backend queue i, it counts toward quiesce until it has been written back
+     * @param i
+     * @param b
+     */
+    void push(int i, BatchData<K, V> *b) {
+        b->phase = backends.enter();
+        load++;
+        gpu_qs[i].push(b);
+        parking[i].wake();
+    }
+
+    /**
+     * Returns once every client batch that started before the call is done with the cache and everything it
+     * enqueued has been written back. Batches that start later run on.
+     */
+    void quiesce() {
+        clients.synchronize();
+        backends.synchronize();
+    }
+
     int numslabs;
     SlabUnified<K, V> *slabs;
     q_t *gpu_qs;
     std::vector<std::thread> threads;
     std::atomic_bool done;
-    tbb::concurrent_vector<StatData> *mops;
+    std::shared_ptr<PipelineTracer> trace;
     std::shared_ptr<typename Cache<K, V>::type> _cache;
     std::atomic_size_t ops;
     std::atomic_int load;
-    std::shared_ptr<M> model;
+    std::shared_ptr<PublishedModel<K, V, M>> models;
+    std::shared_ptr<SpillTier<K, V>> spill;
+    /// client batches between logging their writes and entering clients
+    grace_t logged;
+    /// client batches between enter and leave
+    grace_t clients;
+    /// the order of the writes to a key
+    write_order_t writes;
+    /// BatchData between push and write back
+    grace_t backends;
+    /// where the idle threads of every queue park
+    std::unique_ptr<parking_t[]> parking;
+    /// keys each backend queue holds, counted when there is a spill tier
+    std::unique_ptr<std::atomic<int64_t>[]> resident;
 };
 
 template<typename K, typename M>
@@ -346,23 +917,36 @@ struct Slabs<K, data_t *, M> {
     typedef tbb::concurrent_queue<BatchData<K, data_t> *> q_t;
 
     Slabs(const std::vector<PartitionedSlabUnifiedConfig> &config,
-          std::shared_ptr<typename Cache<K, data_t *>::type> cache, std::shared_ptr<M> m) : done(false),
-                                                                                            mops(new tbb::concurrent_vector<StatData>[config.size()]),
-                                                                                            _cache(cache), ops(0),
-                                                                                            load(0), model(m) {
+          std::shared_ptr<typename Cache<K, data_t *>::type> cache,
+          std::shared_ptr<PublishedModel<K, data_t *, M>> m,
+          std::shared_ptr<SpillTier<K, data_t *>> sp = nullptr) : done(false),
+                                                               trace(std::make_shared<PipelineTracer>(config.size())),
+                                                               _cache(cache), ops(0), load(0), models(m),
+                                                               spill(sp) {
         std::unordered_map<int, std::shared_ptr<SlabUnified<K, data_t *>>> gpusToSlab;
+        // the queues are numbered densely in the order their GPUs first appear, config need not start at GPU 0
+        std::unordered_map<int, int> queueOf;
         for (int i = 0; i < config.size(); i++) {
-            if (gpusToSlab.find(config[i].gpu) == gpusToSlab.end())
+            if (gpusToSlab.find(config[i].gpu) == gpusToSlab.end()) {
                 gpusToSlab[config[i].gpu] = std::make_shared<SlabUnified<K, data_t *>>(config[i].size, config[i].gpu);
+                int q = queueOf.size();
+                queueOf[config[i].gpu] = q;
+            }
         }
         gpu_qs = new q_t[gpusToSlab.size()];
         numslabs = gpusToSlab.size();
+        parking.reset(new parking_t[numslabs]);
+        resident.reset(new std::atomic<int64_t>[numslabs]);
+        for (int i = 0; i < numslabs; ++i) {
+            resident[i] = 0;
+        }
 
         for (int i = 0; i < config.size(); i++) {
             //config[i].stream;
             threads.push_back(
-                    std::thread([this](int tid, int gpu, std::shared_ptr<SlabUnified<K, data_t *>> slab,
+                    std::thread([this](int tid, int queue, std::shared_ptr<SlabUnified<K, data_t *>> slab,
                                        cudaStream_t stream) {
+                                    BACKEND_CPUS.pin();
                                     slab->setGPU();
                                     auto batchData = new BatchBuffer<K, data_t *>();
 
@@ -376,6 +960,15 @@ struct Slabs<K, data_t *, M> {
                                     std::vector<std::pair<int, BatchData<K, data_t> *>> writeBack;
                                     writeBack.reserve(THREADS_PER_BLOCK * BLOCKS / 512);
 
+                                    std::vector<CacheFill> cacheFills;
+                                    cacheFills.reserve(THREADS_PER_BLOCK * BLOCKS);
+
+                                    // entries whose value was read from the spill tier this round
+                                    std::vector<int> spilled;
+                                    std::vector<bool> fromSpill(THREADS_PER_BLOCK * BLOCKS, false);
+
+                                    backoff_t backoff;
+
                                     int index = THREADS_PER_BLOCK * BLOCKS;
                                     while (!done.load()) {
                                         writeBack.clear();
@@ -386,7 +979,7 @@ struct Slabs<K, data_t *, M> {
 
                                         BatchData<K, data_t> *res;
 
-                                        auto timestampWriteToBatch = std::chrono::high_resolution_clock::now();
+                                        uint64_t timestampWriteToBatch = tsc_clock_t::now();
 
                                         if (holdonto) {
                                             //std::cerr << "Hold onto set " << tid << std::endl;
@@ -405,8 +998,9 @@ struct Slabs<K, data_t *, M> {
                                         int attempts = 0;
 
                                         while (attempts < MAX_ATTEMPTS && index < THREADS_PER_BLOCK * BLOCKS) {
-                                            if (this->gpu_qs[gpu].try_pop(res)) {
+                                            if (this->gpu_qs[queue].try_pop(res)) {
                                                 load--;
+                                                trace->recordQueueWait(tid, res->start, tsc_clock_t::now());
                                                 //std::cerr << "Got a batch on handler thread " << tid << "\n";
                                                 if (res->idx + index > THREADS_PER_BLOCK * BLOCKS) {
                                                     //std::cerr << "Cannot add any more to batch " << tid << "\n";
@@ -430,11 +1024,19 @@ struct Slabs<K, data_t *, M> {
                                             }
                                         }
 
+                                        if (index == 0) {
+                                            backoff.wait(parking[queue], [&]() {
+                                                return !gpu_qs[queue].empty() || done.load();
+                                            });
+                                            continue;
+                                        }
+                                        backoff.reset();
+
                                         if (index > 0) {
 
                                             //std::cerr << "Batching " << tid << "\n";
 
-                                            auto timestampStartBatch = std::chrono::high_resolution_clock::now();
+                                            uint64_t timestampStartBatch = tsc_clock_t::now();
 
                                             cudaEvent_t start, stop;
 
@@ -450,65 +1052,138 @@ struct Slabs<K, data_t *, M> {
                                             slab->moveBufferToCPU(batchData, stream);
                                             gpuErrchk(cudaStreamSynchronize(stream));
 
-                                            auto timestampWriteBack = std::chrono::high_resolution_clock::now();
+                                            uint64_t timestampWriteBack = tsc_clock_t::now();
                                             gpuErrchk(cudaEventElapsedTime(&t, start, stop));
                                             gpuErrchk(cudaEventDestroy(start));
                                             gpuErrchk(cudaEventDestroy(stop));
-                                            int timesGoingToCache = 0;
-                                            for (auto &wb : writeBack) {
 
-                                                int rbLoc = wb.second->resBufStart;
+                                            // GETs the backend did not find may have been spilled
+                                            if (spill) {
+                                                count_resident(queue, values, requests, index);
+                                                spilled.clear();
+                                                spill->resolve(keys, values, requests, index, spilled);
+                                                for (int p : spilled) {
+                                                    fromSpill[p] = true;
+                                                }
+                                                supersede(writeBack, keys, requests);
+                                            }
 
-                                                for (int i = 0; i < wb.second->idx; ++i) {
+                                            // respond to everything that does not touch the cache and collect the cache fills
+                                            cacheFills.clear();
+                                            uint64_t answered = tsc_clock_t::now();
+                                            for (int w = 0; w < writeBack.size(); ++w) {
 
-                                                    if (wb.second->handleInCache[i]) {
-                                                        timesGoingToCache++;
-                                                        auto cacheRes = _cache->get(wb.second->keys[i], wb.second->hashes[i],
-                                                                                    *(this->model));
-                                                        if (cacheRes.first->valid == 1) {
-                                                            data_t *cpy = nullptr;
-                                                            if (cacheRes.first->deleted == 0) {
-                                                                cpy = new data_t(cacheRes.first->value->size);
-                                                                memcpy(cpy->data, cacheRes.first->value->data, cpy->size);
-                                                            }
-
-                                                            wb.second->resBuf->resultValues[rbLoc + i] = cpy;
-                                                        } else {
-                                                            cacheRes.first->valid = 1;
-                                                            cacheRes.first->value = values[wb.first + i];
-                                                            cacheRes.first->deleted = (values[wb.first + i] ==
-                                                                                       EMPTY<data_t *>::value);
-                                                        }
-                                                        asm volatile("":: : "memory");
+                                                BatchData<K, data_t> *bd = writeBack[w].second;
+                                                int wbStart = writeBack[w].first;
+                                                int rbLoc = bd->resBufStart;
 
-                                                        wb.second->resBuf->requestIDs[rbLoc + i] = wb.second->requestID[i];
+                                                for (int i = 0; i < bd->idx; ++i) {
 
+                                                    if (bd->handleInCache[i]) {
+                                                        cacheFills.push_back({_cache->set_index(bd->hashes[i]), w, i});
                                                     } else {
-                                                        if (requests[wb.first + i] == REQUEST_REMOVE) {
-                                                            wb.second->resBuf->resultValues[rbLoc +
-                                                                                            i] = values[wb.first + i];
-                                                        } else if (requests[wb.first + i] == REQUEST_GET) {
+                                                        if (requests[wbStart + i] == REQUEST_REMOVE) {
+                                                            bd->resBuf->resultValues[rbLoc + i] = values[wbStart + i];
+                                                        } else if (requests[wbStart + i] == REQUEST_GET) {
                                                             data_t *cpy = nullptr;
-                                                            if (values[wb.first + i]) {
-                                                                cpy = new data_t(values[wb.first + i]->size);
-                                                                memcpy(cpy->data, values[wb.first + i]->data, cpy->size);
+                                                            if (values[wbStart + i]) {
+                                                                cpy = new data_t(values[wbStart + i]->size);
+                                                                memcpy(cpy->data, values[wbStart + i]->data, cpy->size);
                                                             }
-                                                            wb.second->resBuf->resultValues[rbLoc + i] = cpy;
+                                                            bd->resBuf->resultValues[rbLoc + i] = cpy;
+                                                            respond_to_duplicates(bd, i, values[wbStart + i]);
                                                         } else {
-                                                            wb.second->resBuf->resultValues[rbLoc + i] = nullptr;
+                                                            bd->resBuf->resultValues[rbLoc + i] = nullptr;
                                                         }
 
                                                         asm volatile("":: : "memory");
-                                                        wb.second->resBuf->requestIDs[rbLoc + i] = wb.second->requestID[i];
+                                                        bd->resBuf->requestIDs[rbLoc + i] = bd->requestID[i];
+                                                        record_latency(bd->requests[i], LATENCY_BACKEND, bd->start,
+                                                                       answered, 1 + bd->dupCount[i]);
                                                     }
                                                 }
+                                            }
+                                            int timesGoingToCache = cacheFills.size();
+
+                                            // group the fills by set so each set lock is taken once
+                                            std::stable_sort(cacheFills.begin(), cacheFills.end(),
+                                                             [](const CacheFill &lhs, const CacheFill &rhs) {
+                                                                 return lhs.set < rhs.set;
+                                                             });
+
+                                            kvgpu::locktype setLock;
+                                            for (size_t f = 0; f < cacheFills.size(); ++f) {
+
+                                                if (f + WRITEBACK_PREFETCH_DISTANCE < cacheFills.size()) {
+                                                    _cache->prefetch_set(
+                                                            cacheFills[f + WRITEBACK_PREFETCH_DISTANCE].set);
+                                                }
+
+                                                CacheFill &fill = cacheFills[f];
+                                                if (f == 0 || cacheFills[f - 1].set != fill.set) {
+                                                    setLock = _cache->lock_set(fill.set);
+                                                }
+
+                                                BatchData<K, data_t> *bd = writeBack[fill.wb].second;
+                                                int wbStart = writeBack[fill.wb].first;
+                                                int rbLoc = bd->resBufStart;
+                                                int i = fill.i;
+
+                                                auto cacheRes = _cache->get_locked(bd->keys[i], bd->hashes[i],
+                                                                                   *bd->model);
+                                                data_t *result = values[wbStart + i];
+                                                if (cacheRes->valid == 1) {
+                                                    result = cacheRes->deleted == 0 ? cacheRes->value : nullptr;
+                                                } else {
+                                                    cacheRes->valid = 1;
+                                                    cacheRes->value = result;
+                                                    cacheRes->deleted = (result == EMPTY<data_t *>::value);
+                                                    // spilled values are freed after the round, the cache keeps a copy
+                                                    if (fromSpill[wbStart + i]) {
+                                                        cacheRes->value = new data_t(result->size);
+                                                        memcpy(cacheRes->value->data, result->data, result->size);
+                                                    }
+                                                }
+
+                                                data_t *cpy = nullptr;
+                                                if (result) {
+                                                    cpy = new data_t(result->size);
+                                                    memcpy(cpy->data, result->data, cpy->size);
+                                                }
+                                                bd->resBuf->resultValues[rbLoc + i] = cpy;
+                                                respond_to_duplicates(bd, i, result);
+                                                asm volatile("":: : "memory");
+
+                                                bd->resBuf->requestIDs[rbLoc + i] = bd->requestID[i];
+                                            }
+                                            if (setLock.owns_lock()) {
+                                                setLock.unlock();
+                                            }
+
+                                            uint64_t filled = tsc_clock_t::now();
+                                            for (auto &fill : cacheFills) {
+                                                BatchData<K, data_t> *bd = writeBack[fill.wb].second;
+                                                record_latency(bd->requests[fill.i], LATENCY_MISS_FILL, bd->start,
+                                                               filled, 1 + bd->dupCount[fill.i]);
+                                            }
+
+                                            for (int p : spilled) {
+                                                wal_codec_t<data_t *>::free(values[p]);
+                                                values[p] = nullptr;
+                                                fromSpill[p] = false;
+                                            }
+
+                                            for (auto &wb : writeBack) {
+                                                if (wb.second->credit)
+                                                    wb.second->credit->release();
+                                                if (wb.second->phase >= 0)
+                                                    backends.leave(wb.second->phase);
                                                 delete wb.second;
                                             }
 
-                                            mops[tid].push_back(
-                                                    {std::chrono::high_resolution_clock::now(), timestampWriteBack,
-                                                     timestampStartBatch,
-                                                     timestampWriteToBatch, t, index, timesGoingToCache});
+                                            trace->recordBatch(tid, {tsc_clock_t::now(), timestampWriteBack,
+                                                                     timestampStartBatch, timestampWriteToBatch, t,
+                                                                     index, timesGoingToCache});
 
                                             ops += index;
                                             //std::cerr << "Batched " << tid << "\n";
@@ -516,7 +1191,7 @@ struct Slabs<K, data_t *, M> {
                                         }
                                     }
                                     if (stream != cudaStreamDefault) gpuErrchk(cudaStreamDestroy(stream));
-                                }, i, config[i].gpu,
+                                }, i, queueOf[config[i].gpu],
                                 gpusToSlab[config[i].gpu], config[i].stream));
 
         }
@@ -525,18 +1200,64 @@ struct Slabs<K, data_t *, M> {
     ~Slabs() {
         std::cerr << "Slabs deleted\n";
         done = true;
+        for (int i = 0; i < numslabs; ++i) {
+            parking[i].wakeAll();
+        }
         for (auto &t : threads) {
             if (t.joinable())
                 t.join();
         }
         delete[] gpu_qs;
-        delete[] mops;
     }
 
-    void clearMops() {
-        for (int i = 0; i < numslabs; i++) {
-            mops[i].clear();
+    /**
+     * True once backend queue i holds SPILL_BACKEND_KEYS keys, client batches then spill the INSERTs bound for it
+     * @param i
+     * @return
+     */
+    bool full(int i) const {
+        return spill && resident[i].load(std::memory_order_relaxed) >= (int64_t) SPILL_BACKEND_KEYS;
+    }
+
+    /**
+     * Keys backend queue i can take before it is full, at most SPILL_BACKEND_KEYS and below 0 once it is past full
+     * @param i
+     * @return
+     */
+    int64_t room(int i) const {
+        return (int64_t) SPILL_BACKEND_KEYS - resident[i].load(std::memory_order_relaxed);
+    }
+
+    /**
+     * Counts the keys backend queue i gained and lost in a round from what the backend answered,
+     * an INSERT that replaced nothing adds one and a REMOVE that found a value takes one
+     */
+    void count_resident(int i, data_t *const *values, const int *requests, int n) {
+        int64_t delta = 0;
+        for (int p = 0; p < n; ++p) {
+            if (requests[p] == REQUEST_INSERT && values[p] == EMPTY<data_t *>::value)
+                delta++;
+            else if (requests[p] == REQUEST_REMOVE && values[p] != EMPTY<data_t *>::value)
+                delta--;
         }
+        resident[i] += delta;
+    }
+
+    /// spilled records older than the INSERTs the backend applied this round are garbage now
+    template<typename WB>
+    void supersede(const WB &writeBack, const K *keys, const int *requests) {
+        for (auto &wb : writeBack) {
+            if (wb.second->seq == 0)
+                continue;
+            for (int i = 0; i < wb.second->idx; ++i) {
+                if (requests[wb.first + i] == REQUEST_INSERT)
+                    spill->supersede(keys[wb.first + i], wb.second->seq);
+            }
+        }
+    }
+
+    void clearMops() {
+        trace->reset();
         ops = 0;
     }
 
@@ -544,15 +1265,49 @@ struct Slabs<K, data_t *, M> {
         return ops;
     }
 
+    /**
+     * Enqueues b on backend queue i, it counts toward quiesce until it has been written back
+     * @param i
+     * @param b
+     */
+    void push(int i, BatchData<K, data_t> *b) {
+        b->phase = backends.enter();
+        load++;
+        gpu_qs[i].push(b);
+        parking[i].wake();
+    }
+
+    /**
+     * Returns once every client batch that started before the call is done with the cache and everything it
+     * enqueued has been written back. Batches that start later run on.
+     */
+    void quiesce() {
+        clients.synchronize();
+        backends.synchronize();
+    }
+
     int numslabs;
     q_t *gpu_qs;
     std::vector<std::thread> threads;
     std::atomic_bool done;
-    tbb::concurrent_vector<StatData> *mops;
+    std::shared_ptr<PipelineTracer> trace;
     std::shared_ptr<typename Cache<K, data_t *>::type> _cache;
     std::atomic_size_t ops;
     std::atomic_int load;
-    std::shared_ptr<M> model;
+    std::shared_ptr<PublishedModel<K, data_t *, M>> models;
+    std::shared_ptr<SpillTier<K, data_t *>> spill;
+    /// client batches between logging their writes and entering clients
+    grace_t logged;
+    /// client batches between enter and leave
+    grace_t clients;
+    /// the order of the writes to a key
+    write_order_t writes;
+    /// BatchData between push and write back
+    grace_t backends;
+    /// where the idle threads of every queue park
+    std::unique_ptr<parking_t[]> parking;
+    /// keys each backend queue holds, counted when there is a spill tier
+    std::unique_ptr<std::atomic<int64_t>[]> resident;
 };
 
 
@@ -560,16 +1315,22 @@ template<typename K, typename V, typename M>
 class KVStore {
 public:
 
-    KVStore() : cache(std::make_shared<typename Cache<K, V>::type>()), model(new M()) {
-        slab = std::make_shared<Slabs<K, V, M>>(STANDARD_CONFIG, this->cache, model);
+    KVStore() : cache(std::make_shared<typename Cache<K, V>::type>()), models(initialModel(cache)),
+                index(ORDERED_INDEX ? std::make_shared<OrderedIndex<K>>() : nullptr), wal(openWAL()),
+                spill(openSpill()) {
+        slab = std::make_shared<Slabs<K, V, M>>(STANDARD_CONFIG, this->cache, models, spill);
     }
 
-    KVStore(const std::vector<PartitionedSlabUnifiedConfig> &conf) : cache(
-            std::make_shared<typename Cache<K, V>::type>()), model(new M()) {
-        slab = std::make_shared<Slabs<K, V, M>>(conf, this->cache, model);
+    KVStore(const std::vector<PartitionedSlabUnifiedConfig> &conf, const store_options_t &opts = store_options_t())
+            : cache(opts.cacheSets ? std::make_shared<typename Cache<K, V>::type>(opts.cacheSets)
+                                   : std::make_shared<typename Cache<K, V>::type>()), models(initialModel(cache)),
+              index(ORDERED_INDEX ? std::make_shared<OrderedIndex<K>>() : nullptr), wal(openWAL(opts.walFile)),
+              spill(openSpill(opts.spillFile)) {
+        slab = std::make_shared<Slabs<K, V, M>>(conf, this->cache, models, spill);
     }
 
-    KVStore(const KVStore<K, V, M> &other) : slab(other.slab), cache(other.cache), model(other.model) {
+    KVStore(const KVStore<K, V, M> &other) : slab(other.slab), cache(other.cache), models(other.models),
+                                             index(other.index), wal(other.wal), spill(other.spill) {
 
     }
 
@@ -586,14 +1347,60 @@ public:
     }
 
     std::shared_ptr<M> getModel() {
-        return model;
+        return models->load()->model;
+    }
+
+    std::shared_ptr<PublishedModel<K, V, M>> getModels() {
+        return models;
+    }
+
+    /**
+     * @return the ordered index of the keys, nullptr unless ORDERED_INDEX was set
+     */
+    std::shared_ptr<OrderedIndex<K>> getIndex() {
+        return index;
+    }
+
+    /**
+     * @return the write-ahead log, nullptr unless the store has a log file
+     */
+    std::shared_ptr<WriteAheadLog> getWAL() {
+        return wal;
+    }
+
+    /**
+     * @return the spill tier, nullptr unless the store has a spill file
+     */
+    std::shared_ptr<SpillTier<K, V>> getSpill() {
+        return spill;
     }
 
 
 private:
+
+    static std::shared_ptr<WriteAheadLog> openWAL(const std::string &file = WAL_FILE) {
+        if (file.empty())
+            return nullptr;
+        return std::make_shared<WriteAheadLog>(file, std::chrono::microseconds(WAL_COMMIT_INTERVAL_US));
+    }
+
+    static std::shared_ptr<SpillTier<K, V>> openSpill(const std::string &file = SPILL_FILE) {
+        if (file.empty())
+            return nullptr;
+        return std::make_shared<SpillTier<K, V>>(file, (size_t) SPILL_SEGMENT_MB << 20);
+    }
+
+    static std::shared_ptr<PublishedModel<K, V, M>> initialModel(std::shared_ptr<typename Cache<K, V>::type> &c) {
+        return std::make_shared<PublishedModel<K, V, M>>(
+                std::make_shared<ModelEpoch<K, V, M>>(std::make_shared<M>(), c->getN() * c->getSETS(), true));
+    }
+
     std::shared_ptr<Slabs<K, V, M>> slab;
     std::shared_ptr<typename Cache<K, V>::type> cache;
-    std::shared_ptr<M> model;
+    std::shared_ptr<PublishedModel<K, V, M>> models;
+    std::shared_ptr<OrderedIndex<K>> index;
+    std::shared_ptr<WriteAheadLog> wal;
+    std::shared_ptr<SpillTier<K, V>> spill;
 };
 
 #endif //KVGPU_KVSTORE_CUH
@@ -0,0 +1,266 @@
+/*
+ * Copyright (c) 2020-2021 dePaul Miller (dsm220@lehigh.edu)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <utility>
+#include <memory>
+#include <atomic>
+#include <future>
+#include <mutex>
+#include <condition_variable>
+#include <list>
+#include <tbb/concurrent_queue.h>
+#include "KVStoreClient.cuh"
+#include "Idle.cuh"
+
+#ifndef KVGPU_KVSTOREASYNCCLIENT_CUH
+#define KVGPU_KVSTOREASYNCCLIENT_CUH
+
+/**
+ * How a result is taken out of a ResultsBuffers slot
+ * @tparam V
+ */
+template<typename V>
+struct AsyncValue {
+    typedef V type;
+
+    static V take(ResultsBuffers<V> &rb, int slot) {
+        return rb.resultValues[slot];
+    }
+};
+
+template<>
+struct AsyncValue<data_t> {
+    typedef data_t *type;
+
+    /// the caller owns the value afterwards, so the ResultsBuffers must not free it
+    static data_t *take(ResultsBuffers<data_t> &rb, int slot) {
+        data_t *v = (data_t *) rb.resultValues[slot];
+        rb.resultValues[slot] = nullptr;
+        return v;
+    }
+};
+
+/**
+ * Per key client. Requests from any number of threads are gathered into batches that are a multiple of 512, which
+ * are sent when batchSize requests are waiting or flushInterval passed, and each request gets its own future.
+ * K is the type of the Key
+ * V is the type of the Value
+ * M is the type of the Model
+ * @tparam K
+ * @tparam V
+ * @tparam M
+ */
+template<typename K, typename V, typename M>
+class KVStoreAsyncClient {
+public:
+    typedef typename AsyncValue<V>::type value_t;
+    typedef RequestWrapper<K, value_t> RW;
+
+    KVStoreAsyncClient() = delete;
+
+    explicit KVStoreAsyncClient(KVStoreCtx<K, V, M> ctx, int batchSize = 512,
+                                std::chrono::microseconds flushInterval = std::chrono::microseconds(100)) :
+            client(ctx), batchSize(batchSize), flushInterval(flushInterval), pendingCount(0), done(false),
+            flushed(false) {
+        assert(batchSize > 0 && batchSize % 512 == 0);
+        flushThread = std::thread([this]() { flusher(); });
+        completionThread = std::thread([this]() { completer(); });
+    }
+
+    KVStoreAsyncClient(const KVStoreAsyncClient<K, V, M> &) = delete;
+
+    /**
+     * Sends what is still pending and waits for every outstanding request to complete
+     */
+    ~KVStoreAsyncClient() {
+        {
+            std::unique_lock<std::mutex> l(mtx);
+            done = true;
+        }
+        cv.notify_one();
+        flushThread.join();
+        completionThread.join();
+    }
+
+    /**
+     * Gets key, the future holds the value found
+     * @param key
+     * @return
+     */
+    std::future<value_t> get(K key) {
+        return submit({key, value_t(), REQUEST_GET});
+    }
+
+    /**
+     * Inserts value at key, the future is ready once the insert is applied
+     * @param key
+     * @param value
+     * @return
+     */
+    std::future<value_t> put(K key, value_t value) {
+        return submit({key, value, REQUEST_INSERT});
+    }
+
+    /**
+     * Removes key, the future is ready once the remove is applied
+     * @param key
+     * @return
+     */
+    std::future<value_t> remove(K key) {
+        return submit({key, value_t(), REQUEST_REMOVE});
+    }
+
+    KVStoreClient<K, V, M> &getClient() {
+        return client;
+    }
+
+private:
+
+    struct Pending {
+        RW req;
+        std::promise<value_t> result;
+    };
+
+    struct InFlight {
+        std::shared_ptr<ResultsBuffers<V>> rb;
+        std::vector<std::promise<value_t>> results;
+        std::vector<bool> answered;
+        int remaining;
+    };
+
+    std::future<value_t> submit(RW req) {
+        Pending p{req, std::promise<value_t>()};
+        auto f = p.result.get_future();
+        pending.push(std::move(p));
+        if (pendingCount.fetch_add(1) + 1 == batchSize) {
+            cv.notify_one();
+        }
+        return f;
+    }
+
+    void flusher() {
+        while (true) {
+            {
+                std::unique_lock<std::mutex> l(mtx);
+                cv.wait_for(l, flushInterval, [this]() {
+                    return pendingCount.load() >= batchSize || done;
+                });
+            }
+            bool stopping = done.load();
+
+            // full batches first, a partial one only once the timer ran out or we are shutting down
+            do {
+                send();
+            } while (pendingCount.load() >= batchSize || (stopping && pendingCount.load() > 0));
+
+            if (stopping)
+                break;
+        }
+        flushed = true;
+        completions.wake();
+    }
+
+    void send() {
+        std::vector<RW> reqs;
+        reqs.reserve(batchSize);
+        auto b = new InFlight();
+        b->results.reserve(batchSize);
+
+        Pending p;
+        while (reqs.size() < batchSize && pending.try_pop(p)) {
+            pendingCount--;
+            reqs.push_back(p.req);
+            b->results.push_back(std::move(p.result));
+        }
+        if (reqs.empty()) {
+            delete b;
+            return;
+        }
+
+        b->remaining = reqs.size();
+        b->answered.assign(reqs.size(), false);
+        reqs.resize((reqs.size() + 511) / 512 * 512, {K(), value_t(), REQUEST_EMPTY});
+        b->rb = std::make_shared<ResultsBuffers<V>>(reqs.size());
+
+        client.batch(reqs, b->rb);
+        inflight.push(b);
+        completions.wake();
+    }
+
+    void completer() {
+        std::list<std::unique_ptr<InFlight>> waiting;
+        backoff_t backoff;
+        while (true) {
+            InFlight *f;
+            while (inflight.try_pop(f)) {
+                waiting.emplace_back(f);
+            }
+            if (waiting.empty()) {
+                if (flushed.load() && inflight.empty())
+                    break;
+                // nothing is outstanding, park until the flusher sends a batch or stops
+                backoff.wait(completions, [this]() { return !inflight.empty() || flushed.load(); });
+                continue;
+            }
+            backoff.reset();
+
+            bool progress = false;
+            for (auto it = waiting.begin(); it != waiting.end();) {
+                InFlight &b = **it;
+                for (int slot = 0; slot < b.answered.size(); ++slot) {
+                    int id = b.rb->requestIDs[slot];
+                    if (!b.answered[slot] && id != -1) {
+                        std::atomic_thread_fence(std::memory_order_acquire);
+                        b.answered[slot] = true;
+                        b.remaining--;
+                        b.results[id].set_value(AsyncValue<V>::take(*b.rb, slot));
+                        progress = true;
+                    }
+                }
+                if (b.remaining == 0) {
+                    it = waiting.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+            if (!progress)
+                std::this_thread::yield();
+        }
+    }
+
+    KVStoreClient<K, V, M> client;
+    int batchSize;
+    std::chrono::microseconds flushInterval;
+    tbb::concurrent_queue<Pending> pending;
+    std::atomic_int pendingCount;
+    tbb::concurrent_queue<InFlight *> inflight;
+    /// where the completer parks while no batch is outstanding
+    parking_t completions;
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::atomic_bool done;
+    std::atomic_bool flushed;
+    std::thread flushThread;
+    std::thread completionThread;
+};
+
+#endif //KVGPU_KVSTOREASYNCCLIENT_CUH
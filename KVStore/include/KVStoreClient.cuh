@@ -52,8 +52,8 @@ public:
 
     }
 
-    void batch(std::vector<RequestWrapper<K, V>> &req_vector, std::shared_ptr<ResultsBuffers<V>> resBuf, std::vector<std::chrono::high_resolution_clock::time_point>& times) {
-        client->batch(req_vector, resBuf, times);
+    void batch(std::vector<RequestWrapper<K, V>> &req_vector, std::shared_ptr<ResultsBuffers<V>> resBuf) {
+        client->batch(req_vector, resBuf);
     }
 
     float hitRate() {
@@ -68,6 +68,46 @@ public:
         return client->getHits();
     }
 
+    size_t getOperations() {
+        return client->getOperations();
+    }
+
+    size_t getDedups() {
+        return client->getDedups();
+    }
+
+    size_t getCacheCapacity() {
+        return client->getCacheCapacity();
+    }
+
+    size_t recover(const std::string &snapshotFile = "") {
+        return client->recover(snapshotFile);
+    }
+
+    size_t snapshot(const std::string &filename) {
+        return client->snapshot(filename);
+    }
+
+    std::shared_ptr<WriteAheadLog> getWAL() {
+        return client->getWAL();
+    }
+
+    std::shared_ptr<SpillTier<K, V>> getSpill() {
+        return client->getSpill();
+    }
+
+    size_t scan(K lo, K hi, size_t max, std::vector<std::pair<K, V>> &out) {
+        return client->scan(lo, hi, max, out);
+    }
+
+    void startTraceExport(const std::string &filename, std::chrono::milliseconds interval) {
+        client->startTraceExport(filename, interval);
+    }
+
+    bool writeChromeTrace(const std::string &filename) {
+        return client->writeChromeTrace(filename);
+    }
+
     size_t getOps() {
         return client->getOps();
     }
@@ -76,8 +116,8 @@ public:
         return client->stat();
     }
 
-    std::future<void> change_model(M &newModel, block_t *block, double& time) {
-        return client->change_model(newModel, block, time);
+    std::future<void> change_model(M &newModel, double& time) {
+        return client->change_model(newModel, time);
     }
 
     M getModel(){
@@ -110,8 +150,8 @@ public:
 
     }
 
-    void batch(std::vector<RequestWrapper<K, data_t*>> &req_vector, std::shared_ptr<ResultsBuffers<data_t>>& resBuf, std::vector<std::chrono::high_resolution_clock::time_point>& times) {
-        client->batch(req_vector, resBuf, times);
+    void batch(std::vector<RequestWrapper<K, data_t*>> &req_vector, std::shared_ptr<ResultsBuffers<data_t>>& resBuf) {
+        client->batch(req_vector, resBuf);
     }
 
     float hitRate() {
@@ -126,6 +166,50 @@ public:
         return client->getHits();
     }
 
+    size_t getOperations() {
+        return client->getOperations();
+    }
+
+    size_t getDedups() {
+        return client->getDedups();
+    }
+
+    size_t getCacheCapacity() {
+        return client->getCacheCapacity();
+    }
+
+    size_t recover(const std::string &snapshotFile = "") {
+        return client->recover(snapshotFile);
+    }
+
+    size_t bulkLoad(const K *keys, data_t *const *values, size_t n) {
+        return client->bulkLoad(keys, values, n);
+    }
+
+    size_t snapshot(const std::string &filename) {
+        return client->snapshot(filename);
+    }
+
+    std::shared_ptr<WriteAheadLog> getWAL() {
+        return client->getWAL();
+    }
+
+    std::shared_ptr<SpillTier<K, data_t *>> getSpill() {
+        return client->getSpill();
+    }
+
+    size_t scan(K lo, K hi, size_t max, std::vector<std::pair<K, data_t *>> &out) {
+        return client->scan(lo, hi, max, out);
+    }
+
+    void startTraceExport(const std::string &filename, std::chrono::milliseconds interval) {
+        client->startTraceExport(filename, interval);
+    }
+
+    bool writeChromeTrace(const std::string &filename) {
+        return client->writeChromeTrace(filename);
+    }
+
     size_t getOps() {
         return client->getOps();
     }
@@ -134,8 +218,8 @@ public:
         return client->stat();
     }
 
-    std::future<void> change_model(M &newModel, block_t *block, double& time) {
-        return client->change_model(newModel, block, time);
+    std::future<void> change_model(M &newModel, double& time) {
+        return client->change_model(newModel, time);
     }
 
     M getModel(){
@@ -169,8 +253,8 @@ public:
 
     }
 
-    void batch(std::vector<RequestWrapper<K, V>> &req_vector, std::shared_ptr<ResultsBuffers<V>> resBuf, std::vector<std::chrono::high_resolution_clock::time_point>& times) {
-        client->batch(req_vector, resBuf, times);
+    void batch(std::vector<RequestWrapper<K, V>> &req_vector, std::shared_ptr<ResultsBuffers<V>> resBuf) {
+        client->batch(req_vector, resBuf);
     }
 
     float hitRate() {
@@ -219,8 +303,8 @@ public:
 
     }
 
-    void batch(std::vector<RequestWrapper<K, V>> &req_vector, std::shared_ptr<ResultsBuffers<V>> resBuf, std::vector<std::chrono::high_resolution_clock::time_point>& times) {
-        client->batch(req_vector, resBuf, times);
+    void batch(std::vector<RequestWrapper<K, V>> &req_vector, std::shared_ptr<ResultsBuffers<V>> resBuf) {
+        client->batch(req_vector, resBuf);
     }
 
     float hitRate() {
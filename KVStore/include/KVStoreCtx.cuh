@@ -37,11 +37,16 @@ public:
 
     }
 
+    KVStoreCtx(const std::vector<PartitionedSlabUnifiedConfig>& conf, const store_options_t& opts) : k(conf, opts) {
+
+    }
+
 
     ~KVStoreCtx() {}
 
     std::unique_ptr<KVStoreInternalClient<K, V, M>> getClient() {
-        return std::make_unique<KVStoreInternalClient<K, V, M>>(k.getSlab(), k.getCache(), k.getModel());
+        return std::make_unique<KVStoreInternalClient<K, V, M>>(k.getSlab(), k.getCache(), k.getModels(),
+                                                                k.getIndex(), k.getWAL());
     }
 
 private:
@@ -59,11 +64,16 @@ public:
 
     }
 
+    KVStoreCtx(const std::vector<PartitionedSlabUnifiedConfig>& conf, const store_options_t& opts) : k(conf, opts) {
+
+    }
+
 
     ~KVStoreCtx() {}
 
     std::unique_ptr<KVStoreInternalClient<K, data_t, M>> getClient() {
-        return std::make_unique<KVStoreInternalClient<K, data_t, M>>(k.getSlab(), k.getCache(), k.getModel());
+        return std::make_unique<KVStoreInternalClient<K, data_t, M>>(k.getSlab(), k.getCache(), k.getModels(),
+                                                                     k.getIndex(), k.getWAL());
     }
 
 private:
@@ -21,14 +21,17 @@
  */
 
 #include "KVStore.cuh"
+#include "Snapshot.cuh"
 #include <functional>
 #include <chrono>
 #include <tbb/concurrent_queue.h>
+#include <unordered_set>
 
 #ifndef KVGPU_KVSTOREINTERNALCLIENT_CUH
 #define KVGPU_KVSTOREINTERNALCLIENT_CUH
 
-int LOAD_THRESHOLD = BLOCKS * 10000;
+/// credits each client holds per backend queue, i.e. the BatchData it may have in flight on it
+int CREDITS_PER_BACKEND = BLOCKS * 8;
 
 template<typename K, typename V>
 struct RequestWrapper {
@@ -39,37 +42,6 @@ struct RequestWrapper {
     unsigned requestInteger;
 };
 
-struct block_t {
-    std::condition_variable cond;
-    std::mutex mtx;
-    int count;
-    int crossing;
-
-    block_t(int n) : count(n), crossing(0) {}
-
-    void wait() {
-        std::unique_lock<std::mutex> ulock(mtx);
-
-        crossing++;
-
-        // wait here
-
-        cond.wait(ulock);
-    }
-
-    bool threads_blocked() {
-        std::unique_lock<std::mutex> ulock(mtx);
-        return crossing == count;
-    }
-
-    void wake() {
-        std::unique_lock<std::mutex> ulock(mtx);
-        cond.notify_all();
-        crossing = 0;
-    }
-
-};
-
 template<typename K, typename V>
 void schedule_for_batch_helper(K *&keys, V *&values, unsigned *requests, unsigned *hashes,
                                std::unique_lock<kvgpu::mutex> *locks, unsigned *&correspondence,
@@ -85,6 +57,66 @@ void schedule_for_batch_helper(K *&keys, V *&values, unsigned *requests, unsigne
     index++;
 }
 
+/**
+ * Open-addressed scratch table batch() uses to find repeated keys in a batch.
+ * Entries are stamped with a generation so the table is reused between batches without being cleared.
+ * @tparam K
+ */
+template<typename K>
+struct dedup_table_t {
+
+    struct entry_t {
+        entry_t() : key(), leader(-1), gen(0) {}
+
+        K key;
+        int leader;
+        unsigned gen;
+    };
+
+    dedup_table_t() : mask(0), gen(0) {}
+
+    /**
+     * Readies the table for a batch of n requests
+     * @param n
+     */
+    void reset(size_t n) {
+        size_t cap = 1024;
+        while (cap < 2 * n)
+            cap <<= 1;
+        if (entries.size() < cap) {
+            entries.assign(cap, entry_t());
+            gen = 0;
+        }
+        if (++gen == 0) {
+            entries.assign(entries.size(), entry_t());
+            gen = 1;
+        }
+        mask = entries.size() - 1;
+    }
+
+    /**
+     * Returns the index of the GET of key that later GETs can reuse, -1 if there is none
+     * @param key
+     * @param hash
+     * @return
+     */
+    int &find(K key, unsigned hash) {
+        size_t pos = (hash * 2654435761u) & mask;
+        while (entries[pos].gen == gen && compare(entries[pos].key, key) != 0)
+            pos = (pos + 1) & mask;
+        if (entries[pos].gen != gen) {
+            entries[pos].key = key;
+            entries[pos].leader = -1;
+            entries[pos].gen = gen;
+        }
+        return entries[pos].leader;
+    }
+
+    std::vector<entry_t> entries;
+    size_t mask;
+    unsigned gen;
+};
+
 /**
  * K is the type of the Key
  * V is the type of the Value
@@ -97,11 +129,16 @@ template<typename K, typename V, typename M>
 class KVStoreInternalClient {
 public:
     KVStoreInternalClient(std::shared_ptr<Slabs<K, V, M>> s, std::shared_ptr<typename Cache<K, V>::type> c,
-                          std::shared_ptr<M> m) : numslabs(s->numslabs),
+                          std::shared_ptr<PublishedModel<K, V, M>> m,
+                          std::shared_ptr<OrderedIndex<K>> idx = nullptr,
+                          std::shared_ptr<WriteAheadLog> w = nullptr) : numslabs(s->numslabs),
                                                   slabs(s), cache(c), hits(0),
-                                                  operations(0), start(std::chrono::high_resolution_clock::now()),
-                                                  model(m) {
-
+                                                  operations(0), dedups(0),
+                                                  start(std::chrono::high_resolution_clock::now()),
+                                                  models(m), index(idx), wal(w) {
+        for (int i = 0; i < numslabs; ++i) {
+            credits.push_back(std::make_shared<credit_t>(CREDITS_PER_BACKEND));
+        }
     }
 
     ~KVStoreInternalClient() {}
@@ -111,17 +148,102 @@ public:
     /**
      * Performs the batch of operations given
      * @param req_vector
+     * @param resBuf
+     * @param logWrites false when replaying the write-ahead log
      */
     void batch(std::vector<RequestWrapper<K, V>> &req_vector, std::shared_ptr<ResultsBuffers<V>> resBuf,
-               std::vector<std::chrono::high_resolution_clock::time_point> &times) {
-        bool dontDoGPU = false;
+               bool logWrites = true) {
+        uint64_t batchStart = tsc_clock_t::now();
+        //std::cerr << req_vector.size() << std::endl;
+        assert(req_vector.size() % 512 == 0 && req_vector.size() <= THREADS_PER_BLOCK * BLOCKS * numslabs);
 
-        if (slabs->load >= LOAD_THRESHOLD) {
-            dontDoGPU = true;
+        // logged as the turns on the stripes of the keys written are taken, so the lsns follow the order in which the
+        // writes to a key reach the index, the spill tier, the cache and the backends. The writes are made visible
+        // only once durable, and a batch waits for that and for its turns before entering, holding only its lsn and
+        // its place in line, so it holds back neither a quiesce nor a model change
+        int logging = slabs->logged.enter();
+        uint64_t lsn = 0;
+        write_turns_t ordered;
+        if (index || wal || slabs->spill) {
+            ordered = slabs->writes.take(req_vector, hfn, [&]() {
+                if (wal && logWrites)
+                    lsn = wal->append(req_vector);
+            });
+        }
+        if (lsn != 0)
+            wal->waitDurable(lsn);
+        ordered.wait();
+
+        int inflight = slabs->clients.enter();
+        slabs->logged.leave(logging);
+        auto epoch = models->enter();
+
+        int n = req_vector.size();
+
+        // a GET repeating an earlier GET of the same key, with no write to that key in between, is not performed
+        // and gets the result of the first one instead
+        static thread_local dedup_table_t<K> dedup;
+        std::vector<int> leaderOf(n, -1);
+        std::vector<int> dupStart(n, 0);
+        std::vector<int> dupCount(n, 0);
+        auto dupIDs = std::make_shared<std::vector<int>>();
+        int performed = 0;
+        int duplicates = 0;
+        int writes = 0;
+
+        dedup.reset(n);
+        for (int i = 0; i < n; ++i) {
+            const RW &req = req_vector[i];
+            if (req.requestInteger == REQUEST_EMPTY)
+                continue;
+            int &leader = dedup.find(req.key, hfn(req.key));
+            if (req.requestInteger != REQUEST_GET) {
+                leader = -1;
+                writes++;
+            } else if (leader == -1) {
+                leader = i;
+            } else {
+                leaderOf[i] = leader;
+                dupCount[leader]++;
+                duplicates++;
+                continue;
+            }
+            performed++;
         }
 
-        //std::cerr << req_vector.size() << std::endl;
-        assert(req_vector.size() % 512 == 0 && req_vector.size() <= THREADS_PER_BLOCK * BLOCKS * numslabs);
+        // lay the duplicates of each GET out contiguously, they are answered after everything performed
+        if (duplicates > 0) {
+            int offset = 0;
+            for (int i = 0; i < n; ++i) {
+                dupStart[i] = offset;
+                offset += dupCount[i];
+            }
+            dupIDs->resize(duplicates);
+            for (int i = 0; i < n; ++i) {
+                if (leaderOf[i] != -1)
+                    (*dupIDs)[dupStart[leaderOf[i]]++] = i;
+            }
+            for (int i = 0; i < n; ++i) {
+                dupStart[i] -= dupCount[i];
+            }
+        }
+
+        if (index && writes > 0) {
+            index->apply(req_vector);
+        }
+
+        // INSERTs bound for a full backend go to the spill tier and the backend drops its copy instead, the writes
+        // the cache and the backends take make the spilled records of their keys garbage
+        uint64_t seq = 0;
+        std::vector<char> full;
+        std::vector<RW> spills;
+        std::vector<K> drops;
+        if (slabs->spill && writes > 0) {
+            seq = slabs->writes.stamp();
+            for (int i = 0; i < numslabs; ++i) {
+                full.push_back(slabs->full(i));
+            }
+        }
 
         std::vector<std::pair<int, unsigned>> cache_batch_corespondance;
 
@@ -130,22 +252,41 @@ public:
 
         for (int i = 0; i < numslabs; ++i) {
             gpu_batches[i] = new BatchData<K, V>(0, resBuf, req_vector.size());
+            gpu_batches[i]->start = batchStart;
+            gpu_batches[i]->dupIDs = dupIDs;
+            gpu_batches[i]->dupBase = performed;
+            gpu_batches[i]->model = epoch->model;
+            gpu_batches[i]->seq = seq;
         }
 
         for (int i = 0; i < req_vector.size(); ++i) {
             RW req = req_vector[i];
-            if (req.requestInteger != REQUEST_EMPTY) {
+            if (req.requestInteger != REQUEST_EMPTY && leaderOf[i] == -1) {
                 unsigned h = hfn(req.key);
-                if (model->operator()(req.key, h)) {
+                if (epoch->model->operator()(req.key, h)) {
                     cache_batch_corespondance.push_back({i, h});
+                    if (seq && req.requestInteger != REQUEST_GET)
+                        drops.push_back(req.key);
                 } else {
                     int gpuToUse = h % numslabs;
+                    unsigned request = req.requestInteger;
+                    if (seq && request == REQUEST_INSERT && full[gpuToUse]) {
+                        // the tier keeps a copy, the backend only drops its own
+                        spills.push_back(req);
+                        request = REQUEST_REMOVE;
+                        req.value = V();
+                    } else if (seq && request == REQUEST_REMOVE) {
+                        drops.push_back(req.key);
+                    }
                     int idx = gpu_batches[gpuToUse]->idx;
                     gpu_batches[gpuToUse]->idx++;
                     gpu_batches[gpuToUse]->keys[idx] = req.key;
                     gpu_batches[gpuToUse]->values[idx] = req.value;
-                    gpu_batches[gpuToUse]->requests[idx] = req.requestInteger;
+                    gpu_batches[gpuToUse]->requests[idx] = request;
                     gpu_batches[gpuToUse]->hashes[idx] = h;
+                    gpu_batches[gpuToUse]->requestID[idx] = i;
+                    gpu_batches[gpuToUse]->dupStart[idx] = dupStart[i];
+                    gpu_batches[gpuToUse]->dupCount[idx] = dupCount[i];
                 }
             }
         }
@@ -156,20 +297,13 @@ public:
             sizeForGPUBatches += gpu_batches[i]->idx;
         }
 
-        if (!dontDoGPU) {
-            for (int i = 0; i < numslabs; ++i) {
-                slabs->load++;
-                slabs->gpu_qs[i].push(gpu_batches[i]);
-            }
-        } else {
-            for (int i = 0; i < numslabs; ++i) {
-                delete gpu_batches[i];
-            }
-        }
-
         auto gpu_batches2 = std::vector<BatchData<K, V> *>(numslabs);
         for (int i = 0; i < numslabs; ++i) {
             gpu_batches2[i] = new BatchData<K, V>(0, resBuf, req_vector.size());
+            gpu_batches2[i]->start = batchStart;
+            gpu_batches2[i]->dupIDs = dupIDs;
+            gpu_batches2[i]->dupBase = performed;
+            gpu_batches2[i]->model = epoch->model;
         }
 
         //std::cerr << "Looking through cache now\n";
@@ -185,7 +319,7 @@ public:
                     std::pair<kvgpu::LockingPair<K, V> *, kvgpu::sharedlocktype> pair = cache->fast_get(
                             req_vector_elm.key,
                             cache_batch_idx.second,
-                            *model);
+                            *epoch->model);
                     if (pair.first == nullptr || pair.first->valid != 1) {
                         int gpuToUse = cache_batch_idx.second % numslabs;
                         int idx = gpu_batches2[gpuToUse]->idx;
@@ -194,16 +328,23 @@ public:
                         gpu_batches2[gpuToUse]->requests[idx] = req_vector_elm.requestInteger;
                         gpu_batches2[gpuToUse]->hashes[idx] = cache_batch_idx.second;
                         gpu_batches2[gpuToUse]->handleInCache[idx] = true;
+                        gpu_batches2[gpuToUse]->requestID[idx] = cache_batch_idx.first;
+                        gpu_batches2[gpuToUse]->dupStart[idx] = dupStart[cache_batch_idx.first];
+                        gpu_batches2[gpuToUse]->dupCount[idx] = dupCount[cache_batch_idx.first];
 
                     } else {
                         hits++;
                         //std::cerr << "Hit on get" << __FILE__ << ":" << __LINE__ << "\n";
 
                         resBuf->resultValues[responseLocationInResBuf] = pair.first->value;
+                        respond_to_duplicates(*resBuf, performed + dupStart[cache_batch_idx.first],
+                                              dupIDs->data() + dupStart[cache_batch_idx.first],
+                                              dupCount[cache_batch_idx.first], pair.first->value);
                         asm volatile("":: : "memory");
                         resBuf->requestIDs[responseLocationInResBuf] = cache_batch_idx.first;
                         responseLocationInResBuf++;
-                        times.push_back(std::chrono::high_resolution_clock::now());
+                        record_latency(REQUEST_GET, LATENCY_CACHE_HIT, batchStart, tsc_clock_t::now(),
+                                       1 + dupCount[cache_batch_idx.first]);
 
                     }
                     if (pair.first != nullptr)
@@ -211,7 +352,7 @@ public:
                 } else {
                     size_t logLoc = 0;
                     std::pair<kvgpu::LockingPair<K, V> *, std::unique_lock<kvgpu::mutex>> pair = cache->get_with_log(
-                            req_vector_elm.key, cache_batch_idx.second, *model, logLoc);
+                            req_vector_elm.key, cache_batch_idx.second, *epoch->model, logLoc);
                     switch (req_vector_elm.requestInteger) {
                         case REQUEST_INSERT:
                             //std::cerr << "Insert request\n";
@@ -221,10 +362,8 @@ public:
                             pair.first->valid = 1;
                             resBuf->requestIDs[responseLocationInResBuf] = cache_batch_idx.first;
                             responseLocationInResBuf++;
-                            cache->log_requests->operator[](logLoc) = REQUEST_INSERT;
-                            cache->log_hash->operator[](logLoc) = cache_batch_idx.second;
-                            cache->log_keys->operator[](logLoc) = req_vector_elm.key;
-                            cache->log_values->operator[](logLoc) = req_vector_elm.value;
+                            epoch->log(logLoc, REQUEST_INSERT, cache_batch_idx.second, req_vector_elm.key,
+                                       req_vector_elm.value);
 
                             break;
                         case REQUEST_REMOVE:
@@ -235,16 +374,15 @@ public:
                             resBuf->requestIDs[responseLocationInResBuf] = cache_batch_idx.first;
                             responseLocationInResBuf++;
 
-                            cache->log_requests->operator[](logLoc) = REQUEST_REMOVE;
-                            cache->log_hash->operator[](logLoc) = cache_batch_idx.second;
-                            cache->log_keys->operator[](logLoc) = req_vector_elm.key;
+                            epoch->log(logLoc, REQUEST_REMOVE, cache_batch_idx.second, req_vector_elm.key,
+                                       req_vector_elm.value);
 
                             break;
                     }
 
                     if (pair.first != nullptr)
                         pair.second.unlock();
-                    times.push_back(std::chrono::high_resolution_clock::now());
+                    record_latency(req_vector_elm.requestInteger, LATENCY_CACHE_HIT, batchStart, tsc_clock_t::now());
                 }
 
 
@@ -255,100 +393,180 @@ public:
 
         asm volatile("":: : "memory");
         sizeForGPUBatches = responseLocationInResBuf;
-        if (!dontDoGPU) {
-            for (int i = 0; i < numslabs; ++i) {
-                if (gpu_batches2[i]->idx > 0) {
-                    gpu_batches2[i]->resBufStart = sizeForGPUBatches;
-                    sizeForGPUBatches += gpu_batches2[i]->idx;
-                    slabs->load++;
-                    slabs->gpu_qs[i].push(gpu_batches2[i]);
-                } else {
-                    delete gpu_batches2[i];
-                }
-            }
-        } else {
-            for (int i = 0; i < numslabs; ++i) {
-                delete gpu_batches2[i];
-            }
-            resBuf->retryGPU = true;
+        for (int i = 0; i < numslabs; ++i) {
+            gpu_batches2[i]->resBufStart = sizeForGPUBatches;
+            sizeForGPUBatches += gpu_batches2[i]->idx;
+        }
+
+        // spilled before the backends drop their copies, dropped once the cache holds the newer values so a GET
+        // missing the backend meanwhile still finds a value when it fills the cache
+        if (!spills.empty())
+            slabs->spill->spill(spills, seq);
+        for (auto &key : drops) {
+            slabs->spill->drop(key);
+        }
+
+        // the hits are answered, only the backend work waits for the log of a model change to be enqueued
+        for (int i = 0; i < numslabs; ++i) {
+            enqueue(*epoch, i, gpu_batches[i]);
+            enqueue(*epoch, i, gpu_batches2[i]);
         }
 
         // send gpu_batch2
 
         operations += req_vector.size();
+        dedups += duplicates;
+
+        models->leave(epoch);
+        slabs->clients.leave(inflight);
 
     }
 
-    // single threaded
-    std::future<void> change_model(M &newModel, block_t *block, double &time) {
-        std::unique_lock<std::mutex> modelLock(modelMtx);
-        tbb::concurrent_vector<int> *log_requests = cache->log_requests;
-        tbb::concurrent_vector<unsigned> *log_hash = cache->log_hash;
-        tbb::concurrent_vector<K> *log_keys = cache->log_keys;
-        tbb::concurrent_vector<V> *log_values = cache->log_values;
+    /**
+     * Loads the snapshot in snapshotFile if there is one and replays the write-ahead log after it, nothing is logged
+     * again. Snapshot blocks hold distinct keys and are loaded by all hardware threads in parallel from the mapped file.
+     * A log batch holds at most one write per key and goes in only once the one before is applied, so later writes win.
+     * @param snapshotFile
+     * @return the number of pairs and writes recovered
+     */
+    size_t recover(const std::string &snapshotFile = "") {
+        uint64_t after = 0;
+        size_t recovered = 0;
+        if (!snapshotFile.empty() && access(snapshotFile.c_str(), F_OK) == 0) {
+            SnapshotReader<K, V> snap(snapshotFile);
+            if (!snap.valid())
+                exit(1);
+            after = snap.lsn();
+            std::atomic_size_t nextBlock{0};
+            std::atomic_bool damaged{false};
+            std::vector<std::thread> loaders;
+            size_t nthreads = std::max<size_t>(1, std::min<size_t>(std::thread::hardware_concurrency(), snap.blocks()));
+            for (size_t t = 0; t < nthreads; ++t) {
+                loaders.push_back(std::thread([this, &snap, &nextBlock, &damaged]() {
+                    std::vector<RW> reqs;
+                    reqs.reserve(SNAPSHOT_BLOCK_RECORDS);
+                    size_t b;
+                    while ((b = nextBlock.fetch_add(1)) < snap.blocks()) {
+                        if (!snap.block(b, [&reqs](K key, V value) {
+                            reqs.push_back({key, value, REQUEST_INSERT});
+                        })) {
+                            damaged = true;
+                        }
+                        applyAndWait(reqs);
+                    }
+                }));
+            }
+            for (auto &t : loaders) {
+                t.join();
+            }
+            if (damaged) {
+                std::cerr << "Snapshot " << snapshotFile << " is damaged" << std::endl;
+                exit(1);
+            }
+            recovered += snap.records();
+        }
+        if (!wal)
+            return recovered;
+
+        size_t chunk = THREADS_PER_BLOCK * BLOCKS;
+        std::vector<RW> reqs;
+        std::unordered_set<K> keys;
+        reqs.reserve(chunk);
+        recovered += wal->replay<K, V>([&](unsigned request, K key, V value) {
+            if (reqs.size() == chunk || !keys.insert(key).second) {
+                applyAndWait(reqs);
+                keys.clear();
+                keys.insert(key);
+            }
+            reqs.push_back({key, value, request});
+        }, after);
+        applyAndWait(reqs);
+        return recovered;
+    }
 
-        tbb::concurrent_vector<int> *tmp_log_requests = new tbb::concurrent_vector<int>(
-                cache->getN() * cache->getSETS());
-        tbb::concurrent_vector<unsigned> *tmp_log_hash = new tbb::concurrent_vector<unsigned>(
-                cache->getN() * cache->getSETS());
-        tbb::concurrent_vector<K> *tmp_log_keys = new tbb::concurrent_vector<K>(cache->getN() * cache->getSETS());
-        tbb::concurrent_vector<V> *tmp_log_values = new tbb::concurrent_vector<V>(cache->getN() * cache->getSETS());
+    /**
+     * Writes a snapshot of the store to filename while batches keep running, keys come from the ordered index and
+     * values are read like scan does. Every write logged before the snapshot starts is in it and later ones may be,
+     * recovery replays the write-ahead log after the lsn it records and the log up to there is dropped afterwards.
+     * Needs ORDERED_INDEX.
+     * @param filename
+     * @return the number of pairs written, 0 if the snapshot could not be written
+     */
+    size_t snapshot(const std::string &filename) {
+        assert(index != nullptr);
+        uint64_t lsn = wal ? wal->last() : 0;
+        // writes up to lsn may still be waiting to be durable, or on their way to the cache or a backend
+        slabs->logged.synchronize();
+        slabs->quiesce();
+
+        SnapshotWriter<K, V> writer(filename, lsn);
+        size_t chunk = THREADS_PER_BLOCK * BLOCKS;
+        std::vector<K> keys;
+        std::vector<std::pair<K, V>> pairs;
+        while (true) {
+            std::vector<K> next;
+            if (index->walk(keys.empty() ? nullptr : &keys.back(), chunk, next) == 0)
+                break;
+            keys.swap(next);
+            pairs.clear();
+            read(keys, pairs);
+            for (auto &p : pairs) {
+                writer.add(p.first, p.second);
+            }
+        }
+        if (!writer.finish())
+            return 0;
+        if (wal)
+            wal->truncate(lsn);
+        return writer.getRecords();
+    }
 
-        auto gpu_batches = std::vector<BatchData<K, V> *>(numslabs);
+    /**
+     * Appends the pairs with keys in [lo, hi) to out in key order, taking at most max keys from the ordered index.
+     * Values are read through the cache and the backends with batches of GETs, keys removed meanwhile are skipped.
+     * Scanning again from one past the last key returned continues the range. Needs ORDERED_INDEX.
+     * @param lo
+     * @param hi
+     * @param max
+     * @param out
+     * @return the number of pairs appended
+     */
+    size_t scan(K lo, K hi, size_t max, std::vector<std::pair<K, V>> &out) {
+        assert(index != nullptr);
+        std::vector<K> keys;
+        index->range(lo, hi, max, keys);
+        return read(keys, out);
+    }
 
-        while (!block->threads_blocked());
-        //std::cerr << "All threads at barrier\n";
-        asm volatile("":: : "memory");
+    /**
+     * Publishes newModel without stopping any worker. Batches in flight finish under the old model, then the old log
+     * is drained to the backend in parallel and the cache evicts what newModel does not keep.
+     * time is how long publishing took, the future completes once the drain and eviction are done.
+     * @param newModel
+     * @param time
+     * @return
+     */
+    std::future<void> change_model(M &newModel, double &time) {
+        std::unique_lock<std::mutex> modelLock(models->mtx);
         auto start = std::chrono::high_resolution_clock::now();
 
-        *model = newModel;
-        cache->log_requests = tmp_log_requests;
-        cache->log_hash = tmp_log_hash;
-        cache->log_keys = tmp_log_keys;
-        cache->log_values = tmp_log_values;
-        size_t tmpSize = cache->log_size;
-        cache->log_size = 0;
-
-        //std::cerr << "Tmp size " << tmpSize << "\n";
-
-        int batchSizeUsed = std::min(THREADS_PER_BLOCK * BLOCKS,
-                                     (int) (tmpSize / THREADS_PER_BLOCK + 1) * THREADS_PER_BLOCK);
-
-        for (int enqueued = 0; enqueued < tmpSize; enqueued += batchSizeUsed) {
-
-            for (int i = 0; i < numslabs; ++i) {
-                gpu_batches[i] = new BatchData<K, V>(0, std::make_shared<ResultsBuffers<V>>(batchSizeUsed),
-                                                     batchSizeUsed);
-                gpu_batches[i]->resBufStart = 0;
-                gpu_batches[i]->flush = true;
-            }
-
-            for (int i = 0; i + enqueued < tmpSize && i < batchSizeUsed; ++i) {
-                int gpuToUse = log_hash->operator[](i + enqueued) % numslabs;
-                int idx = gpu_batches[gpuToUse]->idx;
-                gpu_batches[gpuToUse]->idx++;
-                gpu_batches[gpuToUse]->keys[idx] = log_keys->operator[](i + enqueued);
-                gpu_batches[gpuToUse]->values[idx] = log_values->operator[](i + enqueued);
-                gpu_batches[gpuToUse]->requests[idx] = log_requests->operator[](i + enqueued);
-                gpu_batches[gpuToUse]->hashes[idx] = log_hash->operator[](i + enqueued);
-            }
+        auto next = std::make_shared<ModelEpoch<K, V, M>>(std::make_shared<M>(newModel),
+                                                          cache->getN() * cache->getSETS(), false);
+        auto old = models->publish(next);
 
-            for (int i = 0; i < numslabs; ++i) {
-                if (gpu_batches[i]->idx == 0) {
-                    delete gpu_batches[i];
-                } else {
-                    slabs->load++;
-                    slabs->gpu_qs[i].push(gpu_batches[i]);
-                }
-            }
-        }
-        block->wake();
         auto end = std::chrono::high_resolution_clock::now();
         time = std::chrono::duration<double>(end - start).count();
 
-        return std::async([this](std::unique_lock<std::mutex> l) {
+        return std::async(std::launch::async, [this, old, next](std::unique_lock<std::mutex> l) {
+            // grace period, batches still running under the old epoch may log to it
+            while (old->active.load() != 0)
+                std::this_thread::yield();
+
+            drain_log(*old);
+            next->ready = true;
+
             std::hash<K> h;
-            cache->scan_and_evict(*(this->model), h, std::move(l));
+            cache->scan_and_evict(*(next->model), h, std::move(l));
         }, std::move(modelLock));
     }
 
@@ -364,63 +582,234 @@ public:
         return hits;
     }
 
+    /// requests in the batches since the stats were reset, hitRate is hits over this
+    size_t getOperations() {
+        return operations;
+    }
+
+    size_t getDedups() {
+        return dedups;
+    }
+
+    /// BatchData waiting on the backend queues of every client
+    int getQueued() {
+        return slabs->load;
+    }
+
+    /// pairs the cache holds before a set has to grow
+    size_t getCacheCapacity() {
+        return cache->getN() * cache->getSETS();
+    }
+
+    std::shared_ptr<WriteAheadLog> getWAL() {
+        return wal;
+    }
+
+    std::shared_ptr<SpillTier<K, V>> getSpill() {
+        return slabs->spill;
+    }
+
     void resetStats() {
+        LatencyStats::global().reset();
         hits = 0;
         operations = 0;
+        dedups = 0;
         slabs->clearMops();
     }
 
     M getModel() {
-        return *model;
+        return *models->load()->model;
     }
 
     void stat() {
-        for (int i = 0; i < numslabs; i++) {
-            std::cout << "TABLE: GPU Info " << i << std::endl;
-            std::cout
-                    << "Time from start (s)\tTime spent responding (ms)\tTime in batch fn (ms)\tTime Dequeueing (ms)\tFraction that goes to cache\tDuration (ms)\tFill\tThroughput GPU "
-                    << i << " (Mops)" << std::endl;
-            for (auto &s : slabs->mops[i]) {
-
-                std::cout << std::chrono::duration<double>(s.timestampEnd - start).count() << "\t"
-                          << std::chrono::duration<double>(s.timestampEnd - s.timestampWriteBack).count() * 1e3 << "\t"
-                          << std::chrono::duration<double>(s.timestampWriteBack - s.timestampStartBatch).count() * 1e3
-                          << "\t"
-                          << std::chrono::duration<double>(s.timestampStartBatch - s.timestampDequeueToBatch).count() *
-                             1e3 << "\t"
-                          << s.timesGoingToCache / (double) s.size << "\t"
-                          << s.duration << "\t" << (double) s.size / THREADS_PER_BLOCK / BLOCKS << "\t"
-                          << s.size / s.duration / 1e3 << std::endl;
-            }
-            std::cout << std::endl;
-        }
+        slabs->trace->print(std::cout);
         cache->stat();
     }
 
+    /**
+     * Appends the pipeline stage latencies of the last interval to filename every interval
+     * @param filename
+     * @param interval
+     */
+    void startTraceExport(const std::string &filename, std::chrono::milliseconds interval) {
+        slabs->trace->startExport(filename, interval);
+    }
+
+    /**
+     * Writes the sampled backend batches as a Chrome trace
+     * @param filename
+     * @return false if the file could not be written
+     */
+    bool writeChromeTrace(const std::string &filename) {
+        return slabs->trace->writeChromeTrace(filename);
+    }
+
 private:
+    /**
+     * Appends the keys that are present to out with their values, reading them with batches of GETs
+     * @param keys
+     * @param out
+     * @return the number of pairs appended
+     */
+    size_t read(const std::vector<K> &keys, std::vector<std::pair<K, V>> &out) {
+        size_t found = 0;
+        size_t chunk = THREADS_PER_BLOCK * BLOCKS;
+        for (size_t begin = 0; begin < keys.size(); begin += chunk) {
+            size_t count = std::min(chunk, keys.size() - begin);
+            std::vector<RW> req_vector((count + 511) / 512 * 512, {K(), V(), REQUEST_EMPTY});
+            for (size_t i = 0; i < count; ++i) {
+                req_vector[i] = {keys[begin + i], V(), REQUEST_GET};
+            }
+            auto rb = std::make_shared<ResultsBuffers<V>>(req_vector.size());
+            batch(req_vector, rb);
+
+            std::vector<V> values(count);
+            for (size_t slot = 0; slot < count; ++slot) {
+                int id;
+                while ((id = rb->requestIDs[slot]) == -1)
+                    std::this_thread::yield();
+                std::atomic_thread_fence(std::memory_order_acquire);
+                values[id] = rb->resultValues[slot];
+            }
+            for (size_t i = 0; i < count; ++i) {
+                if (values[i] != EMPTY<V>::value) {
+                    out.push_back({keys[begin + i], values[i]});
+                    found++;
+                }
+            }
+        }
+        return found;
+    }
+
+    /**
+     * Applies reqs without logging them, waits until all are answered and empties reqs
+     * @param reqs
+     */
+    void applyAndWait(std::vector<RW> &reqs) {
+        if (reqs.empty())
+            return;
+        size_t count = reqs.size();
+        reqs.resize((count + 511) / 512 * 512, {K(), V(), REQUEST_EMPTY});
+        auto rb = std::make_shared<ResultsBuffers<V>>(reqs.size());
+        batch(reqs, rb, false);
+        for (size_t slot = 0; slot < count; ++slot) {
+            while (rb->requestIDs[slot] == -1)
+                std::this_thread::yield();
+        }
+        reqs.clear();
+    }
+
+    /**
+     * Enqueues the writes logged under e to the backend, the log is split in chunks across threads
+     * @param e
+     */
+    void drain_log(ModelEpoch<K, V, M> &e) {
+        size_t logSize = e.log_requests.size();
+        size_t chunk = THREADS_PER_BLOCK * BLOCKS;
+        size_t chunks = (logSize + chunk - 1) / chunk;
+        size_t nthreads = std::max<size_t>(1, std::min<size_t>(std::thread::hardware_concurrency(), chunks));
+
+        std::atomic_size_t nextChunk{0};
+        std::vector<std::thread> drainers;
+        for (size_t t = 0; t < nthreads; ++t) {
+            drainers.push_back(std::thread([this, &e, &nextChunk, logSize, chunk, chunks]() {
+                size_t c;
+                while ((c = nextChunk.fetch_add(1)) < chunks) {
+                    size_t begin = c * chunk;
+                    size_t end = std::min(logSize, begin + chunk);
+
+                    auto rb = std::make_shared<ResultsBuffers<V>>(end - begin);
+                    auto gpu_batches = std::vector<BatchData<K, V> *>(numslabs);
+                    for (int i = 0; i < numslabs; ++i) {
+                        gpu_batches[i] = new BatchData<K, V>(0, rb, end - begin);
+                        gpu_batches[i]->flush = true;
+                    }
+
+                    for (size_t l = begin; l < end; ++l) {
+                        int request = e.log_requests[l];
+                        if (request != REQUEST_INSERT && request != REQUEST_REMOVE)
+                            continue;
+                        int gpuToUse = e.log_hash[l] % numslabs;
+                        int idx = gpu_batches[gpuToUse]->idx;
+                        gpu_batches[gpuToUse]->idx++;
+                        gpu_batches[gpuToUse]->keys[idx] = e.log_keys[l];
+                        gpu_batches[gpuToUse]->values[idx] = e.log_values[l];
+                        gpu_batches[gpuToUse]->requests[idx] = request;
+                        gpu_batches[gpuToUse]->hashes[idx] = e.log_hash[l];
+                    }
+
+                    int resBufStart = 0;
+                    for (int i = 0; i < numslabs; ++i) {
+                        if (gpu_batches[i]->idx == 0) {
+                            delete gpu_batches[i];
+                        } else {
+                            gpu_batches[i]->resBufStart = resBufStart;
+                            resBufStart += gpu_batches[i]->idx;
+                            slabs->push(i, gpu_batches[i]);
+                        }
+                    }
+                }
+            }));
+        }
+        for (auto &t : drainers) {
+            t.join();
+        }
+    }
+
+    /**
+     * Takes a credit on backend queue i and enqueues the batch, the Slabs thread gives the credit back after write back.
+     * Waits until the log of the epoch before e is enqueued so the batch queues behind it, an empty batch is dropped
+     * without waiting.
+     * @param e
+     * @param i
+     * @param b
+     */
+    void enqueue(ModelEpoch<K, V, M> &e, int i, BatchData<K, V> *b) {
+        if (b->idx == 0) {
+            delete b;
+            return;
+        }
+        while (!e.ready.load())
+            std::this_thread::yield();
+        credits[i]->acquire();
+        b->credit = credits[i];
+        slabs->push(i, b);
+    }
+
     int numslabs;
     std::mutex mtx;
     std::shared_ptr<Slabs<K, V, M>> slabs;
     //SlabUnified<K,V> *slabs;
     std::shared_ptr<typename Cache<K, V>::type> cache;
+    std::shared_ptr<PublishedModel<K, V, M>> models;
+    std::shared_ptr<OrderedIndex<K>> index;
+    std::shared_ptr<WriteAheadLog> wal;
     std::hash<K> hfn;
     std::atomic_size_t hits;
     std::atomic_size_t operations;
-    std::shared_ptr<M> model;
+    std::atomic_size_t dedups;
     std::chrono::high_resolution_clock::time_point start;
-    std::mutex modelMtx;
+    std::vector<std::shared_ptr<credit_t>> credits;
 };
 
 template<typename K, typename M>
 class KVStoreInternalClient<K, data_t, M> {
 public:
     KVStoreInternalClient(std::shared_ptr<Slabs<K, data_t *, M>> s,
-                          std::shared_ptr<typename Cache<K, data_t *>::type> c, std::shared_ptr<M> m) : numslabs(
+                          std::shared_ptr<typename Cache<K, data_t *>::type> c,
+                          std::shared_ptr<PublishedModel<K, data_t *, M>> m,
+                          std::shared_ptr<OrderedIndex<K>> idx = nullptr,
+                          std::shared_ptr<WriteAheadLog> w = nullptr) : numslabs(
             s->numslabs), slabs(s), cache(c), hits(0),
                                                                                                         operations(0),
+                                                                                                        dedups(0),
                                                                                                         start(std::chrono::high_resolution_clock::now()),
-                                                                                                        model(m) {
-
+                                                                                                        models(m),
+                                                                                                        index(idx),
+                                                                                                        wal(w) {
+        for (int i = 0; i < numslabs; ++i) {
+            credits.push_back(std::make_shared<credit_t>(CREDITS_PER_BACKEND));
+        }
     }
 
     ~KVStoreInternalClient() {}
@@ -430,19 +819,104 @@ public:
     /**
      * Performs the batch of operations given
      * @param req_vector
+     * @param resBuf
+     * @param logWrites false when replaying the write-ahead log
      */
     void batch(std::vector<RequestWrapper<K, data_t *>> &req_vector, std::shared_ptr<ResultsBuffers<data_t>> &resBuf,
-               std::vector<std::chrono::high_resolution_clock::time_point> &times) {
-        bool dontDoGPU = false;
-
-        if (slabs->load >= LOAD_THRESHOLD) {
-            dontDoGPU = true;
-        }
-
+               bool logWrites = true) {
+        uint64_t batchStart = tsc_clock_t::now();
         //std::cerr << req_vector.size() << std::endl;
         //req_vector.size() % 512 == 0 &&
         assert(req_vector.size() <= THREADS_PER_BLOCK * BLOCKS * numslabs);
 
+        // logged as the turns on the stripes of the keys written are taken, so the lsns follow the order in which the
+        // writes to a key reach the index, the spill tier, the cache and the backends. The writes are made visible
+        // only once durable, and a batch waits for that and for its turns before entering, holding only its lsn and
+        // its place in line, so it holds back neither a quiesce nor a model change
+        int logging = slabs->logged.enter();
+        uint64_t lsn = 0;
+        write_turns_t ordered;
+        if (index || wal || slabs->spill) {
+            ordered = slabs->writes.take(req_vector, hfn, [&]() {
+                if (wal && logWrites)
+                    lsn = wal->append(req_vector);
+            });
+        }
+        if (lsn != 0)
+            wal->waitDurable(lsn);
+        ordered.wait();
+
+        int inflight = slabs->clients.enter();
+        slabs->logged.leave(logging);
+        auto epoch = models->enter();
+
+        int n = req_vector.size();
+
+        // a GET repeating an earlier GET of the same key, with no write to that key in between, is not performed
+        // and gets the result of the first one instead
+        static thread_local dedup_table_t<K> dedup;
+        std::vector<int> leaderOf(n, -1);
+        std::vector<int> dupStart(n, 0);
+        std::vector<int> dupCount(n, 0);
+        auto dupIDs = std::make_shared<std::vector<int>>();
+        int performed = 0;
+        int duplicates = 0;
+        int writes = 0;
+
+        dedup.reset(n);
+        for (int i = 0; i < n; ++i) {
+            const RW &req = req_vector[i];
+            if (req.requestInteger == REQUEST_EMPTY)
+                continue;
+            int &leader = dedup.find(req.key, hfn(req.key));
+            if (req.requestInteger != REQUEST_GET) {
+                leader = -1;
+                writes++;
+            } else if (leader == -1) {
+                leader = i;
+            } else {
+                leaderOf[i] = leader;
+                dupCount[leader]++;
+                duplicates++;
+                continue;
+            }
+            performed++;
+        }
+
+        // lay the duplicates of each GET out contiguously, they are answered after everything performed
+        if (duplicates > 0) {
+            int offset = 0;
+            for (int i = 0; i < n; ++i) {
+                dupStart[i] = offset;
+                offset += dupCount[i];
+            }
+            dupIDs->resize(duplicates);
+            for (int i = 0; i < n; ++i) {
+                if (leaderOf[i] != -1)
+                    (*dupIDs)[dupStart[leaderOf[i]]++] = i;
+            }
+            for (int i = 0; i < n; ++i) {
+                dupStart[i] -= dupCount[i];
+            }
+        }
+
+        if (index && writes > 0) {
+            index->apply(req_vector);
+        }
+
+        // INSERTs bound for a full backend go to the spill tier and the backend drops its copy instead, the writes
+        // the cache and the backends take make the spilled records of their keys garbage
+        uint64_t seq = 0;
+        std::vector<char> full;
+        std::vector<RW> spills;
+        std::vector<K> drops;
+        if (slabs->spill && writes > 0) {
+            seq = slabs->writes.stamp();
+            for (int i = 0; i < numslabs; ++i) {
+                full.push_back(slabs->full(i));
+            }
+        }
+
         std::vector<std::pair<int, unsigned>> cache_batch_corespondance;
 
         cache_batch_corespondance.reserve(req_vector.size());
@@ -450,22 +924,41 @@ public:
 
         for (int i = 0; i < numslabs; ++i) {
             gpu_batches[i] = new BatchData<K, data_t>(0, resBuf, req_vector.size());
+            gpu_batches[i]->start = batchStart;
+            gpu_batches[i]->dupIDs = dupIDs;
+            gpu_batches[i]->dupBase = performed;
+            gpu_batches[i]->model = epoch->model;
+            gpu_batches[i]->seq = seq;
         }
 
         for (int i = 0; i < req_vector.size(); ++i) {
             RW req = req_vector[i];
-            if (req.requestInteger != REQUEST_EMPTY) {
+            if (req.requestInteger != REQUEST_EMPTY && leaderOf[i] == -1) {
                 unsigned h = hfn(req.key);
-                if (model->operator()(req.key, h)) {
+                if (epoch->model->operator()(req.key, h)) {
                     cache_batch_corespondance.push_back({i, h});
+                    if (seq && req.requestInteger != REQUEST_GET)
+                        drops.push_back(req.key);
                 } else {
                     int gpuToUse = h % numslabs;
+                    unsigned request = req.requestInteger;
+                    if (seq && request == REQUEST_INSERT && full[gpuToUse]) {
+                        // the tier keeps a copy, the backend only drops its own
+                        spills.push_back(req);
+                        request = REQUEST_REMOVE;
+                        req.value = nullptr;
+                    } else if (seq && request == REQUEST_REMOVE) {
+                        drops.push_back(req.key);
+                    }
                     int idx = gpu_batches[gpuToUse]->idx;
                     gpu_batches[gpuToUse]->idx++;
                     gpu_batches[gpuToUse]->keys[idx] = req.key;
                     gpu_batches[gpuToUse]->values[idx] = req.value;
-                    gpu_batches[gpuToUse]->requests[idx] = req.requestInteger;
+                    gpu_batches[gpuToUse]->requests[idx] = request;
                     gpu_batches[gpuToUse]->hashes[idx] = h;
+                    gpu_batches[gpuToUse]->requestID[idx] = i;
+                    gpu_batches[gpuToUse]->dupStart[idx] = dupStart[i];
+                    gpu_batches[gpuToUse]->dupCount[idx] = dupCount[i];
                 }
             }
         }
@@ -476,20 +969,13 @@ public:
             sizeForGPUBatches += gpu_batches[i]->idx;
         }
 
-        if (!dontDoGPU) {
-            for (int i = 0; i < numslabs; ++i) {
-                slabs->load++;
-                slabs->gpu_qs[i].push(gpu_batches[i]);
-            }
-        } else {
-            for (int i = 0; i < numslabs; ++i) {
-                delete gpu_batches[i];
-            }
-        }
-
         auto gpu_batches2 = std::vector<BatchData<K, data_t> *>(numslabs);
         for (int i = 0; i < numslabs; ++i) {
             gpu_batches2[i] = new BatchData<K, data_t>(0, resBuf, req_vector.size());
+            gpu_batches2[i]->start = batchStart;
+            gpu_batches2[i]->dupIDs = dupIDs;
+            gpu_batches2[i]->dupBase = performed;
+            gpu_batches2[i]->model = epoch->model;
         }
 
         //std::cerr << "Looking through cache now\n";
@@ -503,7 +989,7 @@ public:
 
                 if (req_vector_elm.requestInteger == REQUEST_GET) {
                     std::pair<kvgpu::LockingPair<K, data_t *> *, kvgpu::sharedlocktype> pair = cache->fast_get(
-                            req_vector_elm.key, cache_batch_idx.second, *model);
+                            req_vector_elm.key, cache_batch_idx.second, *epoch->model);
                     if (pair.first == nullptr || pair.first->valid != 1) {
                         int gpuToUse = cache_batch_idx.second % numslabs;
                         int idx = gpu_batches2[gpuToUse]->idx;
@@ -512,6 +998,9 @@ public:
                         gpu_batches2[gpuToUse]->requests[idx] = req_vector_elm.requestInteger;
                         gpu_batches2[gpuToUse]->hashes[idx] = cache_batch_idx.second;
                         gpu_batches2[gpuToUse]->handleInCache[idx] = true;
+                        gpu_batches2[gpuToUse]->requestID[idx] = cache_batch_idx.first;
+                        gpu_batches2[gpuToUse]->dupStart[idx] = dupStart[cache_batch_idx.first];
+                        gpu_batches2[gpuToUse]->dupCount[idx] = dupCount[cache_batch_idx.first];
 
                     } else {
                         hits.fetch_add(1, std::memory_order_relaxed);
@@ -522,17 +1011,21 @@ public:
                             memcpy(cpy->data, pair.first->value->data, cpy->size);
                         }
                         resBuf->resultValues[responseLocationInResBuf] = cpy;
+                        respond_to_duplicates(*resBuf, performed + dupStart[cache_batch_idx.first],
+                                              dupIDs->data() + dupStart[cache_batch_idx.first],
+                                              dupCount[cache_batch_idx.first], cpy);
                         asm volatile("":: : "memory");
                         resBuf->requestIDs[responseLocationInResBuf] = cache_batch_idx.first;
                         responseLocationInResBuf++;
-                        times.push_back(std::chrono::high_resolution_clock::now());
+                        record_latency(REQUEST_GET, LATENCY_CACHE_HIT, batchStart, tsc_clock_t::now(),
+                                       1 + dupCount[cache_batch_idx.first]);
                     }
                     if (pair.first != nullptr)
                         pair.second.unlock();
                 } else {
                     size_t logLoc = 0;
                     std::pair<kvgpu::LockingPair<K, data_t *> *, std::unique_lock<kvgpu::mutex>> pair = cache->get_with_log(
-                            req_vector_elm.key, cache_batch_idx.second, *model, logLoc);
+                            req_vector_elm.key, cache_batch_idx.second, *epoch->model, logLoc);
                     switch (req_vector_elm.requestInteger) {
                         case REQUEST_INSERT:
                             //std::cerr << "Insert request\n";
@@ -542,10 +1035,8 @@ public:
                             pair.first->valid = 1;
                             resBuf->requestIDs[responseLocationInResBuf] = cache_batch_idx.first;
                             responseLocationInResBuf++;
-                            cache->log_requests->operator[](logLoc) = REQUEST_INSERT;
-                            cache->log_hash->operator[](logLoc) = cache_batch_idx.second;
-                            cache->log_keys->operator[](logLoc) = req_vector_elm.key;
-                            cache->log_values->operator[](logLoc) = req_vector_elm.value;
+                            epoch->log(logLoc, REQUEST_INSERT, cache_batch_idx.second, req_vector_elm.key,
+                                       req_vector_elm.value);
 
                             break;
                         case REQUEST_REMOVE:
@@ -562,16 +1053,15 @@ public:
                             resBuf->requestIDs[responseLocationInResBuf] = cache_batch_idx.first;
                             responseLocationInResBuf++;
 
-                            cache->log_requests->operator[](logLoc) = REQUEST_REMOVE;
-                            cache->log_hash->operator[](logLoc) = cache_batch_idx.second;
-                            cache->log_keys->operator[](logLoc) = req_vector_elm.key;
+                            epoch->log(logLoc, REQUEST_REMOVE, cache_batch_idx.second, req_vector_elm.key,
+                                       req_vector_elm.value);
 
                             break;
                     }
-                    times.push_back(std::chrono::high_resolution_clock::now());
 
                     if (pair.first != nullptr)
                         pair.second.unlock();
+                    record_latency(req_vector_elm.requestInteger, LATENCY_CACHE_HIT, batchStart, tsc_clock_t::now());
                 }
             }
         }
@@ -580,98 +1070,351 @@ public:
 
         asm volatile("":: : "memory");
         sizeForGPUBatches = responseLocationInResBuf;
-        if (!dontDoGPU) {
-            for (int i = 0; i < numslabs; ++i) {
-                if (gpu_batches2[i]->idx > 0) {
-                    gpu_batches2[i]->resBufStart = sizeForGPUBatches;
-                    sizeForGPUBatches += gpu_batches2[i]->idx;
-                    slabs->load++;
-                    slabs->gpu_qs[i].push(gpu_batches2[i]);
-                } else {
-                    delete gpu_batches2[i];
-                }
-            }
-        } else {
-            for (int i = 0; i < numslabs; ++i) {
-                delete gpu_batches2[i];
+        for (int i = 0; i < numslabs; ++i) {
+            gpu_batches2[i]->resBufStart = sizeForGPUBatches;
+            sizeForGPUBatches += gpu_batches2[i]->idx;
+        }
+
+        // spilled before the backends drop their copies, dropped once the cache holds the newer values so a GET
+        // missing the backend meanwhile still finds a value when it fills the cache
+        if (!spills.empty()) {
+            slabs->spill->spill(spills, seq);
+            for (auto &r : spills) {
+                wal_codec_t<data_t *>::free(r.value);
             }
-            resBuf->retryGPU = true;
+        }
+        for (auto &key : drops) {
+            slabs->spill->drop(key);
+        }
+
+        // the hits are answered, only the backend work waits for the log of a model change to be enqueued
+        for (int i = 0; i < numslabs; ++i) {
+            enqueue(*epoch, i, gpu_batches[i]);
+            enqueue(*epoch, i, gpu_batches2[i]);
         }
 
         // send gpu_batch2
 
         operations += req_vector.size();
+        dedups += duplicates;
+
+        models->leave(epoch);
+        slabs->clients.leave(inflight);
 
     }
 
-    // single threaded
-    std::future<void> change_model(M &newModel, block_t *block, double &time) {
-        std::unique_lock<std::mutex> modelLock(modelMtx);
-        tbb::concurrent_vector<int> *log_requests = cache->log_requests;
-        tbb::concurrent_vector<unsigned> *log_hash = cache->log_hash;
-        tbb::concurrent_vector<K> *log_keys = cache->log_keys;
-        tbb::concurrent_vector<data_t *> *log_values = cache->log_values;
+    /**
+     * Loads the snapshot in snapshotFile if there is one and replays the write-ahead log after it, nothing is logged
+     * again. Snapshot blocks hold distinct keys and are loaded by all hardware threads in parallel from the mapped file.
+     * A log batch holds at most one write per key and goes in only once the one before is applied, so later writes win.
+     * @param snapshotFile
+     * @return the number of pairs and writes recovered
+     */
+    size_t recover(const std::string &snapshotFile = "") {
+        uint64_t after = 0;
+        size_t recovered = 0;
+        if (!snapshotFile.empty() && access(snapshotFile.c_str(), F_OK) == 0) {
+            SnapshotReader<K, data_t *> snap(snapshotFile);
+            if (!snap.valid())
+                exit(1);
+            after = snap.lsn();
+            std::atomic_size_t nextBlock{0};
+            std::atomic_bool damaged{false};
+            std::vector<std::thread> loaders;
+            size_t nthreads = std::max<size_t>(1, std::min<size_t>(std::thread::hardware_concurrency(), snap.blocks()));
+            for (size_t t = 0; t < nthreads; ++t) {
+                loaders.push_back(std::thread([this, &snap, &nextBlock, &damaged]() {
+                    std::vector<RW> reqs;
+                    reqs.reserve(SNAPSHOT_BLOCK_RECORDS);
+                    size_t b;
+                    while ((b = nextBlock.fetch_add(1)) < snap.blocks()) {
+                        if (!snap.block(b, [&reqs](K key, data_t * value) {
+                            reqs.push_back({key, value, REQUEST_INSERT});
+                        })) {
+                            damaged = true;
+                        }
+                        applyAndWait(reqs);
+                    }
+                }));
+            }
+            for (auto &t : loaders) {
+                t.join();
+            }
+            if (damaged) {
+                std::cerr << "Snapshot " << snapshotFile << " is damaged" << std::endl;
+                exit(1);
+            }
+            recovered += snap.records();
+        }
+        if (!wal)
+            return recovered;
+
+        size_t chunk = THREADS_PER_BLOCK * BLOCKS;
+        std::vector<RW> reqs;
+        std::unordered_set<K> keys;
+        reqs.reserve(chunk);
+        recovered += wal->replay<K, data_t *>([&](unsigned request, K key, data_t * value) {
+            if (reqs.size() == chunk || !keys.insert(key).second) {
+                applyAndWait(reqs);
+                keys.clear();
+                keys.insert(key);
+            }
+            reqs.push_back({key, value, request});
+        }, after);
+        applyAndWait(reqs);
+        return recovered;
+    }
 
-        while (!block->threads_blocked());
-        //std::cerr << "All threads at barrier\n";
-        asm volatile("":: : "memory");
-        auto start = std::chrono::high_resolution_clock::now();
+    /**
+     * Inserts n pairs without the per request work of batch. All hardware threads hash the keys and count where each
+     * goes, the pairs are scattered into one partition for the cache and one per backend, the cache partition is
+     * inserted straight into the cache and the backend ones are enqueued in full BatchData that are waited for once at
+     * the end. A chunk bound for a backend that is full goes to the spill tier instead, like the INSERTs of batch.
+     * Keys may come sorted or not but must be distinct. The store owns the values afterwards like after an insert
+     * through batch. Nothing is logged, snapshot the store after loading if the load has to survive a restart.
+     * @param keys
+     * @param values
+     * @param n
+     * @return the number of pairs loaded
+     */
+    size_t bulkLoad(const K *keys, data_t *const *values, size_t n) {
+        if (n == 0)
+            return 0;
+        size_t chunk = THREADS_PER_BLOCK * BLOCKS;
+        size_t nthreads = std::max<size_t>(1, std::min<size_t>(std::thread::hardware_concurrency(),
+                                                                (n + chunk - 1) / chunk));
+        // partitions 0 to numslabs - 1 are the backends, numslabs is the cache
+        size_t parts = numslabs + 1;
+
+        int inflight = slabs->clients.enter();
+        auto epoch = models->enter();
+        // the load is one write to the spill tier, later batches writing its keys supersede it
+        uint64_t seq = slabs->spill ? slabs->writes.stamp() : 0;
+        // the backends count their keys only once they run the chunks, so the load takes their room as it goes
+        std::unique_ptr<std::atomic<int64_t>[]> room(new std::atomic<int64_t>[numslabs]);
+        for (int i = 0; i < numslabs; ++i) {
+            room[i] = slabs->spill ? slabs->room(i) : INT64_MAX;
+        }
 
-        *model = newModel;
-        cache->log_requests = new tbb::concurrent_vector<int>(cache->getN() * cache->getSETS());
-        cache->log_hash = new tbb::concurrent_vector<unsigned>(cache->getN() * cache->getSETS());
-        cache->log_keys = new tbb::concurrent_vector<K>(cache->getN() * cache->getSETS());
-        cache->log_values = new tbb::concurrent_vector<data_t *>(cache->getN() * cache->getSETS());
-        size_t tmpSize = cache->log_size;
-        cache->log_size = 0;
+        std::vector<unsigned> hashes(n);
+        std::vector<uint32_t> dest(n);
+        std::vector<size_t> counts(nthreads * parts, 0);
+        std::vector<size_t> order(n);
 
-        int batchSizeUsed = std::min(THREADS_PER_BLOCK * BLOCKS,
-                                     (int) (tmpSize / THREADS_PER_BLOCK + 1) * THREADS_PER_BLOCK);
+        auto parallel = [nthreads](const std::function<void(size_t)> &f) {
+            std::vector<std::thread> workers;
+            for (size_t t = 1; t < nthreads; ++t) {
+                workers.push_back(std::thread(f, t));
+            }
+            f(0);
+            for (auto &w : workers) {
+                w.join();
+            }
+        };
+
+        parallel([&](size_t t) {
+            size_t *count = counts.data() + t * parts;
+            for (size_t i = n * t / nthreads; i < n * (t + 1) / nthreads; ++i) {
+                unsigned h = hfn(keys[i]);
+                uint32_t d = epoch->model->operator()(keys[i], h) ? numslabs : h % numslabs;
+                hashes[i] = h;
+                dest[i] = d;
+                count[d]++;
+            }
+        });
+
+        // every thread scatters its range right after the threads before it in the same partition
+        std::vector<size_t> partStart(parts + 1, 0);
+        size_t offset = 0;
+        for (size_t d = 0; d < parts; ++d) {
+            partStart[d] = offset;
+            for (size_t t = 0; t < nthreads; ++t) {
+                size_t c = counts[t * parts + d];
+                counts[t * parts + d] = offset;
+                offset += c;
+            }
+        }
+        partStart[parts] = offset;
 
-        for (int enqueued = 0; enqueued < tmpSize; enqueued += batchSizeUsed) {
+        parallel([&](size_t t) {
+            size_t *next = counts.data() + t * parts;
+            for (size_t i = n * t / nthreads; i < n * (t + 1) / nthreads; ++i) {
+                order[next[dest[i]]++] = i;
+            }
+        });
+
+        // the cache partition is cut in chunks like the backend ones so the threads share out both
+        struct part_chunk_t {
+            size_t part;
+            size_t begin;
+            size_t end;
+        };
+        std::vector<part_chunk_t> work;
+        for (size_t d = 0; d < parts; ++d) {
+            for (size_t b = partStart[d]; b < partStart[d + 1]; b += chunk) {
+                work.push_back({d, b, std::min(partStart[d + 1], b + chunk)});
+            }
+        }
 
-            auto gpu_batches = std::vector<BatchData<K, data_t *> *>(numslabs);
+        while (!epoch->ready.load())
+            std::this_thread::yield();
 
-            for (int i = 0; i < numslabs; ++i) {
-                gpu_batches[i] = new BatchData<K, data_t *>(0,
-                                                            std::make_shared<ResultsBuffers<data_t *>>(batchSizeUsed),
-                                                            batchSizeUsed);
-                gpu_batches[i]->resBufStart = 0;
-                gpu_batches[i]->flush = true;
-            }
+        std::atomic_size_t nextChunk{0};
+        parallel([&](size_t) {
+            std::vector<RW> reqs;
+            size_t c;
+            while ((c = nextChunk.fetch_add(1)) < work.size()) {
+                const part_chunk_t &w = work[c];
 
-            for (int i = 0; i + enqueued < tmpSize && i < batchSizeUsed; ++i) {
-                int gpuToUse = log_hash->operator[](i + enqueued) % numslabs;
-                int idx = gpu_batches[gpuToUse]->idx;
-                gpu_batches[gpuToUse]->idx++;
-                gpu_batches[gpuToUse]->keys[idx] = log_keys->operator[](i + enqueued);
-                gpu_batches[gpuToUse]->values[idx] = log_values->operator[](i + enqueued);
-                gpu_batches[gpuToUse]->requests[idx] = log_requests->operator[](i + enqueued);
-                gpu_batches[gpuToUse]->hashes[idx] = log_hash->operator[](i + enqueued);
-            }
+                if (index) {
+                    reqs.clear();
+                    for (size_t p = w.begin; p < w.end; ++p) {
+                        reqs.push_back({keys[order[p]], values[order[p]], REQUEST_INSERT});
+                    }
+                    index->apply(reqs);
+                }
 
-            for (int i = 0; i < numslabs; ++i) {
-                if (gpu_batches[i]->idx == 0) {
-                    delete gpu_batches[i];
+                if (w.part == numslabs) {
+                    for (size_t p = w.begin; p < w.end; ++p) {
+                        size_t i = order[p];
+                        size_t logLoc = 0;
+                        std::pair<kvgpu::LockingPair<K, data_t *> *, std::unique_lock<kvgpu::mutex>> pair = cache->get_with_log(
+                                keys[i], hashes[i], *epoch->model, logLoc);
+                        pair.first->value = values[i];
+                        pair.first->deleted = 0;
+                        pair.first->valid = 1;
+                        epoch->log(logLoc, REQUEST_INSERT, hashes[i], keys[i], values[i]);
+                        pair.second.unlock();
+                    }
+                } else if (room[w.part].fetch_sub(w.end - w.begin) < (int64_t) (w.end - w.begin)) {
+                    reqs.clear();
+                    for (size_t p = w.begin; p < w.end; ++p) {
+                        reqs.push_back({keys[order[p]], values[order[p]], REQUEST_INSERT});
+                    }
+                    // the tier keeps a copy
+                    slabs->spill->spill(reqs, seq);
+                    for (auto &r : reqs) {
+                        wal_codec_t<data_t *>::free(r.value);
+                    }
                 } else {
-                    slabs->load++;
-                    slabs->gpu_qs[i].push(gpu_batches[i]);
+                    int size = w.end - w.begin;
+                    auto rb = std::make_shared<ResultsBuffers<data_t>>(size);
+                    auto b = new BatchData<K, data_t>(0, rb, size);
+                    b->start = tsc_clock_t::now();
+                    b->flush = true;
+                    for (size_t p = w.begin; p < w.end; ++p) {
+                        size_t i = order[p];
+                        int idx = b->idx++;
+                        b->keys[idx] = keys[i];
+                        b->values[idx] = values[i];
+                        b->requests[idx] = REQUEST_INSERT;
+                        b->hashes[idx] = hashes[i];
+                        b->requestID[idx] = idx;
+                    }
+                    credits[w.part]->acquire();
+                    b->credit = credits[w.part];
+                    slabs->push(w.part, b);
                 }
             }
+        });
 
+        models->leave(epoch);
+        slabs->clients.leave(inflight);
+        // the BatchData pushed above are among the ones in flight now
+        slabs->backends.synchronize();
+        return n;
+    }
+
+    /**
+     * Writes a snapshot of the store to filename while batches keep running, keys come from the ordered index and
+     * values are read like scan does. Every write logged before the snapshot starts is in it and later ones may be,
+     * recovery replays the write-ahead log after the lsn it records and the log up to there is dropped afterwards.
+     * Needs ORDERED_INDEX.
+     * @param filename
+     * @return the number of pairs written, 0 if the snapshot could not be written
+     */
+    size_t snapshot(const std::string &filename) {
+        assert(index != nullptr);
+        uint64_t lsn = wal ? wal->last() : 0;
+        // writes up to lsn may still be waiting to be durable, or on their way to the cache or a backend
+        slabs->logged.synchronize();
+        slabs->quiesce();
+
+        SnapshotWriter<K, data_t *> writer(filename, lsn);
+        size_t chunk = THREADS_PER_BLOCK * BLOCKS;
+        std::vector<K> keys;
+        std::vector<std::pair<K, data_t *>> pairs;
+        while (true) {
+            std::vector<K> next;
+            if (index->walk(keys.empty() ? nullptr : &keys.back(), chunk, next) == 0)
+                break;
+            keys.swap(next);
+            pairs.clear();
+            read(keys, pairs);
+            for (auto &p : pairs) {
+                writer.add(p.first, p.second);
+                wal_codec_t<data_t *>::free(p.second);
+            }
         }
-        block->wake();
+        if (!writer.finish())
+            return 0;
+        if (wal)
+            wal->truncate(lsn);
+        return writer.getRecords();
+    }
+
+    /**
+     * Appends the pairs with keys in [lo, hi) to out in key order, taking at most max keys from the ordered index.
+     * out owns the values.
+     * Values are read through the cache and the backends with batches of GETs, keys removed meanwhile are skipped.
+     * Scanning again from one past the last key returned continues the range. Needs ORDERED_INDEX.
+     * @param lo
+     * @param hi
+     * @param max
+     * @param out
+     * @return the number of pairs appended
+     */
+    size_t scan(K lo, K hi, size_t max, std::vector<std::pair<K, data_t *>> &out) {
+        assert(index != nullptr);
+        std::vector<K> keys;
+        index->range(lo, hi, max, keys);
+        return read(keys, out);
+    }
+
+    /**
+     * Publishes newModel without stopping any worker. Batches in flight finish under the old model, then the old log
+     * is drained to the backend in parallel and the cache evicts what newModel does not keep.
+     * time is how long publishing took, the future completes once the drain and eviction are done.
+     * @param newModel
+     * @param time
+     * @return
+     */
+    std::future<void> change_model(M &newModel, double &time) {
+        std::unique_lock<std::mutex> modelLock(models->mtx);
+        auto start = std::chrono::high_resolution_clock::now();
+
+        auto next = std::make_shared<ModelEpoch<K, data_t *, M>>(std::make_shared<M>(newModel),
+                                                          cache->getN() * cache->getSETS(), false);
+        auto old = models->publish(next);
+
         auto end = std::chrono::high_resolution_clock::now();
         time = std::chrono::duration<double>(end - start).count();
 
-        return std::async([this](std::unique_lock<std::mutex> l) {
+        return std::async(std::launch::async, [this, old, next](std::unique_lock<std::mutex> l) {
+            // grace period, batches still running under the old epoch may log to it
+            while (old->active.load() != 0)
+                std::this_thread::yield();
+
+            drain_log(*old);
+            next->ready = true;
+
             std::hash<K> h;
-            cache->scan_and_evict(*(this->model), h, std::move(l));
+            cache->scan_and_evict(*(next->model), h, std::move(l));
         }, std::move(modelLock));
     }
 
     M getModel() {
-        return *model;
+        return *models->load()->model;
     }
 
     float hitRate() {
@@ -686,47 +1429,211 @@ public:
         return hits;
     }
 
+    /// requests in the batches since the stats were reset, hitRate is hits over this
+    size_t getOperations() {
+        return operations;
+    }
+
+    size_t getDedups() {
+        return dedups;
+    }
+
+    /// BatchData waiting on the backend queues of every client
+    int getQueued() {
+        return slabs->load;
+    }
+
+    /// pairs the cache holds before a set has to grow
+    size_t getCacheCapacity() {
+        return cache->getN() * cache->getSETS();
+    }
+
+    std::shared_ptr<WriteAheadLog> getWAL() {
+        return wal;
+    }
+
+    std::shared_ptr<SpillTier<K, data_t *>> getSpill() {
+        return slabs->spill;
+    }
+
     void resetStats() {
+        LatencyStats::global().reset();
         hits = 0;
         operations = 0;
+        dedups = 0;
         slabs->clearMops();
     }
 
     void stat() {
-        for (int i = 0; i < numslabs; i++) {
-            std::cout << "TABLE: GPU Info " << i << std::endl;
-            std::cout
-                    << "Time from start (s)\tTime spent responding (ms)\tTime in batch fn (ms)\tTime Dequeueing (ms)\tFraction that goes to cache\tDuration (ms)\tFill\tThroughput GPU "
-                    << i << " (Mops)" << std::endl;
-            for (auto &s : slabs->mops[i]) {
-
-                std::cout << std::chrono::duration<double>(s.timestampEnd - start).count() << "\t"
-                          << std::chrono::duration<double>(s.timestampEnd - s.timestampWriteBack).count() * 1e3 << "\t"
-                          << std::chrono::duration<double>(s.timestampWriteBack - s.timestampStartBatch).count() * 1e3
-                          << "\t"
-                          << std::chrono::duration<double>(s.timestampStartBatch - s.timestampDequeueToBatch).count() *
-                             1e3 << "\t"
-                          << s.timesGoingToCache / (double) s.size << "\t"
-                          << s.duration << "\t" << (double) s.size / THREADS_PER_BLOCK / BLOCKS << "\t"
-                          << s.size / s.duration / 1e3 << std::endl;
-            }
-            std::cout << std::endl;
-        }
+        slabs->trace->print(std::cout);
         cache->stat();
     }
 
+    /**
+     * Appends the pipeline stage latencies of the last interval to filename every interval
+     * @param filename
+     * @param interval
+     */
+    void startTraceExport(const std::string &filename, std::chrono::milliseconds interval) {
+        slabs->trace->startExport(filename, interval);
+    }
+
+    /**
+     * Writes the sampled backend batches as a Chrome trace
+     * @param filename
+     * @return false if the file could not be written
+     */
+    bool writeChromeTrace(const std::string &filename) {
+        return slabs->trace->writeChromeTrace(filename);
+    }
+
 private:
+    /**
+     * Appends the keys that are present to out with their values, reading them with batches of GETs, out owns the values
+     * @param keys
+     * @param out
+     * @return the number of pairs appended
+     */
+    size_t read(const std::vector<K> &keys, std::vector<std::pair<K, data_t *>> &out) {
+        size_t found = 0;
+        size_t chunk = THREADS_PER_BLOCK * BLOCKS;
+        for (size_t begin = 0; begin < keys.size(); begin += chunk) {
+            size_t count = std::min(chunk, keys.size() - begin);
+            std::vector<RW> req_vector((count + 511) / 512 * 512, {K(), nullptr, REQUEST_EMPTY});
+            for (size_t i = 0; i < count; ++i) {
+                req_vector[i] = {keys[begin + i], nullptr, REQUEST_GET};
+            }
+            auto rb = std::make_shared<ResultsBuffers<data_t>>(req_vector.size());
+            batch(req_vector, rb);
+
+            std::vector<data_t *> values(count, nullptr);
+            for (size_t slot = 0; slot < count; ++slot) {
+                int id;
+                while ((id = rb->requestIDs[slot]) == -1)
+                    std::this_thread::yield();
+                std::atomic_thread_fence(std::memory_order_acquire);
+                values[id] = (data_t *) rb->resultValues[slot];
+                rb->resultValues[slot] = nullptr;
+            }
+            for (size_t i = 0; i < count; ++i) {
+                if (values[i] != nullptr) {
+                    out.push_back({keys[begin + i], values[i]});
+                    found++;
+                }
+            }
+        }
+        return found;
+    }
+
+    /**
+     * Applies reqs without logging them, waits until all are answered and empties reqs
+     * @param reqs
+     */
+    void applyAndWait(std::vector<RW> &reqs) {
+        if (reqs.empty())
+            return;
+        size_t count = reqs.size();
+        reqs.resize((count + 511) / 512 * 512, {K(), nullptr, REQUEST_EMPTY});
+        auto rb = std::make_shared<ResultsBuffers<data_t>>(reqs.size());
+        batch(reqs, rb, false);
+        for (size_t slot = 0; slot < count; ++slot) {
+            while (rb->requestIDs[slot] == -1)
+                std::this_thread::yield();
+        }
+        reqs.clear();
+    }
+
+    /**
+     * Enqueues the writes logged under e to the backend, the log is split in chunks across threads
+     * @param e
+     */
+    void drain_log(ModelEpoch<K, data_t *, M> &e) {
+        size_t logSize = e.log_requests.size();
+        size_t chunk = THREADS_PER_BLOCK * BLOCKS;
+        size_t chunks = (logSize + chunk - 1) / chunk;
+        size_t nthreads = std::max<size_t>(1, std::min<size_t>(std::thread::hardware_concurrency(), chunks));
+
+        std::atomic_size_t nextChunk{0};
+        std::vector<std::thread> drainers;
+        for (size_t t = 0; t < nthreads; ++t) {
+            drainers.push_back(std::thread([this, &e, &nextChunk, logSize, chunk, chunks]() {
+                size_t c;
+                while ((c = nextChunk.fetch_add(1)) < chunks) {
+                    size_t begin = c * chunk;
+                    size_t end = std::min(logSize, begin + chunk);
+
+                    auto rb = std::make_shared<ResultsBuffers<data_t>>(end - begin);
+                    auto gpu_batches = std::vector<BatchData<K, data_t> *>(numslabs);
+                    for (int i = 0; i < numslabs; ++i) {
+                        gpu_batches[i] = new BatchData<K, data_t>(0, rb, end - begin);
+                        gpu_batches[i]->flush = true;
+                    }
+
+                    for (size_t l = begin; l < end; ++l) {
+                        int request = e.log_requests[l];
+                        if (request != REQUEST_INSERT && request != REQUEST_REMOVE)
+                            continue;
+                        int gpuToUse = e.log_hash[l] % numslabs;
+                        int idx = gpu_batches[gpuToUse]->idx;
+                        gpu_batches[gpuToUse]->idx++;
+                        gpu_batches[gpuToUse]->keys[idx] = e.log_keys[l];
+                        gpu_batches[gpuToUse]->values[idx] = e.log_values[l];
+                        gpu_batches[gpuToUse]->requests[idx] = request;
+                        gpu_batches[gpuToUse]->hashes[idx] = e.log_hash[l];
+                    }
+
+                    int resBufStart = 0;
+                    for (int i = 0; i < numslabs; ++i) {
+                        if (gpu_batches[i]->idx == 0) {
+                            delete gpu_batches[i];
+                        } else {
+                            gpu_batches[i]->resBufStart = resBufStart;
+                            resBufStart += gpu_batches[i]->idx;
+                            slabs->push(i, gpu_batches[i]);
+                        }
+                    }
+                }
+            }));
+        }
+        for (auto &t : drainers) {
+            t.join();
+        }
+    }
+
+    /**
+     * Takes a credit on backend queue i and enqueues the batch, the Slabs thread gives the credit back after write back.
+     * Waits until the log of the epoch before e is enqueued so the batch queues behind it, an empty batch is dropped
+     * without waiting.
+     * @param e
+     * @param i
+     * @param b
+     */
+    void enqueue(ModelEpoch<K, data_t *, M> &e, int i, BatchData<K, data_t> *b) {
+        if (b->idx == 0) {
+            delete b;
+            return;
+        }
+        while (!e.ready.load())
+            std::this_thread::yield();
+        credits[i]->acquire();
+        b->credit = credits[i];
+        slabs->push(i, b);
+    }
+
     int numslabs;
     std::mutex mtx;
     std::shared_ptr<Slabs<K, data_t *, M>> slabs;
     //SlabUnified<K,V> *slabs;
     std::shared_ptr<typename Cache<K, data_t *>::type> cache;
+    std::shared_ptr<PublishedModel<K, data_t *, M>> models;
+    std::shared_ptr<OrderedIndex<K>> index;
+    std::shared_ptr<WriteAheadLog> wal;
     std::hash<K> hfn;
     std::atomic_size_t hits;
     std::atomic_size_t operations;
-    std::shared_ptr<M> model;
+    std::atomic_size_t dedups;
     std::chrono::high_resolution_clock::time_point start;
-    std::mutex modelMtx;
+    std::vector<std::shared_ptr<credit_t>> credits;
 };
 
 
@@ -737,7 +1644,9 @@ public:
                                  std::shared_ptr<M> m) : numslabs(s->numslabs), slabs(s), cache(c),
                                                          hits(0), operations(0),
                                                          start(std::chrono::high_resolution_clock::now()), model(m) {
-
+        for (int i = 0; i < numslabs; ++i) {
+            credits.push_back(std::make_shared<credit_t>(CREDITS_PER_BACKEND));
+        }
     }
 
     ~NoCacheKVStoreInternalClient() {}
@@ -748,8 +1657,8 @@ public:
      * Performs the batch of operations given
      * @param req_vector
      */
-    void batch(std::vector<RequestWrapper<K, V>> &req_vector, std::shared_ptr<ResultsBuffers<V>> resBuf,
-               std::vector<std::chrono::high_resolution_clock::time_point> &times) {
+    void batch(std::vector<RequestWrapper<K, V>> &req_vector, std::shared_ptr<ResultsBuffers<V>> resBuf) {
+        uint64_t batchStart = tsc_clock_t::now();
 
         //std::cerr << req_vector.size() << std::endl;
         assert(req_vector.size() % 512 == 0 && req_vector.size() <= THREADS_PER_BLOCK * BLOCKS * numslabs);
@@ -761,6 +1670,7 @@ public:
 
         for (int i = 0; i < numslabs; ++i) {
             gpu_batches[i] = new BatchData<K, V>(0, resBuf, req_vector.size());
+            gpu_batches[i]->start = batchStart;
         }
 
         for (int i = 0; i < req_vector.size(); ++i) {
@@ -788,12 +1698,14 @@ public:
         }
 
         for (int i = 0; i < numslabs; ++i) {
-            slabs->gpu_qs[i].push(gpu_batches[i]);
+            enqueue(i, gpu_batches[i]);
         }
 
         auto gpu_batches2 = std::vector<BatchData<K, V> *>(numslabs);
         for (int i = 0; i < numslabs; ++i) {
             gpu_batches2[i] = new BatchData<K, V>(0, resBuf, req_vector.size());
+            gpu_batches2[i]->start = batchStart;
+            gpu_batches2[i]->model = model;
         }
 
         //std::cerr << "Looking through cache now\n";
@@ -826,7 +1738,7 @@ public:
                         asm volatile("":: : "memory");
                         resBuf->requestIDs[responseLocationInResBuf] = cache_batch_idx.first;
                         responseLocationInResBuf++;
-                        times.push_back(std::chrono::high_resolution_clock::now());
+                        record_latency(REQUEST_GET, LATENCY_CACHE_HIT, batchStart, tsc_clock_t::now());
 
                     }
                     if (pair.first != nullptr)
@@ -854,7 +1766,7 @@ public:
                             responseLocationInResBuf++;
                             break;
                     }
-                    times.push_back(std::chrono::high_resolution_clock::now());
+                    record_latency(req_vector_elm.requestInteger, LATENCY_CACHE_HIT, batchStart, tsc_clock_t::now());
 
                     if (pair.first != nullptr)
                         pair.second.unlock();
@@ -872,7 +1784,7 @@ public:
             if (gpu_batches2[i]->idx > 0) {
                 gpu_batches2[i]->resBufStart = sizeForGPUBatches;
                 sizeForGPUBatches += gpu_batches2[i]->idx;
-                slabs->gpu_qs[i].push(gpu_batches2[i]);
+                enqueue(i, gpu_batches2[i]);
             } else {
                 delete gpu_batches2[i];
             }
@@ -897,34 +1809,29 @@ public:
     }
 
     void resetStats() {
+        LatencyStats::global().reset();
         hits = 0;
         operations = 0;
         slabs->clearMops();
     }
 
     void stat() {
-        for (int i = 0; i < numslabs; i++) {
-            std::cout << "TABLE: GPU Info " << i << std::endl;
-            std::cout
-                    << "Time from start (s)\tTime spent responding (ms)\tTime in batch fn (ms)\tTime Dequeueing (ms)\tFraction that goes to cache\tDuration (ms)\tFill\tThroughput GPU "
-                    << i << " (Mops)" << std::endl;
-            for (auto &s : slabs->mops[i]) {
-
-                std::cout << std::chrono::duration<double>(s.timestampEnd - start).count() << "\t"
-                          << std::chrono::duration<double>(s.timestampEnd - s.timestampWriteBack).count() * 1e3 << "\t"
-                          << std::chrono::duration<double>(s.timestampWriteBack - s.timestampStartBatch).count() * 1e3
-                          << "\t"
-                          << std::chrono::duration<double>(s.timestampStartBatch - s.timestampDequeueToBatch).count() *
-                             1e3 << "\t"
-                          << s.timesGoingToCache / (double) s.size << "\t"
-                          << s.duration << "\t" << (double) s.size / THREADS_PER_BLOCK / BLOCKS << "\t"
-                          << s.size / s.duration / 1e3 << std::endl;
-            }
-            std::cout << std::endl;
-        }
+        slabs->trace->print(std::cout);
         cache->stat();
     }
 
+private:
+    /**
+     * Takes a credit on backend queue i and enqueues the batch, the Slabs thread gives the credit back after write back
+     * @param i
+     * @param b
+     */
+    void enqueue(int i, BatchData<K, V> *b) {
+        credits[i]->acquire();
+        b->credit = credits[i];
+        slabs->push(i, b);
+    }
+
 private:
     int numslabs;
     std::mutex mtx;
@@ -936,6 +1843,7 @@ private:
     std::atomic_size_t operations;
     std::shared_ptr<M> model;
     std::chrono::high_resolution_clock::time_point start;
+    std::vector<std::shared_ptr<credit_t>> credits;
 };
 
 
@@ -957,8 +1865,8 @@ public:
      * Performs the batch of operations given
      * @param req_vector
      */
-    void batch(std::vector<RequestWrapper<K, V>> &req_vector, std::shared_ptr<ResultsBuffers<V>> resBuf,
-               std::vector<std::chrono::high_resolution_clock::time_point> &times) {
+    void batch(std::vector<RequestWrapper<K, V>> &req_vector, std::shared_ptr<ResultsBuffers<V>> resBuf) {
+        uint64_t batchStart = tsc_clock_t::now();
 
         //std::cerr << req_vector.size() << std::endl;
         assert(req_vector.size() % 512 == 0 && req_vector.size() <= THREADS_PER_BLOCK * BLOCKS * numslabs);
@@ -970,6 +1878,7 @@ public:
 
         for (int i = 0; i < numslabs; ++i) {
             gpu_batches[i] = new BatchData<K, V>(0, resBuf, req_vector.size());
+            gpu_batches[i]->start = batchStart;
         }
 
         for (int i = 0; i < req_vector.size(); ++i) {
@@ -1004,6 +1913,8 @@ public:
         auto gpu_batches2 = std::vector<BatchData<K, V> *>(numslabs);
         for (int i = 0; i < numslabs; ++i) {
             gpu_batches2[i] = new BatchData<K, V>(0, resBuf, req_vector.size());
+            gpu_batches2[i]->start = batchStart;
+            gpu_batches2[i]->model = model;
         }
 
         //std::cerr << "Looking through cache now\n";
@@ -1036,7 +1947,7 @@ public:
                         asm volatile("":: : "memory");
                         resBuf->requestIDs[responseLocationInResBuf] = cache_batch_idx.first;
                         responseLocationInResBuf++;
-                        times.push_back(std::chrono::high_resolution_clock::now());
+                        record_latency(REQUEST_GET, LATENCY_CACHE_HIT, batchStart, tsc_clock_t::now());
 
                     }
                     if (pair.first != nullptr)
@@ -1064,7 +1975,7 @@ public:
                             responseLocationInResBuf++;
                             break;
                     }
-                    times.push_back(std::chrono::high_resolution_clock::now());
+                    record_latency(req_vector_elm.requestInteger, LATENCY_CACHE_HIT, batchStart, tsc_clock_t::now());
 
                     if (pair.first != nullptr)
                         pair.second.unlock();
@@ -1108,31 +2019,14 @@ public:
     }
 
     void resetStats() {
+        LatencyStats::global().reset();
         hits = 0;
         operations = 0;
         slabs->clearMops();
     }
 
     void stat() {
-        for (int i = 0; i < numslabs; i++) {
-            std::cout << "TABLE: GPU Info " << i << std::endl;
-            std::cout
-                    << "Time from start (s)\tTime spent responding (ms)\tTime in batch fn (ms)\tTime Dequeueing (ms)\tFraction that goes to cache\tDuration (ms)\tFill\tThroughput GPU "
-                    << i << " (Mops)" << std::endl;
-            for (auto &s : slabs->mops[i]) {
-
-                std::cout << std::chrono::duration<double>(s.timestampEnd - start).count() << "\t"
-                          << std::chrono::duration<double>(s.timestampEnd - s.timestampWriteBack).count() * 1e3 << "\t"
-                          << std::chrono::duration<double>(s.timestampWriteBack - s.timestampStartBatch).count() * 1e3
-                          << "\t"
-                          << std::chrono::duration<double>(s.timestampStartBatch - s.timestampDequeueToBatch).count() *
-                             1e3 << "\t"
-                          << s.timesGoingToCache / (double) s.size << "\t"
-                          << s.duration << "\t" << (double) s.size / THREADS_PER_BLOCK / BLOCKS << "\t"
-                          << s.size / s.duration / 1e3 << std::endl;
-            }
-            std::cout << std::endl;
-        }
+        slabs->trace->print(std::cout);
         cache->stat();
     }
 
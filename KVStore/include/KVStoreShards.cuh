@@ -0,0 +1,251 @@
+/*
+ * Copyright (c) 2020-2021 dePaul Miller (dsm220@lehigh.edu)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <future>
+#include <memory>
+#include <string>
+#include <vector>
+#include "KVStoreClient.cuh"
+#include "KVStoreAsyncClient.cuh"
+
+#ifndef KVGPU_KVSTORESHARDS_CUH
+#define KVGPU_KVSTORESHARDS_CUH
+
+/**
+ * Names the file of a shard, the file itself when there is a single shard
+ * @param file
+ * @param shard
+ * @param shards
+ * @return
+ */
+inline std::string shardFile(const std::string &file, int shard, int shards) {
+    if (file.empty() || shards == 1)
+        return file;
+    return file + "." + std::to_string(shard);
+}
+
+/**
+ * Shared nothing stores. The key space is hash partitioned and every shard is a whole KVStore with its own cache,
+ * slabs, backend queues, write-ahead log and spill tier, so a thread that only sends a shard its own keys never
+ * contends with the others. The shards split the memory and backend threads of one store: each gets its share of the
+ * cache sets, and the slab entries are dealt out so there is one backend thread per entry, or per shard when there are
+ * fewer entries than shards and the shards sharing an entry split its slab.
+ * K is the type of the Key
+ * V is the type of the Value
+ * M is the type of the Model
+ * @tparam K
+ * @tparam V
+ * @tparam M
+ */
+template<typename K, typename V, typename M>
+class KVStoreShards {
+public:
+    typedef typename AsyncValue<V>::type value_t;
+    typedef RequestWrapper<K, value_t> RW;
+    typedef KVStoreClient<K, V, M> client_t;
+
+    KVStoreShards() = delete;
+
+    /**
+     * Makes the shards, each gets the files named by WAL_FILE and SPILL_FILE with its shard number appended
+     * @param shards
+     * @param conf the slabs of the whole store
+     */
+    KVStoreShards(int shards, const std::vector<PartitionedSlabUnifiedConfig> &conf) {
+        int entries = conf.size();
+        for (int s = 0; s < shards; ++s) {
+            std::vector<PartitionedSlabUnifiedConfig> shardConf;
+            if (entries >= shards) {
+                for (int i = s; i < entries; i += shards) {
+                    shardConf.push_back(conf[i]);
+                }
+            } else {
+                // shards s, s + entries, ... share entry s % entries
+                int sharing = (shards - s % entries + entries - 1) / entries;
+                shardConf.push_back(conf[s % entries]);
+                shardConf.back().size = std::max(1, conf[s % entries].size / sharing);
+            }
+            store_options_t opts;
+            opts.walFile = shardFile(WAL_FILE, s, shards);
+            opts.spillFile = shardFile(SPILL_FILE, s, shards);
+            opts.cacheSets = std::max<size_t>(1, Cache<K, V>::SETS / shards);
+            KVStoreCtx<K, V, M> ctx(shardConf, opts);
+            clients.emplace_back(new client_t(ctx));
+        }
+    }
+
+    KVStoreShards(const KVStoreShards<K, V, M> &) = delete;
+
+    int size() const {
+        return clients.size();
+    }
+
+    /**
+     * The shard that owns key. The cache picks its set from the key itself, so the key is mixed first or the keys of
+     * a shard would only ever land in a fraction of its sets.
+     * @param key
+     * @return
+     */
+    int shardOf(K key) const {
+        uint64_t h = (uint64_t) std::hash<K>()(key) * 0x9E3779B97F4A7C15ULL;
+        return (int) ((h >> 32) * clients.size() >> 32);
+    }
+
+    client_t &operator[](int shard) {
+        return *clients[shard];
+    }
+
+    /**
+     * Recovers every shard from its own log and snapshot
+     * @param snapshotFile
+     * @return the writes replayed
+     */
+    size_t recover(const std::string &snapshotFile = "") {
+        size_t n = 0;
+        for (int s = 0; s < size(); ++s) {
+            n += clients[s]->recover(shardFile(snapshotFile, s, size()));
+        }
+        return n;
+    }
+
+    /**
+     * Bulk loads every shard with the pairs it owns, each shard loads on all hardware threads
+     * @param keys
+     * @param values
+     * @param n
+     * @return the pairs loaded
+     */
+    size_t bulkLoad(const K *keys, value_t const *values, size_t n) {
+        std::vector<std::vector<K>> shardKeys(size());
+        std::vector<std::vector<value_t>> shardValues(size());
+        for (size_t i = 0; i < n; ++i) {
+            int s = shardOf(keys[i]);
+            shardKeys[s].push_back(keys[i]);
+            shardValues[s].push_back(values[i]);
+        }
+        size_t loaded = 0;
+        for (int s = 0; s < size(); ++s) {
+            loaded += clients[s]->bulkLoad(shardKeys[s].data(), shardValues[s].data(), shardKeys[s].size());
+        }
+        return loaded;
+    }
+
+    /**
+     * Snapshots every shard to its own file
+     * @param filename
+     * @return the pairs written
+     */
+    size_t snapshot(const std::string &filename) {
+        size_t n = 0;
+        for (int s = 0; s < size(); ++s) {
+            n += clients[s]->snapshot(shardFile(filename, s, size()));
+        }
+        return n;
+    }
+
+    /**
+     * Publishes newModel in every shard
+     * @param newModel
+     * @param time the longest publish of a shard
+     * @return ready once every shard adopted it
+     */
+    std::future<void> change_model(M &newModel, double &time) {
+        std::vector<std::shared_ptr<std::future<void>>> changes;
+        time = 0;
+        for (auto &c : clients) {
+            double t = 0;
+            changes.push_back(std::make_shared<std::future<void>>(c->change_model(newModel, t)));
+            time = std::max(time, t);
+        }
+        return std::async(std::launch::deferred, [changes]() {
+            for (auto &f : changes) {
+                f->wait();
+            }
+        });
+    }
+
+    void resetStats() {
+        for (auto &c : clients) {
+            c->resetStats();
+        }
+    }
+
+    float hitRate() {
+        size_t operations = 0;
+        for (auto &c : clients) {
+            operations += c->getOperations();
+        }
+        return (double) getHits() / operations;
+    }
+
+    size_t getHits() {
+        size_t n = 0;
+        for (auto &c : clients) {
+            n += c->getHits();
+        }
+        return n;
+    }
+
+    size_t getDedups() {
+        size_t n = 0;
+        for (auto &c : clients) {
+            n += c->getDedups();
+        }
+        return n;
+    }
+
+    size_t getOperations() {
+        size_t n = 0;
+        for (auto &c : clients) {
+            n += c->getOperations();
+        }
+        return n;
+    }
+
+    size_t getCacheCapacity() {
+        size_t n = 0;
+        for (auto &c : clients) {
+            n += c->getCacheCapacity();
+        }
+        return n;
+    }
+
+    size_t getOps() {
+        size_t n = 0;
+        for (auto &c : clients) {
+            n += c->getOps();
+        }
+        return n;
+    }
+
+    void stat() {
+        for (auto &c : clients) {
+            c->stat();
+        }
+    }
+
+private:
+    std::vector<std::unique_ptr<client_t>> clients;
+};
+
+#endif //KVGPU_KVSTORESHARDS_CUH
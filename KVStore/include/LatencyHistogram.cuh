@@ -0,0 +1,339 @@
+/*
+ * Copyright (c) 2020-2021 dePaul Miller (dsm220@lehigh.edu)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <ImportantDefinitions.cuh>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#ifndef KVGPU_LATENCYHISTOGRAM_CUH
+#define KVGPU_LATENCYHISTOGRAM_CUH
+
+/// values in [2^e, 2^(e+1)) are split into 2^LATENCY_SUB_BUCKET_BITS buckets, about 1.6% relative error
+const int LATENCY_SUB_BUCKET_BITS = 6;
+/// anything at or above 2^LATENCY_MAX_EXP ticks lands in the last bucket
+const int LATENCY_MAX_EXP = 40;
+
+/// where a request was answered
+enum LatencyTier {
+    LATENCY_CACHE_HIT = 0,
+    LATENCY_BACKEND = 1,
+    LATENCY_MISS_FILL = 2,
+    LATENCY_TIERS = 3
+};
+
+/// REQUEST_GET, REQUEST_INSERT and REQUEST_REMOVE
+const int LATENCY_REQUEST_TYPES = 3;
+
+/**
+ * Cheap timestamps, the TSC where there is one. Ticks are converted to time only when reporting.
+ */
+struct tsc_clock_t {
+    static inline uint64_t now() {
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+    }
+
+    /**
+     * @return nanoseconds per tick, measured once against the steady clock
+     */
+    static double nsPerTick() {
+        static const double ns = calibrate();
+        return ns;
+    }
+
+private:
+    static double calibrate() {
+#if defined(__x86_64__) || defined(__i386__)
+        auto start = std::chrono::steady_clock::now();
+        uint64_t ticks = now();
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        uint64_t ticksEnd = now();
+        auto end = std::chrono::steady_clock::now();
+        return std::chrono::duration<double, std::nano>(end - start).count() / (double) (ticksEnd - ticks);
+#else
+        return 1.0;
+#endif
+    }
+};
+
+/**
+ * HDR style log bucketed histogram of tick counts. One thread records, any thread may read or merge it.
+ */
+struct LatencyHistogram {
+    static const int SUB_BUCKETS = 1 << LATENCY_SUB_BUCKET_BITS;
+    static const int BUCKETS = (LATENCY_MAX_EXP - LATENCY_SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+    LatencyHistogram() : counts(new std::atomic<uint64_t>[BUCKETS]), total(0), sum(0), max(0) {
+        reset();
+    }
+
+    LatencyHistogram(const LatencyHistogram &) = delete;
+
+    ~LatencyHistogram() {
+        delete[] counts;
+    }
+
+    static inline int bucketOf(uint64_t v) {
+        if (v < SUB_BUCKETS)
+            return (int) v;
+        if (v >= (1ull << LATENCY_MAX_EXP))
+            v = (1ull << LATENCY_MAX_EXP) - 1;
+        int shift = 63 - __builtin_clzll(v) - LATENCY_SUB_BUCKET_BITS;
+        return (shift + 1) * SUB_BUCKETS + (int) ((v >> shift) - SUB_BUCKETS);
+    }
+
+    /**
+     * @return the highest value that lands in bucket b
+     */
+    static inline uint64_t valueOf(int b) {
+        if (b < SUB_BUCKETS)
+            return b;
+        int shift = b / SUB_BUCKETS - 1;
+        uint64_t sub = b % SUB_BUCKETS + SUB_BUCKETS;
+        return ((sub + 1) << shift) - 1;
+    }
+
+    /**
+     * Records n requests that took v ticks, only the owning thread calls this
+     * @param v
+     * @param n
+     */
+    inline void record(uint64_t v, uint64_t n = 1) {
+        auto &c = counts[bucketOf(v)];
+        c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+        total.store(total.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+        sum.store(sum.load(std::memory_order_relaxed) + v * n, std::memory_order_relaxed);
+        if (v > max.load(std::memory_order_relaxed))
+            max.store(v, std::memory_order_relaxed);
+    }
+
+    void merge(const LatencyHistogram &other) {
+        for (int b = 0; b < BUCKETS; ++b) {
+            counts[b] += other.counts[b].load(std::memory_order_relaxed);
+        }
+        total += other.total.load(std::memory_order_relaxed);
+        sum += other.sum.load(std::memory_order_relaxed);
+        if (other.max.load(std::memory_order_relaxed) > max.load())
+            max = other.max.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * Makes this hold what cur recorded since prev was merged from it, the max is the top of the highest bucket used
+     * @param cur
+     * @param prev
+     */
+    void since(const LatencyHistogram &cur, const LatencyHistogram &prev) {
+        uint64_t n = 0;
+        uint64_t top = 0;
+        for (int b = 0; b < BUCKETS; ++b) {
+            uint64_t c = cur.counts[b].load(std::memory_order_relaxed) - prev.counts[b].load(std::memory_order_relaxed);
+            counts[b] = c;
+            n += c;
+            if (c != 0)
+                top = valueOf(b);
+        }
+        total = n;
+        sum = cur.sum.load(std::memory_order_relaxed) - prev.sum.load(std::memory_order_relaxed);
+        max = std::min(top, cur.max.load(std::memory_order_relaxed));
+    }
+
+    void reset() {
+        for (int b = 0; b < BUCKETS; ++b) {
+            counts[b] = 0;
+        }
+        total = 0;
+        sum = 0;
+        max = 0;
+    }
+
+    /**
+     * @param p percentile in [0, 100]
+     * @return ticks at or below which p percent of the requests finished
+     */
+    uint64_t percentile(double p) const {
+        uint64_t n = total.load();
+        if (n == 0)
+            return 0;
+        uint64_t target = std::max<uint64_t>(1, (uint64_t) std::ceil(p / 100.0 * n));
+        uint64_t seen = 0;
+        for (int b = 0; b < BUCKETS; ++b) {
+            seen += counts[b].load(std::memory_order_relaxed);
+            if (seen >= target)
+                return std::min(valueOf(b), max.load());
+        }
+        return max.load();
+    }
+
+    std::atomic<uint64_t> *counts;
+    std::atomic<uint64_t> total;
+    std::atomic<uint64_t> sum;
+    std::atomic<uint64_t> max;
+};
+
+/**
+ * Histograms of one thread, by request type and tier
+ */
+struct LatencyRecorder {
+    LatencyRecorder() : generation(0) {}
+
+    LatencyHistogram hist[LATENCY_REQUEST_TYPES][LATENCY_TIERS];
+    /// the reset these histograms were last cleared for
+    std::atomic<uint64_t> generation;
+};
+
+/**
+ * Summary of one request type and tier, in milliseconds
+ */
+struct LatencySummary {
+    std::string request;
+    std::string tier;
+    uint64_t count;
+    double mean;
+    double p50;
+    double p99;
+    double p999;
+    double max;
+};
+
+/**
+ * Every thread that records gets its own LatencyRecorder, they are merged when reporting.
+ * Only the owning thread writes a recorder, so a reset only starts a new generation and each thread clears its own
+ * recorder the next time it records. Recorders not cleared since are left out of the summary.
+ */
+class LatencyStats {
+public:
+
+    static LatencyStats &global() {
+        static LatencyStats stats;
+        return stats;
+    }
+
+    /**
+     * @return the recorder of the calling thread, made on first use
+     */
+    LatencyRecorder &local() {
+        thread_local LatencyRecorder *r = nullptr;
+        if (r == nullptr) {
+            std::unique_lock<std::mutex> l(mtx);
+            recorders.push_back(std::make_unique<LatencyRecorder>());
+            r = recorders.back().get();
+            r->generation = generation.load();
+        }
+        uint64_t g = generation.load(std::memory_order_acquire);
+        if (r->generation.load(std::memory_order_relaxed) != g) {
+            for (auto &type : r->hist) {
+                for (auto &h : type) {
+                    h.reset();
+                }
+            }
+            r->generation.store(g, std::memory_order_release);
+        }
+        return *r;
+    }
+
+    /// drops what was recorded so far, the threads clear their recorders when they next record
+    void reset() {
+        generation++;
+    }
+
+    /**
+     * Merges the recorders of all threads
+     * @return one summary for each request type and tier that saw requests
+     */
+    std::vector<LatencySummary> summary() {
+        static const char *requestNames[LATENCY_REQUEST_TYPES] = {"GET", "INSERT", "REMOVE"};
+        static const char *tierNames[LATENCY_TIERS] = {"cache hit", "backend", "miss then fill"};
+
+        double msPerTick = tsc_clock_t::nsPerTick() / 1e6;
+        std::vector<LatencySummary> res;
+        std::unique_lock<std::mutex> l(mtx);
+        for (int type = 0; type < LATENCY_REQUEST_TYPES; ++type) {
+            for (int tier = 0; tier < LATENCY_TIERS; ++tier) {
+                LatencyHistogram merged;
+                for (auto &r : recorders) {
+                    if (r->generation.load(std::memory_order_acquire) == generation.load())
+                        merged.merge(r->hist[type][tier]);
+                }
+                uint64_t n = merged.total.load();
+                if (n == 0)
+                    continue;
+                res.push_back({requestNames[type], tierNames[tier], n,
+                               (double) merged.sum.load() / n * msPerTick,
+                               merged.percentile(50) * msPerTick,
+                               merged.percentile(99) * msPerTick,
+                               merged.percentile(99.9) * msPerTick,
+                               merged.max.load() * msPerTick});
+            }
+        }
+        return res;
+    }
+
+private:
+    LatencyStats() : generation(0) {}
+
+    std::mutex mtx;
+    std::atomic<uint64_t> generation;
+    std::vector<std::unique_ptr<LatencyRecorder>> recorders;
+};
+
+/**
+ * Records n requests of type request answered from tier that started at tick start and finished at tick end.
+ * Starts of 0 are not timed (log drains) and neither is anything that is not a GET, INSERT or REMOVE.
+ */
+inline void record_latency(unsigned request, int tier, uint64_t start, uint64_t end, uint64_t n = 1) {
+    if (start == 0)
+        return;
+    // in the order of the names in LatencyStats::summary, whatever the values of the request codes
+    int type;
+    switch (request) {
+        case REQUEST_GET:
+            type = 0;
+            break;
+        case REQUEST_INSERT:
+            type = 1;
+            break;
+        case REQUEST_REMOVE:
+            type = 2;
+            break;
+        default:
+            return;
+    }
+    LatencyStats::global().local().hist[type][tier].record(end - start, n);
+}
+
+#endif //KVGPU_LATENCYHISTOGRAM_CUH
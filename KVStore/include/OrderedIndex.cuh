@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2020-2021 dePaul Miller (dsm220@lehigh.edu)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <atomic>
+#include <vector>
+#include <functional>
+#define TBB_PREVIEW_CONCURRENT_ORDERED_CONTAINERS 1
+#include <tbb/concurrent_map.h>
+#include <ImportantDefinitions.cuh>
+
+#ifndef KVGPU_ORDEREDINDEX_CUH
+#define KVGPU_ORDEREDINDEX_CUH
+
+/**
+ * Ordered set of the keys present in the store, kept next to the hash tiers so ranges of keys can be enumerated.
+ * The keys are in a concurrent skiplist, so writes and scans run in parallel without a lock. A removed key stays in
+ * the skiplist marked absent, since the skiplist cannot erase concurrently, and is marked present again when it is
+ * inserted again. The caller orders the writes to a key, the batches of the store hold its stripes of write_order_t.
+ * K is the type of the Key
+ * @tparam K
+ */
+template<typename K, typename Compare = std::less<K>>
+class OrderedIndex {
+public:
+    OrderedIndex() : present(0) {}
+
+    OrderedIndex(const OrderedIndex<K, Compare> &) = delete;
+
+    /**
+     * Applies the INSERTs and REMOVEs of a batch in order, everything else is ignored
+     * @param reqs
+     */
+    template<typename Requests>
+    void apply(const Requests &reqs) {
+        for (auto &r : reqs) {
+            if (r.requestInteger == REQUEST_INSERT) {
+                auto it = keys.find(r.key);
+                if (it == keys.end()) {
+                    auto added = keys.emplace(r.key, true);
+                    if (added.second) {
+                        present++;
+                        continue;
+                    }
+                    it = added.first;
+                }
+                if (!it->second.exchange(true))
+                    present++;
+            } else if (r.requestInteger == REQUEST_REMOVE) {
+                auto it = keys.find(r.key);
+                if (it != keys.end() && it->second.exchange(false))
+                    present--;
+            }
+        }
+    }
+
+    /**
+     * Appends up to max keys in [lo, hi) to out in key order
+     * @param lo
+     * @param hi
+     * @param max
+     * @param out
+     * @return the number of keys appended
+     */
+    size_t range(const K &lo, const K &hi, size_t max, std::vector<K> &out) {
+        size_t found = 0;
+        Compare less;
+        for (auto it = keys.lower_bound(lo); it != keys.end() && found < max && less(it->first, hi); ++it) {
+            if (!it->second.load())
+                continue;
+            out.push_back(it->first);
+            found++;
+        }
+        return found;
+    }
+
+    /**
+     * Appends up to max keys greater than *after to out in key order, starting from the smallest key if after is null.
+     * Lets a walk over every key continue from the last one it got.
+     * @param after
+     * @param max
+     * @param out
+     * @return the number of keys appended
+     */
+    size_t walk(const K *after, size_t max, std::vector<K> &out) {
+        size_t found = 0;
+        for (auto it = after ? keys.upper_bound(*after) : keys.begin(); it != keys.end() && found < max; ++it) {
+            if (!it->second.load())
+                continue;
+            out.push_back(it->first);
+            found++;
+        }
+        return found;
+    }
+
+    size_t size() {
+        return present.load();
+    }
+
+private:
+    tbb::concurrent_map<K, std::atomic_bool, Compare> keys;
+    std::atomic<size_t> present;
+};
+
+#endif //KVGPU_ORDEREDINDEX_CUH
@@ -0,0 +1,317 @@
+/*
+ * Copyright (c) 2020-2021 dePaul Miller (dsm220@lehigh.edu)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "LatencyHistogram.cuh"
+
+#ifndef KVGPU_PIPELINETRACE_CUH
+#define KVGPU_PIPELINETRACE_CUH
+
+/// every TRACE_SAMPLE_EVERY-th batch of a backend thread is kept for the stat tables and Chrome traces
+const int TRACE_SAMPLE_EVERY = 16;
+/// sampled batches kept per backend thread, older ones are overwritten
+const int TRACE_SAMPLES = 4096;
+
+enum PipelineStage {
+    /// from the client taking the batch to a backend thread dequeuing it
+    STAGE_QUEUE_WAIT = 0,
+    /// from starting to gather a backend batch to handing it to the backend
+    STAGE_ASSEMBLY = 1,
+    /// the backend running the batch
+    STAGE_EXECUTE = 2,
+    /// answering the requests and filling the cache
+    STAGE_WRITE_BACK = 3,
+    PIPELINE_STAGES = 4
+};
+
+/**
+ * Timings of one backend batch, in tsc_clock_t ticks
+ */
+struct StatData {
+    uint64_t timestampEnd;
+    uint64_t timestampWriteBack;
+    uint64_t timestampStartBatch;
+    uint64_t timestampDequeueToBatch;
+    float duration;
+    int size;
+    int timesGoingToCache;
+};
+
+/**
+ * Stage histograms and a ring of sampled batches for each backend thread, in fixed memory.
+ * Thread t is the only one writing slot t, so a reset only starts a new generation and thread t clears its slot the
+ * next time it records. Slots not cleared since are left out of what is printed and exported.
+ */
+class PipelineTracer {
+public:
+    explicit PipelineTracer(int threads) : n(threads), stages(new LatencyHistogram[threads * PIPELINE_STAGES]),
+                                           last(new LatencyHistogram[threads * PIPELINE_STAGES]),
+                                           samples(new StatData[threads * TRACE_SAMPLES]),
+                                           batches(new std::atomic<uint64_t>[threads]),
+                                           seen(new std::atomic<uint64_t>[threads]), generation(0),
+                                           origin(tsc_clock_t::now()), stopExport(false) {
+        for (int t = 0; t < n; ++t) {
+            batches[t] = 0;
+            seen[t] = 0;
+        }
+    }
+
+    PipelineTracer(const PipelineTracer &) = delete;
+
+    ~PipelineTracer() {
+        if (exporter.joinable()) {
+            {
+                std::unique_lock<std::mutex> l(mtx);
+                stopExport = true;
+            }
+            cv.notify_one();
+            exporter.join();
+        }
+        delete[] stages;
+        delete[] last;
+        delete[] samples;
+        delete[] batches;
+        delete[] seen;
+    }
+
+    int size() const {
+        return n;
+    }
+
+    LatencyHistogram &stage(int t, int s) {
+        return stages[t * PIPELINE_STAGES + s];
+    }
+
+    inline void recordQueueWait(int t, uint64_t enqueued, uint64_t dequeued) {
+        claim(t);
+        if (enqueued != 0)
+            stage(t, STAGE_QUEUE_WAIT).record(dequeued - enqueued);
+    }
+
+    inline void recordBatch(int t, const StatData &s) {
+        claim(t);
+        stage(t, STAGE_ASSEMBLY).record(s.timestampStartBatch - s.timestampDequeueToBatch);
+        stage(t, STAGE_EXECUTE).record(s.timestampWriteBack - s.timestampStartBatch);
+        stage(t, STAGE_WRITE_BACK).record(s.timestampEnd - s.timestampWriteBack);
+
+        uint64_t b = batches[t].load(std::memory_order_relaxed);
+        if (b % TRACE_SAMPLE_EVERY == 0) {
+            samples[t * TRACE_SAMPLES + (b / TRACE_SAMPLE_EVERY) % TRACE_SAMPLES] = s;
+        }
+        batches[t].store(b + 1, std::memory_order_release);
+    }
+
+    /**
+     * Drops what was recorded so far while the backend threads keep recording
+     */
+    void reset() {
+        std::unique_lock<std::mutex> l(mtx);
+        generation++;
+        for (int i = 0; i < n * PIPELINE_STAGES; ++i) {
+            last[i].reset();
+        }
+    }
+
+    /**
+     * @param t
+     * @return true once thread t cleared its slot since the last reset
+     */
+    bool current(int t) const {
+        return seen[t].load(std::memory_order_acquire) == generation.load(std::memory_order_acquire);
+    }
+
+    /**
+     * @param t
+     * @return the sampled batches of thread t, oldest first
+     */
+    std::vector<StatData> sampled(int t) const {
+        if (!current(t))
+            return {};
+        uint64_t kept = (batches[t].load(std::memory_order_acquire) + TRACE_SAMPLE_EVERY - 1) / TRACE_SAMPLE_EVERY;
+        uint64_t first = kept > TRACE_SAMPLES ? kept - TRACE_SAMPLES : 0;
+        std::vector<StatData> res;
+        res.reserve(kept - first);
+        for (uint64_t k = first; k < kept; ++k) {
+            res.push_back(samples[t * TRACE_SAMPLES + k % TRACE_SAMPLES]);
+        }
+        return res;
+    }
+
+    static const char *stageName(int s) {
+        static const char *names[PIPELINE_STAGES] = {"queue wait", "batch assembly", "backend execute", "write back"};
+        return names[s];
+    }
+
+    /**
+     * Prints the sampled batches of every backend thread and the stage latencies
+     * @param out
+     */
+    void print(std::ostream &out) {
+        double sPerTick = tsc_clock_t::nsPerTick() / 1e9;
+        double msPerTick = tsc_clock_t::nsPerTick() / 1e6;
+        for (int t = 0; t < n; t++) {
+            out << "TABLE: GPU Info " << t << std::endl;
+            out << "Time from start (s)\tTime spent responding (ms)\tTime in batch fn (ms)\tTime Dequeueing (ms)"
+                   "\tFraction that goes to cache\tDuration (ms)\tFill\tThroughput GPU " << t << " (Mops)" << std::endl;
+            for (auto &s : sampled(t)) {
+                out << (s.timestampEnd - origin) * sPerTick << "\t"
+                    << (s.timestampEnd - s.timestampWriteBack) * msPerTick << "\t"
+                    << (s.timestampWriteBack - s.timestampStartBatch) * msPerTick << "\t"
+                    << (s.timestampStartBatch - s.timestampDequeueToBatch) * msPerTick << "\t"
+                    << s.timesGoingToCache / (double) s.size << "\t"
+                    << s.duration << "\t" << (double) s.size / THREADS_PER_BLOCK / BLOCKS << "\t"
+                    << s.size / s.duration / 1e3 << std::endl;
+            }
+            out << std::endl;
+        }
+
+        out << "TABLE: Pipeline Stages" << std::endl;
+        out << "GPU\tStage\tCount\tMean (ms)\tp50 (ms)\tp99 (ms)\tMax (ms)" << std::endl;
+        for (int t = 0; t < n; t++) {
+            for (int s = 0; s < PIPELINE_STAGES && current(t); ++s) {
+                LatencyHistogram &h = stage(t, s);
+                uint64_t count = h.total.load();
+                if (count == 0)
+                    continue;
+                out << t << "\t" << stageName(s) << "\t" << count << "\t" << (double) h.sum.load() / count * msPerTick
+                    << "\t" << h.percentile(50) * msPerTick << "\t" << h.percentile(99) * msPerTick << "\t"
+                    << h.max.load() * msPerTick << std::endl;
+            }
+        }
+        out << std::endl;
+    }
+
+    /**
+     * Appends a CSV row per backend thread and stage to filename every interval, covering what was recorded since
+     * the row before
+     * @param filename
+     * @param interval
+     */
+    void startExport(const std::string &filename, std::chrono::milliseconds interval) {
+        std::unique_lock<std::mutex> l(mtx);
+        if (exporter.joinable())
+            return;
+        exporter = std::thread([this, filename, interval]() {
+            std::ofstream out(filename);
+            out << "time_s,gpu,stage,count,mean_ms,p50_ms,p99_ms,max_ms" << std::endl;
+            std::unique_lock<std::mutex> l(mtx);
+            while (!stopExport) {
+                cv.wait_for(l, interval, [this]() { return stopExport; });
+                exportInterval(out);
+            }
+        });
+    }
+
+    /**
+     * Writes the sampled batches in the Chrome trace event format, one track per backend thread
+     * @param filename
+     * @return false if the file could not be written
+     */
+    bool writeChromeTrace(const std::string &filename) {
+        std::ofstream out(filename);
+        if (!out)
+            return false;
+        double usPerTick = tsc_clock_t::nsPerTick() / 1e3;
+        bool first = true;
+        auto event = [&](const char *name, int t, uint64_t from, uint64_t to) {
+            out << (first ? "" : ",\n") << "{\"name\":\"" << name << "\",\"ph\":\"X\",\"pid\":0,\"tid\":" << t
+                << ",\"ts\":" << (from - origin) * usPerTick << ",\"dur\":" << (to - from) * usPerTick << "}";
+            first = false;
+        };
+        out << "[\n";
+        for (int t = 0; t < n; ++t) {
+            out << (first ? "" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":" << t
+                << ",\"args\":{\"name\":\"GPU " << t << "\"}}";
+            first = false;
+            for (auto &s : sampled(t)) {
+                event(stageName(STAGE_ASSEMBLY), t, s.timestampDequeueToBatch, s.timestampStartBatch);
+                event(stageName(STAGE_EXECUTE), t, s.timestampStartBatch, s.timestampWriteBack);
+                event(stageName(STAGE_WRITE_BACK), t, s.timestampWriteBack, s.timestampEnd);
+            }
+        }
+        out << "\n]" << std::endl;
+        return out.good();
+    }
+
+private:
+
+    /// clears slot t if a reset happened since thread t last recorded, only thread t calls this
+    inline void claim(int t) {
+        uint64_t g = generation.load(std::memory_order_acquire);
+        if (seen[t].load(std::memory_order_relaxed) == g)
+            return;
+        for (int s = 0; s < PIPELINE_STAGES; ++s) {
+            stage(t, s).reset();
+        }
+        batches[t].store(0, std::memory_order_relaxed);
+        seen[t].store(g, std::memory_order_release);
+    }
+
+    /// called with mtx held, which keeps generation from changing
+    void exportInterval(std::ofstream &out) {
+        double msPerTick = tsc_clock_t::nsPerTick() / 1e6;
+        double time = (tsc_clock_t::now() - origin) * tsc_clock_t::nsPerTick() / 1e9;
+        LatencyHistogram interval;
+        for (int t = 0; t < n; ++t) {
+            // a slot not yet cleared would show what was recorded before the reset
+            for (int s = 0; s < PIPELINE_STAGES && current(t); ++s) {
+                int i = t * PIPELINE_STAGES + s;
+                interval.since(stages[i], last[i]);
+                last[i].reset();
+                last[i].merge(stages[i]);
+                uint64_t count = interval.total.load();
+                if (count == 0)
+                    continue;
+                out << time << "," << t << "," << stageName(s) << "," << count << ","
+                    << (double) interval.sum.load() / count * msPerTick << ","
+                    << interval.percentile(50) * msPerTick << "," << interval.percentile(99) * msPerTick << ","
+                    << interval.max.load() * msPerTick << std::endl;
+            }
+        }
+    }
+
+    int n;
+    LatencyHistogram *stages;
+    /// what stages held at the last export
+    LatencyHistogram *last;
+    StatData *samples;
+    std::atomic<uint64_t> *batches;
+    /// the generation slot t was last cleared for
+    std::atomic<uint64_t> *seen;
+    std::atomic<uint64_t> generation;
+    uint64_t origin;
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool stopExport;
+    std::thread exporter;
+};
+
+#endif //KVGPU_PIPELINETRACE_CUH
@@ -0,0 +1,259 @@
+/*
+ * Copyright (c) 2020-2021 dePaul Miller (dsm220@lehigh.edu)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+#include <dirent.h>
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifndef KVGPU_PLACEMENT_CUH
+#define KVGPU_PLACEMENT_CUH
+
+/**
+ * Parses a Linux CPU list such as "0-3,8,10-11"
+ * @param list
+ * @return the CPUs in order, empty if list is empty or malformed
+ */
+inline std::vector<int> parseCpuList(const std::string &list) {
+    std::vector<int> cpus;
+    std::stringstream ss(list);
+    std::string part;
+    while (std::getline(ss, part, ',')) {
+        part.erase(std::remove_if(part.begin(), part.end(), ::isspace), part.end());
+        if (part.empty())
+            continue;
+        int first, last;
+        char dash;
+        std::stringstream ps(part);
+        if (!(ps >> first))
+            return {};
+        last = first;
+        if (ps >> dash && (dash != '-' || !(ps >> last)))
+            return {};
+        for (int c = first; c <= last; ++c) {
+            cpus.push_back(c);
+        }
+    }
+    return cpus;
+}
+
+/**
+ * Formats cpus as a CPU list
+ * @param cpus
+ * @return
+ */
+inline std::string formatCpuList(const std::vector<int> &cpus) {
+    std::string out;
+    for (size_t i = 0; i < cpus.size();) {
+        size_t j = i;
+        while (j + 1 < cpus.size() && cpus[j + 1] == cpus[j] + 1) {
+            ++j;
+        }
+        if (!out.empty())
+            out += ",";
+        out += std::to_string(cpus[i]);
+        if (j > i)
+            out += "-" + std::to_string(cpus[j]);
+        i = j + 1;
+    }
+    return out;
+}
+
+/// where a logical CPU sits, read from sysfs
+struct cpu_info_t {
+    int cpu;
+    int core;
+    int package;
+    int node;
+};
+
+/**
+ * Reads the online CPUs this process may run on with their core, package and NUMA node from
+ * /sys/devices/system/cpu. A missing file counts as core = cpu and package and node 0, so a machine without the
+ * topology files looks like one without SMT.
+ * @return
+ */
+inline std::vector<cpu_info_t> readTopology() {
+    auto readInt = [](const std::string &path, int fallback) {
+        std::ifstream in(path);
+        int v;
+        return in >> v ? v : fallback;
+    };
+
+    std::string online;
+    std::ifstream onlineFile("/sys/devices/system/cpu/online");
+    std::getline(onlineFile, online);
+    std::vector<int> cpus = parseCpuList(online);
+    if (cpus.empty()) {
+        for (int c = 0; c < (int) std::thread::hardware_concurrency(); ++c) {
+            cpus.push_back(c);
+        }
+    }
+
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    bool haveAllowed = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+
+    std::vector<cpu_info_t> topology;
+    for (int c : cpus) {
+        if (haveAllowed && c < CPU_SETSIZE && !CPU_ISSET(c, &allowed))
+            continue;
+        std::string dir = "/sys/devices/system/cpu/cpu" + std::to_string(c);
+        cpu_info_t info{c, readInt(dir + "/topology/core_id", c), readInt(dir + "/topology/physical_package_id", 0),
+                        0};
+        if (DIR *d = opendir(dir.c_str())) {
+            while (dirent *e = readdir(d)) {
+                int node;
+                if (sscanf(e->d_name, "node%d", &node) == 1) {
+                    info.node = node;
+                    break;
+                }
+            }
+            closedir(d);
+        }
+        topology.push_back(info);
+    }
+    return topology;
+}
+
+/**
+ * The CPUs of one kind of thread. Every thread of the role pins itself to the next CPU in turn, so a role with fewer
+ * CPUs than threads shares them round robin.
+ */
+struct cpu_role_t {
+
+    cpu_role_t() : next(0) {}
+
+    cpu_role_t(const cpu_role_t &) = delete;
+
+    /**
+     * Pins the calling thread to the next CPU of the role, does nothing if the role has no CPUs
+     * @return the CPU or -1
+     */
+    int pin() {
+        if (cpus.empty())
+            return -1;
+        int cpu = cpus[next.fetch_add(1) % cpus.size()];
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (err != 0) {
+            std::cerr << "Could not pin a thread to CPU " << cpu << ": " << strerror(err) << std::endl;
+            return -1;
+        }
+        return cpu;
+    }
+
+    std::vector<int> cpus;
+    std::atomic_int next;
+};
+
+/// worker threads of the server that run batches
+cpu_role_t WORKER_CPUS;
+/// Slabs threads that batch for the GPUs
+cpu_role_t BACKEND_CPUS;
+/// network and shared memory front-end threads
+cpu_role_t IO_CPUS;
+/// workload threads that generate batches
+cpu_role_t GENERATOR_CPUS;
+
+/**
+ * Prefers memory of node for the calling thread and the threads it starts from now on, does nothing for node < 0
+ * @param node
+ * @return false if the kernel refused
+ */
+inline bool bindMemoryToNode(int node) {
+    if (node < 0)
+        return true;
+    unsigned long mask[16] = {};
+    if (node >= (int) (sizeof(mask) * 8))
+        return false;
+    mask[node / (sizeof(unsigned long) * 8)] |= 1UL << (node % (sizeof(unsigned long) * 8));
+    if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, sizeof(mask) * 8) != 0) {
+        std::cerr << "Could not bind memory to node " << node << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Picks CPUs for every role from the topology. Every physical core is handed out once before any SMT sibling, and
+ * siblings are left out altogether with avoidSmt. Roles are served in order backends, workers, I/O and generators,
+ * since the backends feed the GPUs. Once the CPUs run out, the remaining threads wrap around and share.
+ * @param topology
+ * @param counts threads of each role, in the order above
+ * @param avoidSmt
+ * @param node only use CPUs of this NUMA node, all nodes if negative
+ * @return the CPUs of each role, empty if the topology has no usable CPU
+ */
+inline std::vector<std::vector<int>> planPlacement(const std::vector<cpu_info_t> &topology,
+                                                   const std::vector<int> &counts, bool avoidSmt, int node) {
+    std::vector<cpu_info_t> usable;
+    for (auto &c : topology) {
+        if (node < 0 || c.node == node)
+            usable.push_back(c);
+    }
+    std::sort(usable.begin(), usable.end(), [](const cpu_info_t &a, const cpu_info_t &b) {
+        return std::tie(a.node, a.package, a.core, a.cpu) < std::tie(b.node, b.package, b.core, b.cpu);
+    });
+
+    std::vector<int> pool;
+    std::vector<int> siblings;
+    for (size_t i = 0; i < usable.size(); ++i) {
+        bool first = i == 0 || usable[i].package != usable[i - 1].package || usable[i].core != usable[i - 1].core;
+        (first ? pool : siblings).push_back(usable[i].cpu);
+    }
+    if (!avoidSmt)
+        pool.insert(pool.end(), siblings.begin(), siblings.end());
+
+    std::vector<std::vector<int>> roles(counts.size());
+    if (pool.empty())
+        return roles;
+    size_t next = 0;
+    for (size_t r = 0; r < counts.size(); ++r) {
+        for (int t = 0; t < counts[r]; ++t) {
+            roles[r].push_back(pool[next++ % pool.size()]);
+        }
+    }
+    if (next > pool.size()) {
+        std::cerr << next << " threads share " << pool.size() << " CPUs" << std::endl;
+    }
+    return roles;
+}
+
+#endif //KVGPU_PLACEMENT_CUH
@@ -0,0 +1,303 @@
+/*
+ * Copyright (c) 2020-2021 dePaul Miller (dsm220@lehigh.edu)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "WriteAheadLog.cuh"
+
+#ifndef KVGPU_SNAPSHOT_CUH
+#define KVGPU_SNAPSHOT_CUH
+
+/// records per snapshot block, a block is what one recovery thread loads in one batch
+const size_t SNAPSHOT_BLOCK_RECORDS = 4096;
+
+const char SNAPSHOT_MAGIC[8] = {'K', 'V', 'C', 'G', 'S', 'N', 'A', 'P'};
+const uint32_t SNAPSHOT_VERSION = 1;
+
+struct snapshot_header_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t keySize;
+    /// every write-ahead log record up to here is in the snapshot
+    uint64_t lsn;
+    uint64_t records;
+    uint64_t blocks;
+    uint64_t indexOffset;
+};
+
+/**
+ * Index entry of a block, first is its smallest key
+ * @tparam K
+ */
+template<typename K>
+struct snapshot_block_t {
+    K first;
+    uint64_t offset;
+    uint64_t length;
+    uint64_t records;
+    uint32_t checksum;
+};
+
+/// FNV-1a
+inline uint32_t snapshot_checksum(const char *p, size_t n) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < n; ++i) {
+        h ^= (unsigned char) p[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/**
+ * Writes a snapshot file: a header, blocks of SNAPSHOT_BLOCK_RECORDS pairs in key order and an index of the blocks.
+ * Keys and values are written with wal_codec_t, so V is data_t * for data_t stores.
+ * The file is written next to filename and renamed over it once synced, an old snapshot stays whole until then.
+ * @tparam K
+ * @tparam V
+ */
+template<typename K, typename V>
+class SnapshotWriter {
+public:
+
+    SnapshotWriter(const std::string &filename, uint64_t lsn) : filename(filename), tmp(filename + ".tmp"),
+                                                                offset(sizeof(snapshot_header_t)), records(0) {
+        fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            std::cerr << "Cannot open snapshot " << tmp << ": " << strerror(errno) << std::endl;
+            return;
+        }
+        memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+        header.version = SNAPSHOT_VERSION;
+        header.keySize = sizeof(K);
+        header.lsn = lsn;
+        header.records = 0;
+        header.blocks = 0;
+        header.indexOffset = 0;
+    }
+
+    SnapshotWriter(const SnapshotWriter<K, V> &) = delete;
+
+    ~SnapshotWriter() {
+        if (fd >= 0) {
+            close(fd);
+            unlink(tmp.c_str());
+        }
+    }
+
+    /**
+     * Adds a pair, keys have to come in increasing order
+     * @param key
+     * @param value
+     */
+    void add(const K &key, const V &value) {
+        if (fd < 0)
+            return;
+        if (block.empty()) {
+            index.push_back({key, offset, 0, 0, 0});
+        }
+        wal_codec_t<K>::put(block, key);
+        wal_codec_t<V>::put(block, value);
+        index.back().records++;
+        records++;
+        if (index.back().records == SNAPSHOT_BLOCK_RECORDS) {
+            endBlock();
+        }
+    }
+
+    /**
+     * Writes the index and header, syncs and renames the snapshot into place
+     * @return false if the snapshot could not be written
+     */
+    bool finish() {
+        if (fd < 0)
+            return false;
+        endBlock();
+        header.records = records;
+        header.blocks = index.size();
+        header.indexOffset = offset;
+        bool ok = writeAt(reinterpret_cast<const char *>(index.data()), index.size() * sizeof(snapshot_block_t<K>),
+                          offset) &&
+                  writeAt(reinterpret_cast<const char *>(&header), sizeof(header), 0) && fdatasync(fd) == 0;
+        ok = close(fd) == 0 && ok;
+        fd = -1;
+        if (!ok || rename(tmp.c_str(), filename.c_str()) != 0) {
+            std::cerr << "Cannot write snapshot " << filename << ": " << strerror(errno) << std::endl;
+            unlink(tmp.c_str());
+            return false;
+        }
+        sync_parent_dir(filename);
+        return true;
+    }
+
+    size_t getRecords() const {
+        return records;
+    }
+
+private:
+
+    void endBlock() {
+        if (block.empty())
+            return;
+        index.back().length = block.size();
+        index.back().checksum = snapshot_checksum(block.data(), block.size());
+        if (!writeAt(block.data(), block.size(), offset)) {
+            std::cerr << "Cannot write snapshot " << tmp << ": " << strerror(errno) << std::endl;
+            close(fd);
+            unlink(tmp.c_str());
+            fd = -1;
+        }
+        offset += block.size();
+        block.clear();
+    }
+
+    bool writeAt(const char *p, size_t n, uint64_t at) {
+        while (n > 0) {
+            ssize_t w = pwrite(fd, p, n, at);
+            if (w < 0) {
+                if (errno == EINTR)
+                    continue;
+                return false;
+            }
+            p += w;
+            n -= w;
+            at += w;
+        }
+        return true;
+    }
+
+    std::string filename;
+    std::string tmp;
+    int fd;
+    snapshot_header_t header;
+    uint64_t offset;
+    uint64_t records;
+    std::vector<char> block;
+    std::vector<snapshot_block_t<K>> index;
+};
+
+/**
+ * Maps a snapshot file and decodes its blocks, blocks are independent so they can be loaded in parallel
+ * @tparam K
+ * @tparam V
+ */
+template<typename K, typename V>
+class SnapshotReader {
+public:
+
+    explicit SnapshotReader(const std::string &filename) : base(nullptr), size(0), index(nullptr) {
+        fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            std::cerr << "Cannot open snapshot " << filename << ": " << strerror(errno) << std::endl;
+            return;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(snapshot_header_t)) {
+            std::cerr << "Snapshot " << filename << " is truncated" << std::endl;
+            return;
+        }
+        size = st.st_size;
+        void *m = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (m == MAP_FAILED) {
+            std::cerr << "Cannot map snapshot " << filename << ": " << strerror(errno) << std::endl;
+            return;
+        }
+        memcpy(&header, m, sizeof(header));
+        if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0 ||
+            header.version != SNAPSHOT_VERSION || header.keySize != sizeof(K) ||
+            header.indexOffset > size ||
+            header.blocks > (size - header.indexOffset) / sizeof(snapshot_block_t<K>)) {
+            std::cerr << "Snapshot " << filename << " is not a snapshot of this store" << std::endl;
+            munmap(m, size);
+            return;
+        }
+        // blocks are read by many threads at once
+        madvise(m, size, MADV_WILLNEED);
+        base = static_cast<const char *>(m);
+        index = reinterpret_cast<const snapshot_block_t<K> *>(base + header.indexOffset);
+    }
+
+    SnapshotReader(const SnapshotReader<K, V> &) = delete;
+
+    ~SnapshotReader() {
+        if (base)
+            munmap(const_cast<char *>(base), size);
+        if (fd >= 0)
+            close(fd);
+    }
+
+    bool valid() const {
+        return base != nullptr;
+    }
+
+    uint64_t lsn() const {
+        return header.lsn;
+    }
+
+    uint64_t records() const {
+        return header.records;
+    }
+
+    size_t blocks() const {
+        return valid() ? header.blocks : 0;
+    }
+
+    /**
+     * Hands every pair of block b to f in key order, values are allocated by the codec and owned by f
+     * @param b
+     * @param f called with the key and value
+     * @return false if the block is damaged
+     */
+    template<typename F>
+    bool block(size_t b, F f) const {
+        snapshot_block_t<K> e;
+        memcpy(&e, index + b, sizeof(e));
+        if (e.offset > header.indexOffset || e.length > header.indexOffset - e.offset ||
+            snapshot_checksum(base + e.offset, e.length) != e.checksum)
+            return false;
+        const char *p = base + e.offset;
+        const char *end = p + e.length;
+        for (uint64_t r = 0; r < e.records; ++r) {
+            K key{};
+            V value{};
+            if (!wal_codec_t<K>::get(p, end, key) || !wal_codec_t<V>::get(p, end, value))
+                return false;
+            f(key, value);
+        }
+        return true;
+    }
+
+private:
+    int fd;
+    const char *base;
+    size_t size;
+    snapshot_header_t header;
+    const snapshot_block_t<K> *index;
+};
+
+#endif //KVGPU_SNAPSHOT_CUH
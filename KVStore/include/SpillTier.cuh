@@ -0,0 +1,638 @@
+/*
+ * Copyright (c) 2020-2021 dePaul Miller (dsm220@lehigh.edu)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include "WriteAheadLog.cuh"
+
+#ifndef KVGPU_SPILLTIER_CUH
+#define KVGPU_SPILLTIER_CUH
+
+/// index shards of the spill tier, each has its own lock
+const int SPILL_SHARDS = 64;
+/// slots an index shard starts with, a power of two
+const size_t SPILL_SHARD_SLOTS = 1024;
+/// threads reading spilled values for the backend threads
+const int SPILL_IO_THREADS = 8;
+/// a resolve with more reads than this splits them across the I/O threads
+const size_t SPILL_READS_PER_THREAD = 32;
+
+/**
+ * Where a record is, length counts the length prefix and is 0 for a free index slot
+ */
+struct spill_loc_t {
+    uint32_t segment;
+    uint32_t length;
+    uint64_t offset;
+};
+
+/**
+ * Log-structured file tier for the values a full backend has no room for.
+ * A client batch writes the INSERTs bound for a full backend to the active segment with one pwrite, the backend gets
+ * REMOVEs for them instead. The in-memory index maps keys to their newest record and every entry carries
+ * the write sequence of its record, so a stale location never replaces a newer one. GETs the backends do not find are
+ * resolved from the tier with preads spread over a pool of I/O threads. A compaction thread rewrites the live records
+ * of sealed segments that are mostly garbage and deletes them.
+ * The tier is scratch space, it starts empty and durability is left to the write-ahead log and snapshots.
+ * V is data_t * for data_t stores.
+ * @tparam K
+ * @tparam V
+ */
+template<typename K, typename V>
+class SpillTier {
+public:
+
+    SpillTier(const std::string &base, size_t segmentBytes,
+              std::chrono::milliseconds compactInterval = std::chrono::milliseconds(100)) : base(base),
+                                                                                            segmentBytes(segmentBytes),
+                                                                                            compactInterval(
+                                                                                                    compactInterval),
+                                                                                            nextSegment(0), keys(0),
+                                                                                            lookups(0), hits(0),
+                                                                                            compactions(0),
+                                                                                            stop(false) {
+        for (auto &s : shards) {
+            s.slots.resize(SPILL_SHARD_SLOTS);
+        }
+        active = newSegment();
+        for (int t = 0; t < SPILL_IO_THREADS; ++t) {
+            io.push_back(std::thread([this]() { ioLoop(); }));
+        }
+        compactor = std::thread([this]() { compactLoop(); });
+    }
+
+    SpillTier(const SpillTier<K, V> &) = delete;
+
+    /**
+     * Stops the threads and deletes the segment files
+     */
+    ~SpillTier() {
+        {
+            std::unique_lock<std::mutex> l(ioMtx);
+            stop = true;
+        }
+        ioCv.notify_all();
+        for (auto &t : io) {
+            t.join();
+        }
+        compactor.join();
+        for (auto &s : segments) {
+            unlink(s.second->path.c_str());
+        }
+    }
+
+    /**
+     * Writes the INSERTs in reqs to the tier, the caller holds their write stripes
+     * @param reqs
+     * @param seq write sequence of the batch reqs come from
+     */
+    template<typename Requests>
+    void spill(const Requests &reqs, uint64_t seq) {
+        std::vector<char> buf;
+        std::vector<std::pair<K, spill_loc_t>> updates;
+        for (auto &r : reqs) {
+            if (r.requestInteger == REQUEST_INSERT)
+                updates.push_back({r.key, encode(buf, r.key, r.value)});
+        }
+        if (buf.empty())
+            return;
+        uint64_t offset = 0;
+        std::shared_ptr<segment_t> seg = place(buf, offset);
+        for (auto &u : updates) {
+            u.second.segment = seg->id;
+            u.second.offset += offset;
+            uint64_t fp = fingerprint(u.first);
+            shard_t &s = shardOf(fp);
+            std::unique_lock<std::mutex> l(s.mtx);
+            size_t at = s.find(fp, u.first);
+            if (at == NOT_FOUND) {
+                s.insert({u.first, fp, seq, u.second});
+                keys++;
+                seg->live += u.second.length;
+            } else if (s.slots[at].seq <= seq) {
+                retire(s.slots[at].loc);
+                s.slots[at].seq = seq;
+                s.slots[at].loc = u.second;
+                seg->live += u.second.length;
+            }
+        }
+        seg->writers--;
+    }
+
+    /**
+     * Forgets key, for REMOVEs and writes the cache takes, the caller holds the write stripe of key
+     * @param key
+     */
+    void drop(const K &key) {
+        forget(key, UINT64_MAX);
+    }
+
+    /**
+     * Forgets key if its record is older than seq, for INSERTs a backend has applied
+     * @param key
+     * @param seq
+     */
+    void supersede(const K &key, uint64_t seq) {
+        forget(key, seq);
+    }
+
+    /**
+     * Fills in the GETs among the first n entries of a backend batch that came back empty and were spilled
+     * @param keys
+     * @param values
+     * @param requests
+     * @param n
+     * @param filled gets the entries filled in, their values are allocated here for data_t stores
+     * @return the number of entries filled in
+     */
+    size_t resolve(const K *keys, V *values, const int *requests, int n, std::vector<int> &filled) {
+        std::vector<int> candidates;
+        for (int p = 0; p < n; ++p) {
+            if (requests[p] == REQUEST_GET && values[p] == EMPTY<V>::value)
+                candidates.push_back(p);
+        }
+        if (candidates.empty())
+            return 0;
+        lookups += candidates.size();
+
+        std::vector<char> found(candidates.size(), 0);
+        parallel(candidates.size(), [&](size_t c) {
+            found[c] = read(keys[candidates[c]], values[candidates[c]]);
+        });
+        size_t count = 0;
+        for (size_t c = 0; c < candidates.size(); ++c) {
+            if (found[c]) {
+                filled.push_back(candidates[c]);
+                count++;
+            }
+        }
+        hits += count;
+        return count;
+    }
+
+    size_t getSegments() {
+        std::shared_lock<std::shared_mutex> l(segMtx);
+        return segments.size();
+    }
+
+    /// bytes in the segment files
+    size_t getBytes() {
+        std::shared_lock<std::shared_mutex> l(segMtx);
+        size_t b = 0;
+        for (auto &s : segments) {
+            b += s.second->size;
+        }
+        return b;
+    }
+
+    /// bytes of records the index still points at
+    size_t getLiveBytes() {
+        std::shared_lock<std::shared_mutex> l(segMtx);
+        size_t b = 0;
+        for (auto &s : segments) {
+            b += s.second->live;
+        }
+        return b;
+    }
+
+    /// keys the index holds
+    size_t getKeys() const {
+        return keys;
+    }
+
+    size_t getLookups() const {
+        return lookups;
+    }
+
+    size_t getHits() const {
+        return hits;
+    }
+
+    size_t getCompactions() const {
+        return compactions;
+    }
+
+private:
+
+    struct segment_t {
+        segment_t(uint32_t i, std::string p, int f) : id(i), path(std::move(p)), fd(f), size(0), live(0),
+                                                      writers(0), sealed(false) {}
+
+        ~segment_t() {
+            close(fd);
+        }
+
+        uint32_t id;
+        std::string path;
+        int fd;
+        std::atomic<uint64_t> size;
+        std::atomic<uint64_t> live;
+        /// placed records whose index update is still to come, compaction waits for them
+        std::atomic_int writers;
+        std::atomic_bool sealed;
+    };
+
+    static const size_t NOT_FOUND = SIZE_MAX;
+
+    /// index entry, keys whose fingerprints collide get entries of their own
+    struct slot_t {
+        K key;
+        uint64_t fp;
+        uint64_t seq;
+        spill_loc_t loc;
+    };
+
+    /// open addressed with linear probing, removal shifts the entries behind back so there are no tombstones
+    struct shard_t {
+        size_t find(uint64_t fp, const K &key) const {
+            size_t mask = slots.size() - 1;
+            for (size_t i = fp & mask; slots[i].loc.length != 0; i = (i + 1) & mask) {
+                if (slots[i].fp == fp && memcmp(&slots[i].key, &key, sizeof(K)) == 0)
+                    return i;
+            }
+            return NOT_FOUND;
+        }
+
+        void insert(const slot_t &slot) {
+            if ((used + 1) * 4 > slots.size() * 3) {
+                std::vector<slot_t> old(slots.size() * 2);
+                old.swap(slots);
+                used = 0;
+                for (auto &o : old) {
+                    if (o.loc.length != 0)
+                        insert(o);
+                }
+            }
+            size_t mask = slots.size() - 1;
+            size_t i = slot.fp & mask;
+            while (slots[i].loc.length != 0) {
+                i = (i + 1) & mask;
+            }
+            slots[i] = slot;
+            used++;
+        }
+
+        void erase(size_t i) {
+            size_t mask = slots.size() - 1;
+            for (size_t j = (i + 1) & mask; slots[j].loc.length != 0; j = (j + 1) & mask) {
+                size_t home = slots[j].fp & mask;
+                if (((j - home) & mask) >= ((j - i) & mask)) {
+                    slots[i] = slots[j];
+                    i = j;
+                }
+            }
+            slots[i].loc.length = 0;
+            used--;
+        }
+
+        std::mutex mtx;
+        std::vector<slot_t> slots;
+        size_t used = 0;
+    };
+
+    /**
+     * Mixes the hash of key, the mix is a bijection so keys of up to 8 bytes hashed by identity never collide.
+     * The top bits pick the shard, the low ones the slot.
+     */
+    static uint64_t fingerprint(const K &key) {
+        uint64_t h = std::hash<K>()(key);
+        h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+        return h ^ (h >> 31);
+    }
+
+    shard_t &shardOf(uint64_t fp) {
+        return shards[(fp >> 40) % SPILL_SHARDS];
+    }
+
+    /// removes the entry of key if its seq is below seq
+    void forget(const K &key, uint64_t seq) {
+        if (keys.load() == 0)
+            return;
+        uint64_t fp = fingerprint(key);
+        shard_t &s = shardOf(fp);
+        std::unique_lock<std::mutex> l(s.mtx);
+        size_t at = s.find(fp, key);
+        if (at != NOT_FOUND && s.slots[at].seq < seq) {
+            retire(s.slots[at].loc);
+            s.erase(at);
+            keys--;
+        }
+    }
+
+    /// appends a length prefixed record and returns where it is in buf
+    static spill_loc_t encode(std::vector<char> &buf, const K &key, const V &value) {
+        size_t at = buf.size();
+        buf.resize(at + sizeof(uint32_t));
+        wal_codec_t<K>::put(buf, key);
+        wal_codec_t<V>::put(buf, value);
+        uint32_t len = buf.size() - at;
+        memcpy(buf.data() + at, &len, sizeof(len));
+        return {0, len, at};
+    }
+
+    std::shared_ptr<segment_t> newSegment() {
+        uint32_t id = nextSegment++;
+        std::string path = base + "." + std::to_string(id);
+        int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            std::cerr << "Cannot open spill segment " << path << ": " << strerror(errno) << std::endl;
+            exit(1);
+        }
+        auto seg = std::make_shared<segment_t>(id, path, fd);
+        std::unique_lock<std::shared_mutex> l(segMtx);
+        segments[id] = seg;
+        return seg;
+    }
+
+    std::shared_ptr<segment_t> segment(uint32_t id) {
+        std::shared_lock<std::shared_mutex> l(segMtx);
+        auto it = segments.find(id);
+        return it == segments.end() ? nullptr : it->second;
+    }
+
+    /**
+     * Reserves room for buf in the active segment, sealing it first if buf does not fit, and writes buf there.
+     * The caller counts as a writer of the segment until it has updated the index.
+     * @param buf
+     * @param offset where buf starts in the segment
+     * @return the segment buf was written to
+     */
+    std::shared_ptr<segment_t> place(const std::vector<char> &buf, uint64_t &offset) {
+        std::shared_ptr<segment_t> seg;
+        {
+            std::unique_lock<std::mutex> l(appendMtx);
+            if (active->size > 0 && active->size + buf.size() > segmentBytes) {
+                active->sealed = true;
+                active = newSegment();
+            }
+            seg = active;
+            seg->writers++;
+            offset = seg->size.fetch_add(buf.size());
+        }
+        size_t done = 0;
+        while (done < buf.size()) {
+            ssize_t w = pwrite(seg->fd, buf.data() + done, buf.size() - done, offset + done);
+            if (w < 0) {
+                if (errno == EINTR)
+                    continue;
+                std::cerr << "Cannot write spill segment " << seg->path << ": " << strerror(errno) << std::endl;
+                exit(1);
+            }
+            done += w;
+        }
+        return seg;
+    }
+
+    /// the record at loc is garbage now
+    void retire(const spill_loc_t &loc) {
+        if (auto seg = segment(loc.segment))
+            seg->live -= loc.length;
+    }
+
+    /**
+     * Reads the newest record of key, retried if compaction moved it in between
+     * @param key
+     * @param value
+     * @return false if key was not spilled
+     */
+    bool read(const K &key, V &value) {
+        std::vector<char> buf;
+        uint64_t fp = fingerprint(key);
+        for (int attempt = 0; attempt < 3; ++attempt) {
+            spill_loc_t loc;
+            {
+                shard_t &s = shardOf(fp);
+                std::unique_lock<std::mutex> l(s.mtx);
+                size_t at = s.find(fp, key);
+                if (at == NOT_FOUND)
+                    return false;
+                loc = s.slots[at].loc;
+            }
+            auto seg = segment(loc.segment);
+            if (!seg)
+                continue;
+            buf.resize(loc.length);
+            size_t done = 0;
+            while (done < buf.size()) {
+                ssize_t r = pread(seg->fd, buf.data() + done, buf.size() - done, loc.offset + done);
+                if (r <= 0) {
+                    if (r < 0 && errno == EINTR)
+                        continue;
+                    std::cerr << "Cannot read spill segment " << seg->path << ": " << strerror(errno) << std::endl;
+                    exit(1);
+                }
+                done += r;
+            }
+            // the record holds the key before the value
+            const char *p = buf.data() + sizeof(uint32_t);
+            K stored;
+            if (!wal_codec_t<K>::get(p, buf.data() + buf.size(), stored))
+                return false;
+            return wal_codec_t<V>::get(p, buf.data() + buf.size(), value);
+        }
+        return false;
+    }
+
+    /**
+     * Runs f(i) for i in [0, n), split in chunks across the I/O threads and the caller
+     * @param n
+     * @param f
+     */
+    template<typename F>
+    void parallel(size_t n, F f) {
+        size_t chunks = std::min<size_t>(SPILL_IO_THREADS + 1, (n + SPILL_READS_PER_THREAD - 1) / SPILL_READS_PER_THREAD);
+        std::atomic_size_t next{0};
+        auto work = [&]() {
+            size_t c;
+            while ((c = next.fetch_add(1)) < chunks) {
+                for (size_t i = c * n / chunks; i < (c + 1) * n / chunks; ++i) {
+                    f(i);
+                }
+            }
+        };
+        std::atomic_size_t pending{chunks - 1};
+        if (chunks > 1) {
+            {
+                std::unique_lock<std::mutex> l(ioMtx);
+                for (size_t j = 0; j + 1 < chunks; ++j) {
+                    jobs.push_back([&work, &pending]() {
+                        work();
+                        pending--;
+                    });
+                }
+            }
+            ioCv.notify_all();
+        }
+        work();
+        while (pending.load() != 0)
+            std::this_thread::yield();
+    }
+
+    void ioLoop() {
+        while (true) {
+            std::function<void()> job;
+            {
+                std::unique_lock<std::mutex> l(ioMtx);
+                ioCv.wait(l, [this]() { return stop || !jobs.empty(); });
+                if (jobs.empty())
+                    return;
+                job = std::move(jobs.front());
+                jobs.pop_front();
+            }
+            job();
+        }
+    }
+
+    void compactLoop() {
+        while (true) {
+            {
+                std::unique_lock<std::mutex> l(ioMtx);
+                ioCv.wait_for(l, compactInterval, [this]() { return stop; });
+                if (stop)
+                    return;
+            }
+            std::vector<std::shared_ptr<segment_t>> victims;
+            {
+                std::shared_lock<std::shared_mutex> l(segMtx);
+                for (auto &s : segments) {
+                    if (s.second->sealed && s.second->writers == 0 && s.second->live * 2 < s.second->size)
+                        victims.push_back(s.second);
+                }
+            }
+            for (auto &seg : victims) {
+                compact(seg);
+            }
+        }
+    }
+
+    /**
+     * Moves the live records of seg to the active segment and deletes seg.
+     * An entry is only pointed at the moved record if it still points at the old one, a record moved while a write
+     * replaced or dropped it is garbage in its new place.
+     * @param seg
+     */
+    void compact(const std::shared_ptr<segment_t> &seg) {
+        std::vector<char> old(seg->size);
+        size_t read = 0;
+        while (read < old.size()) {
+            ssize_t r = pread(seg->fd, old.data() + read, old.size() - read, read);
+            if (r <= 0) {
+                std::cerr << "Cannot read spill segment " << seg->path << ": " << strerror(errno) << std::endl;
+                exit(1);
+            }
+            read += r;
+        }
+
+        std::vector<char> buf;
+        // key, fingerprint, where the record was and where it goes
+        struct move_t {
+            K key;
+            uint64_t fp;
+            uint64_t from;
+            spill_loc_t to;
+        };
+        std::vector<move_t> moved;
+        for (size_t pos = 0; pos + sizeof(uint32_t) <= old.size();) {
+            uint32_t len;
+            memcpy(&len, old.data() + pos, sizeof(len));
+            const char *p = old.data() + pos + sizeof(uint32_t);
+            K key;
+            wal_codec_t<K>::get(p, old.data() + pos + len, key);
+            uint64_t fp = fingerprint(key);
+            bool live;
+            {
+                shard_t &s = shardOf(fp);
+                std::unique_lock<std::mutex> l(s.mtx);
+                size_t at = s.find(fp, key);
+                live = at != NOT_FOUND && s.slots[at].loc.segment == seg->id && s.slots[at].loc.offset == pos;
+            }
+            if (live) {
+                moved.push_back({key, fp, pos, {0, len, buf.size()}});
+                buf.insert(buf.end(), old.data() + pos, old.data() + pos + len);
+            }
+            pos += len;
+        }
+
+        if (!buf.empty()) {
+            uint64_t offset;
+            auto to = place(buf, offset);
+            for (auto &m : moved) {
+                m.to.segment = to->id;
+                m.to.offset += offset;
+                shard_t &s = shardOf(m.fp);
+                std::unique_lock<std::mutex> l(s.mtx);
+                size_t at = s.find(m.fp, m.key);
+                if (at != NOT_FOUND && s.slots[at].loc.segment == seg->id && s.slots[at].loc.offset == m.from) {
+                    s.slots[at].loc = m.to;
+                    to->live += m.to.length;
+                }
+            }
+            to->writers--;
+        }
+
+        {
+            std::unique_lock<std::shared_mutex> l(segMtx);
+            segments.erase(seg->id);
+        }
+        // readers holding seg still read through its descriptor
+        unlink(seg->path.c_str());
+        compactions++;
+    }
+
+    std::string base;
+    size_t segmentBytes;
+    std::chrono::milliseconds compactInterval;
+    std::atomic<uint32_t> nextSegment;
+    shard_t shards[SPILL_SHARDS];
+    std::atomic_size_t keys;
+    std::shared_mutex segMtx;
+    std::map<uint32_t, std::shared_ptr<segment_t>> segments;
+    std::mutex appendMtx;
+    std::shared_ptr<segment_t> active;
+    std::atomic_size_t lookups;
+    std::atomic_size_t hits;
+    std::atomic_size_t compactions;
+    std::mutex ioMtx;
+    std::condition_variable ioCv;
+    std::deque<std::function<void()>> jobs;
+    bool stop;
+    std::vector<std::thread> io;
+    std::thread compactor;
+};
+
+#endif //KVGPU_SPILLTIER_CUH
@@ -0,0 +1,523 @@
+/*
+ * Copyright (c) 2020-2021 dePaul Miller (dsm220@lehigh.edu)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#include <algorithm>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <climits>
+#include <ImportantDefinitions.cuh>
+
+#ifndef KVGPU_WRITEAHEADLOG_CUH
+#define KVGPU_WRITEAHEADLOG_CUH
+
+/// threads append to one of this many buffers, picked once per thread
+const int WAL_BUFFERS = 64;
+
+/**
+ * How keys and values are written to the log, trivially copyable types are copied as is
+ * @tparam T
+ */
+template<typename T>
+struct wal_codec_t {
+    static_assert(std::is_trivially_copyable<T>::value, "log records copy keys and values bytewise");
+
+    static void put(std::vector<char> &out, const T &v) {
+        const char *p = reinterpret_cast<const char *>(&v);
+        out.insert(out.end(), p, p + sizeof(T));
+    }
+
+    static bool get(const char *&p, const char *end, T &v) {
+        if (end - p < (long) sizeof(T))
+            return false;
+        memcpy(&v, p, sizeof(T));
+        p += sizeof(T);
+        return true;
+    }
+};
+
+template<>
+struct wal_codec_t<data_t *> {
+    static const uint64_t NONE = UINT64_MAX;
+
+    static void put(std::vector<char> &out, data_t *const &v) {
+        uint64_t size = v ? v->size : NONE;
+        wal_codec_t<uint64_t>::put(out, size);
+        if (v)
+            out.insert(out.end(), v->data, v->data + v->size);
+    }
+
+    /// the value read is allocated here and owned by the caller
+    static bool get(const char *&p, const char *end, data_t *&v) {
+        uint64_t size;
+        if (!wal_codec_t<uint64_t>::get(p, end, size))
+            return false;
+        if (size == NONE) {
+            v = nullptr;
+            return true;
+        }
+        if ((uint64_t) (end - p) < size)
+            return false;
+        v = new data_t(size);
+        memcpy(v->data, p, size);
+        p += size;
+        return true;
+    }
+
+    /// frees a value get allocated
+    static void free(data_t *v) {
+        if (v) {
+            delete[] v->data;
+            v->data = nullptr;
+            delete v;
+        }
+    }
+};
+
+/**
+ * Syncs the directory holding filename, a rename into it is only durable once the directory is
+ * @param filename
+ * @return false if the directory could not be synced
+ */
+inline bool sync_parent_dir(const std::string &filename) {
+    size_t slash = filename.find_last_of('/');
+    std::string dir = slash == std::string::npos ? "." : filename.substr(0, slash + 1);
+    int dfd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (dfd < 0)
+        return false;
+    bool ok = fsync(dfd) == 0;
+    close(dfd);
+    return ok;
+}
+
+/**
+ * Group commit write-ahead log of INSERTs and REMOVEs.
+ * Every write gets a log sequence number (lsn) and is appended to a per-thread buffer, a commit thread writes all
+ * buffers with pwritev and fdatasync every interval and then everything up to the lsn it started from is durable.
+ * Records are written in commit order and sorted by lsn when replayed.
+ * Once a snapshot holds everything up to some lsn, truncate drops those records and leaves a checkpoint record in their
+ * place so sequence numbers keep growing across restarts.
+ */
+class WriteAheadLog {
+public:
+
+    WriteAheadLog(const std::string &filename, std::chrono::microseconds interval) : filename(filename),
+                                                                                     interval(interval),
+                                                                                     buffers(new buffer_t[WAL_BUFFERS]),
+                                                                                     sequence(0), durableLsn(0),
+                                                                                     commits(0), records(0),
+                                                                                     bytes(0), truncateTo(0),
+                                                                                     truncating(false), stop(false) {
+        fd = open(filename.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0) {
+            std::cerr << "Cannot open write-ahead log " << filename << ": " << strerror(errno) << std::endl;
+            exit(1);
+        }
+        offset = scan();
+        if (ftruncate(fd, offset) != 0) {
+            std::cerr << "Cannot truncate write-ahead log " << filename << ": " << strerror(errno) << std::endl;
+            exit(1);
+        }
+        committer = std::thread([this]() { commitLoop(); });
+    }
+
+    WriteAheadLog(const WriteAheadLog &) = delete;
+
+    /**
+     * Commits what is left
+     */
+    ~WriteAheadLog() {
+        {
+            std::unique_lock<std::mutex> l(mtx);
+            stop = true;
+        }
+        cv.notify_all();
+        committer.join();
+        close(fd);
+        delete[] buffers;
+    }
+
+    /**
+     * Appends the INSERTs and REMOVEs in reqs in order
+     * @param reqs
+     * @return the lsn of the last write appended, 0 if there was none
+     */
+    template<typename Requests>
+    uint64_t append(const Requests &reqs) {
+        buffer_t &b = buffers[slot()];
+        std::unique_lock<std::mutex> l(b.mtx);
+        uint64_t lsn = 0;
+        for (auto &r : reqs) {
+            if (r.requestInteger != REQUEST_INSERT && r.requestInteger != REQUEST_REMOVE)
+                continue;
+            // taken under the buffer lock so a commit that read a later sequence number sees this record
+            lsn = sequence.fetch_add(1) + 1;
+            size_t headerAt = b.data.size();
+            b.data.resize(headerAt + sizeof(header_t));
+            wal_codec_t<typename std::decay<decltype(r.key)>::type>::put(b.data, r.key);
+            wal_codec_t<typename std::decay<decltype(r.value)>::type>::put(b.data, r.value);
+
+            header_t h;
+            h.lsn = lsn;
+            h.request = r.requestInteger;
+            h.length = b.data.size() - headerAt - sizeof(header_t);
+            h.checksum = checksum(b.data.data() + headerAt + sizeof(header_t), h.length, lsn, h.request);
+            memcpy(b.data.data() + headerAt, &h, sizeof(header_t));
+        }
+        return lsn;
+    }
+
+    uint64_t durable() const {
+        return durableLsn.load(std::memory_order_acquire);
+    }
+
+    /// the lsn of the last write appended
+    uint64_t last() const {
+        return sequence.load();
+    }
+
+    /**
+     * Blocks until everything up to lsn is durable
+     * @param lsn
+     */
+    void waitDurable(uint64_t lsn) {
+        if (durable() >= lsn)
+            return;
+        std::unique_lock<std::mutex> l(mtx);
+        durableCv.wait(l, [this, lsn]() { return durableLsn.load() >= lsn; });
+    }
+
+    /**
+     * Drops the records up to lsn from the log file, for when a snapshot holds them.
+     * Runs on the commit thread between commits and returns once the shorter log is in place.
+     * @param lsn
+     */
+    void truncate(uint64_t lsn) {
+        std::unique_lock<std::mutex> l(mtx);
+        truncateTo = std::max(truncateTo, lsn);
+        truncating = true;
+        cv.notify_all();
+        durableCv.wait(l, [this]() { return !truncating; });
+    }
+
+    /**
+     * Hands every write in the log after lsn after to apply in lsn order, the values are owned by apply
+     * @tparam K
+     * @tparam V
+     * @param apply called with the request, key and value
+     * @param after the lsn of the snapshot recovered first, 0 for everything
+     * @return the number of records replayed
+     */
+    template<typename K, typename V, typename F>
+    size_t replay(F apply, uint64_t after = 0) {
+        std::vector<char> log(offset);
+        size_t read = 0;
+        while (read < offset) {
+            ssize_t r = pread(fd, log.data() + read, offset - read, read);
+            if (r <= 0) {
+                std::cerr << "Cannot read write-ahead log: " << strerror(errno) << std::endl;
+                exit(1);
+            }
+            read += r;
+        }
+
+        std::vector<std::pair<uint64_t, size_t>> order;
+        for (size_t pos = 0; pos < log.size();) {
+            header_t h;
+            memcpy(&h, log.data() + pos, sizeof(header_t));
+            if (h.lsn > after && (h.request == REQUEST_INSERT || h.request == REQUEST_REMOVE))
+                order.push_back({h.lsn, pos});
+            pos += sizeof(header_t) + h.length;
+        }
+        std::sort(order.begin(), order.end());
+
+        for (auto &o : order) {
+            header_t h;
+            memcpy(&h, log.data() + o.second, sizeof(header_t));
+            const char *p = log.data() + o.second + sizeof(header_t);
+            const char *end = p + h.length;
+            K key{};
+            V value{};
+            wal_codec_t<K>::get(p, end, key);
+            wal_codec_t<V>::get(p, end, value);
+            apply(h.request, key, value);
+        }
+        return order.size();
+    }
+
+    size_t getCommits() const {
+        return commits;
+    }
+
+    size_t getRecords() const {
+        return records;
+    }
+
+    size_t getBytes() const {
+        return bytes;
+    }
+
+    std::chrono::microseconds getInterval() const {
+        return interval;
+    }
+
+private:
+
+    struct header_t {
+        uint64_t lsn;
+        uint32_t request;
+        uint32_t length;
+        uint32_t checksum;
+        uint32_t pad;
+    };
+
+    struct buffer_t {
+        std::mutex mtx;
+        std::vector<char> data;
+    };
+
+    static int slot() {
+        static std::atomic_int next{0};
+        thread_local int s = next.fetch_add(1) % WAL_BUFFERS;
+        return s;
+    }
+
+    /// FNV-1a over the payload, lsn and request
+    static uint32_t checksum(const char *p, size_t n, uint64_t lsn, uint32_t request) {
+        uint32_t h = 2166136261u;
+        auto mix = [&h](const char *q, size_t m) {
+            for (size_t i = 0; i < m; ++i) {
+                h ^= (unsigned char) q[i];
+                h *= 16777619u;
+            }
+        };
+        mix(p, n);
+        mix(reinterpret_cast<const char *>(&lsn), sizeof(lsn));
+        mix(reinterpret_cast<const char *>(&request), sizeof(request));
+        return h;
+    }
+
+    /**
+     * Finds the end of the last whole record, anything after it was torn by a crash
+     * @return the length of the valid log
+     */
+    size_t scan() {
+        struct stat st;
+        fstat(fd, &st);
+        std::vector<char> log(st.st_size);
+        size_t read = 0;
+        while (read < log.size()) {
+            ssize_t r = pread(fd, log.data() + read, log.size() - read, read);
+            if (r <= 0)
+                break;
+            read += r;
+        }
+
+        size_t pos = 0;
+        uint64_t maxLsn = 0;
+        while (pos + sizeof(header_t) <= read) {
+            header_t h;
+            memcpy(&h, log.data() + pos, sizeof(header_t));
+            if (pos + sizeof(header_t) + h.length > read ||
+                checksum(log.data() + pos + sizeof(header_t), h.length, h.lsn, h.request) != h.checksum)
+                break;
+            maxLsn = std::max(maxLsn, h.lsn);
+            pos += sizeof(header_t) + h.length;
+        }
+        sequence = maxLsn;
+        durableLsn = maxLsn;
+        return pos;
+    }
+
+    void commitLoop() {
+        std::vector<std::vector<char>> taken(WAL_BUFFERS);
+        std::vector<iovec> iov;
+        while (true) {
+            bool stopping;
+            {
+                std::unique_lock<std::mutex> l(mtx);
+                cv.wait_for(l, interval, [this]() { return stop || truncating; });
+                stopping = stop;
+            }
+            commit(taken, iov);
+            if (truncating.load())
+                compact();
+            if (stopping)
+                break;
+        }
+    }
+
+    void commit(std::vector<std::vector<char>> &taken, std::vector<iovec> &iov) {
+        uint64_t target = sequence.load();
+        if (target == durableLsn.load())
+            return;
+
+        iov.clear();
+        size_t len = 0;
+        for (int i = 0; i < WAL_BUFFERS; ++i) {
+            taken[i].clear();
+            {
+                std::unique_lock<std::mutex> l(buffers[i].mtx);
+                taken[i].swap(buffers[i].data);
+            }
+            if (!taken[i].empty()) {
+                iov.push_back({taken[i].data(), taken[i].size()});
+                len += taken[i].size();
+            }
+        }
+
+        writeAll(iov);
+        if (fdatasync(fd) != 0) {
+            std::cerr << "Cannot sync write-ahead log: " << strerror(errno) << std::endl;
+            exit(1);
+        }
+        commits++;
+        records += target - durableLsn.load();
+        bytes += len;
+
+        {
+            std::unique_lock<std::mutex> l(mtx);
+            durableLsn.store(target, std::memory_order_release);
+        }
+        durableCv.notify_all();
+    }
+
+    /**
+     * Rewrites the log without the records up to truncateTo, starting with a checkpoint record at truncateTo.
+     * Appends keep going to the buffers meanwhile, only commits wait.
+     */
+    void compact() {
+        uint64_t upTo;
+        {
+            std::unique_lock<std::mutex> l(mtx);
+            upTo = truncateTo;
+        }
+        std::vector<char> log(offset);
+        size_t read = 0;
+        while (read < offset) {
+            ssize_t r = pread(fd, log.data() + read, offset - read, read);
+            if (r <= 0) {
+                std::cerr << "Cannot read write-ahead log: " << strerror(errno) << std::endl;
+                exit(1);
+            }
+            read += r;
+        }
+
+        std::vector<char> kept(sizeof(header_t));
+        header_t checkpoint;
+        checkpoint.lsn = upTo;
+        checkpoint.request = REQUEST_EMPTY;
+        checkpoint.length = 0;
+        checkpoint.checksum = checksum(nullptr, 0, upTo, REQUEST_EMPTY);
+        checkpoint.pad = 0;
+        memcpy(kept.data(), &checkpoint, sizeof(header_t));
+        for (size_t pos = 0; pos < log.size();) {
+            header_t h;
+            memcpy(&h, log.data() + pos, sizeof(header_t));
+            size_t len = sizeof(header_t) + h.length;
+            if (h.lsn > upTo)
+                kept.insert(kept.end(), log.data() + pos, log.data() + pos + len);
+            pos += len;
+        }
+
+        std::string tmp = filename + ".tmp";
+        int nfd = open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (nfd < 0) {
+            std::cerr << "Cannot open write-ahead log " << tmp << ": " << strerror(errno) << std::endl;
+            exit(1);
+        }
+        int old = fd;
+        fd = nfd;
+        offset = 0;
+        std::vector<iovec> iov{{kept.data(), kept.size()}};
+        writeAll(iov);
+        if (fdatasync(fd) != 0 || rename(tmp.c_str(), filename.c_str()) != 0 || !sync_parent_dir(filename)) {
+            std::cerr << "Cannot replace write-ahead log " << filename << ": " << strerror(errno) << std::endl;
+            exit(1);
+        }
+        close(old);
+
+        {
+            std::unique_lock<std::mutex> l(mtx);
+            // a truncate that came in meanwhile goes with the next commit
+            truncating = truncateTo > upTo;
+        }
+        durableCv.notify_all();
+    }
+
+    void writeAll(std::vector<iovec> &iov) {
+        size_t first = 0;
+        while (first < iov.size()) {
+            int count = std::min<size_t>(iov.size() - first, IOV_MAX);
+            ssize_t w = pwritev(fd, iov.data() + first, count, offset);
+            if (w < 0) {
+                if (errno == EINTR)
+                    continue;
+                std::cerr << "Cannot write write-ahead log: " << strerror(errno) << std::endl;
+                exit(1);
+            }
+            offset += w;
+            // skip what was written, a partial write leaves the rest of an iovec for the next call
+            while (first < iov.size() && (size_t) w >= iov[first].iov_len) {
+                w -= iov[first].iov_len;
+                first++;
+            }
+            if (first < iov.size()) {
+                iov[first].iov_base = static_cast<char *>(iov[first].iov_base) + w;
+                iov[first].iov_len -= w;
+            }
+        }
+    }
+
+    std::string filename;
+    int fd;
+    size_t offset;
+    std::chrono::microseconds interval;
+    buffer_t *buffers;
+    std::atomic<uint64_t> sequence;
+    std::atomic<uint64_t> durableLsn;
+    std::atomic_size_t commits;
+    std::atomic_size_t records;
+    std::atomic_size_t bytes;
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::condition_variable durableCv;
+    uint64_t truncateTo;
+    std::atomic_bool truncating;
+    bool stop;
+    std::thread committer;
+};
+
+#endif //KVGPU_WRITEAHEADLOG_CUH
@@ -21,3 +21,5 @@
  */
 
 #include "KVStoreClient.cuh"
+#include "KVStoreAsyncClient.cuh"
+#include "KVStoreShards.cuh"
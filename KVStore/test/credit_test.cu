@@ -0,0 +1,186 @@
+/*
+ * Copyright (c) 2020-2021 dePaul Miller (dsm220@lehigh.edu)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <kvcg.cuh>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+/*
+ * Overloads the store with clients that submit batches without waiting for them. The batches a client has in the store
+ * must stay within its credits, which the test counts from the answers on its own, and the backend queues within the
+ * credits of all clients. Every request must be answered once and the throughput must stay at what a single
+ * closed-loop client gets.
+ */
+
+using K = unsigned long long;
+using M = kvgpu::SimplModel<K>;
+using RB = std::shared_ptr<ResultsBuffers<data_t>>;
+
+const int CLIENTS = 8;
+const int CREDITS = 2;
+const int BATCHES = 200;
+const int BATCH_SIZE = 512;
+
+/// GETs the default model sends to the backend, the store is empty so they all miss
+std::vector<RequestWrapper<K, data_t *>> makeBatch(K first) {
+    std::vector<RequestWrapper<K, data_t *>> b(BATCH_SIZE);
+    for (int i = 0; i < BATCH_SIZE; i++) {
+        b[i] = {first + 16000 + i, nullptr, REQUEST_GET};
+    }
+    return b;
+}
+
+bool answered(const RB &rb) {
+    for (int i = 0; i < BATCH_SIZE; i++) {
+        if (rb->requestIDs[i] == -1)
+            return false;
+    }
+    return true;
+}
+
+void waitFor(const RB &rb) {
+    while (!answered(rb))
+        std::this_thread::yield();
+}
+
+int main() {
+    CREDITS_PER_BACKEND = CREDITS;
+    std::vector<PartitionedSlabUnifiedConfig> conf = {{SLAB_SIZE, 0, cudaStreamDefault}};
+    KVStoreCtx<K, data_t, M> ctx(conf);
+
+    // what one client gets when it waits for each batch
+    double closedLoop;
+    {
+        auto client = ctx.getClient();
+        auto start = std::chrono::steady_clock::now();
+        for (int b = 0; b < BATCHES; b++) {
+            auto batch = makeBatch((K) b * BATCH_SIZE);
+            RB rb = std::make_shared<ResultsBuffers<data_t>>(BATCH_SIZE);
+            client->batch(batch, rb);
+            waitFor(rb);
+        }
+        std::chrono::duration<double> dur = std::chrono::steady_clock::now() - start;
+        closedLoop = BATCHES * BATCH_SIZE / dur.count();
+    }
+
+    std::vector<std::unique_ptr<KVStoreInternalClient<K, data_t, M>>> clients;
+    for (int c = 0; c < CLIENTS; c++) {
+        clients.push_back(ctx.getClient());
+    }
+
+    std::vector<std::vector<RB>> results(CLIENTS, std::vector<RB>(BATCHES));
+    // batches of each client the store took, the credit of a batch is only given back once it is answered
+    std::unique_ptr<std::atomic_int[]> accepted(new std::atomic_int[CLIENTS]);
+    for (int c = 0; c < CLIENTS; c++) {
+        accepted[c] = 0;
+    }
+
+    std::atomic_bool done{false};
+    int maxQueued = 0;
+    // the most batches a client had taken and not answered
+    int maxInFlight = 0;
+    std::thread monitor([&]() {
+        std::vector<int> answeredUpTo(CLIENTS, 0);
+        while (!done) {
+            maxQueued = std::max(maxQueued, clients[0]->getQueued());
+            for (int c = 0; c < CLIENTS; c++) {
+                int a = accepted[c].load();
+                // a client's batches go to the one backend and are answered in order
+                while (answeredUpTo[c] < a && answered(results[c][answeredUpTo[c]])) {
+                    answeredUpTo[c]++;
+                }
+                maxInFlight = std::max(maxInFlight, a - answeredUpTo[c]);
+            }
+            std::this_thread::yield();
+        }
+    });
+
+    std::vector<std::thread> threads;
+    auto start = std::chrono::steady_clock::now();
+    for (int c = 0; c < CLIENTS; c++) {
+        threads.push_back(std::thread([&, c]() {
+            for (int b = 0; b < BATCHES; b++) {
+                auto batch = makeBatch(((K) c * BATCHES + b) * BATCH_SIZE);
+                RB rb = std::make_shared<ResultsBuffers<data_t>>(BATCH_SIZE);
+                results[c][b] = rb;
+                clients[c]->batch(batch, rb);
+                accepted[c] = b + 1;
+            }
+            for (auto &rb : results[c]) {
+                waitFor(rb);
+            }
+        }));
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+    std::chrono::duration<double> dur = std::chrono::steady_clock::now() - start;
+    double overloaded = CLIENTS * BATCHES * BATCH_SIZE / dur.count();
+    done = true;
+    monitor.join();
+
+    bool ok = true;
+    int perClient = CREDITS * (int) conf.size();
+    int bound = CLIENTS * perClient;
+    if (maxInFlight > perClient) {
+        std::cerr << "A client had " << maxInFlight << " batches unanswered with " << perClient << " credits"
+                  << std::endl;
+        ok = false;
+    } else if (maxInFlight < perClient) {
+        // the clients offered BATCHES each, far past their credits, unless the store turned them away
+        std::cerr << "No client used all of its " << perClient << " credits, the store was not overloaded"
+                  << std::endl;
+        ok = false;
+    }
+    if (maxQueued > bound) {
+        std::cerr << "Queued " << maxQueued << " batches with " << bound << " credits" << std::endl;
+        ok = false;
+    }
+    if (clients[0]->getQueued() != 0) {
+        std::cerr << clients[0]->getQueued() << " batches are still counted as queued after all were answered"
+                  << std::endl;
+        ok = false;
+    }
+    for (int c = 0; c < CLIENTS; c++) {
+        for (auto &rb : results[c]) {
+            for (int i = 0; i < BATCH_SIZE; i++) {
+                if (rb->requestIDs[i] < 0 || rb->requestIDs[i] >= BATCH_SIZE || rb->resultValues[i] != nullptr) {
+                    std::cerr << "Request " << i << " of a batch of client " << c << " was answered wrong" << std::endl;
+                    ok = false;
+                }
+            }
+        }
+    }
+    if (overloaded < 0.9 * closedLoop) {
+        std::cerr << "Throughput fell from " << closedLoop << " to " << overloaded << " requests/s" << std::endl;
+        ok = false;
+    }
+
+    std::cout << "Closed loop (requests/s)\tOverloaded (requests/s)\tMax queued\tMax in flight\tCredits" << std::endl;
+    std::cout << closedLoop << "\t" << overloaded << "\t" << maxQueued << "\t" << maxInFlight << "\t" << bound
+              << std::endl;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,162 @@
+/*
+ * Copyright (c) 2020-2021 dePaul Miller (dsm220@lehigh.edu)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+
+#include <kvcg.cuh>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+#include <unistd.h>
+
+/*
+ * Writes keys to a store whose backend is full from the start, so every INSERT the model sends to the backend goes to
+ * the spill tier, through batches and through a bulk load. The values handed to the store must be freed once the tier
+ * has its copy, and every key must read back the value it was last written with from the tier.
+ */
+
+using K = unsigned long long;
+using M = kvgpu::SimplModel<K>;
+using RB = std::shared_ptr<ResultsBuffers<data_t>>;
+using RW = RequestWrapper<K, data_t *>;
+
+const int BATCH_SIZE = 512;
+/// keys written by batches, as many again are bulk loaded
+const int KEYS = 256;
+const int ROUNDS = 20;
+/// no other allocation of the store has this size, so the values can be told apart
+const size_t VALUE_BYTES = 4093;
+
+/// the values allocated and not freed yet
+std::mutex liveMtx;
+std::unordered_set<void *> *live = nullptr;
+
+void *operator new[](size_t n) {
+    void *p = malloc(n ? n : 1);
+    if (p == nullptr)
+        throw std::bad_alloc();
+    if (n == VALUE_BYTES) {
+        std::lock_guard<std::mutex> l(liveMtx);
+        if (live)
+            live->insert(p);
+    }
+    return p;
+}
+
+void operator delete[](void *p) noexcept {
+    if (p != nullptr) {
+        std::lock_guard<std::mutex> l(liveMtx);
+        if (live)
+            live->erase(p);
+    }
+    free(p);
+}
+
+void operator delete[](void *p, size_t) noexcept {
+    operator delete[](p);
+}
+
+size_t liveValues() {
+    std::lock_guard<std::mutex> l(liveMtx);
+    return live->size();
+}
+
+data_t *valueOf(int i, int round) {
+    data_t *v = new data_t(VALUE_BYTES);
+    memset(v->data, round, VALUE_BYTES);
+    memcpy(v->data, &i, sizeof(i));
+    return v;
+}
+
+/// keys past what the default model caches
+K keyOf(int i) {
+    return 16000 + (K) i;
+}
+
+void waitFor(const RB &rb, int n) {
+    for (int i = 0; i < n; i++) {
+        while (rb->requestIDs[i] == -1)
+            std::this_thread::yield();
+    }
+}
+
+int main() {
+    std::string file = "spill_test." + std::to_string(getpid());
+    SPILL_FILE = file;
+    SPILL_BACKEND_KEYS = 0;
+    live = new std::unordered_set<void *>();
+
+    bool ok = true;
+    size_t leaked;
+    {
+        KVStoreCtx<K, data_t, M> ctx;
+        auto client = ctx.getClient();
+        for (int r = 0; r < ROUNDS; r++) {
+            std::vector<RW> batch(BATCH_SIZE, {K(), nullptr, REQUEST_EMPTY});
+            for (int i = 0; i < KEYS; i++) {
+                batch[i] = {keyOf(i), valueOf(i, r), REQUEST_INSERT};
+            }
+            RB rb = std::make_shared<ResultsBuffers<data_t>>(BATCH_SIZE);
+            client->batch(batch, rb);
+            waitFor(rb, KEYS);
+        }
+        std::vector<K> loadKeys;
+        std::vector<data_t *> loadValues;
+        for (int i = KEYS; i < 2 * KEYS; i++) {
+            loadKeys.push_back(keyOf(i));
+            loadValues.push_back(valueOf(i, ROUNDS - 1));
+        }
+        client->bulkLoad(loadKeys.data(), loadValues.data(), KEYS);
+        leaked = liveValues();
+        if (leaked != 0) {
+            std::cerr << leaked << " spilled values were not freed" << std::endl;
+            ok = false;
+        }
+
+        std::vector<RW> batch(BATCH_SIZE, {K(), nullptr, REQUEST_EMPTY});
+        for (int i = 0; i < 2 * KEYS; i++) {
+            batch[i] = {keyOf(i), nullptr, REQUEST_GET};
+        }
+        RB rb = std::make_shared<ResultsBuffers<data_t>>(BATCH_SIZE);
+        client->batch(batch, rb);
+        waitFor(rb, 2 * KEYS);
+        for (int slot = 0; slot < 2 * KEYS; slot++) {
+            int i = rb->requestIDs[slot];
+            auto v = (data_t *) rb->resultValues[slot];
+            if (v == nullptr || v->size != VALUE_BYTES || memcmp(v->data, &i, sizeof(i)) != 0 ||
+                v->data[VALUE_BYTES - 1] != ROUNDS - 1) {
+                std::cerr << "Key " << keyOf(i) << " did not read back its last value" << std::endl;
+                ok = false;
+            }
+        }
+    }
+
+    std::cout << "TABLE: Spill Tier" << std::endl;
+    std::cout << "Spilled writes\tValues leaked\tResult" << std::endl;
+    std::cout << KEYS * (ROUNDS + 1) << "\t" << leaked << "\t" << (ok ? "ok" : "FAILED") << std::endl;
+    return ok ? 0 : 1;
+}
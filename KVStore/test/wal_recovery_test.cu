@@ -0,0 +1,174 @@
+/*
+ * Copyright (c) 2020-2021 dePaul Miller (dsm220@lehigh.edu)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+
+#include <kvcg.cuh>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/*
+ * Kills a process writing to the store with the write-ahead log on and recovers the log in a new store. Every write
+ * acknowledged before the kill must be found, a torn record appended to the log must be dropped.
+ * Each batch inserts WRITES new keys and removes the first REMOVES keys the batch before inserted. A batch is only sent
+ * once the one before is answered, so only the batch in flight at the kill may or may not have been logged.
+ */
+
+using K = unsigned long long;
+using M = kvgpu::SimplModel<K>;
+using RB = std::shared_ptr<ResultsBuffers<data_t>>;
+using RW = RequestWrapper<K, data_t *>;
+
+const int BATCH_SIZE = 512;
+const int REMOVES = 128;
+const int WRITES = BATCH_SIZE - REMOVES;
+/// batches answered before the writer is killed, with keys from 1 on the first ones go to the cache
+const int KILL_AFTER = 60;
+
+K keyOf(int batch, int i) {
+    return (K) batch * WRITES + i + 1;
+}
+
+void waitFor(const RB &rb, int n) {
+    for (int i = 0; i < n; i++) {
+        while (rb->requestIDs[i] == -1)
+            std::this_thread::yield();
+    }
+}
+
+/// writes batches until it is killed, telling the parent through fd how many were answered
+void writer(int fd) {
+    KVStoreCtx<K, data_t, M> ctx;
+    auto client = ctx.getClient();
+    for (int b = 0;; b++) {
+        std::vector<RW> batch(BATCH_SIZE);
+        for (int i = 0; i < WRITES; i++) {
+            K key = keyOf(b, i);
+            data_t *v = new data_t(sizeof(K));
+            memcpy(v->data, &key, sizeof(K));
+            batch[i] = {key, v, REQUEST_INSERT};
+        }
+        for (int i = 0; i < REMOVES; i++) {
+            batch[WRITES + i] = b == 0 ? RW{K(), nullptr, REQUEST_EMPTY} : RW{keyOf(b - 1, i), nullptr,
+                                                                                REQUEST_REMOVE};
+        }
+        RB rb = std::make_shared<ResultsBuffers<data_t>>(BATCH_SIZE);
+        client->batch(batch, rb);
+        waitFor(rb, b == 0 ? WRITES : BATCH_SIZE);
+        int answered = b + 1;
+        if (write(fd, &answered, sizeof(answered)) != sizeof(answered))
+            _exit(1);
+    }
+}
+
+int main() {
+    std::string log = "wal_recovery_test." + std::to_string(getpid()) + ".log";
+    unlink(log.c_str());
+    WAL_FILE = log;
+    // long enough that an acknowledgement sent before its commit would be lost by the kill
+    WAL_COMMIT_INTERVAL_US = 20000;
+
+    // the store is only made after the fork, the child must not inherit a GPU context
+    int fds[2];
+    if (pipe(fds) != 0) {
+        perror("pipe");
+        return 1;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        writer(fds[1]);
+        _exit(0);
+    }
+    close(fds[1]);
+
+    int acked = 0;
+    int n;
+    while (acked < KILL_AFTER && read(fds[0], &n, sizeof(n)) == sizeof(n)) {
+        acked = n;
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, nullptr, 0);
+    // answers sent before the kill are still in the pipe
+    while (read(fds[0], &n, sizeof(n)) == sizeof(n)) {
+        acked = n;
+    }
+    close(fds[0]);
+    if (acked < KILL_AFTER) {
+        std::cerr << "The writer died after " << acked << " batches" << std::endl;
+        return 1;
+    }
+
+    // a record torn by the crash
+    FILE *f = fopen(log.c_str(), "ab");
+    const char torn[] = "\x07\x00\x00\x00\x00\x00\x10\x00torn";
+    fwrite(torn, 1, sizeof(torn) - 1, f);
+    fclose(f);
+
+    bool ok = true;
+    size_t recovered;
+    {
+        KVStoreCtx<K, data_t, M> ctx;
+        auto client = ctx.getClient();
+        recovered = client->recover();
+
+        // batch acked - 1 may have lost its first keys to the batch in flight, later ones may or may not be there
+        for (int b = 0; b < acked; b++) {
+            std::vector<RW> batch(BATCH_SIZE, {K(), nullptr, REQUEST_EMPTY});
+            for (int i = 0; i < WRITES; i++) {
+                batch[i] = {keyOf(b, i), nullptr, REQUEST_GET};
+            }
+            RB rb = std::make_shared<ResultsBuffers<data_t>>(BATCH_SIZE);
+            client->batch(batch, rb);
+            waitFor(rb, WRITES);
+            for (int slot = 0; slot < WRITES; slot++) {
+                int i = rb->requestIDs[slot];
+                auto v = (data_t *) rb->resultValues[slot];
+                K key = keyOf(b, i);
+                bool removed = i < REMOVES && b + 1 < acked;
+                if (i < REMOVES && b + 1 == acked)
+                    continue;
+                if (removed && v != nullptr) {
+                    std::cerr << "Removed key " << key << " came back" << std::endl;
+                    ok = false;
+                } else if (!removed && (v == nullptr || v->size != sizeof(K) || memcmp(v->data, &key, sizeof(K)) != 0)) {
+                    std::cerr << "Acknowledged key " << key << " was lost" << std::endl;
+                    ok = false;
+                }
+            }
+        }
+    }
+    unlink(log.c_str());
+
+    std::cout << "TABLE: WAL Recovery" << std::endl;
+    std::cout << "Batches acknowledged\tWrites recovered\tResult" << std::endl;
+    std::cout << acked << "\t" << recovered << "\t" << (ok ? "ok" : "FAILED") << std::endl;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,209 @@
+/*
+ * Copyright (c) 2020-2021 dePaul Miller (dsm220@lehigh.edu)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <endian.h>
+#include <ImportantDefinitions.cuh>
+
+#ifndef KVGPU_MEMCACHED_CUH
+#define KVGPU_MEMCACHED_CUH
+
+/*
+ * Memcached text and binary protocol support of the network front-end. String keys are hashed to the 64 bit key
+ * space and every value is stored as an item that keeps the key next to the data, so a hash collision reads as a miss
+ * instead of returning another key's value.
+ */
+
+/// longest key memcached accepts
+const size_t MC_MAX_KEY = 250;
+
+/// longest command line other than get and gets, as in memcached
+const size_t MC_MAX_LINE = 2048;
+
+/// longest get or gets line, these carry any number of keys
+const size_t MC_MAX_GET_LINE = 1 << 20;
+
+/// version reported to clients
+#define MC_VERSION_STRING "1.6.0-kvcg"
+
+/// first byte of a binary request, anything else is the text protocol
+const uint8_t MC_MAGIC_REQUEST = 0x80;
+const uint8_t MC_MAGIC_RESPONSE = 0x81;
+
+/// binary opcodes that are understood
+enum : uint8_t {
+    MC_OP_GET = 0x00,
+    MC_OP_SET = 0x01,
+    MC_OP_DELETE = 0x04,
+    MC_OP_QUIT = 0x07,
+    MC_OP_GETQ = 0x09,
+    MC_OP_NOOP = 0x0a,
+    MC_OP_VERSION = 0x0b,
+    MC_OP_GETK = 0x0c,
+    MC_OP_GETKQ = 0x0d,
+    MC_OP_SETQ = 0x11,
+    MC_OP_DELETEQ = 0x14,
+    MC_OP_QUITQ = 0x17
+};
+
+/// binary response status
+enum : uint16_t {
+    MC_STATUS_OK = 0x00,
+    MC_STATUS_NOT_FOUND = 0x01,
+    MC_STATUS_INVALID = 0x04,
+    MC_STATUS_UNKNOWN = 0x81
+};
+
+/// header of binary requests and responses, multi byte fields are big endian except opaque which is echoed
+struct mc_binary_header_t {
+    uint8_t magic;
+    uint8_t opcode;
+    uint16_t keyLength;
+    uint8_t extrasLength;
+    uint8_t dataType;
+    /// vbucket in requests
+    uint16_t status;
+    uint32_t bodyLength;
+    uint32_t opaque;
+    uint64_t cas;
+};
+
+static_assert(sizeof(mc_binary_header_t) == 24, "binary header is sent as is");
+
+/// stored in front of the key and the data of every value
+struct mc_item_t {
+    uint64_t cas;
+    uint32_t flags;
+    uint16_t keyLength;
+    uint16_t pad;
+};
+
+/**
+ * Hashes a string key to the key space, FNV-1a followed by a 64 bit finalizer. Like the workloads it never returns 0.
+ * @param key
+ * @param length
+ * @return
+ */
+inline unsigned long long mc_hash(const char *key, size_t length) {
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; ++i) {
+        h ^= (uint8_t) key[i];
+        h *= 1099511628211ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h == 0 ? 1 : h;
+}
+
+/**
+ * Makes the value stored for a key
+ * @param key
+ * @param keyLength
+ * @param flags
+ * @param data
+ * @param length
+ * @return the item with a new cas
+ */
+inline data_t *mc_item_new(const char *key, size_t keyLength, uint32_t flags, const char *data, size_t length) {
+    static std::atomic<uint64_t> nextCas(1);
+    data_t *v = new data_t(sizeof(mc_item_t) + keyLength + length);
+    mc_item_t item{nextCas.fetch_add(1, std::memory_order_relaxed), flags, (uint16_t) keyLength, 0};
+    memcpy(v->data, &item, sizeof(item));
+    memcpy(v->data + sizeof(item), key, keyLength);
+    memcpy(v->data + sizeof(item) + keyLength, data, length);
+    return v;
+}
+
+/**
+ * @param v
+ * @return the header of a stored value, zeroed if the value is not an item
+ */
+inline mc_item_t mc_item(const data_t *v) {
+    mc_item_t item{0, 0, 0, 0};
+    if (v != nullptr && v->size >= sizeof(item))
+        memcpy(&item, v->data, sizeof(item));
+    return item;
+}
+
+/**
+ * @param v
+ * @param key
+ * @return true if v is the item of key
+ */
+inline bool mc_item_matches(const data_t *v, const std::string &key) {
+    mc_item_t item = mc_item(v);
+    return v != nullptr && v->size >= sizeof(item) + item.keyLength && item.keyLength == key.size() &&
+           memcmp(v->data + sizeof(item), key.data(), key.size()) == 0;
+}
+
+/// offset of the data in an item
+inline size_t mc_item_data(const data_t *v) {
+    return sizeof(mc_item_t) + mc_item(v).keyLength;
+}
+
+/**
+ * Splits a text command line at spaces
+ * @param line
+ * @param length
+ * @param tokens start and length of every token
+ */
+inline void mc_tokenize(const char *line, size_t length, std::vector<std::pair<const char *, size_t>> &tokens) {
+    tokens.clear();
+    size_t i = 0;
+    while (i < length) {
+        while (i < length && line[i] == ' ')
+            i++;
+        size_t start = i;
+        while (i < length && line[i] != ' ')
+            i++;
+        if (i > start)
+            tokens.push_back({line + start, i - start});
+    }
+}
+
+/**
+ * Parses an unsigned decimal token
+ * @param token
+ * @param out
+ * @return false if the token is not a number
+ */
+inline bool mc_number(const std::pair<const char *, size_t> &token, uint64_t &out) {
+    if (token.second == 0 || token.second > 20)
+        return false;
+    out = 0;
+    for (size_t i = 0; i < token.second; ++i) {
+        if (token.first[i] < '0' || token.first[i] > '9')
+            return false;
+        out = out * 10 + (token.first[i] - '0');
+    }
+    return true;
+}
+
+#endif //KVGPU_MEMCACHED_CUH
@@ -0,0 +1,294 @@
+/*
+ * Copyright (c) 2020-2021 dePaul Miller (dsm220@lehigh.edu)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+
+#include <chrono>
+#include <future>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <kvcg.cuh>
+#include "ModelTrainer.cuh"
+
+#ifndef KVGPU_MODELADAPTATION_CUH
+#define KVGPU_MODELADAPTATION_CUH
+
+/**
+ * How a run follows the workload with the model
+ */
+struct adapt_conf_t {
+    /// also retrains and changes the model, otherwise only the timeline is kept
+    bool retrain;
+    /// hash buckets of the trained models
+    size_t buckets;
+    /// timeline interval
+    std::chrono::milliseconds report;
+    /// timeline intervals between retrains
+    int retrainEvery;
+    /// one in this many requests is counted
+    int sample;
+    /// weight of the earlier windows in the counts
+    double decay;
+    /// predicted hit rate a new model has to gain over the current one to be published
+    double margin;
+    /// keys a model may cache
+    double budget;
+    /// share of the hit rate before a shift that counts as recovered
+    double recoverFraction;
+};
+
+/**
+ * Keeps a timeline of throughput and hit rate while a workload runs and, with retrain, retrains the cache placement
+ * on the requests it is shown and changes the model of the store once a new one predicts enough more hits. The phase
+ * of the workload is polled every interval, a shift is a change of phase and is over once the hit rate is back to
+ * recoverFraction of what it was before. Store is a client or the shards of a store using BucketModel.
+ * @tparam Store
+ */
+template<typename Store>
+class ModelAdapter {
+public:
+    using model_t = kvgpu::BucketModel<unsigned long long>;
+
+    /**
+     * @param store
+     * @param conf
+     * @param phase the workload phase, null if the workload has none
+     */
+    ModelAdapter(Store &store, const adapt_conf_t &conf, int (*phase)()) : store(store), conf(conf), phase(phase),
+                                                                           counter(conf.buckets), done(false) {}
+
+    ModelAdapter(const ModelAdapter<Store> &) = delete;
+
+    ~ModelAdapter() {
+        stop();
+    }
+
+    /**
+     * Counts one in conf.sample of the requests of a batch about to be sent
+     * @param batch
+     */
+    template<typename Batch>
+    void observe(const Batch &batch) {
+        static thread_local unsigned skip = 0;
+        for (auto &r : batch) {
+            if (r.requestInteger == REQUEST_EMPTY || ++skip < (unsigned) conf.sample)
+                continue;
+            skip = 0;
+            counter.record(std::hash<unsigned long long>()(r.key), r.key);
+        }
+    }
+
+    void start() {
+        startTime = std::chrono::steady_clock::now();
+        thread = std::thread([this]() {
+            run();
+        });
+    }
+
+    /// stops the timeline and waits for the model changes in flight
+    void stop() {
+        if (!thread.joinable())
+            return;
+        done = true;
+        thread.join();
+        for (auto &t : waiters) {
+            t.join();
+        }
+        waiters.clear();
+    }
+
+    /**
+     * Prints the timeline, the shifts and the model changes
+     * @param out
+     */
+    void print(std::ostream &out) {
+        out << "TABLE: Adaptation" << std::endl;
+        out << "Time (s)\tThroughput (Mops)\tHit Rate\tPhase\tModel changes" << std::endl;
+        for (auto &p : timeline) {
+            out << p.at << "\t" << p.mops << "\t" << p.hitRate << "\t" << p.phase << "\t" << p.changes << std::endl;
+        }
+        out << std::endl;
+
+        // a shift that never recovered shows -1
+        out << "TABLE: Shifts" << std::endl;
+        out << "Phase\tAt (s)\tHit Rate before\tLowest Hit Rate\tRecovered after (s)" << std::endl;
+        for (auto &s : shifts) {
+            out << s.phase << "\t" << s.at << "\t" << s.before << "\t" << s.lowest << "\t" << s.recovered << std::endl;
+        }
+        out << std::endl;
+
+        out << "TABLE: Model Changes" << std::endl;
+        out << "At (s)\tPredicted Hit Rate\tPredicted before\tBuckets\tKeys\tPublish (ms)\tReady (ms)" << std::endl;
+        std::unique_lock<std::mutex> l(mtx);
+        for (auto &c : changes) {
+            out << c.at << "\t" << c.predicted << "\t" << c.before << "\t" << c.cached << "\t" << c.keys << "\t"
+                << c.publish * 1e3 << "\t" << c.ready * 1e3 << std::endl;
+        }
+        out << std::endl;
+    }
+
+private:
+    struct point_t {
+        double at;
+        double mops;
+        double hitRate;
+        int phase;
+        size_t changes;
+    };
+
+    struct shift_t {
+        int phase;
+        double at;
+        double before;
+        double lowest;
+        double recovered;
+    };
+
+    struct change_t {
+        double at;
+        double predicted;
+        double before;
+        size_t cached;
+        double keys;
+        double publish;
+        /// seconds until the old epoch was drained and the cache evicted, -1 while that runs
+        double ready;
+    };
+
+    double now() {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    }
+
+    void run() {
+        size_t lastOps = store.getOps() + store.getHits() + store.getDedups();
+        size_t lastHits = store.getHits();
+        size_t lastRequests = store.getOperations();
+        double last = now();
+        double lastHitRate = 0;
+        int lastPhase = phase ? phase() : 0;
+        auto next = std::chrono::steady_clock::now();
+        for (int tick = 1; !done; ++tick) {
+            next += conf.report;
+            std::this_thread::sleep_until(next);
+
+            double at = now();
+            size_t ops = store.getOps() + store.getHits() + store.getDedups();
+            size_t hits = store.getHits();
+            size_t requests = store.getOperations();
+            // an interval in which no batch finished, as while a change drains, has no hit rate
+            bool measured = requests > lastRequests;
+            double hitRate = measured ? (double) (hits - lastHits) / (requests - lastRequests) : 0;
+            int p = phase ? phase() : 0;
+
+            if (p != lastPhase) {
+                shifts.push_back({p, at, lastHitRate, measured ? hitRate : lastHitRate, -1});
+                lastPhase = p;
+            }
+            for (auto &s : shifts) {
+                if (s.recovered >= 0 || !measured)
+                    continue;
+                s.lowest = std::min(s.lowest, hitRate);
+                if (at > s.at && hitRate >= conf.recoverFraction * s.before)
+                    s.recovered = at - s.at;
+            }
+
+            size_t changed;
+            {
+                std::unique_lock<std::mutex> l(mtx);
+                changed = changes.size();
+            }
+            timeline.push_back({at, (ops - lastOps) / (at - last) / 1e6, hitRate, p, changed});
+
+            if (measured)
+                lastHitRate = hitRate;
+            if (conf.retrain && tick % conf.retrainEvery == 0)
+                retrain(lastHitRate);
+
+            lastOps = ops;
+            lastHits = hits;
+            lastRequests = requests;
+            last = at;
+        }
+    }
+
+    /**
+     * Publishes the plan for the counts so far if it predicts margin more hits than the current model, the hit rate
+     * measured stands in for the prediction of a model that was not trained here
+     * @param measured
+     */
+    void retrain(double measured) {
+        counter.drain(freq, distinct, conf.decay);
+        // one change at a time, the next one would wait for this one to evict anyway
+        if (changing.valid() && changing.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+            return;
+
+        bucket_plan_t plan = planBuckets(freq, distinct, conf.budget);
+        double before = current ? predictHitRate(freq, *current) : measured;
+        if (plan.hitRate - before < conf.margin)
+            return;
+
+        model_t model(std::shared_ptr<const std::vector<bool>>(plan.buckets));
+        change_t c{now(), plan.hitRate, before, plan.cached, plan.keys, 0, -1};
+        auto changeStart = std::chrono::steady_clock::now();
+        std::future<void> f = store.change_model(model, c.publish);
+        current = plan.buckets;
+
+        size_t i;
+        {
+            std::unique_lock<std::mutex> l(mtx);
+            i = changes.size();
+            changes.push_back(c);
+        }
+        std::shared_ptr<std::promise<void>> readied = std::make_shared<std::promise<void>>();
+        changing = readied->get_future();
+        waiters.push_back(std::thread([this, i, changeStart, readied](std::future<void> f) {
+            f.wait();
+            std::unique_lock<std::mutex> l(mtx);
+            changes[i].ready = std::chrono::duration<double>(std::chrono::steady_clock::now() - changeStart).count();
+            readied->set_value();
+        }, std::move(f)));
+    }
+
+    Store &store;
+    adapt_conf_t conf;
+    int (*phase)();
+    access_counter_t counter;
+    std::atomic_bool done;
+    std::thread thread;
+    std::chrono::steady_clock::time_point startTime;
+
+    std::vector<double> freq;
+    std::vector<double> distinct;
+    /// the buckets of the last model published
+    std::shared_ptr<std::vector<bool>> current;
+    std::future<void> changing;
+    std::vector<std::thread> waiters;
+
+    std::vector<point_t> timeline;
+    std::vector<shift_t> shifts;
+    std::mutex mtx;
+    std::vector<change_t> changes;
+};
+
+#endif //KVGPU_MODELADAPTATION_CUH
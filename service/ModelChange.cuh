@@ -0,0 +1,177 @@
+/*
+ * Copyright (c) 2020-2021 dePaul Miller (dsm220@lehigh.edu)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifndef KVGPU_MODELCHANGE_CUH
+#define KVGPU_MODELCHANGE_CUH
+
+/**
+ * Samples the throughput of a store while a run changes its model once, to show the dip the change causes. Before is
+ * the mean over the second before the change, after the mean over the second after the old epoch drained. Store is a
+ * client or the shards of a store.
+ * @tparam Store
+ */
+template<typename Store>
+class ModelChangeMonitor {
+public:
+    /**
+     * @param store
+     * @param interval sampling interval
+     */
+    ModelChangeMonitor(Store &store, std::chrono::milliseconds interval) : store(store), interval(interval),
+                                                                          done(false), publish(0) {}
+
+    ModelChangeMonitor(const ModelChangeMonitor<Store> &) = delete;
+
+    ~ModelChangeMonitor() {
+        stop();
+    }
+
+    void start() {
+        startTime = std::chrono::steady_clock::now();
+        thread = std::thread([this]() {
+            run();
+        });
+    }
+
+    /**
+     * Changes the model of the store, the old epoch drains in the background
+     * @param model
+     */
+    template<typename M>
+    void change(M &model) {
+        changeAt = std::chrono::steady_clock::now();
+        std::future<void> f = store.change_model(model, publish);
+        waiter = std::thread([this](std::future<void> f) {
+            f.wait();
+            std::unique_lock<std::mutex> l(mtx);
+            readyAt = std::chrono::steady_clock::now();
+        }, std::move(f));
+    }
+
+    /// stops sampling and waits for the change in flight
+    void stop() {
+        if (waiter.joinable())
+            waiter.join();
+        if (!thread.joinable())
+            return;
+        done = true;
+        thread.join();
+    }
+
+    /**
+     * Prints the throughput around the change, nothing if the model was not changed
+     * @param out
+     */
+    void print(std::ostream &out) {
+        std::unique_lock<std::mutex> l(mtx);
+        if (changeAt == std::chrono::steady_clock::time_point() || readyAt == std::chrono::steady_clock::time_point())
+            return;
+        double at = seconds(changeAt);
+        double ready = seconds(readyAt);
+
+        double before = mean(at - 1, at);
+        double after = mean(ready, ready + 1);
+        double lowest = before;
+        double below = 0;
+        for (auto &s : samples) {
+            if (s.end <= at || s.start >= ready + 1)
+                continue;
+            lowest = std::min(lowest, s.mops);
+            if (s.mops < 0.9 * before)
+                below += s.end - s.start;
+        }
+
+        // the dip is the time within the change and the second after it under 90% of the throughput before
+        out << "TABLE: Model Change" << std::endl;
+        out << "At (s)\tPublish (ms)\tReady (ms)\tBefore (Mops)\tLowest (Mops)\tDip (ms)\tAfter (Mops)" << std::endl;
+        out << at << "\t" << publish * 1e3 << "\t" << (ready - at) * 1e3 << "\t" << before << "\t" << lowest << "\t"
+            << below * 1e3 << "\t" << after << std::endl;
+        out << std::endl;
+    }
+
+private:
+    struct sample_t {
+        double start;
+        double end;
+        double mops;
+    };
+
+    double seconds(std::chrono::steady_clock::time_point t) {
+        return std::chrono::duration<double>(t - startTime).count();
+    }
+
+    /// the mean throughput of the samples within [from, to)
+    double mean(double from, double to) {
+        double ops = 0;
+        double time = 0;
+        for (auto &s : samples) {
+            if (s.start < from || s.end > to)
+                continue;
+            ops += s.mops * (s.end - s.start) * 1e6;
+            time += s.end - s.start;
+        }
+        return time > 0 ? ops / time / 1e6 : 0;
+    }
+
+    void run() {
+        size_t lastOps = store.getOps() + store.getHits() + store.getDedups();
+        double last = 0;
+        auto next = startTime;
+        while (!done) {
+            next += interval;
+            std::this_thread::sleep_until(next);
+            double at = seconds(std::chrono::steady_clock::now());
+            size_t ops = store.getOps() + store.getHits() + store.getDedups();
+            {
+                std::unique_lock<std::mutex> l(mtx);
+                samples.push_back({last, at, (ops - lastOps) / (at - last) / 1e6});
+            }
+            lastOps = ops;
+            last = at;
+        }
+    }
+
+    Store &store;
+    std::chrono::milliseconds interval;
+    std::atomic_bool done;
+    std::thread thread;
+    std::thread waiter;
+    std::chrono::steady_clock::time_point startTime;
+    std::chrono::steady_clock::time_point changeAt;
+    std::chrono::steady_clock::time_point readyAt;
+    double publish;
+    std::mutex mtx;
+    std::vector<sample_t> samples;
+};
+
+#endif //KVGPU_MODELCHANGE_CUH
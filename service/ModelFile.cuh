@@ -0,0 +1,132 @@
+/*
+ * Copyright (c) 2020-2021 dePaul Miller (dsm220@lehigh.edu)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#ifndef KVGPU_MODELFILE_CUH
+#define KVGPU_MODELFILE_CUH
+
+/*
+ * A model file is a header followed by one bit per hash bucket, set for the buckets BucketModel caches. Bucket b is
+ * bit b % 64 of word b / 64 and a key is in bucket std::hash<K>(key) % buckets, the hash the clients pass the model.
+ */
+
+const char MODEL_MAGIC[8] = {'K', 'V', 'C', 'G', 'M', 'D', 'L', '1'};
+const uint32_t MODEL_VERSION = 1;
+
+struct model_file_header_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t buckets;
+    uint64_t cached;
+    /// distinct keys of the trace in the cached buckets
+    double keys;
+    /// keys the model was planned for
+    double budget;
+    /// share of the accesses in the trace that the cached buckets get
+    double hitRate;
+    uint64_t accesses;
+};
+
+static_assert(sizeof(model_file_header_t) == 64, "the bitmap starts 64 bytes in");
+
+/**
+ * Writes buckets and what they were planned on to filename
+ * @param filename
+ * @param buckets
+ * @param info everything but magic, version and buckets
+ * @return false if it could not be written
+ */
+inline bool writeModelFile(const std::string &filename, const std::vector<bool> &buckets, model_file_header_t info) {
+    memcpy(info.magic, MODEL_MAGIC, sizeof(info.magic));
+    info.version = MODEL_VERSION;
+    info.reserved = 0;
+    info.buckets = buckets.size();
+
+    std::vector<uint64_t> words((buckets.size() + 63) / 64, 0);
+    for (size_t b = 0; b < buckets.size(); ++b) {
+        if (buckets[b])
+            words[b / 64] |= 1ULL << (b % 64);
+    }
+
+    FILE *out = fopen(filename.c_str(), "wb");
+    if (out == nullptr) {
+        std::cerr << "Cannot write model " << filename << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    bool ok = fwrite(&info, sizeof(info), 1, out) == 1;
+    ok = ok && fwrite(words.data(), sizeof(uint64_t), words.size(), out) == words.size();
+    ok = fclose(out) == 0 && ok;
+    if (!ok)
+        std::cerr << "Cannot write model " << filename << std::endl;
+    return ok;
+}
+
+/**
+ * Reads a model written by writeModelFile
+ * @param filename
+ * @param info set to its header
+ * @return the cached buckets, null if filename is missing or not a model
+ */
+inline std::shared_ptr<std::vector<bool>> readModelFile(const std::string &filename, model_file_header_t &info) {
+    FILE *in = fopen(filename.c_str(), "rb");
+    if (in == nullptr) {
+        std::cerr << "Cannot read model " << filename << ": " << strerror(errno) << std::endl;
+        return nullptr;
+    }
+    std::vector<uint64_t> words;
+    bool ok = fread(&info, sizeof(info), 1, in) == 1 && memcmp(info.magic, MODEL_MAGIC, sizeof(MODEL_MAGIC)) == 0 &&
+              info.version == MODEL_VERSION && info.buckets > 0 && info.cached <= info.buckets;
+    // nothing is allocated before the file is known to hold the words, so a corrupt header cannot ask for more
+    uint64_t wordCount = ok ? info.buckets / 64 + (info.buckets % 64 != 0) : 0;
+    ok = ok && fseek(in, 0, SEEK_END) == 0;
+    long length = ok ? ftell(in) : -1;
+    ok = ok && length >= 0 && ((uint64_t) length - sizeof(info)) / sizeof(uint64_t) >= wordCount &&
+         fseek(in, sizeof(info), SEEK_SET) == 0;
+    if (ok) {
+        words.resize(wordCount);
+        ok = fread(words.data(), sizeof(uint64_t), words.size(), in) == words.size();
+    }
+    fclose(in);
+    if (!ok) {
+        std::cerr << filename << " is not a model" << std::endl;
+        return nullptr;
+    }
+
+    auto buckets = std::make_shared<std::vector<bool>>(info.buckets, false);
+    for (size_t b = 0; b < info.buckets; ++b) {
+        (*buckets)[b] = (words[b / 64] >> (b % 64)) & 1;
+    }
+    return buckets;
+}
+
+#endif //KVGPU_MODELFILE_CUH
@@ -0,0 +1,163 @@
+/*
+ * Copyright (c) 2020-2021 dePaul Miller (dsm220@lehigh.edu)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <numeric>
+#include <vector>
+
+#ifndef KVGPU_MODELTRAINER_CUH
+#define KVGPU_MODELTRAINER_CUH
+
+/**
+ * Accesses per hash bucket, hash % buckets as BucketModel picks them, with a 64 bit linear counting sketch per bucket
+ * for how many distinct keys it saw. Any number of threads record while one drains.
+ */
+struct access_counter_t {
+
+    explicit access_counter_t(size_t buckets) : counts(buckets), sketches(buckets) {}
+
+    access_counter_t(const access_counter_t &) = delete;
+
+    inline void record(unsigned hash, uint64_t key) {
+        size_t b = hash % counts.size();
+        counts[b].fetch_add(1, std::memory_order_relaxed);
+        uint64_t bit = 1ULL << (mix(key) & 63);
+        if ((sketches[b].load(std::memory_order_relaxed) & bit) == 0)
+            sketches[b].fetch_or(bit, std::memory_order_relaxed);
+    }
+
+    /**
+     * Decays freq and distinct by decay, adds what was recorded since the last drain and starts counting over
+     * @param freq accesses per bucket
+     * @param distinct distinct keys per bucket
+     * @param decay weight of the earlier windows
+     */
+    void drain(std::vector<double> &freq, std::vector<double> &distinct, double decay) {
+        freq.resize(counts.size(), 0);
+        distinct.resize(counts.size(), 0);
+        for (size_t b = 0; b < counts.size(); ++b) {
+            uint64_t c = counts[b].exchange(0, std::memory_order_relaxed);
+            uint64_t sketch = sketches[b].exchange(0, std::memory_order_relaxed);
+            freq[b] = freq[b] * decay + c;
+            distinct[b] = std::max(distinct[b] * decay, estimateDistinct(sketch));
+        }
+    }
+
+    size_t size() const {
+        return counts.size();
+    }
+
+    /// distinct keys behind a sketch, saturates at 64 ln 64 once every bit is set
+    static double estimateDistinct(uint64_t sketch) {
+        int zeros = 64 - __builtin_popcountll(sketch);
+        return 64 * std::log(64.0 / std::max(zeros, 1));
+    }
+
+private:
+    static inline uint64_t mix(uint64_t x) {
+        x = (x ^ (x >> 33)) * 0xff51afd7ed558ccdULL;
+        return x ^ (x >> 33);
+    }
+
+    std::vector<std::atomic<uint32_t>> counts;
+    std::vector<std::atomic<uint64_t>> sketches;
+};
+
+/**
+ * Buckets a model caches and what the counts they were chosen on predict for it
+ */
+struct bucket_plan_t {
+    std::shared_ptr<std::vector<bool>> buckets;
+    /// share of the accesses that land in a cached bucket
+    double hitRate;
+    /// distinct keys the cached buckets hold
+    double keys;
+    size_t cached;
+};
+
+/**
+ * Caches the buckets with the most accesses per key until budget keys are cached. Greedy by density is the best
+ * choice when buckets may be cached in part and stays close to it while a bucket is small against the budget, a
+ * bucket that does not fit is passed over for smaller ones behind it.
+ * @param freq accesses per bucket
+ * @param distinct distinct keys per bucket
+ * @param budget keys the cache holds
+ * @return
+ */
+inline bucket_plan_t planBuckets(const std::vector<double> &freq, const std::vector<double> &distinct, double budget) {
+    size_t n = freq.size();
+    std::vector<uint32_t> order;
+    order.reserve(n);
+    double total = 0;
+    for (size_t b = 0; b < n; ++b) {
+        total += freq[b];
+        if (freq[b] > 0)
+            order.push_back(b);
+    }
+    auto density = [&](uint32_t b) {
+        return freq[b] / std::max(distinct[b], 1.0);
+    };
+    std::sort(order.begin(), order.end(), [&](uint32_t l, uint32_t r) {
+        return density(l) > density(r);
+    });
+
+    bucket_plan_t plan{std::make_shared<std::vector<bool>>(n, false), 0, 0, 0};
+    double hits = 0;
+    for (uint32_t b : order) {
+        double keys = std::max(distinct[b], 1.0);
+        if (plan.keys + keys > budget)
+            continue;
+        (*plan.buckets)[b] = true;
+        plan.keys += keys;
+        plan.cached++;
+        hits += freq[b];
+    }
+    plan.hitRate = total > 0 ? hits / total : 0;
+    return plan;
+}
+
+/**
+ * Share of the accesses in freq that buckets caches, both count the same buckets
+ * @param freq
+ * @param buckets
+ * @return
+ */
+inline double predictHitRate(const std::vector<double> &freq, const std::vector<bool> &buckets) {
+    assert(freq.size() == buckets.size());
+    double total = 0;
+    double hits = 0;
+    for (size_t b = 0; b < freq.size(); ++b) {
+        total += freq[b];
+        if (buckets[b])
+            hits += freq[b];
+    }
+    return total > 0 ? hits / total : 0;
+}
+
+#endif //KVGPU_MODELTRAINER_CUH
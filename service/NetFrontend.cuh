@@ -0,0 +1,904 @@
+/*
+ * Copyright (c) 2020-2021 dePaul Miller (dsm220@lehigh.edu)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <atomic>
+#include <climits>
+#include <deque>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <kvcg.cuh>
+#include "NetProtocol.cuh"
+#include "Memcached.cuh"
+#include "Trace.cuh"
+
+#ifndef KVGPU_NETFRONTEND_CUH
+#define KVGPU_NETFRONTEND_CUH
+
+/// epoll data of the listening sockets, connections are numbered from 0
+const uint64_t NET_LISTENER = UINT64_MAX - 16;
+
+/**
+ * Serves the binary protocol of NetProtocol.cuh, or the memcached protocols, over TCP and Unix sockets.
+ * Every I/O thread runs its own epoll loop over the shared listening sockets and the connections it accepted.
+ * The frames read in one wake up, from any of its connections, become one batch for the client, and responses are
+ * written with writev as the ResultsBuffers slots complete.
+ * M is the type of the Model
+ * @tparam M
+ */
+template<typename M>
+class NetFrontend {
+public:
+    typedef KVStoreClient<unsigned long long, data_t, M> client_t;
+    typedef RequestWrapper<unsigned long long, data_t *> RW;
+
+    /**
+     * @param client
+     * @param ioThreads
+     * @param batchSize most requests in a batch
+     * @param maxInflight an I/O thread stops reading while this many of its requests are in flight
+     */
+    NetFrontend(client_t &client, int ioThreads, int batchSize, int maxInflight = 64 * 512) : client(client),
+                                                                                            ioThreads(ioThreads),
+                                                                                            batchSize(batchSize),
+                                                                                            maxInflight(maxInflight),
+                                                                                            stopping(false),
+                                                                                            connections(0),
+                                                                                            requests(0),
+                                                                                            batches(0), bytesIn(0),
+                                                                                            bytesOut(0),
+                                                                                            recorder(nullptr) {}
+
+    NetFrontend(const NetFrontend<M> &) = delete;
+
+    ~NetFrontend() {
+        stop();
+        for (int fd : listeners) {
+            close(fd);
+        }
+    }
+
+    /**
+     * Listens on a TCP port, or on a Unix socket if path is not empty. Call before start.
+     * @param port
+     * @param path
+     * @param protocol NET_PROTO_KVCG or NET_PROTO_MEMCACHED
+     * @return false if the socket could not be opened
+     */
+    bool listen(int port, const std::string &path = "", uint8_t protocol = NET_PROTO_KVCG) {
+        int fd = net_listen(port, path);
+        if (fd < 0) {
+            std::cerr << "Cannot listen on " << (path.empty() ? std::to_string(port) : path) << ": "
+                      << strerror(errno) << std::endl;
+            return false;
+        }
+        listeners.push_back(fd);
+        protocols.push_back(protocol);
+        return true;
+    }
+
+    void start() {
+        for (int t = 0; t < ioThreads; ++t) {
+            threads.push_back(std::thread([this]() {
+                IO_CPUS.pin();
+                loop();
+            }));
+        }
+    }
+
+    /// stops the I/O threads and closes the connections, requests in flight are not answered
+    void stop() {
+        stopping = true;
+        for (auto &t : threads) {
+            if (t.joinable())
+                t.join();
+        }
+        threads.clear();
+    }
+
+    size_t getConnections() const {
+        return connections;
+    }
+
+    size_t getRequests() const {
+        return requests;
+    }
+
+    /**
+     * Records every batch sent to the store from now on, call before start
+     * @param r
+     */
+    void setRecorder(TraceWriter *r) {
+        recorder = r;
+    }
+
+    size_t getBatches() const {
+        return batches;
+    }
+
+    size_t getBytesIn() const {
+        return bytesIn;
+    }
+
+    size_t getBytesOut() const {
+        return bytesOut;
+    }
+
+private:
+
+    /// a response waiting to be written, value is owned and freed once written
+    struct out_t {
+        net_response_t header;
+        data_t *value;
+    };
+
+    enum : uint8_t {
+        MODE_KVCG,
+        /// memcached before the first byte arrived
+        MODE_MC,
+        MODE_MC_TEXT,
+        MODE_MC_BINARY
+    };
+
+    enum : uint8_t {
+        /// one key of a text get
+        MC_REPLY_VALUE,
+        /// a fixed text line, or nothing if message is null
+        MC_REPLY_TEXT,
+        MC_REPLY_BINARY
+    };
+
+    /**
+     * A memcached response, they are sent in request order once done. A get takes the value and checks it is the
+     * item of key.
+     */
+    struct mc_reply_t {
+        uint8_t kind;
+        bool done;
+        /// binary quiet ops skip misses of gets and successes of the rest
+        bool quiet;
+        /// text gets adds the cas
+        bool withCas;
+        uint8_t opcode;
+        uint16_t status;
+        uint32_t opaque;
+        uint64_t cas;
+        const char *message;
+        std::string key;
+        data_t *value;
+    };
+
+    struct conn_t {
+        conn_t(int f, uint8_t m) : fd(f), mode(m), inStart(0), outSent(0), wantWrite(false), replyBase(0),
+                                   textSent(0), queued(false), closing(false) {}
+
+        int fd;
+        uint8_t mode;
+        std::vector<char> in;
+        size_t inStart;
+        std::deque<out_t> out;
+        /// bytes of out.front() already written
+        size_t outSent;
+        bool wantWrite;
+        std::deque<mc_reply_t> replies;
+        /// sequence number of replies.front()
+        uint64_t replyBase;
+        /// memcached responses are rendered here before they are written
+        std::string text;
+        size_t textSent;
+        /// in io.dirty
+        bool queued;
+        /// close once the replies are written
+        bool closing;
+    };
+
+    /// who gets the response of a batch entry
+    struct origin_t {
+        uint64_t conn;
+        /// request id, or the reply sequence number for memcached
+        uint64_t id;
+        uint8_t op;
+    };
+
+    struct batch_t {
+        std::shared_ptr<ResultsBuffers<data_t>> rb;
+        std::vector<origin_t> origins;
+        std::vector<bool> answered;
+        int remaining;
+    };
+
+    /// state of one I/O thread
+    struct io_t {
+        int epfd;
+        uint64_t nextConn;
+        std::unordered_map<uint64_t, std::unique_ptr<conn_t>> conns;
+        std::vector<RW> pending;
+        std::vector<origin_t> origins;
+        std::list<batch_t> inflight;
+        int inflightRequests;
+        std::vector<uint64_t> dirty;
+        std::vector<std::pair<const char *, size_t>> tokens;
+    };
+
+    void loop() {
+        io_t io;
+        io.epfd = epoll_create1(0);
+        io.nextConn = 0;
+        io.inflightRequests = 0;
+        for (size_t l = 0; l < listeners.size(); ++l) {
+            epoll_event ev{};
+            // one I/O thread is woken per connection
+            ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+            ev.data.u64 = NET_LISTENER + l;
+            epoll_ctl(io.epfd, EPOLL_CTL_ADD, listeners[l], &ev);
+        }
+
+        std::vector<epoll_event> events(256);
+        while (!stopping.load()) {
+            // completions are polled while batches are in flight
+            int n = epoll_wait(io.epfd, events.data(), events.size(), io.inflight.empty() ? 100 : 0);
+            for (int e = 0; e < n; ++e) {
+                uint64_t tag = events[e].data.u64;
+                if (tag >= NET_LISTENER) {
+                    accept(io, tag - NET_LISTENER);
+                    continue;
+                }
+                auto it = io.conns.find(tag);
+                if (it == io.conns.end())
+                    continue;
+                if (events[e].events & (EPOLLERR | EPOLLHUP)) {
+                    closeConn(io, tag);
+                    continue;
+                }
+                if ((events[e].events & EPOLLOUT) && !flush(io, tag, *it->second))
+                    continue;
+                if ((events[e].events & (EPOLLIN | EPOLLRDHUP)) && io.inflightRequests < maxInflight)
+                    read(io, tag, *it->second);
+            }
+            submit(io);
+            complete(io);
+            for (uint64_t c : io.dirty) {
+                auto it = io.conns.find(c);
+                if (it != io.conns.end()) {
+                    it->second->queued = false;
+                    flush(io, c, *it->second);
+                }
+            }
+            io.dirty.clear();
+        }
+
+        for (auto &c : io.conns) {
+            release(*c.second);
+            close(c.second->fd);
+        }
+        close(io.epfd);
+    }
+
+    void accept(io_t &io, size_t listener) {
+        while (true) {
+            int fd = accept4(listeners[listener], nullptr, nullptr, SOCK_NONBLOCK);
+            if (fd < 0)
+                return;
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            uint64_t id = io.nextConn++;
+            epoll_event ev{};
+            ev.events = EPOLLIN | EPOLLRDHUP;
+            ev.data.u64 = id;
+            epoll_ctl(io.epfd, EPOLL_CTL_ADD, fd, &ev);
+            io.conns[id] = std::unique_ptr<conn_t>(
+                    new conn_t(fd, protocols[listener] == NET_PROTO_MEMCACHED ? MODE_MC : MODE_KVCG));
+            connections++;
+        }
+    }
+
+    void closeConn(io_t &io, uint64_t id) {
+        auto it = io.conns.find(id);
+        if (it == io.conns.end())
+            return;
+        release(*it->second);
+        close(it->second->fd);
+        io.conns.erase(it);
+    }
+
+    /// frees the values still queued on a connection
+    void release(conn_t &c) {
+        for (auto &o : c.out) {
+            wal_codec_t<data_t *>::free(o.value);
+        }
+        for (auto &r : c.replies) {
+            wal_codec_t<data_t *>::free(r.value);
+        }
+    }
+
+    /**
+     * Reads what the socket has and turns the whole frames into pending requests
+     */
+    void read(io_t &io, uint64_t id, conn_t &c) {
+        if (c.closing)
+            return;
+        const size_t chunk = 64 * 1024;
+        while (true) {
+            size_t at = c.in.size();
+            c.in.resize(at + chunk);
+            ssize_t r = ::read(c.fd, c.in.data() + at, chunk);
+            if (r <= 0) {
+                c.in.resize(at);
+                if (r == 0 || (errno != EAGAIN && errno != EINTR)) {
+                    closeConn(io, id);
+                    return;
+                }
+                break;
+            }
+            c.in.resize(at + r);
+            bytesIn += r;
+            if ((size_t) r < chunk)
+                break;
+        }
+
+        if (c.mode == MODE_MC && !c.in.empty())
+            c.mode = (uint8_t) c.in[0] == MC_MAGIC_REQUEST ? MODE_MC_BINARY : MODE_MC_TEXT;
+        bool open;
+        switch (c.mode) {
+            case MODE_KVCG:
+                open = parse(io, id, c);
+                break;
+            case MODE_MC_TEXT:
+                open = parseText(io, id, c);
+                break;
+            case MODE_MC_BINARY:
+                open = parseBinary(io, id, c);
+                break;
+            default:
+                open = true;
+        }
+        if (!open)
+            return;
+        // keep only the partial frame
+        if (c.inStart > 0) {
+            c.in.erase(c.in.begin(), c.in.begin() + c.inStart);
+            c.inStart = 0;
+        }
+    }
+
+    /**
+     * Turns the whole frames of the binary protocol into pending requests
+     * @return false if the connection was closed
+     */
+    bool parse(io_t &io, uint64_t id, conn_t &c) {
+        while (c.in.size() - c.inStart >= sizeof(net_request_t)) {
+            net_request_t req;
+            memcpy(&req, c.in.data() + c.inStart, sizeof(req));
+            if (req.valueLength > NET_MAX_VALUE) {
+                closeConn(io, id);
+                return false;
+            }
+            if (c.in.size() - c.inStart < sizeof(req) + req.valueLength)
+                break;
+            const char *value = c.in.data() + c.inStart + sizeof(req);
+            c.inStart += sizeof(req) + req.valueLength;
+            requests++;
+
+            if (req.op == NET_OP_GET || req.op == NET_OP_REMOVE) {
+                io.pending.push_back({req.key, nullptr, req.op});
+            } else if (req.op == NET_OP_INSERT && req.valueLength > 0) {
+                data_t *v = new data_t(req.valueLength);
+                memcpy(v->data, value, req.valueLength);
+                io.pending.push_back({req.key, v, req.op});
+            } else {
+                respond(io, id, c, {NET_BAD_REQUEST, {0, 0, 0}, 0, req.id}, nullptr);
+                continue;
+            }
+            io.origins.push_back({id, req.id, req.op});
+            if ((int) io.pending.size() == batchSize)
+                submit(io);
+        }
+        return true;
+    }
+
+    /**
+     * Queues a memcached reply, and unless it is done already the request on its key that completes it
+     * @param io
+     * @param id
+     * @param c
+     * @param r
+     * @param op
+     * @param value
+     */
+    void request(io_t &io, uint64_t id, conn_t &c, mc_reply_t r, uint8_t op, data_t *value) {
+        uint64_t seq = c.replyBase + c.replies.size();
+        if (!r.done) {
+            io.pending.push_back({mc_hash(r.key.data(), r.key.size()), value, op});
+            io.origins.push_back({id, seq, op});
+            requests++;
+        }
+        c.replies.push_back(std::move(r));
+        if (c.replies.size() == 1 && c.replies.front().done)
+            markDirty(io, id, c);
+        if ((int) io.pending.size() == batchSize)
+            submit(io);
+    }
+
+    /// queues a text line that needs no request
+    void reply(io_t &io, uint64_t id, conn_t &c, const char *message) {
+        request(io, id, c, {MC_REPLY_TEXT, true, false, false, 0, 0, 0, 0, message, "", nullptr}, 0, nullptr);
+    }
+
+    /**
+     * Parses the commands of the memcached text protocol, get and gets of many keys, set, delete, version and quit
+     * @return false if the connection was closed
+     */
+    bool parseText(io_t &io, uint64_t id, conn_t &c) {
+        std::vector<std::pair<const char *, size_t>> &tokens = io.tokens;
+        while (!c.closing) {
+            const char *line = c.in.data() + c.inStart;
+            size_t available = c.in.size() - c.inStart;
+            const char *nl = (const char *) memchr(line, '\n', available);
+            if (nl == nullptr) {
+                // a pipelined get of many keys is still coming in, no other command line is this long
+                bool get = (available >= 4 && memcmp(line, "get ", 4) == 0) ||
+                           (available >= 5 && memcmp(line, "gets ", 5) == 0);
+                if (available > (get ? MC_MAX_GET_LINE : MC_MAX_LINE)) {
+                    closeConn(io, id);
+                    return false;
+                }
+                break;
+            }
+            size_t lineLength = nl - line;
+            size_t consumed = lineLength + 1;
+            if (lineLength > 0 && line[lineLength - 1] == '\r')
+                lineLength--;
+            mc_tokenize(line, lineLength, tokens);
+
+            auto is = [&](const char *cmd) {
+                return tokens[0].second == strlen(cmd) && memcmp(tokens[0].first, cmd, tokens[0].second) == 0;
+            };
+            auto noreply = [&](size_t at) {
+                return tokens.size() > at && tokens[at].second == 7 && memcmp(tokens[at].first, "noreply", 7) == 0;
+            };
+
+            if (tokens.empty()) {
+                reply(io, id, c, "ERROR\r\n");
+            } else if (is("get") || is("gets")) {
+                bool withCas = is("gets");
+                bool valid = tokens.size() > 1;
+                for (size_t k = 1; k < tokens.size(); ++k) {
+                    valid = valid && tokens[k].second <= MC_MAX_KEY;
+                }
+                if (!valid) {
+                    reply(io, id, c, "CLIENT_ERROR bad command line format\r\n");
+                } else {
+                    // the keys of one get go in one batch
+                    if (!io.pending.empty() && io.pending.size() + tokens.size() - 1 > (size_t) batchSize)
+                        submit(io);
+                    for (size_t k = 1; k < tokens.size(); ++k) {
+                        request(io, id, c, {MC_REPLY_VALUE, false, false, withCas, 0, 0, 0, 0, nullptr,
+                                            std::string(tokens[k].first, tokens[k].second), nullptr},
+                                REQUEST_GET, nullptr);
+                    }
+                    reply(io, id, c, "END\r\n");
+                }
+            } else if (is("set")) {
+                uint64_t flags, exptime, bytes;
+                if (tokens.size() < 5 || tokens.size() > 6 || tokens[1].second > MC_MAX_KEY ||
+                    !mc_number(tokens[2], flags) || flags > UINT32_MAX || !mc_number(tokens[3], exptime) ||
+                    !mc_number(tokens[4], bytes)) {
+                    reply(io, id, c, "CLIENT_ERROR bad command line format\r\n");
+                } else if (bytes > NET_MAX_VALUE) {
+                    reply(io, id, c, "SERVER_ERROR object too large for cache\r\n");
+                    c.closing = true;
+                } else {
+                    if (available < consumed + bytes + 2)
+                        break;
+                    const char *data = line + consumed;
+                    consumed += bytes + 2;
+                    if (data[bytes] != '\r' || data[bytes + 1] != '\n') {
+                        reply(io, id, c, "CLIENT_ERROR bad data chunk\r\n");
+                    } else {
+                        data_t *v = mc_item_new(tokens[1].first, tokens[1].second, flags, data, bytes);
+                        request(io, id, c, {MC_REPLY_TEXT, false, false, false, 0, 0, 0, 0,
+                                            noreply(5) ? nullptr : "STORED\r\n",
+                                            std::string(tokens[1].first, tokens[1].second), nullptr},
+                                REQUEST_INSERT, v);
+                    }
+                }
+            } else if (is("delete")) {
+                if (tokens.size() < 2 || tokens.size() > 4 || tokens[1].second > MC_MAX_KEY) {
+                    reply(io, id, c, "CLIENT_ERROR bad command line format\r\n");
+                } else {
+                    request(io, id, c, {MC_REPLY_TEXT, false, false, false, 0, 0, 0, 0,
+                                        tokens.size() > 2 && noreply(tokens.size() - 1) ? nullptr : "DELETED\r\n",
+                                        std::string(tokens[1].first, tokens[1].second), nullptr},
+                            REQUEST_REMOVE, nullptr);
+                }
+            } else if (is("version")) {
+                reply(io, id, c, "VERSION " MC_VERSION_STRING "\r\n");
+            } else if (is("quit")) {
+                c.closing = true;
+                markDirty(io, id, c);
+            } else {
+                reply(io, id, c, "ERROR\r\n");
+            }
+            c.inStart += consumed;
+        }
+        return true;
+    }
+
+    /**
+     * Parses the requests of the memcached binary protocol, the get, set and delete families, noop, version and quit
+     * @return false if the connection was closed
+     */
+    bool parseBinary(io_t &io, uint64_t id, conn_t &c) {
+        while (!c.closing && c.in.size() - c.inStart >= sizeof(mc_binary_header_t)) {
+            mc_binary_header_t h;
+            memcpy(&h, c.in.data() + c.inStart, sizeof(h));
+            uint32_t body = be32toh(h.bodyLength);
+            uint16_t keyLength = be16toh(h.keyLength);
+            if (h.magic != MC_MAGIC_REQUEST || body > NET_MAX_VALUE + MC_MAX_KEY + 8) {
+                closeConn(io, id);
+                return false;
+            }
+            if (c.in.size() - c.inStart < sizeof(h) + body)
+                break;
+            const char *extras = c.in.data() + c.inStart + sizeof(h);
+            const char *key = extras + h.extrasLength;
+            const char *data = key + keyLength;
+            c.inStart += sizeof(h) + body;
+
+            mc_reply_t r{MC_REPLY_BINARY, false, false, false, h.opcode, MC_STATUS_OK, h.opaque, 0, nullptr, "",
+                         nullptr};
+            bool hasKey = keyLength > 0 && keyLength <= MC_MAX_KEY && h.extrasLength + keyLength <= body;
+            if (hasKey)
+                r.key.assign(key, keyLength);
+            switch (h.opcode) {
+                case MC_OP_GET:
+                case MC_OP_GETQ:
+                case MC_OP_GETK:
+                case MC_OP_GETKQ:
+                    if (!hasKey || h.extrasLength != 0)
+                        break;
+                    r.quiet = h.opcode == MC_OP_GETQ || h.opcode == MC_OP_GETKQ;
+                    request(io, id, c, std::move(r), REQUEST_GET, nullptr);
+                    continue;
+                case MC_OP_SET:
+                case MC_OP_SETQ: {
+                    if (!hasKey || h.extrasLength != 8)
+                        break;
+                    uint32_t flags;
+                    memcpy(&flags, extras, sizeof(flags));
+                    data_t *v = mc_item_new(key, keyLength, be32toh(flags), data,
+                                            body - h.extrasLength - keyLength);
+                    r.quiet = h.opcode == MC_OP_SETQ;
+                    r.cas = mc_item(v).cas;
+                    request(io, id, c, std::move(r), REQUEST_INSERT, v);
+                    continue;
+                }
+                case MC_OP_DELETE:
+                case MC_OP_DELETEQ:
+                    if (!hasKey || h.extrasLength != 0)
+                        break;
+                    r.quiet = h.opcode == MC_OP_DELETEQ;
+                    request(io, id, c, std::move(r), REQUEST_REMOVE, nullptr);
+                    continue;
+                case MC_OP_NOOP:
+                    r.done = true;
+                    request(io, id, c, std::move(r), 0, nullptr);
+                    continue;
+                case MC_OP_VERSION:
+                    r.done = true;
+                    r.message = MC_VERSION_STRING;
+                    request(io, id, c, std::move(r), 0, nullptr);
+                    continue;
+                case MC_OP_QUIT:
+                case MC_OP_QUITQ:
+                    r.done = true;
+                    r.quiet = h.opcode == MC_OP_QUITQ;
+                    request(io, id, c, std::move(r), 0, nullptr);
+                    c.closing = true;
+                    continue;
+                default:
+                    r.done = true;
+                    r.status = MC_STATUS_UNKNOWN;
+                    r.message = "Unknown command";
+                    request(io, id, c, std::move(r), 0, nullptr);
+                    continue;
+            }
+            r.done = true;
+            r.status = MC_STATUS_INVALID;
+            r.message = "Invalid arguments";
+            request(io, id, c, std::move(r), 0, nullptr);
+        }
+        return true;
+    }
+
+    /// sends the pending requests as one batch padded to a multiple of 512
+    void submit(io_t &io) {
+        if (io.pending.empty())
+            return;
+        int count = io.pending.size();
+        io.pending.resize((count + 511) / 512 * 512, {0, nullptr, REQUEST_EMPTY});
+        batch_t b;
+        b.rb = std::make_shared<ResultsBuffers<data_t>>(io.pending.size());
+        b.origins.swap(io.origins);
+        b.answered.assign(count, false);
+        b.remaining = count;
+        if (recorder != nullptr)
+            recorder->record(io.pending);
+        client.batch(io.pending, b.rb);
+        io.pending.clear();
+        io.inflight.push_back(std::move(b));
+        io.inflightRequests += count;
+        batches++;
+    }
+
+    /// answers the batch entries that completed since the last call
+    void complete(io_t &io) {
+        for (auto it = io.inflight.begin(); it != io.inflight.end();) {
+            batch_t &b = *it;
+            for (size_t slot = 0; slot < b.answered.size(); ++slot) {
+                int rid = b.rb->requestIDs[slot];
+                if (b.answered[slot] || rid == -1)
+                    continue;
+                std::atomic_thread_fence(std::memory_order_acquire);
+                b.answered[slot] = true;
+                b.remaining--;
+                io.inflightRequests--;
+
+                origin_t &o = b.origins[rid];
+                data_t *value = nullptr;
+                uint8_t status = NET_OK;
+                if (o.op == NET_OP_GET) {
+                    // the response owns the value from here on
+                    value = (data_t *) b.rb->resultValues[slot];
+                    b.rb->resultValues[slot] = nullptr;
+                    status = value ? NET_OK : NET_NOT_FOUND;
+                }
+                auto c = io.conns.find(o.conn);
+                if (c == io.conns.end()) {
+                    wal_codec_t<data_t *>::free(value);
+                    continue;
+                }
+                if (c->second->mode != MODE_KVCG) {
+                    answer(io, o, *c->second, value);
+                    continue;
+                }
+                respond(io, o.conn, *c->second,
+                        {status, {0, 0, 0}, value ? (uint32_t) value->size : 0, o.id}, value);
+            }
+            if (b.remaining == 0) {
+                it = io.inflight.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    /// completes the memcached reply of a batch entry, a get only hits if the value is the item of its key
+    void answer(io_t &io, const origin_t &o, conn_t &c, data_t *value) {
+        mc_reply_t &r = c.replies[o.id - c.replyBase];
+        if (value != nullptr && !mc_item_matches(value, r.key)) {
+            wal_codec_t<data_t *>::free(value);
+            value = nullptr;
+        }
+        r.value = value;
+        r.done = true;
+        if (o.id == c.replyBase)
+            markDirty(io, o.conn, c);
+    }
+
+    void markDirty(io_t &io, uint64_t id, conn_t &c) {
+        if (!c.queued) {
+            c.queued = true;
+            io.dirty.push_back(id);
+        }
+    }
+
+    /// appends the memcached replies that are done, in request order, to the text to write
+    void render(conn_t &c) {
+        while (!c.replies.empty() && c.replies.front().done) {
+            mc_reply_t &r = c.replies.front();
+            mc_item_t item = mc_item(r.value);
+            size_t dataOffset = r.value ? mc_item_data(r.value) : 0;
+            size_t dataLength = r.value ? r.value->size - dataOffset : 0;
+            switch (r.kind) {
+                case MC_REPLY_VALUE:
+                    if (r.value != nullptr) {
+                        c.text += "VALUE ";
+                        c.text += r.key;
+                        c.text += ' ';
+                        c.text += std::to_string(item.flags);
+                        c.text += ' ';
+                        c.text += std::to_string(dataLength);
+                        if (r.withCas) {
+                            c.text += ' ';
+                            c.text += std::to_string(item.cas);
+                        }
+                        c.text += "\r\n";
+                        c.text.append(r.value->data + dataOffset, dataLength);
+                        c.text += "\r\n";
+                    }
+                    break;
+                case MC_REPLY_TEXT:
+                    if (r.message != nullptr)
+                        c.text += r.message;
+                    break;
+                case MC_REPLY_BINARY: {
+                    bool get = r.opcode == MC_OP_GET || r.opcode == MC_OP_GETQ || r.opcode == MC_OP_GETK ||
+                               r.opcode == MC_OP_GETKQ;
+                    bool withKey = r.opcode == MC_OP_GETK || r.opcode == MC_OP_GETKQ;
+                    if (get && r.value == nullptr)
+                        r.status = MC_STATUS_NOT_FOUND;
+                    // quiet gets only answer hits, the other quiet ops only errors
+                    if (r.quiet && (get ? r.value == nullptr : r.status == MC_STATUS_OK))
+                        break;
+                    mc_binary_header_t h{MC_MAGIC_RESPONSE, r.opcode, 0, 0, 0, htobe16(r.status), 0, r.opaque,
+                                         htobe64(r.cas)};
+                    size_t keyLength = withKey ? r.key.size() : 0;
+                    size_t messageLength = r.message ? strlen(r.message) : 0;
+                    if (get && r.value != nullptr) {
+                        h.extrasLength = 4;
+                        h.cas = htobe64(item.cas);
+                    }
+                    h.keyLength = htobe16(keyLength);
+                    h.bodyLength = htobe32(h.extrasLength + keyLength + dataLength + messageLength);
+                    c.text.append((const char *) &h, sizeof(h));
+                    if (h.extrasLength > 0) {
+                        uint32_t flags = htobe32(item.flags);
+                        c.text.append((const char *) &flags, sizeof(flags));
+                    }
+                    c.text.append(r.key.data(), keyLength);
+                    if (r.value != nullptr)
+                        c.text.append(r.value->data + dataOffset, dataLength);
+                    c.text.append(r.message ? r.message : "", messageLength);
+                    break;
+                }
+            }
+            wal_codec_t<data_t *>::free(r.value);
+            c.replies.pop_front();
+            c.replyBase++;
+        }
+    }
+
+    /**
+     * Writes the rendered memcached replies, and closes the connection after a quit once they are written
+     * @return false if the connection was closed
+     */
+    bool flushText(io_t &io, uint64_t id, conn_t &c) {
+        render(c);
+        while (c.textSent < c.text.size()) {
+            ssize_t w = write(c.fd, c.text.data() + c.textSent, c.text.size() - c.textSent);
+            if (w < 0) {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EAGAIN) {
+                    watchWrite(io, id, c, true);
+                    return true;
+                }
+                closeConn(io, id);
+                return false;
+            }
+            bytesOut += w;
+            c.textSent += w;
+        }
+        c.text.clear();
+        c.textSent = 0;
+        if (c.closing && c.replies.empty()) {
+            closeConn(io, id);
+            return false;
+        }
+        watchWrite(io, id, c, false);
+        return true;
+    }
+
+    void respond(io_t &io, uint64_t id, conn_t &c, net_response_t header, data_t *value) {
+        if (c.out.empty())
+            io.dirty.push_back(id);
+        c.out.push_back({header, value});
+    }
+
+    /**
+     * Writes as much of the queued responses as the socket takes with writev, and waits for EPOLLOUT if it is full
+     * @return false if the connection was closed
+     */
+    bool flush(io_t &io, uint64_t id, conn_t &c) {
+        if (c.mode != MODE_KVCG)
+            return flushText(io, id, c);
+        std::vector<iovec> iov;
+        while (!c.out.empty()) {
+            iov.clear();
+            size_t skip = c.outSent;
+            for (auto &o : c.out) {
+                if (iov.size() + 2 > IOV_MAX)
+                    break;
+                size_t hlen = sizeof(net_response_t);
+                if (skip < hlen) {
+                    iov.push_back({(char *) &o.header + skip, hlen - skip});
+                    skip = 0;
+                } else {
+                    skip -= hlen;
+                }
+                if (o.value && o.value->size > skip) {
+                    iov.push_back({o.value->data + skip, o.value->size - skip});
+                }
+                skip = 0;
+            }
+            ssize_t w = writev(c.fd, iov.data(), iov.size());
+            if (w < 0) {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EAGAIN) {
+                    watchWrite(io, id, c, true);
+                    return true;
+                }
+                closeConn(io, id);
+                return false;
+            }
+            bytesOut += w;
+            // drop the responses written completely
+            size_t written = c.outSent + w;
+            while (!c.out.empty()) {
+                size_t len = sizeof(net_response_t) + (c.out.front().value ? c.out.front().value->size : 0);
+                if (written < len)
+                    break;
+                written -= len;
+                wal_codec_t<data_t *>::free(c.out.front().value);
+                c.out.pop_front();
+            }
+            c.outSent = written;
+        }
+        watchWrite(io, id, c, false);
+        return true;
+    }
+
+    void watchWrite(io_t &io, uint64_t id, conn_t &c, bool on) {
+        if (c.wantWrite == on)
+            return;
+        c.wantWrite = on;
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLRDHUP | (on ? EPOLLOUT : 0);
+        ev.data.u64 = id;
+        epoll_ctl(io.epfd, EPOLL_CTL_MOD, c.fd, &ev);
+    }
+
+    client_t &client;
+    int ioThreads;
+    int batchSize;
+    int maxInflight;
+    std::vector<int> listeners;
+    std::vector<uint8_t> protocols;
+    std::vector<std::thread> threads;
+    std::atomic_bool stopping;
+    std::atomic_size_t connections;
+    std::atomic_size_t requests;
+    std::atomic_size_t batches;
+    std::atomic_size_t bytesIn;
+    std::atomic_size_t bytesOut;
+    TraceWriter *recorder;
+};
+
+#endif //KVGPU_NETFRONTEND_CUH
@@ -0,0 +1,177 @@
+/*
+ * Copyright (c) 2020-2021 dePaul Miller (dsm220@lehigh.edu)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <cerrno>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <ImportantDefinitions.cuh>
+
+#ifndef KVGPU_NETPROTOCOL_CUH
+#define KVGPU_NETPROTOCOL_CUH
+
+/*
+ * Binary protocol of the kvcg network front-end. Every frame is a fixed header in host byte order followed by
+ * valueLength bytes of value. Requests are pipelined, each carries an id the client picks and its response carries
+ * the same id, responses can come back in any order.
+ */
+
+/// op of a request, the same numbers as the store's requests
+enum : uint8_t {
+    NET_OP_GET = REQUEST_GET,
+    NET_OP_INSERT = REQUEST_INSERT,
+    NET_OP_REMOVE = REQUEST_REMOVE
+};
+
+/// status of a response
+enum : uint8_t {
+    NET_OK = 0,
+    NET_NOT_FOUND = 1,
+    NET_BAD_REQUEST = 2
+};
+
+/// protocol spoken on a listening socket
+enum : uint8_t {
+    NET_PROTO_KVCG = 0,
+    /// memcached text or binary, told apart by the first byte of a connection
+    NET_PROTO_MEMCACHED = 1
+};
+
+/// values larger than this close the connection
+const uint32_t NET_MAX_VALUE = 1 << 20;
+
+struct net_request_t {
+    uint8_t op;
+    uint8_t pad[3];
+    uint32_t valueLength;
+    uint64_t id;
+    uint64_t key;
+};
+
+struct net_response_t {
+    uint8_t status;
+    uint8_t pad[3];
+    uint32_t valueLength;
+    uint64_t id;
+};
+
+static_assert(sizeof(net_request_t) == 24, "request header is sent as is");
+static_assert(sizeof(net_response_t) == 16, "response header is sent as is");
+
+/**
+ * Opens a listening socket on a TCP port or, if path is not empty, a Unix socket
+ * @param port
+ * @param path
+ * @return the socket, -1 with errno set on failure
+ */
+inline int net_listen(int port, const std::string &path) {
+    int fd;
+    if (!path.empty()) {
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (fd < 0)
+            return -1;
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+        unlink(path.c_str());
+        if (bind(fd, (sockaddr *) &addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0) {
+            int e = errno;
+            close(fd);
+            errno = e;
+            return -1;
+        }
+        return fd;
+    }
+    fd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd < 0)
+        return -1;
+    int one = 1;
+    int zero = 0;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    // take IPv4 connections too
+    setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+    sockaddr_in6 addr{};
+    addr.sin6_family = AF_INET6;
+    addr.sin6_addr = in6addr_any;
+    addr.sin6_port = htons(port);
+    if (bind(fd, (sockaddr *) &addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0) {
+        int e = errno;
+        close(fd);
+        errno = e;
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Connects a blocking socket to host:port or, if path is not empty, to a Unix socket
+ * @param host
+ * @param port
+ * @param path
+ * @return the socket, -1 on failure
+ */
+inline int net_connect(const std::string &host, int port, const std::string &path) {
+    if (!path.empty()) {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0)
+            return -1;
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+        if (connect(fd, (sockaddr *) &addr, sizeof(addr)) != 0) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo *res;
+    if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &res) != 0)
+        return -1;
+    int fd = -1;
+    for (addrinfo *a = res; a != nullptr; a = a->ai_next) {
+        fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (fd < 0)
+            continue;
+        if (connect(fd, a->ai_addr, a->ai_addrlen) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd >= 0) {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return fd;
+}
+
+#endif //KVGPU_NETPROTOCOL_CUH
@@ -0,0 +1,179 @@
+/*
+ * Copyright (c) 2020-2021 dePaul Miller (dsm220@lehigh.edu)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <atomic>
+#include <chrono>
+#include <list>
+#include <memory>
+#include <random>
+#include <thread>
+#include <tbb/concurrent_queue.h>
+#include <kvcg.cuh>
+
+#ifndef KVGPU_OPENLOOP_CUH
+#define KVGPU_OPENLOOP_CUH
+
+/**
+ * When the batches of one workload thread are due. Constant spaces them evenly, Poisson draws exponential gaps with
+ * the same mean, so the threads together offer a Poisson stream. The schedule never slips: a thread that falls
+ * behind sends at once until it has caught up, and its batches count as late from the time they were due.
+ */
+struct arrivals_t {
+
+    /**
+     * @param batchRate batches per second of all threads, 0 sends as fast as possible
+     * @param threads workload threads sharing batchRate
+     * @param poisson
+     * @param seed
+     */
+    arrivals_t(int batchRate, int threads, bool poisson, unsigned seed) : mean(
+            batchRate > 0 ? 1e9 * threads / batchRate : 0), poisson(poisson), gen(seed), gaps(1.0),
+                                                                           at(std::chrono::steady_clock::now()) {}
+
+    /**
+     * Waits until the next batch is due
+     * @return when it was due
+     */
+    std::chrono::steady_clock::time_point next() {
+        if (mean == 0)
+            return at = std::chrono::steady_clock::now();
+        at += std::chrono::nanoseconds((int64_t) (poisson ? mean * gaps(gen) : mean));
+        std::this_thread::sleep_until(at);
+        return at;
+    }
+
+    double mean;
+    bool poisson;
+    std::mt19937_64 gen;
+    std::exponential_distribution<double> gaps;
+    std::chrono::steady_clock::time_point at;
+};
+
+/**
+ * Times batches from when they were due until every request has an answer, which is what a client sending on a
+ * schedule sees, including the time a batch waited behind a slow one. A single thread polls the ResultsBuffers of
+ * the batches in flight.
+ * V is the value type of the ResultsBuffers
+ * @tparam V
+ */
+template<typename V>
+class CompletionTracker {
+public:
+    using RB = std::shared_ptr<ResultsBuffers<V>>;
+
+    CompletionTracker() : completed(0), requests(0), start(std::chrono::steady_clock::now()), last(start),
+                          stopping(false), poller([this]() { poll(); }) {}
+
+    CompletionTracker(const CompletionTracker<V> &) = delete;
+
+    ~CompletionTracker() {
+        stop();
+    }
+
+    /**
+     * Starts timing a batch that was just handed to the store
+     * @param rb its results
+     * @param size requests in the batch that are not REQUEST_EMPTY, the answers fill the first size slots of rb
+     * @param due when the schedule wanted it sent
+     */
+    void track(RB rb, int size, std::chrono::steady_clock::time_point due) {
+        inflight.push({std::move(rb), size, 0, due});
+    }
+
+    /// waits for the batches in flight to complete
+    void stop() {
+        stopping = true;
+        if (poller.joinable())
+            poller.join();
+    }
+
+    /// latency of the batches in nanoseconds
+    const LatencyHistogram &getLatency() const {
+        return latency;
+    }
+
+    size_t getCompleted() const {
+        return completed;
+    }
+
+    size_t getRequests() const {
+        return requests;
+    }
+
+    /// seconds from creating the tracker to the last completion
+    double getSeconds() const {
+        return std::chrono::duration<double>(last - start).count();
+    }
+
+private:
+
+    struct inflight_t {
+        RB rb;
+        int size;
+        /// requests before this one are known to be answered
+        int answered;
+        std::chrono::steady_clock::time_point due;
+    };
+
+    void poll() {
+        std::list<inflight_t> pending;
+        while (true) {
+            inflight_t b;
+            while (inflight.try_pop(b)) {
+                pending.push_back(std::move(b));
+            }
+            if (pending.empty()) {
+                if (stopping && inflight.empty())
+                    return;
+                std::this_thread::sleep_for(std::chrono::microseconds(10));
+                continue;
+            }
+            auto now = std::chrono::steady_clock::now();
+            for (auto it = pending.begin(); it != pending.end();) {
+                while (it->answered < it->size && it->rb->requestIDs[it->answered] != -1) {
+                    it->answered++;
+                }
+                if (it->answered < it->size) {
+                    ++it;
+                    continue;
+                }
+                latency.record(std::chrono::duration_cast<std::chrono::nanoseconds>(now - it->due).count());
+                completed++;
+                requests += it->size;
+                last = now;
+                it = pending.erase(it);
+            }
+        }
+    }
+
+    tbb::concurrent_queue<inflight_t> inflight;
+    LatencyHistogram latency;
+    std::atomic_size_t completed;
+    std::atomic_size_t requests;
+    std::chrono::steady_clock::time_point start;
+    std::chrono::steady_clock::time_point last;
+    std::atomic_bool stopping;
+    std::thread poller;
+};
+
+#endif //KVGPU_OPENLOOP_CUH
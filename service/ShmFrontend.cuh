@@ -0,0 +1,367 @@
+/*
+ * Copyright (c) 2020-2021 dePaul Miller (dsm220@lehigh.edu)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <kvcg.cuh>
+#include "ShmRing.cuh"
+#include "Trace.cuh"
+
+#ifndef KVGPU_SHMFRONTEND_CUH
+#define KVGPU_SHMFRONTEND_CUH
+
+/**
+ * Serves the shared memory rings of ShmRing.cuh. Slot s belongs to worker s % workers, which is the only consumer of
+ * its request ring and the only producer of its response ring. A worker builds one batch from all the requests its
+ * slots have, reading keys and ops straight from ring memory, and writes the responses with their values inline as
+ * the ResultsBuffers slots complete.
+ * M is the type of the Model
+ * @tparam M
+ */
+template<typename M>
+class ShmFrontend {
+public:
+    typedef KVStoreClient<unsigned long long, data_t, M> client_t;
+    typedef RequestWrapper<unsigned long long, data_t *> RW;
+
+    /**
+     * @param client
+     * @param workers
+     * @param batchSize most requests in a batch
+     */
+    ShmFrontend(client_t &client, int workers, int batchSize) : client(client),
+                                                                workers(std::min(workers, SHM_MAX_WORKERS)),
+                                                                batchSize(batchSize), header(nullptr),
+                                                                stopping(false), requests(0), batches(0),
+                                                                sleeps(0), recorder(nullptr) {}
+
+    ShmFrontend(const ShmFrontend<M> &) = delete;
+
+    ~ShmFrontend() {
+        stop();
+        if (header != nullptr) {
+            shm_unmap(header);
+            shm_unlink(name.c_str());
+        }
+    }
+
+    /**
+     * Creates the shared memory region. Call before start.
+     * @param name a POSIX shared memory name such as /kvcg
+     * @param clients slots in the region
+     * @param entries entries of every ring
+     * @param valueSize largest value a request or response carries
+     * @return false if the region could not be created
+     */
+    bool open(const std::string &name, int clients, int entries, int valueSize) {
+        header = shm_map(name, clients, entries, valueSize, workers);
+        if (header == nullptr) {
+            std::cerr << "Cannot create shared memory " << name << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        this->name = name;
+        return true;
+    }
+
+    void start() {
+        for (int w = 0; w < workers; ++w) {
+            threads.push_back(std::thread([this, w]() {
+                IO_CPUS.pin();
+                loop(w);
+            }));
+        }
+    }
+
+    /// stops the workers, requests in flight are not answered
+    void stop() {
+        stopping = true;
+        for (int w = 0; header != nullptr && w < workers; ++w) {
+            header->doorbells[w].ring.fetch_add(1);
+            shm_futex_wake(header->doorbells[w].ring);
+        }
+        for (auto &t : threads) {
+            if (t.joinable())
+                t.join();
+        }
+        threads.clear();
+    }
+
+    /// clients holding a slot
+    size_t getClients() const {
+        size_t n = 0;
+        for (uint32_t s = 0; header != nullptr && s < header->clients; ++s) {
+            n += shm_slot(header, s)->owner.load() != 0;
+        }
+        return n;
+    }
+
+    size_t getRequests() const {
+        return requests;
+    }
+
+    /**
+     * Records every batch sent to the store from now on, call before start
+     * @param r
+     */
+    void setRecorder(TraceWriter *r) {
+        recorder = r;
+    }
+
+    size_t getBatches() const {
+        return batches;
+    }
+
+    /// times a worker slept on its doorbell
+    size_t getSleeps() const {
+        return sleeps;
+    }
+
+private:
+
+    /// who gets the response of a batch entry
+    struct origin_t {
+        uint32_t slot;
+        uint64_t id;
+        uint8_t op;
+    };
+
+    struct batch_t {
+        std::shared_ptr<ResultsBuffers<data_t>> rb;
+        std::vector<origin_t> origins;
+        std::vector<bool> answered;
+        int remaining;
+    };
+
+    /// state of one worker
+    struct worker_t {
+        std::vector<uint32_t> slots;
+        /// local tail of every response ring, published once per round
+        std::vector<uint32_t> responseTail;
+        std::vector<bool> touched;
+        /// answers written since the last publish, still counted as outstanding
+        std::vector<uint32_t> answered;
+        std::vector<RW> pending;
+        std::vector<origin_t> origins;
+        std::list<batch_t> inflight;
+    };
+
+    void loop(int w) {
+        worker_t io;
+        for (uint32_t s = w; s < header->clients; s += workers) {
+            io.slots.push_back(s);
+        }
+        io.responseTail.resize(header->clients);
+        io.touched.assign(header->clients, false);
+        io.answered.assign(header->clients, 0);
+        for (uint32_t s : io.slots) {
+            io.responseTail[s] = shm_slot(header, s)->responses.tail.load();
+        }
+        shm_doorbell_t &doorbell = header->doorbells[w];
+
+        int idle = 0;
+        while (!stopping.load(std::memory_order_relaxed)) {
+            bool work = take(io);
+            submit(io);
+            work = complete(io) || work;
+            publish(io);
+            if (work || !io.inflight.empty()) {
+                idle = 0;
+                continue;
+            }
+            if (++idle < SHM_SPIN_POLLS)
+                continue;
+            // say we sleep, then look once more so a request published in between is not missed
+            uint32_t ring = doorbell.ring.load();
+            doorbell.sleeping.store(1, std::memory_order_seq_cst);
+            if (!ready(io) && !stopping.load()) {
+                sleeps++;
+                shm_futex_wait(doorbell.ring, ring, 100);
+            }
+            doorbell.sleeping.store(0, std::memory_order_relaxed);
+            idle = 0;
+        }
+    }
+
+    bool ready(worker_t &io) {
+        for (uint32_t s : io.slots) {
+            shm_slot_t *slot = shm_slot(header, s);
+            if (slot->requests.head.load(std::memory_order_relaxed) !=
+                slot->requests.tail.load(std::memory_order_seq_cst))
+                return true;
+        }
+        return false;
+    }
+
+    /**
+     * Takes the requests of every slot into the pending batch, no more than the response ring has room for
+     * @return true if a request was taken
+     */
+    bool take(worker_t &io) {
+        bool any = false;
+        for (uint32_t s : io.slots) {
+            shm_slot_t *slot = shm_slot(header, s);
+            uint32_t head = slot->requests.head.load(std::memory_order_relaxed);
+            uint32_t avail = slot->requests.tail.load(std::memory_order_acquire) - head;
+            if (avail == 0)
+                continue;
+            // answers not yet published count twice, which only holds back a little
+            int64_t credits = (int64_t) header->entries -
+                              (uint32_t) (io.responseTail[s] - slot->responses.head.load(std::memory_order_acquire)) -
+                              slot->outstanding.load(std::memory_order_relaxed);
+            if (credits <= 0)
+                continue;
+            uint32_t n = std::min<int64_t>(avail, credits);
+            for (uint32_t i = 0; i < n; ++i) {
+                net_request_t *req = shm_request(header, slot, head + i);
+                if (req->op == NET_OP_GET || req->op == NET_OP_REMOVE) {
+                    io.pending.push_back({req->key, nullptr, req->op});
+                } else if (req->op == NET_OP_INSERT && req->valueLength > 0 &&
+                           req->valueLength <= header->valueSize) {
+                    // the store keeps the value, so it leaves the ring once
+                    data_t *v = new data_t(req->valueLength);
+                    memcpy(v->data, req + 1, req->valueLength);
+                    io.pending.push_back({req->key, v, req->op});
+                } else {
+                    respond(io, s, {NET_BAD_REQUEST, {0, 0, 0}, 0, req->id}, nullptr);
+                    continue;
+                }
+                io.origins.push_back({s, req->id, req->op});
+                slot->outstanding.fetch_add(1, std::memory_order_relaxed);
+                if ((int) io.pending.size() == batchSize)
+                    submit(io);
+            }
+            slot->requests.head.store(head + n, std::memory_order_release);
+            requests += n;
+            any = any || n > 0;
+        }
+        return any;
+    }
+
+    /// sends the pending requests as one batch padded to a multiple of 512
+    void submit(worker_t &io) {
+        if (io.pending.empty())
+            return;
+        int count = io.pending.size();
+        io.pending.resize((count + 511) / 512 * 512, {0, nullptr, REQUEST_EMPTY});
+        batch_t b;
+        b.rb = std::make_shared<ResultsBuffers<data_t>>(io.pending.size());
+        b.origins.swap(io.origins);
+        b.answered.assign(count, false);
+        b.remaining = count;
+        if (recorder != nullptr)
+            recorder->record(io.pending);
+        client.batch(io.pending, b.rb);
+        io.pending.clear();
+        io.inflight.push_back(std::move(b));
+        batches++;
+    }
+
+    /**
+     * Answers the batch entries that completed since the last call
+     * @return true if one did
+     */
+    bool complete(worker_t &io) {
+        bool any = false;
+        for (auto it = io.inflight.begin(); it != io.inflight.end();) {
+            batch_t &b = *it;
+            for (size_t slot = 0; slot < b.answered.size(); ++slot) {
+                int rid = b.rb->requestIDs[slot];
+                if (b.answered[slot] || rid == -1)
+                    continue;
+                std::atomic_thread_fence(std::memory_order_acquire);
+                b.answered[slot] = true;
+                b.remaining--;
+                any = true;
+
+                origin_t &o = b.origins[rid];
+                data_t *value = nullptr;
+                uint8_t status = NET_OK;
+                if (o.op == NET_OP_GET) {
+                    value = (data_t *) b.rb->resultValues[slot];
+                    b.rb->resultValues[slot] = nullptr;
+                    status = value ? NET_OK : NET_NOT_FOUND;
+                    if (value && value->size > header->valueSize) {
+                        // larger than any value a client of this region can put
+                        wal_codec_t<data_t *>::free(value);
+                        value = nullptr;
+                        status = NET_BAD_REQUEST;
+                    }
+                }
+                respond(io, o.slot, {status, {0, 0, 0}, value ? (uint32_t) value->size : 0, o.id}, value);
+                wal_codec_t<data_t *>::free(value);
+                io.answered[o.slot]++;
+            }
+            if (b.remaining == 0) {
+                it = io.inflight.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        return any;
+    }
+
+    /// writes a response in the ring of slot s, the value is copied inline
+    void respond(worker_t &io, uint32_t s, net_response_t r, const data_t *value) {
+        shm_slot_t *slot = shm_slot(header, s);
+        net_response_t *out = shm_response(header, slot, io.responseTail[s]++);
+        *out = r;
+        if (value != nullptr)
+            memcpy(out + 1, value->data, value->size);
+        io.touched[s] = true;
+    }
+
+    /// makes the responses written this round visible and wakes the clients sleeping on them
+    void publish(worker_t &io) {
+        for (uint32_t s : io.slots) {
+            if (!io.touched[s])
+                continue;
+            io.touched[s] = false;
+            shm_slot_t *slot = shm_slot(header, s);
+            slot->responses.tail.store(io.responseTail[s], std::memory_order_seq_cst);
+            // a new owner of the slot waits for this before it drops stale responses
+            slot->outstanding.fetch_sub(io.answered[s], std::memory_order_release);
+            io.answered[s] = 0;
+            if (slot->responses.sleeping.load(std::memory_order_seq_cst))
+                shm_futex_wake(slot->responses.tail);
+        }
+    }
+
+    client_t &client;
+    int workers;
+    int batchSize;
+    std::string name;
+    shm_header_t *header;
+    std::vector<std::thread> threads;
+    std::atomic_bool stopping;
+    std::atomic_size_t requests;
+    std::atomic_size_t batches;
+    std::atomic_size_t sleeps;
+    TraceWriter *recorder;
+};
+
+#endif //KVGPU_SHMFRONTEND_CUH
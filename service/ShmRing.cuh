@@ -0,0 +1,340 @@
+/*
+ * Copyright (c) 2020-2021 dePaul Miller (dsm220@lehigh.edu)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include "NetProtocol.cuh"
+
+#ifndef KVGPU_SHMRING_CUH
+#define KVGPU_SHMRING_CUH
+
+/*
+ * Shared memory transport for clients on the same host. The server creates a POSIX shared memory region with a slot
+ * per client, and a client claims a free slot. Every slot holds a single producer single consumer request ring and
+ * response ring. Entries are the frames of NetProtocol.cuh with the value inline, so no value crosses a socket or
+ * gets copied by the kernel. A side that finds its ring empty for a while sleeps on a futex, and the producer only
+ * makes the wake up call when the consumer said it sleeps.
+ */
+
+const uint32_t SHM_MAGIC = 0x6b766367;
+
+/// most server workers a region has doorbells for
+const int SHM_MAX_WORKERS = 64;
+
+/// empty polls before a side sleeps on its futex
+const int SHM_SPIN_POLLS = 1 << 14;
+
+/// the futex word a sleeping server worker waits on, bumped to wake it
+struct alignas(64) shm_doorbell_t {
+    std::atomic<uint32_t> ring;
+    std::atomic<uint32_t> sleeping;
+};
+
+struct alignas(64) shm_header_t {
+    uint32_t magic;
+    uint32_t clients;
+    /// entries of every ring, a power of two
+    uint32_t entries;
+    /// largest inline value
+    uint32_t valueSize;
+    uint32_t workers;
+    uint32_t requestStride;
+    uint32_t responseStride;
+    uint64_t slotBytes;
+    shm_doorbell_t doorbells[SHM_MAX_WORKERS];
+};
+
+/// indices run freely and are masked with entries - 1, the consumer waits on tail
+struct shm_ring_t {
+    alignas(64) std::atomic<uint32_t> tail;
+    alignas(64) std::atomic<uint32_t> head;
+    alignas(64) std::atomic<uint32_t> sleeping;
+};
+
+/// followed by the request entries and then the response entries
+struct alignas(64) shm_slot_t {
+    /// pid of the client, 0 if the slot is free
+    std::atomic<int32_t> owner;
+    /// requests the server took and has not answered
+    std::atomic<uint32_t> outstanding;
+    shm_ring_t requests;
+    shm_ring_t responses;
+};
+
+inline uint32_t shm_stride(size_t header, uint32_t valueSize) {
+    return (header + valueSize + 63) / 64 * 64;
+}
+
+inline shm_slot_t *shm_slot(shm_header_t *h, uint32_t s) {
+    return (shm_slot_t *) ((char *) h + sizeof(shm_header_t) + s * h->slotBytes);
+}
+
+inline net_request_t *shm_request(shm_header_t *h, shm_slot_t *slot, uint32_t index) {
+    return (net_request_t *) ((char *) slot + sizeof(shm_slot_t) +
+                              (size_t) (index & (h->entries - 1)) * h->requestStride);
+}
+
+inline net_response_t *shm_response(shm_header_t *h, shm_slot_t *slot, uint32_t index) {
+    return (net_response_t *) ((char *) slot + sizeof(shm_slot_t) + (size_t) h->entries * h->requestStride +
+                               (size_t) (index & (h->entries - 1)) * h->responseStride);
+}
+
+inline size_t shm_region_size(uint32_t clients, uint32_t entries, uint32_t valueSize) {
+    size_t slotBytes = sizeof(shm_slot_t) + (size_t) entries * (shm_stride(sizeof(net_request_t), valueSize) +
+                                                                shm_stride(sizeof(net_response_t), valueSize));
+    return sizeof(shm_header_t) + clients * slotBytes;
+}
+
+/**
+ * Sleeps while word holds expected, at most timeoutMs
+ */
+inline void shm_futex_wait(std::atomic<uint32_t> &word, uint32_t expected, int timeoutMs) {
+    timespec ts{timeoutMs / 1000, (timeoutMs % 1000) * 1000000L};
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAIT, expected, &ts, nullptr, 0);
+}
+
+inline void shm_futex_wake(std::atomic<uint32_t> &word) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+
+/**
+ * Maps a region created by the server, or creates it if clients is not 0
+ * @param name
+ * @param clients
+ * @param entries rounded up to a power of two
+ * @param valueSize
+ * @param workers
+ * @return the header, nullptr with errno set on failure
+ */
+inline shm_header_t *shm_map(const std::string &name, uint32_t clients = 0, uint32_t entries = 0,
+                             uint32_t valueSize = 0, uint32_t workers = 0) {
+    bool create = clients != 0;
+    int fd;
+    size_t size;
+    if (create) {
+        shm_unlink(name.c_str());
+        fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+        uint32_t e = 1;
+        while (e < entries)
+            e <<= 1;
+        entries = e;
+        size = shm_region_size(clients, entries, valueSize);
+        if (fd >= 0 && ftruncate(fd, size) != 0) {
+            int err = errno;
+            close(fd);
+            errno = err;
+            return nullptr;
+        }
+    } else {
+        fd = shm_open(name.c_str(), O_RDWR, 0);
+        struct stat st{};
+        if (fd >= 0 && fstat(fd, &st) != 0) {
+            close(fd);
+            return nullptr;
+        }
+        size = st.st_size;
+    }
+    if (fd < 0)
+        return nullptr;
+    void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return nullptr;
+    auto *h = (shm_header_t *) p;
+    if (create) {
+        // a new region reads as zeros, which is an empty ring and a free slot
+        h->clients = clients;
+        h->entries = entries;
+        h->valueSize = valueSize;
+        h->workers = workers;
+        h->requestStride = shm_stride(sizeof(net_request_t), valueSize);
+        h->responseStride = shm_stride(sizeof(net_response_t), valueSize);
+        h->slotBytes = (size - sizeof(shm_header_t)) / clients;
+        std::atomic_thread_fence(std::memory_order_release);
+        reinterpret_cast<std::atomic<uint32_t> *>(&h->magic)->store(SHM_MAGIC, std::memory_order_release);
+    } else if (size < sizeof(shm_header_t) ||
+               reinterpret_cast<std::atomic<uint32_t> *>(&h->magic)->load(std::memory_order_acquire) != SHM_MAGIC ||
+               size < shm_region_size(h->clients, h->entries, h->valueSize)) {
+        munmap(p, size);
+        errno = EINVAL;
+        return nullptr;
+    }
+    return h;
+}
+
+inline void shm_unmap(shm_header_t *h) {
+    munmap(h, shm_region_size(h->clients, h->entries, h->valueSize));
+}
+
+/**
+ * Client side of the shared memory transport. Requests are queued with send and made visible with publish, so a
+ * pipelined client pays for one wake up per burst at most.
+ */
+class ShmClient {
+public:
+    ShmClient() : header(nullptr), slot(nullptr), sent(0), received(0) {}
+
+    ShmClient(const ShmClient &) = delete;
+
+    ~ShmClient() {
+        disconnect();
+    }
+
+    /**
+     * Maps the region and claims a free slot, or the slot of a client that exited
+     * @param name
+     * @return false if the region does not exist or every slot is taken
+     */
+    bool connect(const std::string &name) {
+        header = shm_map(name);
+        if (header == nullptr)
+            return false;
+        int32_t pid = getpid();
+        for (uint32_t s = 0; s < header->clients; ++s) {
+            shm_slot_t *candidate = shm_slot(header, s);
+            int32_t owner = 0;
+            if (!candidate->owner.compare_exchange_strong(owner, pid)) {
+                if (owner == pid || kill(owner, 0) == 0 || errno != ESRCH ||
+                    !candidate->owner.compare_exchange_strong(owner, pid))
+                    continue;
+            }
+            slotIndex = s;
+            slot = candidate;
+            // whatever a previous owner left in flight is answered and dropped
+            while (slot->outstanding.load() != 0 || slot->requests.head.load() != slot->requests.tail.load()) {
+                usleep(100);
+            }
+            slot->responses.head.store(slot->responses.tail.load());
+            sent = slot->requests.tail.load();
+            received = slot->responses.head.load();
+            return true;
+        }
+        shm_unmap(header);
+        header = nullptr;
+        errno = EBUSY;
+        return false;
+    }
+
+    /// frees the slot, call once every response was received
+    void disconnect() {
+        if (header == nullptr)
+            return;
+        slot->owner.store(0);
+        shm_unmap(header);
+        header = nullptr;
+        slot = nullptr;
+    }
+
+    uint32_t getValueSize() const {
+        return header->valueSize;
+    }
+
+    /**
+     * Queues a request, it is not visible to the server before publish
+     * @param op
+     * @param key
+     * @param id echoed in the response
+     * @param value
+     * @param length at most getValueSize()
+     * @return false if the ring is full or the value too large
+     */
+    bool send(uint8_t op, uint64_t key, uint64_t id, const void *value = nullptr, uint32_t length = 0) {
+        if (sent - slot->requests.head.load(std::memory_order_acquire) >= header->entries ||
+            length > header->valueSize)
+            return false;
+        net_request_t *req = shm_request(header, slot, sent);
+        req->op = op;
+        req->valueLength = length;
+        req->id = id;
+        req->key = key;
+        if (length > 0)
+            memcpy(req + 1, value, length);
+        sent++;
+        return true;
+    }
+
+    /// makes the queued requests visible and wakes the worker of this slot if it sleeps
+    void publish() {
+        slot->requests.tail.store(sent, std::memory_order_seq_cst);
+        shm_doorbell_t &d = header->doorbells[slotIndex % header->workers];
+        if (d.sleeping.load(std::memory_order_seq_cst)) {
+            d.ring.fetch_add(1);
+            shm_futex_wake(d.ring);
+        }
+    }
+
+    /**
+     * Hands the responses that arrived to f(const net_response_t &, const char *value)
+     * @return the number of responses
+     */
+    template<typename F>
+    size_t poll(F &&f) {
+        uint32_t tail = slot->responses.tail.load(std::memory_order_acquire);
+        size_t n = tail - received;
+        for (; received != tail; ++received) {
+            net_response_t *resp = shm_response(header, slot, received);
+            f(*resp, (const char *) (resp + 1));
+        }
+        if (n > 0)
+            slot->responses.head.store(received, std::memory_order_release);
+        return n;
+    }
+
+    /**
+     * Spins for a response and then sleeps on the ring until one arrives
+     * @param timeoutMs
+     */
+    void wait(int timeoutMs = 100) {
+        for (int i = 0; i < SHM_SPIN_POLLS; ++i) {
+            if (slot->responses.tail.load(std::memory_order_acquire) != received)
+                return;
+        }
+        slot->responses.sleeping.store(1, std::memory_order_seq_cst);
+        uint32_t tail = slot->responses.tail.load(std::memory_order_seq_cst);
+        if (tail == received)
+            shm_futex_wait(slot->responses.tail, tail, timeoutMs);
+        slot->responses.sleeping.store(0, std::memory_order_relaxed);
+    }
+
+private:
+    shm_header_t *header;
+    shm_slot_t *slot;
+    uint32_t slotIndex;
+    /// tail of the request ring and head of the response ring, owned by this side
+    uint32_t sent;
+    uint32_t received;
+};
+
+#endif //KVGPU_SHMRING_CUH
@@ -0,0 +1,308 @@
+/*
+ * Copyright (c) 2020-2021 dePaul Miller (dsm220@lehigh.edu)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <kvcg.cuh>
+
+#ifndef KVGPU_TRACE_CUH
+#define KVGPU_TRACE_CUH
+
+/*
+ * Binary request traces. A trace is a header, the records of every batch back to back, an index of where each batch
+ * starts and the values of the inserts. A record has the layout of a RequestWrapper with the value pointer replaced
+ * by the offset of the value in the value area, so a reader that swaps the offsets for data_t pointers once can hand
+ * out batches straight from the mapped file. The first populationBatches batches fill the store before a run.
+ */
+
+const char TRACE_MAGIC[8] = {'K', 'V', 'C', 'G', 'T', 'R', 'C', '1'};
+const uint32_t TRACE_VERSION = 1;
+
+struct trace_header_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t recordSize;
+    uint64_t records;
+    uint64_t batches;
+    uint64_t populationBatches;
+    /// batches + 1 record numbers, batch b is records [index[b], index[b + 1])
+    uint64_t indexOffset;
+    uint64_t valuesOffset;
+    uint64_t valueBytes;
+};
+
+static_assert(sizeof(trace_header_t) == 64, "the records start 64 bytes in");
+
+/// one request, value is an offset into the value area until a reader patches it
+struct trace_record_t {
+    uint64_t key;
+    uint64_t value;
+    uint32_t request;
+    uint32_t valueLength;
+};
+
+typedef RequestWrapper<unsigned long long, data_t *> trace_request_t;
+
+static_assert(sizeof(trace_record_t) == sizeof(trace_request_t) &&
+              offsetof(trace_record_t, key) == offsetof(trace_request_t, key) &&
+              offsetof(trace_record_t, value) == offsetof(trace_request_t, value) &&
+              offsetof(trace_record_t, request) == offsetof(trace_request_t, requestInteger) &&
+              sizeof(data_t *) == sizeof(uint64_t), "a patched record must read as a RequestWrapper");
+
+/**
+ * Appends batches to a trace. Values go to a temporary file until close, which writes the index and the values
+ * after the records and fills in the header. Any thread may record.
+ */
+class TraceWriter {
+public:
+    TraceWriter() : out(nullptr), values(nullptr), records(0), valueBytes(0), populationBatches(0) {}
+
+    TraceWriter(const TraceWriter &) = delete;
+
+    ~TraceWriter() {
+        close();
+    }
+
+    /**
+     * Creates or truncates filename
+     * @param filename
+     * @return false if it could not be created
+     */
+    bool open(const std::string &filename) {
+        out = fopen(filename.c_str(), "wb");
+        values = tmpfile();
+        if (out == nullptr || values == nullptr) {
+            std::cerr << "Cannot write trace " << filename << ": " << strerror(errno) << std::endl;
+            close();
+            return false;
+        }
+        trace_header_t h{};
+        fwrite(&h, sizeof(h), 1, out);
+        index.assign(1, 0);
+        return true;
+    }
+
+    /**
+     * Appends a batch as the store sees it, padding included. Values are copied, so the caller still owns them.
+     * @param batch
+     * @param population true for a batch that fills the store, all of which must come before the others
+     */
+    void record(const std::vector<trace_request_t> &batch, bool population = false) {
+        std::vector<trace_record_t> recs;
+        recs.reserve(batch.size());
+        std::lock_guard<std::mutex> l(mtx);
+        if (out == nullptr)
+            return;
+        for (auto &r : batch) {
+            trace_record_t rec{r.key, 0, r.requestInteger, 0};
+            if (r.value != nullptr && r.requestInteger == REQUEST_INSERT) {
+                rec.value = valueBytes;
+                rec.valueLength = r.value->size;
+                fwrite(r.value->data, 1, r.value->size, values);
+                valueBytes += r.value->size;
+            }
+            recs.push_back(rec);
+        }
+        fwrite(recs.data(), sizeof(trace_record_t), recs.size(), out);
+        records += recs.size();
+        index.push_back(records);
+        if (population)
+            populationBatches = index.size() - 1;
+    }
+
+    /**
+     * Writes the index, the values and the header
+     * @return false if a write failed
+     */
+    bool close() {
+        std::lock_guard<std::mutex> l(mtx);
+        bool ok = true;
+        if (out != nullptr) {
+            trace_header_t h{};
+            memcpy(h.magic, TRACE_MAGIC, sizeof(h.magic));
+            h.version = TRACE_VERSION;
+            h.recordSize = sizeof(trace_record_t);
+            h.records = records;
+            h.batches = index.size() - 1;
+            h.populationBatches = populationBatches;
+            h.indexOffset = sizeof(h) + records * sizeof(trace_record_t);
+            h.valuesOffset = h.indexOffset + index.size() * sizeof(uint64_t);
+            h.valueBytes = valueBytes;
+            ok = fwrite(index.data(), sizeof(uint64_t), index.size(), out) == index.size();
+
+            rewind(values);
+            char buf[1 << 16];
+            size_t n;
+            while ((n = fread(buf, 1, sizeof(buf), values)) > 0) {
+                ok = ok && fwrite(buf, 1, n, out) == n;
+            }
+            rewind(out);
+            ok = ok && fwrite(&h, sizeof(h), 1, out) == 1;
+            ok = fclose(out) == 0 && ok;
+            out = nullptr;
+        }
+        if (values != nullptr) {
+            fclose(values);
+            values = nullptr;
+        }
+        return ok;
+    }
+
+    size_t getRecords() const {
+        return records;
+    }
+
+    size_t getBatches() const {
+        return index.empty() ? 0 : index.size() - 1;
+    }
+
+private:
+    std::mutex mtx;
+    FILE *out;
+    FILE *values;
+    std::vector<uint64_t> index;
+    size_t records;
+    size_t valueBytes;
+    size_t populationBatches;
+};
+
+/**
+ * A trace mapped copy on write, so the records can be patched in place without touching the file
+ */
+class TraceReader {
+public:
+    TraceReader() : base(nullptr), length(0), header(nullptr), records(nullptr), index(nullptr), values(nullptr) {}
+
+    TraceReader(const TraceReader &) = delete;
+
+    ~TraceReader() {
+        if (base != nullptr)
+            munmap(base, length);
+    }
+
+    /**
+     * Maps filename and checks its header
+     * @param filename
+     * @return false if it is missing or not a trace
+     */
+    bool open(const std::string &filename) {
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        struct stat st{};
+        if (fd < 0 || fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(trace_header_t)) {
+            std::cerr << "Cannot read trace " << filename << std::endl;
+            if (fd >= 0)
+                ::close(fd);
+            return false;
+        }
+        length = st.st_size;
+        void *m = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (m == MAP_FAILED) {
+            std::cerr << "Cannot map trace " << filename << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        base = (char *) m;
+        madvise(base, length, MADV_WILLNEED);
+        header = (trace_header_t *) base;
+        if (memcmp(header->magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0 || header->version != TRACE_VERSION ||
+            header->recordSize != sizeof(trace_record_t) ||
+            header->indexOffset != sizeof(trace_header_t) + header->records * sizeof(trace_record_t) ||
+            header->valuesOffset != header->indexOffset + (header->batches + 1) * sizeof(uint64_t) ||
+            header->valuesOffset + header->valueBytes > length) {
+            std::cerr << filename << " is not a trace" << std::endl;
+            return false;
+        }
+        records = (trace_record_t *) (base + sizeof(trace_header_t));
+        index = (const uint64_t *) (base + header->indexOffset);
+        values = base + header->valuesOffset;
+        return true;
+    }
+
+    size_t getBatches() const {
+        return header->batches;
+    }
+
+    size_t getPopulationBatches() const {
+        return header->populationBatches;
+    }
+
+    size_t getRecords() const {
+        return header->records;
+    }
+
+    /**
+     * @param b
+     * @param n set to the requests in batch b
+     * @return the first record of batch b
+     */
+    trace_record_t *batch(size_t b, size_t &n) {
+        n = index[b + 1] - index[b];
+        return records + index[b];
+    }
+
+    /**
+     * @param b
+     * @return the number of the first record of batch b, getRecords() for b = getBatches()
+     */
+    size_t firstRecord(size_t b) const {
+        return index[b];
+    }
+
+    trace_record_t *record(size_t i) {
+        return records + i;
+    }
+
+    /**
+     * Copies the value of an unpatched insert
+     * @param r
+     * @return a new data_t, or nullptr if r has no value
+     */
+    data_t *value(const trace_record_t &r) const {
+        if (r.request != REQUEST_INSERT || r.value + r.valueLength > header->valueBytes)
+            return nullptr;
+        data_t *v = new data_t(r.valueLength);
+        memcpy(v->data, values + r.value, r.valueLength);
+        return v;
+    }
+
+private:
+    char *base;
+    size_t length;
+    trace_header_t *header;
+    trace_record_t *records;
+    const uint64_t *index;
+    const char *values;
+};
+
+#endif //KVGPU_TRACE_CUH
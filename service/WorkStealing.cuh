@@ -0,0 +1,151 @@
+/*
+ * Copyright (c) 2020-2021 dePaul Miller (dsm220@lehigh.edu)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+
+#ifndef KVGPU_WORKSTEALING_CUH
+#define KVGPU_WORKSTEALING_CUH
+
+/**
+ * A deque per worker. Producers push to the back of a worker's deque and the worker pops the oldest item from the
+ * front, so its own work runs in arrival order. An idle worker steals the oldest item of another, starting at a victim
+ * drawn from its own generator so thieves spread out, and the item that waited longest is the one that moves. Batches
+ * are coarse, so a lock per deque is cheap next to a batch, and the size is kept outside the lock so a thief skips
+ * empty deques without touching their locks.
+ * T is the type of the work item
+ * @tparam T
+ */
+template<typename T>
+class StealingQueues {
+public:
+    explicit StealingQueues(int workers) : workers(workers), queues(new queue_t[workers]),
+                                           thieves(new thief_t[workers]), steals(0) {
+        for (int i = 0; i < workers; ++i) {
+            thieves[i].seed = 2654435761u * (i + 1);
+        }
+    }
+
+    StealingQueues(const StealingQueues<T> &) = delete;
+
+    /**
+     * Queues item on worker
+     * @param worker
+     * @param item
+     * @return the items queued on worker including item
+     */
+    size_t push(int worker, T &&item) {
+        queue_t &q = queues[worker];
+        std::lock_guard<std::mutex> l(q.mtx);
+        q.items.push_back(std::move(item));
+        q.size.store(q.items.size(), std::memory_order_release);
+        return q.items.size();
+    }
+
+    /**
+     * Takes the oldest item of worker
+     * @param worker
+     * @param out
+     * @return false if the deque is empty
+     */
+    bool pop(int worker, T &out) {
+        queue_t &q = queues[worker];
+        if (q.size.load(std::memory_order_acquire) == 0)
+            return false;
+        std::lock_guard<std::mutex> l(q.mtx);
+        return take(q, out);
+    }
+
+    /**
+     * Takes the oldest item of another worker, the victims are tried from a random one on
+     * @param thief
+     * @param out
+     * @return false if every other deque is empty or busy
+     */
+    bool steal(int thief, T &out) {
+        if (workers < 2)
+            return false;
+        // xorshift, kept apart from the generators of the workload
+        uint32_t &x = thieves[thief].seed;
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        int first = 1 + x % (workers - 1);
+        for (int i = 0; i < workers - 1; ++i) {
+            queue_t &q = queues[(thief + 1 + (first - 1 + i) % (workers - 1)) % workers];
+            if (q.size.load(std::memory_order_acquire) == 0)
+                continue;
+            std::unique_lock<std::mutex> l(q.mtx, std::try_to_lock);
+            if (l.owns_lock() && take(q, out)) {
+                steals.fetch_add(1, std::memory_order_relaxed);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * Items queued on worker, may be stale by the time it returns
+     * @param worker
+     * @return
+     */
+    size_t size(int worker) const {
+        return queues[worker].size.load(std::memory_order_acquire);
+    }
+
+    size_t getSteals() const {
+        return steals;
+    }
+
+private:
+
+    struct alignas(64) queue_t {
+        std::mutex mtx;
+        std::deque<T> items;
+        std::atomic_size_t size{0};
+    };
+
+    /// a thief's generator on its own line
+    struct alignas(64) thief_t {
+        uint32_t seed;
+    };
+
+    static bool take(queue_t &q, T &out) {
+        if (q.items.empty())
+            return false;
+        out = std::move(q.items.front());
+        q.items.pop_front();
+        q.size.store(q.items.size(), std::memory_order_release);
+        return true;
+    }
+
+    int workers;
+    std::unique_ptr<queue_t[]> queues;
+    std::unique_ptr<thief_t[]> thieves;
+    std::atomic_size_t steals;
+};
+
+#endif //KVGPU_WORKSTEALING_CUH
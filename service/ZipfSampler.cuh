@@ -0,0 +1,305 @@
+/*
+ * Copyright (c) 2020-2021 dePaul Miller (dsm220@lehigh.edu)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+#ifndef KVGPU_ZIPFSAMPLER_CUH
+#define KVGPU_ZIPFSAMPLER_CUH
+
+/**
+ * Per thread uniform random numbers, xoshiro256** seeded through splitmix64
+ */
+struct zipf_rng_t {
+
+    explicit zipf_rng_t(uint64_t seed = 1) {
+        for (auto &w : s) {
+            seed += 0x9e3779b97f4a7c15ULL;
+            uint64_t z = seed;
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+            w = z ^ (z >> 31);
+        }
+    }
+
+    inline uint64_t next() {
+        uint64_t result = rotl(s[1] * 5, 7) * 9;
+        uint64_t t = s[1] << 17;
+        s[2] ^= s[0];
+        s[3] ^= s[1];
+        s[1] ^= s[2];
+        s[0] ^= s[3];
+        s[2] ^= t;
+        s[3] = rotl(s[3], 45);
+        return result;
+    }
+
+    /// uniform in [0, 1)
+    inline double uniform() {
+        return (next() >> 11) * 0x1.0p-53;
+    }
+
+    /// uniform in [0, n)
+    inline uint64_t below(uint64_t n) {
+        return (uint64_t) (((unsigned __int128) next() * n) >> 64);
+    }
+
+    uint64_t s[4];
+
+private:
+    static inline uint64_t rotl(uint64_t x, int k) {
+        return (x << k) | (x >> (64 - k));
+    }
+};
+
+/**
+ * Zipf distribution over 1..n, P(k) proportional to k^-theta, sampled by rejection inversion (Hoermann and
+ * Derflinger, 1996). Setup and sampling take constant time for any n and theta >= 0, with no zeta sum, and fewer
+ * than one in ten candidates are rejected. The distribution is immutable and shared, every thread brings its own
+ * zipf_rng_t.
+ */
+class ZipfDistribution {
+public:
+
+    /**
+     * @param n largest value
+     * @param theta skew, 0 is uniform
+     */
+    ZipfDistribution(uint64_t n = 1, double theta = 0.99) : n(n), theta(theta) {
+        hIntegralX1 = hIntegral(1.5) - 1.0;
+        hIntegralN = hIntegral(n + 0.5);
+        s = 2.0 - hIntegralInverse(hIntegral(2.5) - h(2.0));
+    }
+
+    uint64_t getN() const {
+        return n;
+    }
+
+    double getTheta() const {
+        return theta;
+    }
+
+    /**
+     * @param rng
+     * @return a value in 1..n
+     */
+    inline uint64_t sample(zipf_rng_t &rng) const {
+        while (true) {
+            uint64_t k;
+            if (candidate(rng.uniform(), k))
+                return k;
+        }
+    }
+
+    /**
+     * Fills out with count samples. The first pass takes one candidate per slot with no data dependent branches, so
+     * the compiler can vectorize the math, and a second pass redraws the rejected slots.
+     * @param rng
+     * @param out
+     * @param count
+     */
+    void fill(zipf_rng_t &rng, uint64_t *out, size_t count) const {
+        const size_t CHUNK = 256;
+        double r[CHUNK];
+        for (size_t base = 0; base < count; base += CHUNK) {
+            size_t m = count - base < CHUNK ? count - base : CHUNK;
+            for (size_t i = 0; i < m; ++i) {
+                r[i] = rng.uniform();
+            }
+            for (size_t i = 0; i < m; ++i) {
+                uint64_t k;
+                bool accepted = candidate(r[i], k);
+                out[base + i] = accepted ? k : 0;
+            }
+        }
+        for (size_t i = 0; i < count; ++i) {
+            if (out[i] == 0)
+                out[i] = sample(rng);
+        }
+    }
+
+private:
+
+    /**
+     * Maps a uniform draw to a candidate
+     * @param r in [0, 1)
+     * @param k the candidate
+     * @return true if k is accepted
+     */
+    inline bool candidate(double r, uint64_t &k) const {
+        double u = hIntegralN + r * (hIntegralX1 - hIntegralN);
+        double x = hIntegralInverse(u);
+        double kd = std::floor(x + 0.5);
+        kd = kd < 1.0 ? 1.0 : (kd > (double) n ? (double) n : kd);
+        k = (uint64_t) kd;
+        return kd - x <= s || u >= hIntegral(kd + 0.5) - h(kd);
+    }
+
+    /// integral of h from 1 to x, (x^(1 - theta) - 1) / (1 - theta)
+    inline double hIntegral(double x) const {
+        double logX = std::log(x);
+        return helper2((1.0 - theta) * logX) * logX;
+    }
+
+    inline double h(double x) const {
+        return std::exp(-theta * std::log(x));
+    }
+
+    inline double hIntegralInverse(double x) const {
+        double t = x * (1.0 - theta);
+        t = t < -1.0 ? -1.0 : t;
+        return std::exp(helper1(t) * x);
+    }
+
+    /// log(1 + x) / x, accurate near 0
+    static inline double helper1(double x) {
+        return std::fabs(x) > 1e-8 ? std::log1p(x) / x : 1.0 - x * (0.5 - x * (1.0 / 3.0 - 0.25 * x));
+    }
+
+    /// (e^x - 1) / x, accurate near 0
+    static inline double helper2(double x) {
+        return std::fabs(x) > 1e-8 ? std::expm1(x) / x : 1.0 + x * 0.5 * (1.0 + x * (1.0 / 3.0) * (1.0 + 0.25 * x));
+    }
+
+    uint64_t n;
+    double theta;
+    double hIntegralX1;
+    double hIntegralN;
+    double s;
+};
+
+/**
+ * A pseudo random permutation of [0, n) that maps every index on its own, so any number of threads can draw distinct
+ * keys from disjoint index ranges without sharing a set. A four round Feistel network permutes the smallest domain of
+ * an even number of bits holding n and values outside [0, n) are walked through it again, which takes fewer than four
+ * rounds on average.
+ */
+struct key_permutation_t {
+
+    explicit key_permutation_t(uint64_t n = 1, uint64_t seed = 1) : n(n) {
+        int bits = 2;
+        while (bits < 64 && (n - 1) >> bits != 0)
+            bits += 2;
+        half = bits / 2;
+        mask = (1ULL << half) - 1;
+        zipf_rng_t rng(seed);
+        for (auto &k : keys) {
+            k = rng.next();
+        }
+    }
+
+    /// the value index i maps to, i must be below n
+    inline uint64_t operator()(uint64_t i) const {
+        do {
+            i = round(i);
+        } while (i >= n);
+        return i;
+    }
+
+    uint64_t n;
+
+private:
+    inline uint64_t round(uint64_t x) const {
+        uint64_t l = x >> half;
+        uint64_t r = x & mask;
+        for (uint64_t k : keys) {
+            uint64_t f = (r ^ k) * 0xbf58476d1ce4e5b9ULL;
+            f ^= f >> 31;
+            uint64_t next = l ^ (f & mask);
+            l = r;
+            r = next;
+        }
+        return (l << half) | r;
+    }
+
+    int half;
+    uint64_t mask;
+    uint64_t keys[4];
+};
+
+/// the index the harness gave the calling workload thread through setWorkloadThread, a thread it did not name is 0
+inline thread_local int workloadThread = 0;
+inline thread_local zipf_rng_t threadGenerator;
+inline thread_local bool threadSeeded = false;
+
+/**
+ * The generator of the calling workload thread. Thread t gets stream t of base, so a seeded run repeats every thread's
+ * requests however the threads are scheduled.
+ * @param base the seed of the workload
+ * @return
+ */
+inline zipf_rng_t &threadRng(uint64_t base) {
+    if (!threadSeeded) {
+        threadGenerator = zipf_rng_t(base * 0x9E3779B97F4A7C15ULL + workloadThread);
+        threadSeeded = true;
+    }
+    return threadGenerator;
+}
+
+/**
+ * Names the calling workload thread, its generator is seeded again the next time it is asked for
+ * @param thread index of the thread, from 0
+ */
+inline void nameWorkloadThread(int thread) {
+    workloadThread = thread;
+    threadSeeded = false;
+}
+
+/**
+ * Builds the population in batches of batchsize records on every hardware thread, each fills whole batches on its own
+ * @tparam Batch
+ * @tparam F
+ * @param n records
+ * @param batchsize
+ * @param record makes record i
+ * @return
+ */
+template<typename Batch, typename F>
+std::vector<Batch> buildPopulation(size_t n, unsigned batchsize, const F &record) {
+    std::vector<Batch> batches((n + batchsize - 1) / batchsize);
+    std::atomic_size_t nextBatch{0};
+    std::vector<std::thread> threads;
+    size_t nthreads = std::max<size_t>(1, std::min<size_t>(std::thread::hardware_concurrency(), batches.size()));
+    for (size_t t = 0; t < nthreads; ++t) {
+        threads.push_back(std::thread([&]() {
+            size_t b;
+            while ((b = nextBatch.fetch_add(1)) < batches.size()) {
+                Batch &vec = batches[b];
+                for (size_t i = b * batchsize; i < std::min(n, (b + 1) * batchsize); ++i) {
+                    vec.push_back(record(i));
+                }
+            }
+        }));
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+    return batches;
+}
+
+#endif //KVGPU_ZIPFSAMPLER_CUH
@@ -0,0 +1,30 @@
+#!/bin/bash
+# Runs a config under the shifting hotspot workload with the model fixed and with online retraining and prints how
+# long the hit rate takes to come back after each shift for both.
+# usage: adapt.sh <kvcg> <config> [workload library]
+
+if [ $# -lt 2 ]; then
+    echo "usage: $0 <kvcg> <config> [workload library]"
+    exit 1
+fi
+
+KVCG=$1
+CONFIG=$2
+LIB=${3:-./libshiftingZipfianWorkload.so}
+RUN_CONFIG=$(mktemp --suffix=.json)
+trap 'rm -f "$RUN_CONFIG"' EXIT
+
+echo "TABLE: Adaptation Recovery"
+echo -e "Adapt\tPhase\tAt (s)\tHit Rate before\tLowest Hit Rate\tRecovered after (s)"
+for adapt in observe retrain; do
+    python3 - "$CONFIG" "$RUN_CONFIG" "$adapt" <<'PY'
+import json, sys
+conf = json.load(open(sys.argv[1]))
+conf["adapt"] = sys.argv[3]
+json.dump(conf, open(sys.argv[2], "w"), indent=4)
+PY
+    "$KVCG" -f "$RUN_CONFIG" -l "$LIB" 2>/dev/null | awk -v a=$adapt '
+        /^TABLE: / { table = $0; getline; next }
+        table == "TABLE: Shifts" && NF > 0 { print a "\t" $0 }
+        NF == 0 { table = "" }'
+done
@@ -0,0 +1,33 @@
+#!/bin/bash
+# Compares static and work stealing dispatch under uneven batch costs. A share of the batches is made slow by
+# slowBatchUs, and the Dispatch table of every run shows how long batches waited for a worker.
+# usage: dispatch.sh <kvcg> <config> [slow batch %] [slow batch us] [workload library]
+
+if [ $# -lt 2 ]; then
+    echo "usage: $0 <kvcg> <config> [slow batch %] [slow batch us] [workload library]"
+    exit 1
+fi
+
+KVCG=$1
+CONFIG=$2
+SLOW=${3:-10}
+SLOW_US=${4:-2000}
+LIB=${5:-./libzipfianWorkload.so}
+RUN_CONFIG=$(mktemp --suffix=.json)
+trap 'rm -f "$RUN_CONFIG"' EXIT
+
+echo "TABLE: Dispatch"
+for dispatch in static stealing; do
+    python3 - "$CONFIG" "$RUN_CONFIG" "$dispatch" "$SLOW" "$SLOW_US" <<'PY'
+import json, sys
+conf = json.load(open(sys.argv[1]))
+conf["partitioned"] = False
+conf["dispatch"] = sys.argv[3]
+conf["slowBatchPercent"] = int(sys.argv[4])
+conf["slowBatchUs"] = int(sys.argv[5])
+json.dump(conf, open(sys.argv[2], "w"), indent=4)
+PY
+    "$KVCG" -f "$RUN_CONFIG" -l "$LIB" 2>/dev/null |
+        awk -v first=$([ $dispatch = static ] && echo 1 || echo 0) \
+            '/^TABLE: Dispatch/ { getline; if (first) print; getline; print; exit }'
+done
@@ -0,0 +1,54 @@
+#!/bin/bash
+# Compares the CPU use of busy waiting and adaptive spin then park workers with no load and at 10%, 50% and 100% of
+# the peak batch rate. The idle run serves an unused port for serveSeconds, the others pace the workload with
+# batchRate, taking the peak from the unpaced busy waiting run.
+# usage: idle.sh <kvcg> <config> [idle seconds] [workload library]
+
+if [ $# -lt 2 ]; then
+    echo "usage: $0 <kvcg> <config> [idle seconds] [workload library]"
+    exit 1
+fi
+
+KVCG=$1
+CONFIG=$2
+IDLE_SECONDS=${3:-10}
+LIB=${4:-./libzipfianWorkload.so}
+RUN_CONFIG=$(mktemp --suffix=.json)
+trap 'rm -f "$RUN_CONFIG"' EXIT
+
+# run <idle> <batch rate> <serve seconds>, prints the row of the CPU table
+run() {
+    python3 - "$CONFIG" "$RUN_CONFIG" "$1" "$2" "$3" <<'PY'
+import json, sys
+conf = json.load(open(sys.argv[1]))
+conf["idle"] = sys.argv[3]
+conf["batchRate"] = int(sys.argv[4])
+serve = int(sys.argv[5])
+conf["serveSeconds"] = serve
+conf["port"] = 17311 if serve > 0 else 0
+for k in ("unixSocket", "shmName"):
+    conf[k] = ""
+conf["memcachedPort"] = 0
+json.dump(conf, open(sys.argv[2], "w"), indent=4)
+PY
+    "$KVCG" -f "$RUN_CONFIG" -l "$LIB" 2>/dev/null | awk '/^TABLE: CPU/ { getline; getline; print; exit }'
+}
+
+PEAK=$(run spin 0 0 | cut -f2 | cut -d. -f1)
+if [ -z "$PEAK" ]; then
+    echo "no CPU table from $KVCG"
+    exit 1
+fi
+
+echo "TABLE: Idle"
+echo -e "Idle\tLoad (%)\tLoad (batches/s)\tCores busy"
+for idle in spin adaptive; do
+    row=$(run $idle 0 "$IDLE_SECONDS")
+    echo -e "$idle\t0\t$(echo "$row" | cut -f2)\t$(echo "$row" | cut -f5)"
+    for load in 10 50 100; do
+        rate=$((PEAK * load / 100))
+        [ "$load" = 100 ] && rate=0
+        row=$(run $idle $rate 0)
+        echo -e "$idle\t$load\t$(echo "$row" | cut -f2)\t$(echo "$row" | cut -f5)"
+    done
+done
@@ -20,98 +20,231 @@
  * THE SOFTWARE.
  */
 
-#include <zipf.hh>
-#include <vector>
-#include <unordered_map>
-#include <map>
-#include <cmath>
+
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <functional>
 #include <iostream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "Trace.cuh"
+#include "ModelTrainer.cuh"
+#include "ModelFile.cuh"
 
-constexpr float sigmoid(float x) {
-    return 1.0f / (1.0f + expf(-x));
-}
+/*
+ * Trains a model offline on a recorded trace. Every key is counted exactly, which gives the accesses and the distinct
+ * keys of each hash bucket, the buckets are planned under the cache capacity as the server plans them online and the
+ * plan is written as a model file the server loads with modelFile.
+ */
 
-constexpr float d_sigmoid(float x) {
-    return sigmoid(x)*(1 - sigmoid(x));
+void usage(char *command) {
+    std::cerr << command << " -t <trace> -o <model> [-c <capacity in keys>] [-b <buckets>] [-e <holdout fraction>]"
+              << " [-j <threads>] [-p]" << std::endl;
+    std::cerr << "\t-p counts the population batches too" << std::endl;
 }
 
-constexpr float serr(float y, float ypred) {
-    float diff = (y - ypred);
-    return diff * diff;
+/// what a range of batches adds up to per bucket and per key
+struct trace_counts_t {
+    std::vector<double> freq;
+    std::vector<double> distinct;
+    /// accesses of each distinct key
+    std::vector<uint32_t> perKey;
+    size_t accesses;
+};
+
+/**
+ * Counts the requests in records [begin, end) on nthreads threads. Each thread splits its slice of keys by the range of
+ * buckets the key hashes to, then each thread counts the keys of one split into its own buckets, so every key is
+ * counted by one thread and no thread holds counts for all the buckets.
+ * @param trace
+ * @param begin
+ * @param end
+ * @param buckets
+ * @param nthreads
+ * @param keys true to count distinct keys and the accesses per key
+ * @return
+ */
+trace_counts_t countTrace(TraceReader &trace, size_t begin, size_t end, size_t buckets, size_t nthreads, bool keys) {
+    std::hash<unsigned long long> hfn;
+    size_t slice = (end - begin + nthreads - 1) / nthreads;
+    // split t counts buckets [t * range, (t + 1) * range)
+    size_t range = (buckets + nthreads - 1) / nthreads;
+    std::vector<std::vector<std::vector<uint64_t>>> splits(nthreads, std::vector<std::vector<uint64_t>>(nthreads));
+    std::vector<std::vector<uint32_t>> perKey(nthreads);
+    std::vector<size_t> accesses(nthreads, 0);
+
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < nthreads; ++t) {
+        threads.push_back(std::thread([&, t]() {
+            size_t first = std::min(end, begin + t * slice);
+            size_t last = std::min(end, first + slice);
+            for (size_t i = first; i < last; ++i) {
+                trace_record_t *r = trace.record(i);
+                if (r->request == REQUEST_EMPTY)
+                    continue;
+                accesses[t]++;
+                splits[t][(unsigned) hfn(r->key) % buckets / range].push_back(r->key);
+            }
+        }));
+    }
+    for (auto &th : threads) {
+        th.join();
+    }
+    threads.clear();
+
+    trace_counts_t c{std::vector<double>(buckets, 0), std::vector<double>(buckets, 0), {}, 0};
+    for (size_t t = 0; t < nthreads; ++t) {
+        threads.push_back(std::thread([&, t]() {
+            if (!keys) {
+                for (size_t s = 0; s < nthreads; ++s) {
+                    for (uint64_t key : splits[s][t]) {
+                        c.freq[(unsigned) hfn(key) % buckets]++;
+                    }
+                    std::vector<uint64_t>().swap(splits[s][t]);
+                }
+                return;
+            }
+            size_t n = 0;
+            for (size_t s = 0; s < nthreads; ++s) {
+                n += splits[s][t].size();
+            }
+            std::unordered_map<uint64_t, uint32_t> counts;
+            counts.reserve(n / 2);
+            for (size_t s = 0; s < nthreads; ++s) {
+                for (uint64_t key : splits[s][t]) {
+                    counts[key]++;
+                }
+                std::vector<uint64_t>().swap(splits[s][t]);
+            }
+            perKey[t].reserve(counts.size());
+            for (auto &kv : counts) {
+                size_t b = (unsigned) hfn(kv.first) % buckets;
+                c.freq[b] += kv.second;
+                c.distinct[b]++;
+                perKey[t].push_back(kv.second);
+            }
+        }));
+    }
+    for (auto &th : threads) {
+        th.join();
+    }
+    for (size_t t = 0; t < nthreads; ++t) {
+        c.accesses += accesses[t];
+        c.perKey.insert(c.perKey.end(), perKey[t].begin(), perKey[t].end());
+    }
+    return c;
 }
 
-constexpr float d_serr(float y, float ypred) {
-    float diff = (y - ypred);
-    return 2.0f * diff;
+/**
+ * Share of the accesses the most accessed keys get when capacity of them are cached, the best any model can do on
+ * the counts
+ * @param perKey
+ * @param accesses
+ * @param capacity
+ * @return
+ */
+double perKeyHitRate(std::vector<uint32_t> &perKey, size_t accesses, size_t capacity) {
+    if (accesses == 0)
+        return 0;
+    size_t k = std::min(capacity, perKey.size());
+    std::nth_element(perKey.begin(), perKey.begin() + k, perKey.end(), std::greater<uint32_t>());
+    double hits = 0;
+    for (size_t i = 0; i < k; ++i) {
+        hits += perKey[i];
+    }
+    return hits / accesses;
 }
 
-int main() {
-
-    double theta = 0.99;
-    unsigned range = 10000000;
-    auto zetaN = betterstd::zeta(theta, range);
-
-    float w = rand() / (float)RAND_MAX;
-    float b = 0.0;
-    float alpha = 0.1f;
-
-    for(int repeat = 0; repeat < 1000; repeat++) {
-        std::vector<int> v;
-        std::unordered_map<int, unsigned> m;
-
-        for (int i = 0; i < 512; i++) {
-            int gen = betterstd::rand_zipf(range, zetaN, theta);
-            if (m.find(gen) != m.end()) {
-                m[gen] += 1;
-            } else {
-                m[gen] = 1;
-            }
-        }
-
-        std::unordered_map<int, float> pred;
-        std::vector<int> input;
-
-        for (auto &p : m) {
-            pred[p.first] = p.second / 512.0f;
-            input.push_back(p.first);
+int main(int argc, char **argv) {
+
+    std::string traceFile;
+    std::string modelFile;
+    // the keys Cache<K, V>::type holds
+    size_t capacity = 1000000 * 8;
+    size_t buckets = 262144;
+    double holdout = 0;
+    size_t nthreads = std::max(1u, std::thread::hardware_concurrency());
+    bool population = false;
+
+    int c;
+    while ((c = getopt(argc, argv, "t:o:c:b:e:j:p")) != -1) {
+        switch (c) {
+            case 't':
+                traceFile = optarg;
+                break;
+            case 'o':
+                modelFile = optarg;
+                break;
+            case 'c':
+                capacity = std::stoull(optarg);
+                break;
+            case 'b':
+                buckets = std::stoull(optarg);
+                break;
+            case 'e':
+                holdout = std::stod(optarg);
+                break;
+            case 'j':
+                nthreads = std::stoull(optarg);
+                break;
+            case 'p':
+                population = true;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
         }
+    }
+    if (traceFile.empty() || modelFile.empty() || buckets == 0 || nthreads == 0 || holdout < 0 || holdout >= 1) {
+        usage(argv[0]);
+        return 1;
+    }
 
-
-        std::vector<float> output;
-        std::vector<std::pair<float, float>> d_output;
-
-        float sse = 0.0f;
-
-        float d_w = 0.0f;
-        float d_b = 0.0f;
-        float sumdiff = 0.0f;
-
-        for (auto &x : input) {
-            output.push_back(sigmoid(x * w + b));
-
-            auto d_s = d_sigmoid(x * w + b);
-
-            auto p_d_w = x * d_s;
-            auto p_d_b = d_s;
-
-            output.push_back(sigmoid(x * w + b));
-            d_output.push_back({p_d_w, p_d_b});
-        }
-
-        for (int i = 0; i < output.size(); ++i) {
-            sumdiff += pred[i] - output[i];
-            sse += serr(output[i], pred[i]);
-            d_w += d_serr(output[i], pred[i]) * d_output[i].first;
-            d_b += d_serr(output[i], pred[i]) * d_output[i].second;
-        }
-
-        std::cerr << alpha * d_w << " " << sumdiff << std::endl;
-        std::cerr << alpha * d_b << " " << sumdiff << std::endl;
-
-        w -= alpha * d_w;
-        b -= alpha * d_b;
-
-        std::cout << sse << std::endl;
+    auto start = std::chrono::high_resolution_clock::now();
+
+    TraceReader trace;
+    if (!trace.open(traceFile))
+        return 1;
+
+    // the batches after the population, the last holdout of them are kept out of training to check the model on
+    size_t firstBatch = population ? 0 : trace.getPopulationBatches();
+    size_t trainBatches = (size_t) ((trace.getBatches() - firstBatch) * (1 - holdout));
+    size_t begin = trace.firstRecord(firstBatch);
+    size_t split = trace.firstRecord(firstBatch + trainBatches);
+    size_t end = trace.getRecords();
+
+    trace_counts_t train = countTrace(trace, begin, split, buckets, nthreads, true);
+    bucket_plan_t plan = planBuckets(train.freq, train.distinct, capacity);
+    double bound = perKeyHitRate(train.perKey, train.accesses, capacity);
+
+    double heldOut = -1;
+    size_t heldOutAccesses = 0;
+    if (split < end) {
+        trace_counts_t test = countTrace(trace, split, end, buckets, nthreads, false);
+        heldOut = predictHitRate(test.freq, *plan.buckets);
+        heldOutAccesses = test.accesses;
     }
+
+    model_file_header_t info{};
+    info.cached = plan.cached;
+    info.keys = plan.keys;
+    info.budget = capacity;
+    info.hitRate = plan.hitRate;
+    info.accesses = train.accesses;
+    if (!writeModelFile(modelFile, *plan.buckets, info))
+        return 1;
+
+    std::chrono::duration<double> dur = std::chrono::high_resolution_clock::now() - start;
+
+    std::cout << "TABLE: Model Training" << std::endl;
+    std::cout << "Accesses\tKeys\tBuckets\tCached Buckets\tCached Keys\tHit Rate\tPer Key Hit Rate\t"
+                 "Held Out Accesses\tHeld Out Hit Rate\tTime (s)" << std::endl;
+    std::cout << train.accesses << "\t" << train.perKey.size() << "\t" << buckets << "\t" << plan.cached << "\t"
+              << plan.keys << "\t" << plan.hitRate << "\t" << bound << "\t" << heldOutAccesses << "\t" << heldOut
+              << "\t" << dur.count() << std::endl;
+    std::cout << std::endl;
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,321 @@
+/*
+ * Copyright (c) 2020-2021 dePaul Miller (dsm220@lehigh.edu)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <LatencyHistogram.cuh>
+#include "NetProtocol.cuh"
+#include "ShmRing.cuh"
+
+/*
+ * Closed loop load generator for the kvcg network and shared memory front-ends. Every connection has its own thread
+ * and keeps depth requests pipelined, a new request goes out for every response.
+ */
+
+struct LoadConf {
+    std::string host = "127.0.0.1";
+    int port = 7070;
+    std::string unixSocket = "";
+    std::string shmName = "";
+    int connections = 4;
+    int depth = 64;
+    double seconds = 10;
+    int readRatio = 95;
+    unsigned long long keys = 10000;
+    int valueSize = 8;
+};
+
+struct ConnStats {
+    ConnStats() : sent(0), received(0), notFound(0), errors(0) {}
+
+    LatencyHistogram latency;
+    size_t sent;
+    size_t received;
+    size_t notFound;
+    size_t errors;
+};
+
+void usage(char *command);
+
+/**
+ * Picks request id, keys are uniform in [1, keys]
+ */
+net_request_t pickRequest(const LoadConf &conf, unsigned *seed, uint64_t id) {
+    net_request_t req{};
+    req.id = id;
+    req.key = rand_r(seed) % conf.keys + 1;
+    if ((int) (rand_r(seed) % 100) < conf.readRatio) {
+        req.op = NET_OP_GET;
+    } else if (rand_r(seed) % 2 == 0) {
+        req.op = NET_OP_INSERT;
+        req.valueLength = conf.valueSize;
+    } else {
+        req.op = NET_OP_REMOVE;
+    }
+    return req;
+}
+
+/**
+ * Appends request id to out
+ */
+void makeRequest(const LoadConf &conf, unsigned *seed, uint64_t id, std::vector<char> &out) {
+    net_request_t req = pickRequest(conf, seed, id);
+    const char *h = reinterpret_cast<const char *>(&req);
+    out.insert(out.end(), h, h + sizeof(req));
+    out.resize(out.size() + req.valueLength, 'v');
+}
+
+bool writeAll(int fd, const std::vector<char> &buf) {
+    size_t done = 0;
+    while (done < buf.size()) {
+        ssize_t w = write(fd, buf.data() + done, buf.size() - done);
+        if (w < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        done += w;
+    }
+    return true;
+}
+
+void runConnection(const LoadConf &conf, int fd, unsigned seed, std::chrono::steady_clock::time_point end,
+                   ConnStats &stats) {
+    std::vector<uint64_t> sentAt(conf.depth);
+    std::vector<char> out;
+    std::vector<char> in;
+    size_t inStart = 0;
+    uint64_t next = 0;
+
+    for (int i = 0; i < conf.depth; ++i) {
+        sentAt[next % conf.depth] = tsc_clock_t::now();
+        makeRequest(conf, &seed, next++, out);
+    }
+    if (!writeAll(fd, out))
+        return;
+    stats.sent += conf.depth;
+
+    bool sending = true;
+    while (stats.received < stats.sent) {
+        size_t at = in.size();
+        in.resize(at + 64 * 1024);
+        ssize_t r = read(fd, in.data() + at, 64 * 1024);
+        if (r <= 0) {
+            std::cerr << "Connection closed by the server" << std::endl;
+            return;
+        }
+        in.resize(at + r);
+
+        uint64_t now = tsc_clock_t::now();
+        if (sending && std::chrono::steady_clock::now() >= end)
+            sending = false;
+        out.clear();
+        while (in.size() - inStart >= sizeof(net_response_t)) {
+            net_response_t resp;
+            memcpy(&resp, in.data() + inStart, sizeof(resp));
+            if (in.size() - inStart < sizeof(resp) + resp.valueLength)
+                break;
+            inStart += sizeof(resp) + resp.valueLength;
+            stats.received++;
+            stats.latency.record(now - sentAt[resp.id % conf.depth]);
+            if (resp.status == NET_NOT_FOUND)
+                stats.notFound++;
+            else if (resp.status != NET_OK)
+                stats.errors++;
+            if (sending) {
+                sentAt[next % conf.depth] = tsc_clock_t::now();
+                makeRequest(conf, &seed, next++, out);
+                stats.sent++;
+            }
+        }
+        in.erase(in.begin(), in.begin() + inStart);
+        inStart = 0;
+        if (!out.empty() && !writeAll(fd, out))
+            return;
+    }
+}
+
+void runRing(const LoadConf &conf, ShmClient &ring, unsigned seed, std::chrono::steady_clock::time_point end,
+             ConnStats &stats) {
+    std::vector<uint64_t> sentAt(conf.depth);
+    std::vector<char> value(conf.valueSize, 'v');
+    uint64_t next = 0;
+
+    auto send = [&]() {
+        net_request_t req = pickRequest(conf, &seed, next);
+        sentAt[next % conf.depth] = tsc_clock_t::now();
+        if (!ring.send(req.op, req.key, next, value.data(), req.valueLength))
+            return false;
+        next++;
+        stats.sent++;
+        return true;
+    };
+
+    for (int i = 0; i < conf.depth; ++i) {
+        if (!send()) {
+            std::cerr << "Pipeline depth is larger than the ring" << std::endl;
+            return;
+        }
+    }
+    ring.publish();
+
+    bool sending = true;
+    while (stats.received < stats.sent) {
+        ring.wait();
+        uint64_t now = tsc_clock_t::now();
+        if (sending && std::chrono::steady_clock::now() >= end)
+            sending = false;
+        size_t answered = ring.poll([&](const net_response_t &resp, const char *) {
+            stats.received++;
+            stats.latency.record(now - sentAt[resp.id % conf.depth]);
+            if (resp.status == NET_NOT_FOUND)
+                stats.notFound++;
+            else if (resp.status != NET_OK)
+                stats.errors++;
+        });
+        for (size_t i = 0; sending && i < answered; ++i) {
+            send();
+        }
+        if (sending && answered > 0)
+            ring.publish();
+    }
+}
+
+int main(int argc, char **argv) {
+    LoadConf conf;
+
+    int c;
+    while ((c = getopt(argc, argv, "h:p:u:s:c:d:t:r:k:v:")) != -1) {
+        switch (c) {
+            case 'h':
+                conf.host = optarg;
+                break;
+            case 'p':
+                conf.port = atoi(optarg);
+                break;
+            case 'u':
+                conf.unixSocket = optarg;
+                break;
+            case 's':
+                conf.shmName = optarg;
+                break;
+            case 'c':
+                conf.connections = atoi(optarg);
+                break;
+            case 'd':
+                conf.depth = atoi(optarg);
+                break;
+            case 't':
+                conf.seconds = atof(optarg);
+                break;
+            case 'r':
+                conf.readRatio = atoi(optarg);
+                break;
+            case 'k':
+                conf.keys = strtoull(optarg, nullptr, 10);
+                break;
+            case 'v':
+                conf.valueSize = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    std::vector<int> fds;
+    std::vector<std::unique_ptr<ShmClient>> rings;
+    for (int i = 0; i < conf.connections; ++i) {
+        if (!conf.shmName.empty()) {
+            rings.emplace_back(new ShmClient());
+            if (!rings.back()->connect(conf.shmName)) {
+                std::cerr << "Cannot attach to " << conf.shmName << ": " << strerror(errno) << std::endl;
+                return 1;
+            }
+            continue;
+        }
+        int fd = net_connect(conf.host, conf.port, conf.unixSocket);
+        if (fd < 0) {
+            std::cerr << "Cannot connect: " << strerror(errno) << std::endl;
+            return 1;
+        }
+        fds.push_back(fd);
+    }
+
+    std::vector<std::unique_ptr<ConnStats>> stats;
+    std::vector<std::thread> threads;
+    auto start = std::chrono::steady_clock::now();
+    auto end = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>(conf.seconds));
+    for (int i = 0; i < conf.connections; ++i) {
+        stats.emplace_back(new ConnStats());
+        if (!rings.empty()) {
+            threads.push_back(std::thread(runRing, std::cref(conf), std::ref(*rings[i]), (unsigned) (time(nullptr) + i),
+                                          end, std::ref(*stats.back())));
+        } else {
+            threads.push_back(std::thread(runConnection, std::cref(conf), fds[i], (unsigned) (time(nullptr) + i),
+                                          end, std::ref(*stats.back())));
+        }
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+    std::chrono::duration<double> dur = std::chrono::steady_clock::now() - start;
+    for (int fd : fds) {
+        close(fd);
+    }
+    rings.clear();
+
+    LatencyHistogram all;
+    size_t received = 0;
+    size_t notFound = 0;
+    size_t errors = 0;
+    for (auto &s : stats) {
+        all.merge(s->latency);
+        received += s->received;
+        notFound += s->notFound;
+        errors += s->errors;
+    }
+    double us = tsc_clock_t::nsPerTick() / 1e3;
+
+    std::cout << "TABLE: Load Generator" << std::endl;
+    std::cout << "Connections\tDepth\tRequests\tNot found\tErrors\tThroughput (Mops)\tMean (us)\tp50 (us)\tp99 (us)"
+                 "\tp999 (us)\tMax (us)" << std::endl;
+    std::cout << conf.connections << "\t" << conf.depth << "\t" << received << "\t" << notFound << "\t" << errors
+              << "\t" << received / dur.count() / 1e6 << "\t"
+              << (all.total ? (double) all.sum / all.total * us : 0.0) << "\t" << all.percentile(50) * us << "\t"
+              << all.percentile(99) * us << "\t" << all.percentile(99.9) * us << "\t" << all.max * us << std::endl;
+    return 0;
+}
+
+void usage(char *command) {
+    using namespace std;
+    cout << command << " [-h <host>] [-p <port>] [-u <unix socket>] [-s <shared memory>] [-c <connections>]"
+                       " [-d <pipeline depth>]"
+                       " [-t <seconds>] [-r <read %>] [-k <keys>] [-v <value bytes>]" << std::endl;
+}
@@ -123,6 +123,8 @@ int main(int argc, char **argv) {
     initWorkloadFile = (void (*)(std::string)) dlsym(handler, "initWorkloadFile");
     generateWorkloadBatch = (std::shared_ptr<megakv::BatchOfRequests>(*)(unsigned *, unsigned)) dlsym(handler,
                                                                                                       "generateWorkloadBatch");
+    // workloads that seed a stream per thread take the index of the generating thread from here
+    void (*setWorkloadThread)(int, int) = (void (*)(int, int)) dlsym(handler, "setWorkloadThread");
     if (workloadFilenameSet) {
         initWorkloadFile(workloadFilename);
     } else {
@@ -147,7 +149,9 @@ int main(int argc, char **argv) {
     const int clients = 32;
     std::vector<std::thread> threads;
     for (int i = 0; i < clients; i++) {
-        threads.push_back(std::thread([&]() {
+        threads.push_back(std::thread([&, i]() {
+            if (setWorkloadThread)
+                setWorkloadThread(i, clients);
             unsigned s = time(nullptr);
             for (int j = 0; j < batches / clients; j++) {
                 q->push(std::move(generateWorkloadBatch(&s, megakv::THREADS_PER_BLOCK)));
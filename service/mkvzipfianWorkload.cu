@@ -26,14 +26,12 @@
 #include <atomic>
 #include <Request.cuh>
 #include <vector>
-#include <zipf.hh>
+#include "ZipfSampler.cuh"
 #include <boost/property_tree/ptree.hpp>
 #include <boost/property_tree/json_parser.hpp>
 
 namespace pt = boost::property_tree;
 
-double zetaN = 0.1;
-
 struct ZipfianWorkloadConfig {
     ZipfianWorkloadConfig() {
         theta = 0.99;
@@ -41,42 +39,64 @@ struct ZipfianWorkloadConfig {
         //n = 1000000;
         keysize = 8;
         ratio = 100;
+        seed = 0;
     }
 
     ZipfianWorkloadConfig(std::string filename) {
         pt::ptree root;
         pt::read_json(filename, root);
         theta = root.get<double>("theta");
-        range = root.get<int>("range");
+        range = root.get<unsigned long long>("range");
         //n = root.get<int>("n");
         keysize = root.get<size_t>("keysize");
         ratio = root.get<int>("ratio");
+        seed = root.get<unsigned long long>("seed", 0);
     }
 
 
     ~ZipfianWorkloadConfig() {}
 
     double theta;
-    int range;
+    unsigned long long range;
     //int n;
     size_t keysize;
     int ratio;
+    /// seeds every thread from this instead of the seed the server passes when not 0
+    unsigned long long seed;
 };
 
 ZipfianWorkloadConfig zipfianWorkloadConfig;
+ZipfDistribution zipf;
+
+/**
+ * The seed of the workload, the config seed or the seed the server passed when the config has none
+ * @param seed
+ * @return
+ */
+uint64_t workloadSeed(const unsigned *seed) {
+    return zipfianWorkloadConfig.seed != 0 ? zipfianWorkloadConfig.seed : *seed;
+}
+
+/**
+ * Names the calling thread before it generates its first batch
+ * @param thread index of the thread, from 0
+ * @param threads threads that generate batches
+ */
+extern "C" void setWorkloadThread(int thread, int threads) {
+    nameWorkloadThread(thread);
+}
 
 extern "C" void initWorkload() {
-    zetaN = betterstd::zeta(zipfianWorkloadConfig.theta, zipfianWorkloadConfig.range);
+    zipf = ZipfDistribution(zipfianWorkloadConfig.range, zipfianWorkloadConfig.theta);
 }
 
 extern "C" void initWorkloadFile(std::string filename) {
     zipfianWorkloadConfig = ZipfianWorkloadConfig(filename);
-    zetaN = betterstd::zeta(zipfianWorkloadConfig.theta, zipfianWorkloadConfig.range);
+    zipf = ZipfDistribution(zipfianWorkloadConfig.range, zipfianWorkloadConfig.theta);
 }
 
 std::shared_ptr<megakv::BatchOfRequests>
-generateWorkloadZipfLargeKey(size_t keySize, unsigned size, double theta, int n, double zetaN, unsigned *seed,
-                             int ratioOfReads) {
+generateWorkloadZipfLargeKey(size_t keySize, unsigned size, unsigned *seed, int ratioOfReads) {
 
     std::shared_ptr<megakv::BatchOfRequests> batch = std::make_shared<megakv::BatchOfRequests>();
 
@@ -85,18 +105,22 @@ generateWorkloadZipfLargeKey(size_t keySize, unsigned size, double theta, int n,
         longValue += 'a';
     }
 
+    zipf_rng_t &rng = threadRng(workloadSeed(seed));
+    std::vector<uint64_t> keys(size);
+    zipf.fill(rng, keys.data(), size);
+
     for (int i = 0; i < size; i++) {
-        if (rand_r(seed) % 100 < ratioOfReads) {
-            batch->reqs[i].key = std::to_string(betterstd::rand_zipf_r(seed, n, zetaN, theta));
+        if ((int) rng.below(100) < ratioOfReads) {
+            batch->reqs[i].key = std::to_string(keys[i]);
             batch->reqs[i].value = "";
             batch->reqs[i].requestInt = megakv::REQUEST_GET;
         } else {
-            if (rand_r(seed) % 100 < 50) {
-                batch->reqs[i].key = std::to_string(betterstd::rand_zipf_r(seed, n, zetaN, theta));
+            if (rng.below(100) < 50) {
+                batch->reqs[i].key = std::to_string(keys[i]);
                 batch->reqs[i].value = longValue;
                 batch->reqs[i].requestInt = megakv::REQUEST_INSERT;
             } else {
-                batch->reqs[i].key = std::to_string(betterstd::rand_zipf_r(seed, n, zetaN, theta));
+                batch->reqs[i].key = std::to_string(keys[i]);
                 batch->reqs[i].value = "";
                 batch->reqs[i].requestInt = megakv::REQUEST_REMOVE;
             }
@@ -108,6 +132,5 @@ generateWorkloadZipfLargeKey(size_t keySize, unsigned size, double theta, int n,
 }
 
 extern "C" std::shared_ptr<megakv::BatchOfRequests> generateWorkloadBatch(unsigned int *seed, unsigned batchsize) {
-    return generateWorkloadZipfLargeKey(zipfianWorkloadConfig.keysize, batchsize, zipfianWorkloadConfig.theta,
-                                        zipfianWorkloadConfig.range, zetaN, seed, zipfianWorkloadConfig.ratio);
+    return generateWorkloadZipfLargeKey(zipfianWorkloadConfig.keysize, batchsize, seed, zipfianWorkloadConfig.ratio);
 }
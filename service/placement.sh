@@ -0,0 +1,38 @@
+#!/bin/bash
+# Runs a config several times without pinning and with auto placement and prints the mean throughput and its run to
+# run spread for both.
+# usage: placement.sh <kvcg> <config> [runs] [workload library]
+
+if [ $# -lt 2 ]; then
+    echo "usage: $0 <kvcg> <config> [runs] [workload library]"
+    exit 1
+fi
+
+KVCG=$1
+CONFIG=$2
+RUNS=${3:-5}
+LIB=${4:-./libzipfianWorkload.so}
+RUN_CONFIG=$(mktemp --suffix=.json)
+trap 'rm -f "$RUN_CONFIG"' EXIT
+
+echo "TABLE: Placement Variance"
+echo -e "Placement\tRuns\tMean (Mops)\tStddev (Mops)\tCV (%)\tMin (Mops)\tMax (Mops)"
+for placement in none auto; do
+    python3 - "$CONFIG" "$RUN_CONFIG" "$placement" <<'PY'
+import json, sys
+conf = json.load(open(sys.argv[1]))
+conf["placement"] = sys.argv[3]
+json.dump(conf, open(sys.argv[2], "w"), indent=4)
+PY
+    for run in $(seq "$RUNS"); do
+        "$KVCG" -f "$RUN_CONFIG" -l "$LIB" 2>/dev/null | awk '/^TABLE: Throughput/ { getline; getline; print; exit }'
+    done | awk -v p=$placement '
+        { x[NR] = $1; sum += $1; if (NR == 1 || $1 < min) min = $1; if (NR == 1 || $1 > max) max = $1 }
+        END {
+            if (NR == 0) { print p "\t0"; exit }
+            mean = sum / NR
+            for (i = 1; i <= NR; i++) var += (x[i] - mean) ^ 2
+            sd = NR > 1 ? sqrt(var / (NR - 1)) : 0
+            printf "%s\t%d\t%g\t%g\t%.2f\t%g\t%g\n", p, NR, mean, sd, 100 * sd / mean, min, max
+        }'
+done
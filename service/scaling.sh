@@ -0,0 +1,32 @@
+#!/bin/bash
+# Runs kvcg with 1 to max worker threads, in the shared and the partitioned mode, and prints the throughput of every
+# run as a table.
+# usage: scaling.sh <kvcg> <config> [max threads] [workload library]
+
+if [ $# -lt 2 ]; then
+    echo "usage: $0 <kvcg> <config> [max threads] [workload library]"
+    exit 1
+fi
+
+KVCG=$1
+CONFIG=$2
+MAX=${3:-$(nproc)}
+LIB=${4:-./libzipfianWorkload.so}
+RUN_CONFIG=$(mktemp --suffix=.json)
+trap 'rm -f "$RUN_CONFIG"' EXIT
+
+echo "TABLE: Scaling"
+echo -e "Mode\tThreads\tThroughput (Mops)"
+for mode in shared partitioned; do
+    for ((t = 1; t <= MAX; t++)); do
+        python3 - "$CONFIG" "$RUN_CONFIG" "$t" "$mode" <<'PY'
+import json, sys
+conf = json.load(open(sys.argv[1]))
+conf["threads"] = int(sys.argv[3])
+conf["partitioned"] = sys.argv[4] == "partitioned"
+json.dump(conf, open(sys.argv[2], "w"), indent=4)
+PY
+        mops=$("$KVCG" -f "$RUN_CONFIG" -l "$LIB" 2>/dev/null | awk '/^TABLE: Throughput/ { getline; getline; print; exit }')
+        echo -e "$mode\t$t\t${mops:-failed}"
+    done
+done
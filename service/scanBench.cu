@@ -0,0 +1,142 @@
+/*
+ * Copyright (c) 2020-2021 dePaul Miller (dsm220@lehigh.edu)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+
+#include <kvcg.cuh>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+#include <unistd.h>
+
+/*
+ * Times range scans from the ordered index against emulating them with point GETs, for scan lengths from 10 to 10^4.
+ * Keys 1 to n with gap between them are loaded, the emulation GETs every key the range could hold since without the
+ * index it cannot know which ones exist.
+ */
+
+using K = unsigned long long;
+using Model = kvgpu::BucketModel<K>;
+using Client = KVStoreClient<K, data_t, Model>;
+using RW = RequestWrapper<K, data_t *>;
+
+void usage(char *command) {
+    std::cerr << command << ": [-n keys] [-g gap between keys] [-r scans per length] [-s value size]" << std::endl;
+}
+
+/// GETs every key in [lo, hi) in batches, waits for the answers and frees the values found
+size_t pointGets(Client &client, K lo, K hi) {
+    size_t found = 0;
+    size_t chunk = THREADS_PER_BLOCK * BLOCKS;
+    for (K begin = lo; begin < hi; begin += chunk) {
+        size_t count = std::min<K>(chunk, hi - begin);
+        std::vector<RW> req_vector((count + 511) / 512 * 512, {K(), nullptr, REQUEST_EMPTY});
+        for (size_t i = 0; i < count; ++i) {
+            req_vector[i] = {begin + i, nullptr, REQUEST_GET};
+        }
+        auto rb = std::make_shared<ResultsBuffers<data_t>>(req_vector.size());
+        client.batch(req_vector, rb);
+        for (size_t slot = 0; slot < count; ++slot) {
+            while (rb->requestIDs[slot] == -1)
+                std::this_thread::yield();
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (rb->resultValues[slot] != nullptr)
+                found++;
+        }
+    }
+    return found;
+}
+
+int main(int argc, char **argv) {
+    size_t n = 1000000;
+    K gap = 1;
+    int repeat = 20;
+    size_t valueSize = 8;
+
+    int c;
+    while ((c = getopt(argc, argv, "n:g:r:s:")) != -1) {
+        switch (c) {
+            case 'n':
+                n = strtoull(optarg, nullptr, 10);
+                break;
+            case 'g':
+                gap = std::max(1ULL, strtoull(optarg, nullptr, 10));
+                break;
+            case 'r':
+                repeat = atoi(optarg);
+                break;
+            case 's':
+                valueSize = strtoull(optarg, nullptr, 10);
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    ORDERED_INDEX = true;
+    KVStoreCtx<K, data_t, Model> ctx;
+    Client client(ctx);
+
+    std::vector<K> keys(n);
+    std::vector<data_t *> values(n);
+    for (size_t i = 0; i < n; ++i) {
+        keys[i] = 1 + i * gap;
+        values[i] = new data_t(valueSize);
+    }
+    client.bulkLoad(keys.data(), values.data(), n);
+
+    using clock = std::chrono::steady_clock;
+    unsigned seed = 1;
+    size_t checksum = 0;
+
+    std::cout << "TABLE: Scan" << std::endl;
+    std::cout << "Length\tScan (us)\tPoint GETs (us)\tScan (Mkeys/s)\tPoint GETs (Mkeys/s)\tSpeedup" << std::endl;
+    for (size_t length = 10; length <= 10000 && length <= n; length *= 10) {
+        double scanTime = 0;
+        double pointTime = 0;
+        for (int r = 0; r < repeat; ++r) {
+            K lo = 1 + (rand_r(&seed) % (n - length + 1)) * gap;
+            K hi = lo + length * gap;
+
+            std::vector<std::pair<K, data_t *>> out;
+            auto start = clock::now();
+            checksum += client.scan(lo, hi, length, out);
+            scanTime += std::chrono::duration<double, std::micro>(clock::now() - start).count();
+            for (auto &p : out) {
+                delete p.second;
+            }
+
+            start = clock::now();
+            checksum += pointGets(client, lo, hi);
+            pointTime += std::chrono::duration<double, std::micro>(clock::now() - start).count();
+        }
+        scanTime /= repeat;
+        pointTime /= repeat;
+        std::cout << length << "\t" << scanTime << "\t" << pointTime << "\t" << length / scanTime << "\t"
+                  << length / pointTime << "\t" << pointTime / scanTime << std::endl;
+    }
+    std::cout << std::endl;
+    std::cerr << checksum << std::endl;
+    return 0;
+}
@@ -22,20 +22,72 @@
 
 #include <unistd.h>
 #include "helper.cuh"
+#include "NetFrontend.cuh"
+#include "ShmFrontend.cuh"
+#include "WorkStealing.cuh"
+#include "OpenLoop.cuh"
+#include "Trace.cuh"
+#include "ModelAdaptation.cuh"
+#include "ModelFile.cuh"
+#include "ModelChange.cuh"
 #include <algorithm>
+#include <fstream>
 #include <boost/property_tree/ptree.hpp>
 #include <boost/property_tree/json_parser.hpp>
 #include <dlfcn.h>
+#include <csignal>
+#include <sys/resource.h>
 
 namespace pt = boost::property_tree;
 using BatchWrapper = std::vector<RequestWrapper<unsigned long long, data_t *>>;
+using Model = kvgpu::BucketModel<unsigned long long>;
+using Client = KVStoreClient<unsigned long long, data_t, Model>;
+using Shards = KVStoreShards<unsigned long long, data_t, Model>;
 
 int totalBatches = 10000;
 int BATCHSIZE = 512;
-int NUM_THREADS = std::thread::hardware_concurrency() - 4;
+int NUM_THREADS = std::max<int>(1, (int) std::thread::hardware_concurrency() - 4);
+/// workload threads generating batches
+int CLIENT_THREADS = 8;
+/// the newest workload phase whose first batch the store answered
+std::atomic_int answeredPhase{0};
 
 void usage(char *command);
 
+void writeLatencies(const std::string &filename, const std::vector<LatencySummary> &latencies);
+
+struct ServerConf;
+
+int serveNetwork(Client &client, const ServerConf &sconf);
+
+int recordWorkload(const ServerConf &sconf, BatchWrapper (*generateWorkloadBatch)(unsigned int *, unsigned),
+                   std::vector<BatchWrapper> (*getPopulationBatches)(unsigned int *, unsigned));
+
+int runPartitioned(const ServerConf &sconf, const std::vector<PartitionedSlabUnifiedConfig> &conf,
+                   BatchWrapper (*generateWorkloadBatch)(unsigned int *, unsigned),
+                   std::vector<BatchWrapper> (*getPopulationBatches)(unsigned int *, unsigned),
+                   int (*getWorkloadPhase)(), void (*setWorkloadThread)(int, int));
+
+void printLatencies(const ServerConf &sconf);
+
+double cpuSeconds();
+
+void printCpu(const ServerConf &sconf, double load, double wall, double cpu);
+
+bool placeThreads(const ServerConf &sconf, int backends, int io);
+
+template<typename Store>
+bool bulkPopulate(Store &store, const std::vector<BatchWrapper> &pop);
+
+int getAnsweredPhase();
+
+void answerPhase(const BatchWrapper &batch, const std::shared_ptr<ResultsBuffers<data_t>> &rb, int phase);
+
+template<typename Store>
+bool loadModel(Store &store, const std::string &filename);
+
+adapt_conf_t adaptConf(const ServerConf &sconf, size_t cacheCapacity);
+
 struct ServerConf {
     int threads;
     int gpus;
@@ -45,6 +97,59 @@ struct ServerConf {
     int size;
     int batchSize;
     bool cache;
+    int credits;
+    int changeModel;
+    bool orderedIndex;
+    std::string latencyFile;
+    std::string traceFile;
+    int traceInterval;
+    std::string chromeTraceFile;
+    std::string walFile;
+    int walCommitInterval;
+    bool recover;
+    std::string snapshotFile;
+    bool snapshot;
+    std::string spillFile;
+    int spillSegmentMB;
+    size_t spillBackendKeys;
+    int port;
+    std::string unixSocket;
+    int memcachedPort;
+    std::string shmName;
+    int shmClients;
+    int shmEntries;
+    int shmValueSize;
+    int shmWorkers;
+    int ioThreads;
+    int serveSeconds;
+    bool partitioned;
+    std::string dispatch;
+    int slowBatchPercent;
+    int slowBatchUs;
+    std::string idle;
+    int idleSpinUs;
+    int idlePauseUs;
+    int batchRate;
+    std::string placement;
+    std::string workerCpus;
+    std::string backendCpus;
+    std::string ioCpus;
+    std::string generatorCpus;
+    bool avoidSmt;
+    int numaNode;
+    std::string loadMode;
+    std::string arrival;
+    std::string recordFile;
+    bool bulkLoad;
+    std::string adapt;
+    int modelBuckets;
+    int reportMs;
+    int retrainMs;
+    int adaptSample;
+    double adaptDecay;
+    double adaptMargin;
+    unsigned long long cacheBudget;
+    double recoverFraction;
 
     ServerConf() {
         batchSize = BATCHSIZE;
@@ -55,6 +160,59 @@ struct ServerConf {
         size = 1000000;
         train = false;
         cache = true;
+        credits = CREDITS_PER_BACKEND;
+        changeModel = -1;
+        orderedIndex = false;
+        latencyFile = "";
+        traceFile = "";
+        traceInterval = 1000;
+        chromeTraceFile = "";
+        walFile = "";
+        walCommitInterval = WAL_COMMIT_INTERVAL_US;
+        recover = false;
+        snapshotFile = "";
+        snapshot = false;
+        spillFile = "";
+        spillSegmentMB = SPILL_SEGMENT_MB;
+        spillBackendKeys = SPILL_BACKEND_KEYS;
+        port = 0;
+        unixSocket = "";
+        memcachedPort = 0;
+        shmName = "";
+        shmClients = 16;
+        shmEntries = 1024;
+        shmValueSize = 1024;
+        shmWorkers = 2;
+        ioThreads = 4;
+        serveSeconds = 0;
+        partitioned = false;
+        dispatch = "stealing";
+        slowBatchPercent = 0;
+        slowBatchUs = 1000;
+        idle = "adaptive";
+        idleSpinUs = IDLE_SPIN_US;
+        idlePauseUs = IDLE_PAUSE_US;
+        batchRate = 0;
+        placement = "none";
+        workerCpus = "";
+        backendCpus = "";
+        ioCpus = "";
+        generatorCpus = "";
+        avoidSmt = true;
+        numaNode = -1;
+        loadMode = "closed";
+        arrival = "constant";
+        recordFile = "";
+        bulkLoad = true;
+        adapt = "off";
+        modelBuckets = 262144;
+        reportMs = 100;
+        retrainMs = 500;
+        adaptSample = 16;
+        adaptDecay = 0.5;
+        adaptMargin = 0.02;
+        cacheBudget = 0;
+        recoverFraction = 0.9;
     }
 
     ServerConf(std::string filename) {
@@ -68,6 +226,59 @@ struct ServerConf {
         size = root.get<int>("size", 1000000);
         batchSize = root.get<int>("batchSize", BATCHSIZE);
         cache = root.get<bool>("cache", true);
+        credits = root.get<int>("credits", CREDITS_PER_BACKEND);
+        changeModel = root.get<int>("changeModel", -1);
+        orderedIndex = root.get<bool>("orderedIndex", false);
+        latencyFile = root.get<std::string>("latencyFile", "");
+        traceFile = root.get<std::string>("traceFile", "");
+        traceInterval = root.get<int>("traceInterval", 1000);
+        chromeTraceFile = root.get<std::string>("chromeTraceFile", "");
+        walFile = root.get<std::string>("walFile", "");
+        walCommitInterval = root.get<int>("walCommitInterval", WAL_COMMIT_INTERVAL_US);
+        recover = root.get<bool>("recover", false);
+        snapshotFile = root.get<std::string>("snapshotFile", "");
+        snapshot = root.get<bool>("snapshot", false);
+        spillFile = root.get<std::string>("spillFile", "");
+        spillSegmentMB = root.get<int>("spillSegmentMB", SPILL_SEGMENT_MB);
+        spillBackendKeys = root.get<size_t>("spillBackendKeys", SPILL_BACKEND_KEYS);
+        port = root.get<int>("port", 0);
+        unixSocket = root.get<std::string>("unixSocket", "");
+        memcachedPort = root.get<int>("memcachedPort", 0);
+        shmName = root.get<std::string>("shmName", "");
+        shmClients = root.get<int>("shmClients", 16);
+        shmEntries = root.get<int>("shmEntries", 1024);
+        shmValueSize = root.get<int>("shmValueSize", 1024);
+        shmWorkers = root.get<int>("shmWorkers", 2);
+        ioThreads = root.get<int>("ioThreads", 4);
+        serveSeconds = root.get<int>("serveSeconds", 0);
+        partitioned = root.get<bool>("partitioned", false);
+        dispatch = root.get<std::string>("dispatch", "stealing");
+        slowBatchPercent = root.get<int>("slowBatchPercent", 0);
+        slowBatchUs = root.get<int>("slowBatchUs", 1000);
+        idle = root.get<std::string>("idle", "adaptive");
+        idleSpinUs = root.get<int>("idleSpinUs", IDLE_SPIN_US);
+        idlePauseUs = root.get<int>("idlePauseUs", IDLE_PAUSE_US);
+        batchRate = root.get<int>("batchRate", 0);
+        placement = root.get<std::string>("placement", "none");
+        workerCpus = root.get<std::string>("workerCpus", "");
+        backendCpus = root.get<std::string>("backendCpus", "");
+        ioCpus = root.get<std::string>("ioCpus", "");
+        generatorCpus = root.get<std::string>("generatorCpus", "");
+        avoidSmt = root.get<bool>("avoidSmt", true);
+        numaNode = root.get<int>("numaNode", -1);
+        loadMode = root.get<std::string>("loadMode", "closed");
+        arrival = root.get<std::string>("arrival", "constant");
+        recordFile = root.get<std::string>("recordFile", "");
+        bulkLoad = root.get<bool>("bulkLoad", true);
+        adapt = root.get<std::string>("adapt", "off");
+        modelBuckets = root.get<int>("modelBuckets", 262144);
+        reportMs = root.get<int>("reportMs", 100);
+        retrainMs = root.get<int>("retrainMs", 500);
+        adaptSample = root.get<int>("adaptSample", 16);
+        adaptDecay = root.get<double>("adaptDecay", 0.5);
+        adaptMargin = root.get<double>("adaptMargin", 0.02);
+        cacheBudget = root.get<unsigned long long>("cacheBudget", 0);
+        recoverFraction = root.get<double>("recoverFraction", 0.9);
     }
 
     void persist(std::string filename) {
@@ -80,6 +291,59 @@ struct ServerConf {
         root.put("size", size);
         root.put("batchSize", batchSize);
         root.put("cache", cache);
+        root.put("credits", credits);
+        root.put("changeModel", changeModel);
+        root.put("orderedIndex", orderedIndex);
+        root.put("latencyFile", latencyFile);
+        root.put("traceFile", traceFile);
+        root.put("traceInterval", traceInterval);
+        root.put("chromeTraceFile", chromeTraceFile);
+        root.put("walFile", walFile);
+        root.put("walCommitInterval", walCommitInterval);
+        root.put("recover", recover);
+        root.put("snapshotFile", snapshotFile);
+        root.put("snapshot", snapshot);
+        root.put("spillFile", spillFile);
+        root.put("spillSegmentMB", spillSegmentMB);
+        root.put("spillBackendKeys", spillBackendKeys);
+        root.put("port", port);
+        root.put("unixSocket", unixSocket);
+        root.put("memcachedPort", memcachedPort);
+        root.put("shmName", shmName);
+        root.put("shmClients", shmClients);
+        root.put("shmEntries", shmEntries);
+        root.put("shmValueSize", shmValueSize);
+        root.put("shmWorkers", shmWorkers);
+        root.put("ioThreads", ioThreads);
+        root.put("serveSeconds", serveSeconds);
+        root.put("partitioned", partitioned);
+        root.put("dispatch", dispatch);
+        root.put("slowBatchPercent", slowBatchPercent);
+        root.put("slowBatchUs", slowBatchUs);
+        root.put("idle", idle);
+        root.put("idleSpinUs", idleSpinUs);
+        root.put("idlePauseUs", idlePauseUs);
+        root.put("batchRate", batchRate);
+        root.put("placement", placement);
+        root.put("workerCpus", workerCpus);
+        root.put("backendCpus", backendCpus);
+        root.put("ioCpus", ioCpus);
+        root.put("generatorCpus", generatorCpus);
+        root.put("avoidSmt", avoidSmt);
+        root.put("numaNode", numaNode);
+        root.put("loadMode", loadMode);
+        root.put("arrival", arrival);
+        root.put("recordFile", recordFile);
+        root.put("bulkLoad", bulkLoad);
+        root.put("adapt", adapt);
+        root.put("modelBuckets", modelBuckets);
+        root.put("reportMs", reportMs);
+        root.put("retrainMs", retrainMs);
+        root.put("adaptSample", adaptSample);
+        root.put("adaptDecay", adaptDecay);
+        root.put("adaptMargin", adaptMargin);
+        root.put("cacheBudget", cacheBudget);
+        root.put("recoverFraction", recoverFraction);
         pt::write_json(filename, root);
     }
 
@@ -133,6 +397,10 @@ int main(int argc, char **argv) {
     getBatchesToRun = (int (*)()) dlsym(handler, "getBatchesToRun");
     getPopulationBatches = (std::vector<BatchWrapper> (*)(unsigned int *, unsigned)) dlsym(handler,
                                                                                            "getPopulationBatches");
+    // only workloads whose distribution changes over time have phases
+    int (*getWorkloadPhase)() = (int (*)()) dlsym(handler, "getWorkloadPhase");
+    // workloads that seed a stream per thread take the index of the generating thread from here
+    void (*setWorkloadThread)(int, int) = (void (*)(int, int)) dlsym(handler, "setWorkloadThread");
 
     if (workloadFilenameSet) {
         initWorkloadFile(workloadFilename);
@@ -142,6 +410,14 @@ int main(int argc, char **argv) {
 
     totalBatches = getBatchesToRun();
 
+    // the workload is written to a trace instead of run, served traffic is recorded as it is served
+    bool serving = sconf.port > 0 || !sconf.unixSocket.empty() || sconf.memcachedPort > 0 || !sconf.shmName.empty();
+    if (!sconf.recordFile.empty() && !serving) {
+        int ret = recordWorkload(sconf, generateWorkloadBatch, getPopulationBatches);
+        dlclose(handler);
+        return ret;
+    }
+
     std::vector<PartitionedSlabUnifiedConfig> conf;
     for (int i = 0; i < sconf.gpus; i++) {
         for(int j = 0; j < sconf.streams; j++){
@@ -154,112 +430,268 @@ int main(int argc, char **argv) {
         }
     }
 
-    KVStoreCtx<unsigned long long, data_t, kvgpu::SimplModel<unsigned long long>> ctx(conf);
+    CREDITS_PER_BACKEND = sconf.credits;
+    // snapshots walk the keys in the ordered index
+    ORDERED_INDEX = sconf.orderedIndex || sconf.snapshot;
+    WAL_FILE = sconf.walFile;
+    WAL_COMMIT_INTERVAL_US = sconf.walCommitInterval;
+    SPILL_FILE = sconf.spillFile;
+    SPILL_SEGMENT_MB = sconf.spillSegmentMB;
+    SPILL_BACKEND_KEYS = sconf.spillBackendKeys;
+    // spin keeps every idle thread busy waiting
+    IDLE_PARK = sconf.idle != "spin";
+    IDLE_SPIN_US = sconf.idleSpinUs;
+    IDLE_PAUSE_US = sconf.idlePauseUs;
+
+    // a backend thread per slab, the shards deal the slabs out and split one between them when there are fewer
+    int backends = sconf.partitioned ? std::max((int) conf.size(), sconf.threads) : (int) conf.size();
+    int io = (sconf.port > 0 || !sconf.unixSocket.empty() || sconf.memcachedPort > 0 ? sconf.ioThreads : 0) +
+             (!sconf.shmName.empty() ? sconf.shmWorkers : 0);
+    if (!placeThreads(sconf, backends, io))
+        return 1;
 
-    KVStoreClient<unsigned long long, data_t, kvgpu::SimplModel<unsigned long long>> client(ctx);
+    if (sconf.adapt != "off" && sconf.adapt != "observe" && sconf.adapt != "retrain") {
+        std::cerr << "adapt is off, observe or retrain" << std::endl;
+        return 1;
+    }
 
-    unsigned popSeed = time(nullptr);
-    auto pop = getPopulationBatches(&popSeed, BATCHSIZE);
+    bool openLoop = sconf.loadMode == "open";
+    if (openLoop && sconf.batchRate <= 0) {
+        std::cerr << "An open loop needs a batchRate" << std::endl;
+        return 1;
+    }
 
-    for (auto &b : pop) {
-        bool retry;
-        int size = b.size();
-        do {
-            auto rb = std::make_shared<ResultsBuffers<data_t>>(sconf.batchSize);
-            std::vector<std::chrono::high_resolution_clock::time_point> rt;
-            rt.reserve(BATCHSIZE);
-            client.batch(b, rb, rt);
-
-
-            bool finished;
-
-            do {
-                finished = true;
-                for (int i = 0; i < size; i++) {
-                    if (rb->requestIDs[i] == -1) {
-                        finished = false;
-                        break;
+    if (sconf.partitioned) {
+        if (sconf.port > 0 || !sconf.unixSocket.empty() || sconf.memcachedPort > 0 || !sconf.shmName.empty()) {
+            std::cerr << "The partitioned mode only runs the workload" << std::endl;
+            return 1;
+        }
+        if (openLoop) {
+            std::cerr << "The partitioned mode only runs a closed loop" << std::endl;
+            return 1;
+        }
+        int ret = runPartitioned(sconf, conf, generateWorkloadBatch, getPopulationBatches, getWorkloadPhase,
+                                 setWorkloadThread);
+        dlclose(handler);
+        return ret;
+    }
+
+    KVStoreCtx<unsigned long long, data_t, Model> ctx(conf);
+
+    Client client(ctx);
+
+    if (!sconf.modelFile.empty() && !loadModel(client, sconf.modelFile)) {
+        dlclose(handler);
+        return 1;
+    }
+
+    size_t recovered = 0;
+    if (sconf.recover) {
+        auto recoverStart = std::chrono::high_resolution_clock::now();
+        recovered = client.recover(sconf.snapshotFile);
+        std::chrono::duration<double> recoverTime = std::chrono::high_resolution_clock::now() - recoverStart;
+        std::cerr << "Recovered writes\tRecovery (s)" << std::endl;
+        std::cerr << recovered << "\t" << recoverTime.count() << std::endl;
+        std::cerr << std::endl;
+    }
+
+    // a recovered store already holds its data, populating it again would overwrite the recovered values
+    if (recovered == 0) {
+        unsigned popSeed = time(nullptr);
+        auto pop = getPopulationBatches(&popSeed, BATCHSIZE);
+
+        if (!sconf.bulkLoad || !bulkPopulate(client, pop)) {
+            for (auto &b : pop) {
+                int size = b.size();
+                auto rb = std::make_shared<ResultsBuffers<data_t>>(std::max(sconf.batchSize, size));
+                client.batch(b, rb);
+
+                bool finished;
+
+                do {
+                    finished = true;
+                    for (int i = 0; i < size; i++) {
+                        if (rb->requestIDs[i] == -1) {
+                            finished = false;
+                            break;
+                        }
                     }
-                }
-            } while (!finished && !rb->retryGPU);
-            retry = rb->retryGPU;
-        } while (retry);
+                } while (!finished);
+            }
+        }
     }
 
     client.resetStats();
 
+    if (!sconf.traceFile.empty()) {
+        client.startTraceExport(sconf.traceFile, std::chrono::milliseconds(sconf.traceInterval));
+    }
+
+    // real clients drive the store instead of the workload library
+    if (sconf.port > 0 || !sconf.unixSocket.empty() || sconf.memcachedPort > 0 || !sconf.shmName.empty()) {
+        int ret = serveNetwork(client, sconf);
+        dlclose(handler);
+        return ret;
+    }
+
     std::vector<std::thread> threads;
-    tbb::concurrent_vector<std::pair<std::chrono::high_resolution_clock::time_point, std::vector<std::chrono::high_resolution_clock::time_point>>> times;
+    std::atomic_size_t batchesRun{0};
 
     using RB = std::shared_ptr<ResultsBuffers<data_t>>;
 
-    tbb::concurrent_queue<std::pair<BatchWrapper, RB>> *q = new tbb::concurrent_queue<std::pair<BatchWrapper, RB>>[sconf.threads];
+    /// a batch waiting for a worker, slow ones emulate batches that cost more to serve
+    struct dispatch_t {
+        BatchWrapper batch;
+        RB rb;
+        uint64_t enqueued;
+        bool slow;
+        /// the workload phase the batch was generated in
+        int phase;
+    };
+
+    // every workload thread feeds its own worker, which idle workers steal from, static dispatch deals the batches
+    // out round robin and never steals
+    bool stealing = sconf.dispatch != "static";
+    StealingQueues<dispatch_t> q(sconf.threads);
+    // idle workers park here, a push wakes its worker and, while batches back up, one more parked worker to steal
+    std::unique_ptr<parking_t[]> parking(new parking_t[sconf.threads]);
+    std::vector<std::unique_ptr<LatencyHistogram>> waits;
+    for (int i = 0; i < sconf.threads; ++i) {
+        waits.emplace_back(new LatencyHistogram());
+    }
 
     std::atomic_bool reclaim{false};
 
-    std::atomic_bool changing{false};
-
-    block_t *block = new block_t(sconf.threads);
-
     for (int i = 0; i < sconf.threads; ++i) {
-        threads.push_back(std::thread([&client, &times, &reclaim, &q, &changing, &block](int tid) {
-
-            std::vector<std::pair<std::chrono::high_resolution_clock::time_point, std::vector<std::chrono::high_resolution_clock::time_point>>> tmpTimes;
-
-            while (!reclaim) {
-
-                if (changing) {
-                    block->wait();
-                    while (changing);
+        threads.push_back(std::thread([&client, &batchesRun, &reclaim, &q, &waits, &parking, &sconf,
+                                              stealing](int tid) {
+            WORKER_CPUS.pin();
+            auto run = [&](dispatch_t &d) {
+                waits[tid]->record(tsc_clock_t::now() - d.enqueued);
+                client.batch(d.batch, d.rb);
+                answerPhase(d.batch, d.rb, d.phase);
+                if (d.slow) {
+                    auto until = std::chrono::steady_clock::now() + std::chrono::microseconds(sconf.slowBatchUs);
+                    while (std::chrono::steady_clock::now() < until);
                 }
-
-                std::pair<BatchWrapper, RB> p;
-                if (q[tid].try_pop(p)) {
-                    auto start = std::chrono::high_resolution_clock::now();
-                    std::vector<std::chrono::high_resolution_clock::time_point> rt;
-                    rt.reserve(BATCHSIZE);
-                    client.batch(p.first, p.second, rt);
-                    tmpTimes.push_back({start, rt});
+                batchesRun++;
+            };
+
+            auto ready = [&]() {
+                if (reclaim || q.size(tid) > 0)
+                    return true;
+                for (int i = 0; stealing && i < sconf.threads; ++i) {
+                    if (q.size(i) > 0)
+                        return true;
                 }
+                return false;
+            };
 
+            backoff_t backoff;
+            dispatch_t d;
+            while (!reclaim) {
+                if (q.pop(tid, d) || (stealing && q.steal(tid, d))) {
+                    backoff.reset();
+                    run(d);
+                } else {
+                    backoff.wait(parking[tid], ready);
+                }
             }
-
-            std::pair<BatchWrapper, RB> p;
-            while (q[tid].try_pop(p)) {
-                auto start = std::chrono::high_resolution_clock::now();
-                std::vector<std::chrono::high_resolution_clock::time_point> rt;
-                rt.reserve(BATCHSIZE);
-                client.batch(p.first, p.second, rt);
-                tmpTimes.push_back({start, rt});
-            }
-
-            for (auto &t : tmpTimes) {
-                times.push_back(t);
+            while (q.pop(tid, d) || q.steal(tid, d)) {
+                run(d);
             }
         }, i));
     }
+    // follows the hit rate over time and, with retrain, moves the cache placement along with the workload
+    std::unique_ptr<ModelAdapter<Client>> adapter;
+    if (sconf.adapt != "off") {
+        adapter.reset(new ModelAdapter<Client>(client, adaptConf(sconf, client.getCacheCapacity()),
+                                               getWorkloadPhase ? getAnsweredPhase : nullptr));
+        adapter->start();
+    }
+
     auto startTime = std::chrono::high_resolution_clock::now();
+    double startCpu = cpuSeconds();
+
+    // the throughput around a model change is sampled to show the dip it causes
+    ModelChangeMonitor<Client> changeMonitor(client, std::chrono::milliseconds(10));
+    if (sconf.changeModel >= 0)
+        changeMonitor.start();
+
+    std::future<size_t> snapshotTaken;
+    std::chrono::high_resolution_clock::time_point snapshotStart;
+    std::chrono::high_resolution_clock::time_point snapshotEnd;
+    size_t batchesBeforeSnapshot = 0;
+    size_t batchesDuringSnapshot = 0;
+
+    // an open loop sends on schedule whether or not earlier batches completed and times them from when they were due
+    std::unique_ptr<CompletionTracker<data_t>> tracker;
+    if (openLoop)
+        tracker.reset(new CompletionTracker<data_t>());
+    std::atomic<int64_t> maxSendLag{0};
 
     std::vector<std::thread> threads2;
-    int clients = 8;
+    int clients = CLIENT_THREADS;
     for (int j = 0; j < clients; j++) {
         threads2.push_back(std::thread(
-                [clients, &q, &sconf, generateWorkloadBatch](int tid) {
+                [clients, stealing, &q, &parking, &sconf, generateWorkloadBatch, getWorkloadPhase,
+                        setWorkloadThread, &client, &changeMonitor, &tracker, &maxSendLag, &adapter, &snapshotTaken,
+                        &snapshotStart, &snapshotEnd, &batchesRun, &batchesBeforeSnapshot,
+                        &batchesDuringSnapshot](int tid) {
+                    GENERATOR_CPUS.pin();
+                    if (setWorkloadThread)
+                        setWorkloadThread(tid, clients);
                     unsigned tseed = time(nullptr);
+                    arrivals_t arrivals(sconf.batchRate, clients, sconf.arrival == "poisson", tseed + tid);
+                    // slow batches are drawn apart from tseed so they leave the workload stream as it is
+                    unsigned slowSeed = tseed ^ (0x9E3779B9u * (tid + 1));
                     for (int i = 0; i < totalBatches / clients; i++) {
 
-                        /*if (tid == 0 && i == totalBatches / clients / 10) {
-                            std::cerr << "Changing\n";
-                            auto tmp = kvgpu::SimplModel<unsigned>(18000);
-                            changing = true;
-                            client.change_model(tmp, block);
-                            changing = false;
-                            std::cerr << "Changed\n";
-                        }*/
-                        std::pair<BatchWrapper, RB> p = {
-                                generateWorkloadBatch(&tseed, sconf.batchSize),
-                                std::make_shared<ResultsBuffers<data_t>>(sconf.batchSize)};
-                        q[(tid + i) % NUM_THREADS].push(std::move(p));
+                        if (sconf.changeModel >= 0 && tid == 0 && i == totalBatches / clients / 10) {
+                            auto tmp = Model(sconf.changeModel);
+                            changeMonitor.change(tmp);
+                        }
+                        if (sconf.snapshot && tid == 0 && i == totalBatches / clients / 10) {
+                            snapshotTaken = std::async(std::launch::async, [&]() {
+                                snapshotStart = std::chrono::high_resolution_clock::now();
+                                batchesBeforeSnapshot = batchesRun;
+                                size_t pairs = client.snapshot(sconf.snapshotFile);
+                                batchesDuringSnapshot = batchesRun - batchesBeforeSnapshot;
+                                snapshotEnd = std::chrono::high_resolution_clock::now();
+                                return pairs;
+                            });
+                        }
+                        BatchWrapper batch = generateWorkloadBatch(&tseed, sconf.batchSize);
+                        int phase = getWorkloadPhase ? getWorkloadPhase() : 0;
+                        if (adapter)
+                            adapter->observe(batch);
+                        int size = std::max<int>(sconf.batchSize, batch.size());
+                        dispatch_t d{std::move(batch), std::make_shared<ResultsBuffers<data_t>>(size), 0,
+                                     (int) (rand_r(&slowSeed) % 100) < sconf.slowBatchPercent, phase};
+                        auto due = arrivals.next();
+                        if (tracker) {
+                            // only the requests that are not REQUEST_EMPTY get an answer
+                            int requests = 0;
+                            for (auto &r : d.batch) {
+                                requests += r.requestInteger != REQUEST_EMPTY;
+                            }
+                            tracker->track(d.rb, requests, due);
+                            int64_t lag = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                    std::chrono::steady_clock::now() - due).count();
+                            int64_t seen = maxSendLag.load();
+                            while (lag > seen && !maxSendLag.compare_exchange_weak(seen, lag));
+                        }
+                        d.enqueued = tsc_clock_t::now();
+                        int worker = stealing ? tid % sconf.threads : (tid + i) % sconf.threads;
+                        size_t backlog = q.push(worker, std::move(d));
+                        parking[worker].wake();
+                        for (int k = 1; stealing && backlog > 1 && k < sconf.threads; ++k) {
+                            parking_t &p = parking[(worker + k) % sconf.threads];
+                            if (p.hasParked()) {
+                                p.wake();
+                                break;
+                            }
+                        }
                     }
                 }, j
         ));
@@ -271,6 +703,9 @@ int main(int argc, char **argv) {
 
 
     reclaim = true;
+    for (int i = 0; i < sconf.threads; ++i) {
+        parking[i].wakeAll();
+    }
 
 
     std::cerr << "Awake and joining\n";
@@ -278,78 +713,712 @@ int main(int argc, char **argv) {
         t.join();
     }
     auto endTime = std::chrono::high_resolution_clock::now();
+    double cpu = cpuSeconds() - startCpu;
+    if (tracker)
+        tracker->stop();
+    if (adapter)
+        adapter->stop();
+
+    changeMonitor.stop();
+    changeMonitor.print(std::cout);
+
+    if (snapshotTaken.valid()) {
+        size_t pairs = snapshotTaken.get();
+        std::chrono::duration<double> snapshotDur = snapshotEnd - snapshotStart;
+        std::chrono::duration<double> runDur = endTime - startTime;
+        std::cout << "TABLE: Snapshot" << std::endl;
+        std::cout << "Start (s)\tDuration (s)\tPairs\tThroughput during (Mops)\tThroughput overall (Mops)" << std::endl;
+        std::cout << std::chrono::duration<double>(snapshotStart - startTime).count() << "\t" << snapshotDur.count()
+                  << "\t" << pairs << "\t" << sconf.batchSize * batchesDuringSnapshot / snapshotDur.count() / 1e6
+                  << "\t" << sconf.batchSize * batchesRun / runDur.count() / 1e6 << std::endl;
+        std::cout << std::endl;
+    }
 
     size_t ops = client.getOps();
 
-    std::sort(times.begin(), times.end(),
-              [](const std::pair<std::chrono::high_resolution_clock::time_point, std::vector<std::chrono::high_resolution_clock::time_point>> &lhs,
-                 const std::pair<std::chrono::high_resolution_clock::time_point, std::vector<std::chrono::high_resolution_clock::time_point>> &rhs) {
-                  return lhs.first < rhs.first;
-              });
+    std::chrono::duration<double> dur = endTime - startTime;
+    std::chrono::duration<double> durArr = endTimeArrival - startTime;
+    if (batchesRun > 0) {
+        printLatencies(sconf);
 
-    std::vector<std::pair<std::chrono::high_resolution_clock::time_point, std::vector<double>>> times2;
+        LatencyHistogram wait;
+        for (auto &w : waits) {
+            wait.merge(*w);
+        }
+        double us = tsc_clock_t::nsPerTick() / 1e3;
+        std::cout << "TABLE: Dispatch" << std::endl;
+        std::cout << "Dispatch\tWorkers\tBatches\tSteals\tSlow batches (%)\tWait mean (us)\tWait p50 (us)"
+                     "\tWait p99 (us)\tWait p999 (us)\tWait max (us)" << std::endl;
+        std::cout << (stealing ? "stealing" : "static") << "\t" << sconf.threads << "\t" << batchesRun << "\t"
+                  << q.getSteals() << "\t" << sconf.slowBatchPercent << "\t" << (double) wait.sum / wait.total * us
+                  << "\t" << wait.percentile(50) * us << "\t" << wait.percentile(99) * us << "\t"
+                  << wait.percentile(99.9) * us << "\t" << wait.max * us << std::endl;
+        std::cout << std::endl;
 
-    for (auto &t : times) {
-        std::vector<double> tmp;
-        for (auto &t2 : t.second) {
-            tmp.push_back(std::chrono::duration<double>(t2 - t.first).count());
+        printCpu(sconf, batchesRun / dur.count(), dur.count(), cpu);
+
+        if (tracker) {
+            auto &l = tracker->getLatency();
+            std::cout << "TABLE: Open Loop" << std::endl;
+            std::cout << "Arrival\tOffered (batches/s)\tOffered (Mops)\tAchieved (Mops)\tBatches\tMean (us)"
+                         "\tp50 (us)\tp99 (us)\tp999 (us)\tMax (us)\tMax send lag (us)" << std::endl;
+            std::cout << sconf.arrival << "\t" << sconf.batchRate << "\t"
+                      << (double) sconf.batchRate * sconf.batchSize / 1e6 << "\t"
+                      << tracker->getRequests() / tracker->getSeconds() / 1e6 << "\t" << tracker->getCompleted()
+                      << "\t" << (double) l.sum / std::max<uint64_t>(1, l.total) / 1e3 << "\t"
+                      << l.percentile(50) / 1e3 << "\t" << l.percentile(99) / 1e3 << "\t"
+                      << l.percentile(99.9) / 1e3 << "\t" << l.max / 1e3 << "\t" << maxSendLag / 1e3 << std::endl;
+            std::cout << std::endl;
         }
-        times2.push_back({t.first, tmp});
-    }
 
-    std::chrono::duration<double> dur = endTime - startTime;
-    std::chrono::duration<double> durArr = endTimeArrival - startTime;
-    if (!times.empty()) {
-        auto s = times[0].first;
-        std::cout << "TABLE: Latency of Hot Storage" << std::endl;
-        std::cout << "Timestamp\tAvg Latency\tMin Latency\tMax Latency" << std::endl;
-        for (auto &t : times2) {
+        client.stat();
 
-            double avg = 0.0;
-            std::for_each(t.second.begin(), t.second.end(), [&avg](double d) {
-                avg += d;
-            });
+        if (adapter)
+            adapter->print(std::cout);
 
-            avg /= t.second.size();
+        if (!sconf.chromeTraceFile.empty() && !client.writeChromeTrace(sconf.chromeTraceFile)) {
+            std::cerr << "Could not write " << sconf.chromeTraceFile << std::endl;
+        }
 
-            std::cout << std::chrono::duration<double>(t.first - s).count() << "\t" << avg * 1e3 << "\t"
-                      << t.second[0] * 1e3 << "\t" << t.second[t.second.size() - 1] * 1e3 << std::endl;
+        std::cerr << "Arrival Rate (Mops) " << (sconf.batchSize * batchesRun) / durArr.count() / 1e6 << std::endl;
+        std::cerr << "Throughput (Mops) " << ((double) ops + client.getHits() + client.getDedups()) / dur.count() / 1e6
+                  << std::endl;
+
+        std::cerr << "Hit Rate\tHits" << std::endl;
+        std::cerr << client.hitRate() << "\t" << client.getHits() << std::endl;
+        std::cerr << std::endl;
+
+        std::cerr << "Dedup Ratio\tDeduplicated GETs" << std::endl;
+        std::cerr << client.getDedups() / (double) (sconf.batchSize * batchesRun) << "\t" << client.getDedups()
+                  << std::endl;
+        std::cerr << std::endl;
+
+        if (auto wal = client.getWAL()) {
+            std::cout << "TABLE: Write-Ahead Log" << std::endl;
+            std::cout << "Commit interval (us)\tCommits\tRecords\tMB written\tRecords per commit" << std::endl;
+            std::cout << wal->getInterval().count() << "\t" << wal->getCommits() << "\t" << wal->getRecords() << "\t"
+                      << wal->getBytes() / 1e6 << "\t"
+                      << (double) wal->getRecords() / std::max<size_t>(1, wal->getCommits()) << std::endl;
+            std::cout << std::endl;
         }
 
-        //delete barrier;
+        if (auto spill = client.getSpill()) {
+            std::cout << "TABLE: Spill Tier" << std::endl;
+            std::cout << "Keys\tSegments\tMB on disk\tMB live\tLookups\tHits\tCompactions" << std::endl;
+            std::cout << spill->getKeys() << "\t" << spill->getSegments() << "\t" << spill->getBytes() / 1e6 << "\t"
+                      << spill->getLiveBytes() / 1e6 << "\t" << spill->getLookups() << "\t" << spill->getHits()
+                      << "\t" << spill->getCompactions() << std::endl;
+            std::cout << std::endl;
+        }
 
+        std::cout << "TABLE: Throughput" << std::endl;
+        std::cout << "Throughput" << std::endl;
+        std::cout << ((double) ops + client.getHits() + client.getDedups()) / dur.count() / 1e6 << std::endl;
+    }
+    dlclose(handler);
+    return 0;
+}
+
+std::atomic_bool interrupted{false};
+
+/**
+ * Serves the network and shared memory front-ends until SIGINT or SIGTERM, or for serveSeconds if it is set, and
+ * prints their stats
+ * @param client
+ * @param sconf
+ * @return the exit code
+ */
+int serveNetwork(Client &client, const ServerConf &sconf) {
+    NetFrontend<Model> frontend(client, sconf.ioThreads, sconf.batchSize);
+    if (sconf.port > 0 && !frontend.listen(sconf.port))
+        return 1;
+    if (!sconf.unixSocket.empty() && !frontend.listen(0, sconf.unixSocket))
+        return 1;
+    if (sconf.memcachedPort > 0 && !frontend.listen(sconf.memcachedPort, "", NET_PROTO_MEMCACHED))
+        return 1;
+    bool sockets = sconf.port > 0 || !sconf.unixSocket.empty() || sconf.memcachedPort > 0;
+    ShmFrontend<Model> shm(client, sconf.shmWorkers, sconf.batchSize);
+    if (!sconf.shmName.empty() && !shm.open(sconf.shmName, sconf.shmClients, sconf.shmEntries, sconf.shmValueSize))
+        return 1;
+    TraceWriter recorder;
+    if (!sconf.recordFile.empty()) {
+        if (!recorder.open(sconf.recordFile))
+            return 1;
+        frontend.setRecorder(&recorder);
+        shm.setRecorder(&recorder);
+    }
+
+    signal(SIGINT, [](int) { interrupted = true; });
+    signal(SIGTERM, [](int) { interrupted = true; });
+    signal(SIGPIPE, SIG_IGN);
+
+    auto startTime = std::chrono::high_resolution_clock::now();
+    double startCpu = cpuSeconds();
+    if (sockets)
+        frontend.start();
+    if (!sconf.shmName.empty())
+        shm.start();
+    std::cerr << "Serving";
+    if (sconf.port > 0)
+        std::cerr << " on port " << sconf.port;
+    if (!sconf.unixSocket.empty())
+        std::cerr << " on " << sconf.unixSocket;
+    if (sconf.memcachedPort > 0)
+        std::cerr << " memcached on port " << sconf.memcachedPort;
+    if (!sconf.shmName.empty())
+        std::cerr << " on shared memory " << sconf.shmName;
+    std::cerr << std::endl;
+    while (!interrupted.load() && (sconf.serveSeconds <= 0 || std::chrono::high_resolution_clock::now() - startTime <
+                                                                 std::chrono::seconds(sconf.serveSeconds))) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    double cpu = cpuSeconds() - startCpu;
+    frontend.stop();
+    shm.stop();
+    if (!sconf.recordFile.empty()) {
+        recorder.close();
+        std::cerr << "Recorded " << recorder.getBatches() << " batches to " << sconf.recordFile << std::endl;
+    }
+    std::chrono::duration<double> dur = std::chrono::high_resolution_clock::now() - startTime;
+
+    if (!sconf.unixSocket.empty())
+        unlink(sconf.unixSocket.c_str());
+
+    client.stat();
+
+    std::cout << "TABLE: Network" << std::endl;
+    std::cout << "Connections\tRequests\tBatches\tRequests per batch\tMB in\tMB out\tThroughput (Mops)" << std::endl;
+    std::cout << frontend.getConnections() << "\t" << frontend.getRequests() << "\t" << frontend.getBatches() << "\t"
+              << (double) frontend.getRequests() / std::max<size_t>(1, frontend.getBatches()) << "\t"
+              << frontend.getBytesIn() / 1e6 << "\t" << frontend.getBytesOut() / 1e6 << "\t"
+              << frontend.getRequests() / dur.count() / 1e6 << std::endl;
+    std::cout << std::endl;
+
+    if (!sconf.shmName.empty()) {
+        std::cout << "TABLE: Shared Memory" << std::endl;
+        std::cout << "Clients\tRequests\tBatches\tRequests per batch\tWorker sleeps\tThroughput (Mops)" << std::endl;
+        std::cout << shm.getClients() << "\t" << shm.getRequests() << "\t" << shm.getBatches() << "\t"
+                  << (double) shm.getRequests() / std::max<size_t>(1, shm.getBatches()) << "\t" << shm.getSleeps()
+                  << "\t" << shm.getRequests() / dur.count() / 1e6 << std::endl;
         std::cout << std::endl;
+    }
 
-        std::cout << "TABLE: Hot Storage Latencies" << std::endl;
-        std::cout << "Latency" << std::endl;
-        for (auto &t : times2) {
-            for (auto &t2 : t.second) {
-                std::cout << t2 * 1e3 << std::endl;
+    printCpu(sconf, (frontend.getBatches() + shm.getBatches()) / dur.count(), dur.count(), cpu);
+    return 0;
+}
+
+/**
+ * Writes the population and totalBatches workload batches to a trace, which traceWorkload replays without the cost
+ * of generating them
+ * @param sconf
+ * @param generateWorkloadBatch
+ * @param getPopulationBatches
+ * @return the exit code
+ */
+int recordWorkload(const ServerConf &sconf, BatchWrapper (*generateWorkloadBatch)(unsigned int *, unsigned),
+                   std::vector<BatchWrapper> (*getPopulationBatches)(unsigned int *, unsigned)) {
+    TraceWriter trace;
+    if (!trace.open(sconf.recordFile))
+        return 1;
+    auto release = [](BatchWrapper &b) {
+        for (auto &r : b) {
+            if (r.value != nullptr) {
+                delete[] r.value->data;
+                delete r.value;
             }
         }
+    };
 
-        std::cout << std::endl;
+    unsigned seed = time(nullptr);
+    for (auto &b : getPopulationBatches(&seed, BATCHSIZE)) {
+        trace.record(b, true);
+        release(b);
+    }
+    for (int i = 0; i < totalBatches; ++i) {
+        BatchWrapper b = generateWorkloadBatch(&seed, sconf.batchSize);
+        trace.record(b);
+        release(b);
+    }
+    size_t batches = trace.getBatches();
+    size_t records = trace.getRecords();
+    if (!trace.close()) {
+        std::cerr << "Could not write " << sconf.recordFile << std::endl;
+        return 1;
+    }
 
+    std::cout << "TABLE: Trace" << std::endl;
+    std::cout << "File\tBatches\tRequests" << std::endl;
+    std::cout << sconf.recordFile << "\t" << batches << "\t" << records << std::endl;
+    std::cout << std::endl;
+    return 0;
+}
 
-        client.stat();
+/**
+ * Runs the workload on shared nothing shards, one worker thread per shard. The workload threads split every batch
+ * by shard as it is generated and send a shard a batch once batchSize of its requests are staged, so a worker only
+ * touches its own cache and backend queues.
+ * @param sconf
+ * @param conf the slabs, split between the shards
+ * @param generateWorkloadBatch
+ * @param getPopulationBatches
+ * @param getWorkloadPhase null if the workload has no phases
+ * @param setWorkloadThread null if the workload does not seed by thread
+ * @return the exit code
+ */
+int runPartitioned(const ServerConf &sconf, const std::vector<PartitionedSlabUnifiedConfig> &conf,
+                   BatchWrapper (*generateWorkloadBatch)(unsigned int *, unsigned),
+                   std::vector<BatchWrapper> (*getPopulationBatches)(unsigned int *, unsigned),
+                   int (*getWorkloadPhase)(), void (*setWorkloadThread)(int, int)) {
+    using RB = std::shared_ptr<ResultsBuffers<data_t>>;
 
-        std::cerr << "Arrival Rate (Mops) " << (sconf.batchSize * times.size()) / durArr.count() / 1e6 << std::endl;
-        std::cerr << "Throughput (Mops) " << ((double) ops + client.getHits()) / dur.count() / 1e6 << std::endl;
+    Shards shards(sconf.threads, conf);
+    int n = shards.size();
 
-        std::cerr << "Hit Rate\tHits" << std::endl;
-        std::cerr << client.hitRate() << "\t" << client.getHits() << std::endl;
+    if (!sconf.modelFile.empty() && !loadModel(shards, sconf.modelFile))
+        return 1;
+
+    size_t recovered = 0;
+    if (sconf.recover) {
+        auto recoverStart = std::chrono::high_resolution_clock::now();
+        recovered = shards.recover(sconf.snapshotFile);
+        std::chrono::duration<double> recoverTime = std::chrono::high_resolution_clock::now() - recoverStart;
+        std::cerr << "Recovered writes\tRecovery (s)" << std::endl;
+        std::cerr << recovered << "\t" << recoverTime.count() << std::endl;
         std::cerr << std::endl;
+    }
+    if (sconf.snapshot) {
+        std::cerr << "Snapshots are only taken in the shared mode" << std::endl;
+    }
 
-        std::cout << "TABLE: Throughput" << std::endl;
-        std::cout << "Throughput" << std::endl;
-        std::cout << ((double) ops + client.getHits()) / dur.count() / 1e6 << std::endl;
+    // pads the staged requests of a shard to a multiple of 512 and takes them
+    auto seal = [](BatchWrapper &staged) {
+        BatchWrapper b;
+        b.swap(staged);
+        b.resize((b.size() + 511) / 512 * 512, {0, nullptr, REQUEST_EMPTY});
+        return b;
+    };
+
+    // a recovered store already holds its data, populating it again would overwrite the recovered values
+    if (recovered == 0) {
+        unsigned popSeed = time(nullptr);
+        auto pop = getPopulationBatches(&popSeed, BATCHSIZE);
+        if (!sconf.bulkLoad || !bulkPopulate(shards, pop)) {
+            for (auto &b : pop) {
+                std::vector<BatchWrapper> staged(n);
+                for (auto &r : b) {
+                    staged[shards.shardOf(r.key)].push_back(r);
+                }
+                for (int s = 0; s < n; ++s) {
+                    if (staged[s].empty())
+                        continue;
+                    int size = staged[s].size();
+                    BatchWrapper sb = seal(staged[s]);
+                    auto rb = std::make_shared<ResultsBuffers<data_t>>(sb.size());
+                    shards[s].batch(sb, rb);
+                    for (int i = 0; i < size; i++) {
+                        while (rb->requestIDs[i] == -1);
+                    }
+                }
+            }
+        }
     }
-    delete block;
-    dlclose(handler);
+
+    shards.resetStats();
+
+    std::vector<std::thread> threads;
+    std::vector<std::atomic_size_t> batchesRun(n);
+    std::vector<std::atomic_size_t> requestsRun(n);
+    std::atomic_bool reclaim{false};
+
+    /// the requests of one shard, phase is the newest workload phase among the batches they were staged from
+    struct shard_batch_t {
+        BatchWrapper batch;
+        RB rb;
+        int phase;
+    };
+
+    tbb::concurrent_queue<shard_batch_t> *q = new tbb::concurrent_queue<shard_batch_t>[n];
+    std::unique_ptr<parking_t[]> parking(new parking_t[n]);
+
+    for (int i = 0; i < n; ++i) {
+        batchesRun[i] = 0;
+        requestsRun[i] = 0;
+        threads.push_back(std::thread([&shards, &batchesRun, &reclaim, &q, &parking](int shard) {
+            WORKER_CPUS.pin();
+            backoff_t backoff;
+            shard_batch_t p;
+            while (!reclaim) {
+                if (q[shard].try_pop(p)) {
+                    backoff.reset();
+                    shards[shard].batch(p.batch, p.rb);
+                    answerPhase(p.batch, p.rb, p.phase);
+                    batchesRun[shard]++;
+                } else {
+                    backoff.wait(parking[shard], [&]() { return reclaim || !q[shard].empty(); });
+                }
+            }
+            while (q[shard].try_pop(p)) {
+                shards[shard].batch(p.batch, p.rb);
+                answerPhase(p.batch, p.rb, p.phase);
+                batchesRun[shard]++;
+            }
+        }, i));
+    }
+    std::unique_ptr<ModelAdapter<Shards>> adapter;
+    if (sconf.adapt != "off") {
+        adapter.reset(new ModelAdapter<Shards>(shards, adaptConf(sconf, shards.getCacheCapacity()),
+                                               getWorkloadPhase ? getAnsweredPhase : nullptr));
+        adapter->start();
+    }
+
+    auto startTime = std::chrono::high_resolution_clock::now();
+    double startCpu = cpuSeconds();
+
+    ModelChangeMonitor<Shards> changeMonitor(shards, std::chrono::milliseconds(10));
+    if (sconf.changeModel >= 0)
+        changeMonitor.start();
+
+    std::vector<std::thread> threads2;
+    int clients = CLIENT_THREADS;
+    for (int j = 0; j < clients; j++) {
+        threads2.push_back(std::thread(
+                [clients, n, &q, &parking, &sconf, generateWorkloadBatch, getWorkloadPhase, setWorkloadThread,
+                        &shards, &requestsRun, &seal, &changeMonitor, &adapter](int tid) {
+                    GENERATOR_CPUS.pin();
+                    if (setWorkloadThread)
+                        setWorkloadThread(tid, clients);
+                    unsigned tseed = time(nullptr) + tid;
+                    std::vector<BatchWrapper> staged(n);
+                    std::vector<int> stagedPhase(n, 0);
+                    auto send = [&](int s) {
+                        requestsRun[s] += staged[s].size();
+                        BatchWrapper b = seal(staged[s]);
+                        RB rb = std::make_shared<ResultsBuffers<data_t>>(b.size());
+                        q[s].push({std::move(b), rb, stagedPhase[s]});
+                        parking[s].wake();
+                    };
+                    arrivals_t arrivals(sconf.batchRate, clients, sconf.arrival == "poisson", tseed);
+                    for (int i = 0; i < totalBatches / clients; i++) {
+                        arrivals.next();
+                        if (sconf.changeModel >= 0 && tid == 0 && i == totalBatches / clients / 10) {
+                            auto tmp = Model(sconf.changeModel);
+                            changeMonitor.change(tmp);
+                        }
+                        BatchWrapper batch = generateWorkloadBatch(&tseed, sconf.batchSize);
+                        int phase = getWorkloadPhase ? getWorkloadPhase() : 0;
+                        if (adapter)
+                            adapter->observe(batch);
+                        for (auto &r : batch) {
+                            int s = shards.shardOf(r.key);
+                            staged[s].push_back(r);
+                            stagedPhase[s] = std::max(stagedPhase[s], phase);
+                            if ((int) staged[s].size() == sconf.batchSize)
+                                send(s);
+                        }
+                    }
+                    for (int s = 0; s < n; ++s) {
+                        if (!staged[s].empty())
+                            send(s);
+                    }
+                }, j
+        ));
+    }
+    for (auto &t : threads2) {
+        t.join();
+    }
+    auto endTimeArrival = std::chrono::high_resolution_clock::now();
+
+    reclaim = true;
+    for (int s = 0; s < n; ++s) {
+        parking[s].wakeAll();
+    }
+
+    std::cerr << "Awake and joining\n";
+    for (auto &t : threads) {
+        t.join();
+    }
+    auto endTime = std::chrono::high_resolution_clock::now();
+    double cpu = cpuSeconds() - startCpu;
+    delete[] q;
+    if (adapter)
+        adapter->stop();
+
+    changeMonitor.stop();
+    changeMonitor.print(std::cout);
+
+    size_t batches = 0;
+    size_t requests = 0;
+    for (int s = 0; s < n; ++s) {
+        batches += batchesRun[s];
+        requests += requestsRun[s];
+    }
+    if (batches == 0)
+        return 0;
+
+    std::chrono::duration<double> dur = endTime - startTime;
+    std::chrono::duration<double> durArr = endTimeArrival - startTime;
+    size_t ops = shards.getOps();
+
+    printLatencies(sconf);
+
+    printCpu(sconf, batches / dur.count(), dur.count(), cpu);
+
+    shards.stat();
+
+    if (adapter)
+        adapter->print(std::cout);
+
+    std::cerr << "Arrival Rate (Mops) " << requests / durArr.count() / 1e6 << std::endl;
+    std::cerr << "Throughput (Mops) " << ((double) ops + shards.getHits() + shards.getDedups()) / dur.count() / 1e6
+              << std::endl;
+
+    std::cerr << "Hit Rate\tHits" << std::endl;
+    std::cerr << shards.hitRate() << "\t" << shards.getHits() << std::endl;
+    std::cerr << std::endl;
+
+    std::cout << "TABLE: Shards" << std::endl;
+    std::cout << "Shard\tBatches\tRequests\tHit Rate" << std::endl;
+    for (int s = 0; s < n; ++s) {
+        std::cout << s << "\t" << batchesRun[s] << "\t" << requestsRun[s] << "\t" << shards[s].hitRate() << std::endl;
+    }
+    std::cout << std::endl;
+
+    std::cout << "TABLE: Throughput" << std::endl;
+    std::cout << "Throughput" << std::endl;
+    std::cout << ((double) ops + shards.getHits() + shards.getDedups()) / dur.count() / 1e6 << std::endl;
     return 0;
 }
 
+/**
+ * Prints the latency summary and writes it to latencyFile if set
+ * @param sconf
+ */
+void printLatencies(const ServerConf &sconf) {
+    auto latencies = LatencyStats::global().summary();
+
+    std::cout << "TABLE: Latency" << std::endl;
+    std::cout << "Request\tTier\tCount\tMean (ms)\tp50 (ms)\tp99 (ms)\tp999 (ms)\tMax (ms)" << std::endl;
+    for (auto &l : latencies) {
+        std::cout << l.request << "\t" << l.tier << "\t" << l.count << "\t" << l.mean << "\t" << l.p50 << "\t"
+                  << l.p99 << "\t" << l.p999 << "\t" << l.max << std::endl;
+    }
+    std::cout << std::endl;
+
+    if (!sconf.latencyFile.empty()) {
+        writeLatencies(sconf.latencyFile, latencies);
+    }
+}
+
 void usage(char *command) {
     using namespace std;
     cout << command << " [-f <config file>]" << std::endl;
 }
+
+/**
+ * Writes the latency summary as JSON if filename ends in .json and as CSV otherwise
+ * @param filename
+ * @param latencies
+ */
+void writeLatencies(const std::string &filename, const std::vector<LatencySummary> &latencies) {
+    std::string ext = ".json";
+    if (filename.size() >= ext.size() && filename.compare(filename.size() - ext.size(), ext.size(), ext) == 0) {
+        pt::ptree root;
+        pt::ptree rows;
+        for (auto &l : latencies) {
+            pt::ptree row;
+            row.put("request", l.request);
+            row.put("tier", l.tier);
+            row.put("count", l.count);
+            row.put("mean_ms", l.mean);
+            row.put("p50_ms", l.p50);
+            row.put("p99_ms", l.p99);
+            row.put("p999_ms", l.p999);
+            row.put("max_ms", l.max);
+            rows.push_back({"", row});
+        }
+        root.add_child("latency", rows);
+        pt::write_json(filename, root);
+    } else {
+        std::ofstream out(filename);
+        out << "request,tier,count,mean_ms,p50_ms,p99_ms,p999_ms,max_ms" << std::endl;
+        for (auto &l : latencies) {
+            out << l.request << "," << l.tier << "," << l.count << "," << l.mean << "," << l.p50 << "," << l.p99
+                << "," << l.p999 << "," << l.max << std::endl;
+        }
+    }
+}
+
+/**
+ * Loads a population that only inserts with bulkLoad instead of batches and prints how long it took
+ * @param store a Client or the Shards
+ * @param pop
+ * @return false if the population does more than insert and has to go through batches
+ */
+template<typename Store>
+bool bulkPopulate(Store &store, const std::vector<BatchWrapper> &pop) {
+    std::vector<unsigned long long> keys;
+    std::vector<data_t *> values;
+    for (auto &b : pop) {
+        for (auto &r : b) {
+            if (r.requestInteger == REQUEST_EMPTY)
+                continue;
+            if (r.requestInteger != REQUEST_INSERT)
+                return false;
+            keys.push_back(r.key);
+            values.push_back(r.value);
+        }
+    }
+    auto loadStart = std::chrono::high_resolution_clock::now();
+    size_t loaded = store.bulkLoad(keys.data(), values.data(), keys.size());
+    std::chrono::duration<double> loadTime = std::chrono::high_resolution_clock::now() - loadStart;
+    std::cout << "TABLE: Bulk Load" << std::endl;
+    std::cout << "Pairs\tLoad (s)\tPairs/s" << std::endl;
+    std::cout << loaded << "\t" << loadTime.count() << "\t" << loaded / loadTime.count() << std::endl;
+    std::cout << std::endl;
+    return true;
+}
+
+/**
+ * Publishes the model trained offline into filename and waits until it is in place, before anything is cached
+ * @param store a Client or the Shards
+ * @param filename
+ * @return false if filename is not a model
+ */
+template<typename Store>
+bool loadModel(Store &store, const std::string &filename) {
+    model_file_header_t info{};
+    auto buckets = readModelFile(filename, info);
+    if (!buckets)
+        return false;
+    Model model{std::shared_ptr<const std::vector<bool>>(buckets)};
+    double publish = 0;
+    store.change_model(model, publish).wait();
+    std::cout << "TABLE: Model File" << std::endl;
+    std::cout << "Buckets\tCached Buckets\tCached Keys\tBudget (keys)\tTrained Accesses\tTrained Hit Rate" << std::endl;
+    std::cout << info.buckets << "\t" << info.cached << "\t" << info.keys << "\t" << info.budget << "\t"
+              << info.accesses << "\t" << info.hitRate << std::endl;
+    std::cout << std::endl;
+    return true;
+}
+
+/**
+ * The adaptation settings of sconf, cacheBudget 0 budgets what the caches hold before their sets grow
+ * @param sconf
+ * @param cacheCapacity
+ * @return
+ */
+adapt_conf_t adaptConf(const ServerConf &sconf, size_t cacheCapacity) {
+    adapt_conf_t c{};
+    c.retrain = sconf.adapt == "retrain";
+    c.buckets = std::max(1, sconf.modelBuckets);
+    c.report = std::chrono::milliseconds(std::max(1, sconf.reportMs));
+    c.retrainEvery = std::max(1, sconf.retrainMs / std::max(1, sconf.reportMs));
+    c.sample = std::max(1, sconf.adaptSample);
+    c.decay = sconf.adaptDecay;
+    c.margin = sconf.adaptMargin;
+    c.budget = sconf.cacheBudget > 0 ? sconf.cacheBudget : cacheCapacity;
+    c.recoverFraction = sconf.recoverFraction;
+    return c;
+}
+
+/**
+ * CPU time of the process so far, user and system
+ * @return seconds
+ */
+double cpuSeconds() {
+    rusage ru{};
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+/**
+ * Prints how many cores the process kept busy while it served load batches per second
+ * @param sconf
+ * @param load
+ * @param wall seconds measured
+ * @param cpu CPU seconds used in that time
+ */
+void printCpu(const ServerConf &sconf, double load, double wall, double cpu) {
+    std::cout << "TABLE: CPU" << std::endl;
+    std::cout << "Idle\tLoad (batches/s)\tWall (s)\tCPU (s)\tCores busy" << std::endl;
+    std::cout << sconf.idle << "\t" << load << "\t" << wall << "\t" << cpu << "\t" << cpu / wall << std::endl;
+    std::cout << std::endl;
+}
+
+/**
+ * Gives the worker, backend, I/O and workload threads their CPUs before any of them starts. "auto" spreads them over
+ * the physical cores read from sysfs, an explicit CPU list of a role replaces what auto picked, and roles without
+ * CPUs are left to the scheduler. numaNode keeps auto on the CPUs of that node and prefers its memory. Prints the
+ * placement.
+ * @param sconf
+ * @param backends Slabs threads
+ * @param io front-end threads
+ * @return false if a CPU list does not parse
+ */
+bool placeThreads(const ServerConf &sconf, int backends, int io) {
+    cpu_role_t *roles[] = {&BACKEND_CPUS, &WORKER_CPUS, &IO_CPUS, &GENERATOR_CPUS};
+    const char *names[] = {"Backend", "Worker", "I/O", "Generator"};
+    // served clients replace the workers and the workload threads
+    bool serving = sconf.port > 0 || !sconf.unixSocket.empty() || sconf.memcachedPort > 0 || !sconf.shmName.empty();
+    int counts[] = {backends, serving ? 0 : sconf.threads, io, serving ? 0 : CLIENT_THREADS};
+    const std::string *lists[] = {&sconf.backendCpus, &sconf.workerCpus, &sconf.ioCpus, &sconf.generatorCpus};
+
+    if (sconf.placement == "auto") {
+        auto plan = planPlacement(readTopology(), std::vector<int>(counts, counts + 4), sconf.avoidSmt,
+                                  sconf.numaNode);
+        for (int r = 0; r < 4; ++r) {
+            roles[r]->cpus = plan[r];
+        }
+    } else if (sconf.placement != "none") {
+        std::cerr << "Unknown placement " << sconf.placement << ", expected none or auto" << std::endl;
+        return false;
+    }
+    for (int r = 0; r < 4; ++r) {
+        if (lists[r]->empty())
+            continue;
+        roles[r]->cpus = parseCpuList(*lists[r]);
+        if (roles[r]->cpus.empty()) {
+            std::cerr << "Bad CPU list for " << names[r] << " threads: " << *lists[r] << std::endl;
+            return false;
+        }
+    }
+    bindMemoryToNode(sconf.numaNode);
+
+    std::cout << "TABLE: Placement" << std::endl;
+    std::cout << "Role\tThreads\tCPUs" << std::endl;
+    for (int r = 0; r < 4; ++r) {
+        std::vector<int> cpus = roles[r]->cpus;
+        std::sort(cpus.begin(), cpus.end());
+        cpus.erase(std::unique(cpus.begin(), cpus.end()), cpus.end());
+        std::cout << names[r] << "\t" << counts[r] << "\t" << (cpus.empty() ? "any" : formatCpuList(cpus))
+                  << std::endl;
+    }
+    std::cout << std::endl;
+    return true;
+}
+
+int getAnsweredPhase() {
+    return answeredPhase.load();
+}
+
+/**
+ * Stamps the phase of a batch once all of its requests are answered, only the first batch of a newer phase than the
+ * stamped one is waited for
+ * @param batch
+ * @param rb the answers to the batch, packed into the first slots whatever the position of the request
+ * @param phase the workload phase the batch was generated in
+ */
+void answerPhase(const BatchWrapper &batch, const std::shared_ptr<ResultsBuffers<data_t>> &rb, int phase) {
+    if (phase <= answeredPhase.load())
+        return;
+    int requests = 0;
+    for (auto &r : batch) {
+        requests += r.requestInteger != REQUEST_EMPTY;
+    }
+    for (int i = 0; i < requests; ++i) {
+        while (rb->requestIDs[i] == -1)
+            cpu_relax();
+    }
+    int seen = answeredPhase.load();
+    while (phase > seen && !answeredPhase.compare_exchange_weak(seen, phase));
+}
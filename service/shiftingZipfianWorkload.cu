@@ -0,0 +1,182 @@
+/*
+ * Copyright (c) 2020-2021 dePaul Miller (dsm220@lehigh.edu)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <thread>
+#include <kvcg.cuh>
+#include <vector>
+#include "ZipfSampler.cuh"
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/json_parser.hpp>
+
+namespace pt = boost::property_tree;
+
+/*
+ * The zipfian workload with a hot set that moves. Rank r is key (r - 1 + offset) % range + 1, so the hot keys are a
+ * run of keys starting at the offset. When the population is smaller than the range the keys go through the
+ * permutation that spreads the population, so the hot set starts out loaded. Every shiftBatches batches handed out
+ * the phase goes up and the offset jumps by shiftKeys, or with drift the offset grows by shiftKeys over each phase one
+ * batch at a time. getWorkloadPhase tells the server the phase of every batch it generates.
+ */
+
+using BatchWrapper = std::vector<RequestWrapper<unsigned long long, data_t *>>;
+
+struct ShiftingWorkloadConfig {
+    ShiftingWorkloadConfig() {
+        theta = 0.99;
+        range = 1000000;
+        population = 1000000;
+        n = 10000;
+        keysize = 8;
+        ratio = 95;
+        shiftBatches = 2000;
+        shiftKeys = 250000;
+        drift = false;
+        seed = 0;
+    }
+
+    ShiftingWorkloadConfig(std::string filename) : ShiftingWorkloadConfig() {
+        pt::ptree root;
+        pt::read_json(filename, root);
+        theta = root.get<double>("theta", theta);
+        range = root.get<unsigned long long>("range", range);
+        population = root.get<unsigned long long>("population", range);
+        n = root.get<int>("n", n);
+        keysize = root.get<size_t>("keysize", keysize);
+        ratio = root.get<int>("ratio", ratio);
+        shiftBatches = root.get<unsigned long long>("shiftBatches", shiftBatches);
+        shiftKeys = root.get<unsigned long long>("shiftKeys", shiftKeys);
+        drift = root.get<bool>("drift", drift);
+        seed = root.get<unsigned long long>("seed", seed);
+    }
+
+    ~ShiftingWorkloadConfig() {}
+
+    double theta;
+    unsigned long long range;
+    /// keys loaded before the run, spread over the range
+    unsigned long long population;
+    int n;
+    size_t keysize;
+    int ratio;
+    /// batches in a phase
+    unsigned long long shiftBatches;
+    /// keys the hot set moves in a phase
+    unsigned long long shiftKeys;
+    /// moves the hot set a little every batch instead of all at once when the phase changes
+    bool drift;
+    /// seeds every thread from this instead of the seed the server passes when not 0, and the population spread
+    unsigned long long seed;
+};
+
+ShiftingWorkloadConfig shiftingWorkloadConfig;
+ZipfDistribution zipf;
+/// spreads the population over the range, seeded from the config so every run loads the same keys
+key_permutation_t spread;
+std::atomic<unsigned long long> batchesHandedOut{0};
+/// the phase of the last batch the calling thread generated
+thread_local int batchPhase = 0;
+
+void setupWorkload() {
+    ShiftingWorkloadConfig &c = shiftingWorkloadConfig;
+    if (c.range == 0 || c.shiftBatches == 0 || c.population > c.range) {
+        std::cerr << "range and shiftBatches have to be at least 1 and population at most range" << std::endl;
+        exit(1);
+    }
+    zipf = ZipfDistribution(c.range, c.theta);
+    spread = key_permutation_t(c.range, c.seed + 1);
+}
+
+extern "C" int getBatchesToRun() {
+    return shiftingWorkloadConfig.n;
+}
+
+extern "C" void initWorkload() {
+    setupWorkload();
+}
+
+extern "C" void initWorkloadFile(std::string filename) {
+    shiftingWorkloadConfig = ShiftingWorkloadConfig(filename);
+    setupWorkload();
+}
+
+/**
+ * Names the calling thread before it generates its first batch
+ * @param thread index of the thread, from 0
+ * @param threads threads that generate batches
+ */
+extern "C" void setWorkloadThread(int thread, int threads) {
+    nameWorkloadThread(thread);
+}
+
+/**
+ * The phase of the last batch the calling thread generated, the phases start at 0
+ */
+extern "C" int getWorkloadPhase() {
+    return batchPhase;
+}
+
+extern "C" BatchWrapper generateWorkloadBatch(unsigned int *seed, unsigned batchsize) {
+    ShiftingWorkloadConfig &c = shiftingWorkloadConfig;
+    zipf_rng_t &rng = threadRng(c.seed != 0 ? c.seed : *seed);
+
+    unsigned long long b = batchesHandedOut.fetch_add(1);
+    unsigned long long phase = b / c.shiftBatches;
+    batchPhase = (int) phase;
+    unsigned __int128 moved = (unsigned __int128) phase * c.shiftKeys;
+    if (c.drift)
+        moved += (unsigned __int128) (b % c.shiftBatches) * c.shiftKeys / c.shiftBatches;
+    unsigned long long offset = moved % c.range;
+
+    std::vector<uint64_t> ranks(batchsize);
+    zipf.fill(rng, ranks.data(), batchsize);
+
+    BatchWrapper vec;
+    vec.reserve(batchsize);
+    for (unsigned i = 0; i < batchsize; i++) {
+        unsigned long long key = (ranks[i] - 1 + offset) % c.range;
+        key = (c.population < c.range ? spread(key) : key) + 1;
+        if ((int) rng.below(100) < c.ratio) {
+            vec.push_back({key, nullptr, REQUEST_GET});
+        } else if (rng.below(100) < 50) {
+            vec.push_back({key, new data_t(c.keysize), REQUEST_INSERT});
+        } else {
+            vec.push_back({key, nullptr, REQUEST_REMOVE});
+        }
+    }
+    return vec;
+}
+
+/**
+ * population distinct keys spread over the range by the spread permutation, all of it when population is range
+ */
+extern "C" std::vector<BatchWrapper> getPopulationBatches(unsigned int *seed, unsigned batchsize) {
+    size_t n = shiftingWorkloadConfig.population;
+
+    return buildPopulation<BatchWrapper>(n, batchsize, [&](size_t i) {
+        return BatchWrapper::value_type{spread(i) + 1, new data_t(shiftingWorkloadConfig.keysize), REQUEST_INSERT};
+    });
+}
@@ -0,0 +1,74 @@
+#!/bin/bash
+# Measures what persistence costs. The throughput of a run without the ordered index, with it, and with it and a
+# snapshot taken a tenth into the run (with the throughput while the snapshot was written), all with the write-ahead
+# log on. Then the recovery time from the whole log against the snapshot and the log after it. Size the store with
+# the workload config, e.g. 100M keys.
+# usage: snapshot.sh <kvcg> <config> [workload config|-] [workload library] [directory for the files]
+
+if [ $# -lt 2 ]; then
+    echo "usage: $0 <kvcg> <config> [workload config|-] [workload library] [directory for the files]"
+    exit 1
+fi
+
+KVCG=$1
+CONFIG=$2
+WORKLOAD_CONFIG=${3:--}
+LIB=${4:-./libzipfianWorkload.so}
+DIR=${5:-.}
+WAL="$DIR/snapshot_bench.wal"
+SNAP="$DIR/snapshot_bench.snap"
+RUN_CONFIG=$(mktemp --suffix=.json)
+OUT=$(mktemp)
+trap 'rm -f "$RUN_CONFIG" "$OUT" "$WAL" "$WAL.tmp" "$SNAP" "$SNAP.tmp"' EXIT
+
+# run <ordered index> <snapshot> <recover> <snapshot file>, leaves stdout and stderr of the server in $OUT
+run() {
+    python3 - "$CONFIG" "$RUN_CONFIG" "$WAL" "$1" "$2" "$3" "$4" <<'PY'
+import json, sys
+conf = json.load(open(sys.argv[1]))
+conf["walFile"] = sys.argv[3]
+conf["orderedIndex"] = sys.argv[4] == "1"
+conf["snapshot"] = sys.argv[5] == "1"
+conf["recover"] = sys.argv[6] == "1"
+conf["snapshotFile"] = sys.argv[7]
+json.dump(conf, open(sys.argv[2], "w"), indent=4)
+PY
+    args=(-f "$RUN_CONFIG" -l "$LIB")
+    [ "$WORKLOAD_CONFIG" != - ] && args+=(-w "$WORKLOAD_CONFIG")
+    "$KVCG" "${args[@]}" >"$OUT" 2>&1
+}
+
+throughput() {
+    awk '/^TABLE: Throughput/ { getline; getline; print; exit }' "$OUT"
+}
+
+# records and seconds of the recovery
+recovery() {
+    awk '/^Recovered writes\tRecovery/ { getline; print; exit }' "$OUT"
+}
+
+echo "TABLE: Snapshot Overhead"
+echo -e "Run\tThroughput (Mops)\tThroughput during snapshot (Mops)\tSnapshot (s)\tPairs"
+rm -f "$WAL" "$SNAP"
+run 0 0 0 ""
+echo -e "no index\t$(throughput)\t\t\t"
+
+# the log of this run has every write, it is recovered from alone below
+rm -f "$WAL" "$SNAP"
+run 1 0 0 ""
+echo -e "index\t$(throughput)\t\t\t"
+run 0 0 1 ""
+LOG_ONLY=$(recovery)
+
+rm -f "$WAL" "$SNAP"
+run 1 1 0 "$SNAP"
+row=$(awk '/^TABLE: Snapshot$/ { getline; getline; print; exit }' "$OUT")
+echo -e "index and snapshot\t$(throughput)\t$(echo "$row" | cut -f4)\t$(echo "$row" | cut -f2)\t$(echo "$row" | cut -f3)"
+run 1 0 1 "$SNAP"
+FROM_SNAPSHOT=$(recovery)
+echo
+
+echo "TABLE: Recovery"
+echo -e "From\tRecords\tRecovery (s)"
+echo -e "log\t$LOG_ONLY"
+echo -e "snapshot and log\t$FROM_SNAPSHOT"
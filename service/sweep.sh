@@ -0,0 +1,44 @@
+#!/bin/bash
+# Runs an open loop at each offered batch rate and prints the Open Loop rows, the throughput against p99 curve of
+# the config. Works with any workload library.
+# usage: sweep.sh <kvcg> <config> <constant|poisson> <batches/s>... [-l workload library]
+
+if [ $# -lt 4 ]; then
+    echo "usage: $0 <kvcg> <config> <constant|poisson> <batches/s>... [-l workload library]"
+    exit 1
+fi
+
+KVCG=$1
+CONFIG=$2
+ARRIVAL=$3
+shift 3
+LIB=./libzipfianWorkload.so
+RATES=()
+while [ $# -gt 0 ]; do
+    if [ "$1" = -l ]; then
+        LIB=$2
+        shift 2
+    else
+        RATES+=("$1")
+        shift
+    fi
+done
+RUN_CONFIG=$(mktemp --suffix=.json)
+trap 'rm -f "$RUN_CONFIG"' EXIT
+
+echo "TABLE: Open Loop"
+first=1
+for rate in "${RATES[@]}"; do
+    python3 - "$CONFIG" "$RUN_CONFIG" "$ARRIVAL" "$rate" <<'PY'
+import json, sys
+conf = json.load(open(sys.argv[1]))
+conf["partitioned"] = False
+conf["loadMode"] = "open"
+conf["arrival"] = sys.argv[3]
+conf["batchRate"] = int(sys.argv[4])
+json.dump(conf, open(sys.argv[2], "w"), indent=4)
+PY
+    "$KVCG" -f "$RUN_CONFIG" -l "$LIB" 2>/dev/null |
+        awk -v first=$first '/^TABLE: Open Loop/ { getline; if (first) print; getline; print; exit }'
+    first=0
+done
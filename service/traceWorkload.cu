@@ -0,0 +1,151 @@
+/*
+ * Copyright (c) 2020-2021 dePaul Miller (dsm220@lehigh.edu)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <kvcg.cuh>
+#include <vector>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/json_parser.hpp>
+#include "Trace.cuh"
+
+namespace pt = boost::property_tree;
+
+/*
+ * Replays a trace written by TraceWriter. The values of the inserts are allocated and the records patched to point
+ * at them when the trace is loaded, so during the run a batch is a copy of mapped records and nothing else. The store
+ * owns every insert value it is given, so batches handed out after the trace wrapped around get fresh values.
+ */
+
+using BatchWrapper = std::vector<RequestWrapper<unsigned long long, data_t *>>;
+
+struct TraceWorkloadConfig {
+    TraceWorkloadConfig() {
+        const char *env = getenv("KVCG_TRACE");
+        trace = env ? env : "workload.trace";
+        batches = 0;
+    }
+
+    TraceWorkloadConfig(std::string filename) {
+        pt::ptree root;
+        pt::read_json(filename, root);
+        trace = root.get<std::string>("trace", "workload.trace");
+        batches = root.get<int>("batches", 0);
+    }
+
+    ~TraceWorkloadConfig() {}
+
+    std::string trace;
+    /// batches to run, 0 runs the trace once
+    int batches;
+};
+
+TraceWorkloadConfig traceWorkloadConfig;
+TraceReader traceReader;
+/// value offsets of the workload records, for copies once the trace wrapped around
+std::vector<uint64_t> valueOffsets;
+std::atomic_size_t nextBatch{0};
+
+void loadTrace() {
+    if (!traceReader.open(traceWorkloadConfig.trace))
+        exit(1);
+    if (traceReader.getBatches() == traceReader.getPopulationBatches()) {
+        std::cerr << traceWorkloadConfig.trace << " has no batches to run" << std::endl;
+        exit(1);
+    }
+    size_t first = traceReader.firstRecord(traceReader.getPopulationBatches());
+    valueOffsets.resize(traceReader.getRecords() - first);
+    for (size_t i = first; i < traceReader.getRecords(); ++i) {
+        trace_record_t *r = traceReader.record(i);
+        valueOffsets[i - first] = r->value;
+        r->value = (uint64_t) traceReader.value(*r);
+    }
+}
+
+/**
+ * Batch b of the trace padded to a multiple of 512 with REQUEST_EMPTY, which get no answers and are not counted by the
+ * open loop tracker. The records are copied: batch takes a vector it may pad and the store keeps the insert values, so
+ * handing out a view of the mapped trace would not spare the copy, it would only move it into the store.
+ * @param b
+ * @param fresh copy the values instead of handing out the preallocated ones
+ * @return
+ */
+BatchWrapper traceBatch(size_t b, bool fresh) {
+    size_t n;
+    trace_record_t *r = traceReader.batch(b, n);
+    auto *first = reinterpret_cast<const RequestWrapper<unsigned long long, data_t *> *>(r);
+    BatchWrapper vec;
+    vec.reserve((n + 511) / 512 * 512);
+    vec.assign(first, first + n);
+    if (fresh) {
+        size_t first = traceReader.firstRecord(traceReader.getPopulationBatches());
+        for (size_t i = 0; i < n; ++i) {
+            trace_record_t copy = r[i];
+            copy.value = valueOffsets[traceReader.firstRecord(b) + i - first];
+            vec[i].value = traceReader.value(copy);
+        }
+    }
+    vec.resize((n + 511) / 512 * 512, {0, nullptr, REQUEST_EMPTY});
+    return vec;
+}
+
+extern "C" int getBatchesToRun() {
+    if (traceWorkloadConfig.batches > 0)
+        return traceWorkloadConfig.batches;
+    return traceReader.getBatches() - traceReader.getPopulationBatches();
+}
+
+extern "C" void initWorkload() {
+    loadTrace();
+}
+
+extern "C" void initWorkloadFile(std::string filename) {
+    traceWorkloadConfig = TraceWorkloadConfig(filename);
+    loadTrace();
+}
+
+/**
+ * Hands out the recorded batches in order to whichever thread asks, the recorded size wins over batchsize
+ */
+extern "C" BatchWrapper generateWorkloadBatch(unsigned int *seed, unsigned batchsize) {
+    size_t pop = traceReader.getPopulationBatches();
+    size_t workload = traceReader.getBatches() - pop;
+    size_t i = nextBatch++;
+    return traceBatch(pop + i % workload, i >= workload);
+}
+
+extern "C" std::vector<BatchWrapper> getPopulationBatches(unsigned int *seed, unsigned batchsize) {
+    std::vector<BatchWrapper> batches;
+    for (size_t b = 0; b < traceReader.getPopulationBatches(); ++b) {
+        size_t n;
+        trace_record_t *r = traceReader.batch(b, n);
+        BatchWrapper vec;
+        for (size_t i = 0; i < n; ++i) {
+            vec.push_back({r[i].key, traceReader.value(r[i]), r[i].request});
+        }
+        vec.resize((n + 511) / 512 * 512, {0, nullptr, REQUEST_EMPTY});
+        batches.push_back(std::move(vec));
+    }
+    return batches;
+}
@@ -0,0 +1,42 @@
+#!/bin/bash
+# Runs a config under each YCSB workload library and prints the throughput and hit rate of every workload. The
+# libraries are looked for next to kvcg. A workload config, - for none, overrides the record count, mix and so on of
+# every workload but keeps the one each library is named after unless it names a workload itself.
+# usage: ycsb.sh <kvcg> <config> [workload config|-] [a|b|c|d|e|f|hotspot]...
+
+if [ $# -lt 2 ]; then
+    echo "usage: $0 <kvcg> <config> [workload config|-] [a|b|c|d|e|f|hotspot]..."
+    exit 1
+fi
+
+KVCG=$1
+CONFIG=$2
+WORKLOAD_CONFIG=${3:--}
+shift $(($# < 3 ? $# : 3))
+WORKLOADS=("$@")
+if [ ${#WORKLOADS[@]} -eq 0 ]; then
+    WORKLOADS=(a b c d e f hotspot)
+fi
+LIBDIR=$(dirname "$KVCG")
+RUN_WORKLOAD=$(mktemp --suffix=.json)
+trap 'rm -f "$RUN_WORKLOAD"' EXIT
+
+echo "TABLE: YCSB"
+echo -e "Workload\tThroughput (Mops)\tHit Rate"
+for w in "${WORKLOADS[@]}"; do
+    args=(-f "$CONFIG" -l "$LIBDIR/libycsbWorkload_$w.so")
+    if [ "$WORKLOAD_CONFIG" != - ]; then
+        python3 - "$WORKLOAD_CONFIG" "$RUN_WORKLOAD" "$w" <<'PY'
+import json, sys
+conf = json.load(open(sys.argv[1]))
+conf.setdefault("workload", sys.argv[3])
+json.dump(conf, open(sys.argv[2], "w"), indent=4)
+PY
+        args+=(-w "$RUN_WORKLOAD")
+    fi
+    "$KVCG" "${args[@]}" 2>&1 |
+        awk -v w=$w '
+            /^TABLE: Throughput/ { getline; getline; tput = $1 }
+            /^Hit Rate\tHits/ { getline; hit = $1 }
+            END { print w "\t" tput "\t" hit }'
+done
@@ -0,0 +1,299 @@
+/*
+ * Copyright (c) 2020-2021 dePaul Miller (dsm220@lehigh.edu)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <thread>
+#include <kvcg.cuh>
+#include <vector>
+#include "ZipfSampler.cuh"
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/json_parser.hpp>
+
+namespace pt = boost::property_tree;
+
+/*
+ * The YCSB core workloads. Records are keyed 1..recordCount in load order and new inserts take the keys after them,
+ * dealt between the threads in turn, so a scan is a run of consecutive keys. Batches carry no scans, a scan is sent
+ * as GETs of the keys it covers. A read-modify-write is a GET and an INSERT of the same key next to each other in the
+ * batch. Every library built from this file starts from the workload it is named after, a config file can pick
+ * another one and override any part.
+ */
+
+#ifndef YCSB_WORKLOAD
+#define YCSB_WORKLOAD "a"
+#endif
+
+using BatchWrapper = std::vector<RequestWrapper<unsigned long long, data_t *>>;
+
+struct YcsbWorkloadConfig {
+    YcsbWorkloadConfig() {
+        preset(YCSB_WORKLOAD);
+    }
+
+    YcsbWorkloadConfig(std::string filename) {
+        pt::ptree root;
+        pt::read_json(filename, root);
+        preset(root.get<std::string>("workload", YCSB_WORKLOAD));
+        n = root.get<int>("n", n);
+        recordCount = root.get<unsigned long long>("recordCount", recordCount);
+        valueSize = root.get<size_t>("valueSize", valueSize);
+        readProportion = root.get<double>("readProportion", readProportion);
+        updateProportion = root.get<double>("updateProportion", updateProportion);
+        insertProportion = root.get<double>("insertProportion", insertProportion);
+        scanProportion = root.get<double>("scanProportion", scanProportion);
+        rmwProportion = root.get<double>("rmwProportion", rmwProportion);
+        maxScanLength = root.get<int>("maxScanLength", maxScanLength);
+        distribution = root.get<std::string>("distribution", distribution);
+        theta = root.get<double>("theta", theta);
+        scramble = root.get<bool>("scramble", scramble);
+        hotsetFraction = root.get<double>("hotsetFraction", hotsetFraction);
+        hotOpnFraction = root.get<double>("hotOpnFraction", hotOpnFraction);
+        seed = root.get<unsigned long long>("seed", seed);
+    }
+
+    ~YcsbWorkloadConfig() {}
+
+    /**
+     * Sets the mix and distribution of YCSB workload a to f, or hotspot for workload b over a hotspot distribution
+     * @param w
+     */
+    void preset(const std::string &w) {
+        workload = w;
+        n = 10000;
+        recordCount = 1000000;
+        valueSize = 100;
+        readProportion = 0;
+        updateProportion = 0;
+        insertProportion = 0;
+        scanProportion = 0;
+        rmwProportion = 0;
+        maxScanLength = 100;
+        distribution = "zipfian";
+        theta = 0.99;
+        scramble = true;
+        hotsetFraction = 0.2;
+        hotOpnFraction = 0.8;
+        seed = 0;
+        if (w == "a") {
+            readProportion = 0.5;
+            updateProportion = 0.5;
+        } else if (w == "b") {
+            readProportion = 0.95;
+            updateProportion = 0.05;
+        } else if (w == "c") {
+            readProportion = 1;
+        } else if (w == "d") {
+            readProportion = 0.95;
+            insertProportion = 0.05;
+            distribution = "latest";
+        } else if (w == "e") {
+            scanProportion = 0.95;
+            insertProportion = 0.05;
+        } else if (w == "f") {
+            readProportion = 0.5;
+            rmwProportion = 0.5;
+        } else if (w == "hotspot") {
+            readProportion = 0.95;
+            updateProportion = 0.05;
+            distribution = "hotspot";
+        } else {
+            std::cerr << "Unknown YCSB workload " << w << std::endl;
+            exit(1);
+        }
+    }
+
+    std::string workload;
+    int n;
+    unsigned long long recordCount;
+    size_t valueSize;
+    double readProportion;
+    double updateProportion;
+    double insertProportion;
+    double scanProportion;
+    double rmwProportion;
+    /// scan lengths are uniform in 1..maxScanLength
+    int maxScanLength;
+    /// uniform, zipfian, latest or hotspot
+    std::string distribution;
+    double theta;
+    /// spreads the popular zipfian ranks over the key space instead of on the lowest keys
+    bool scramble;
+    /// the hot set is the lowest hotsetFraction of the keys and gets hotOpnFraction of the operations
+    double hotsetFraction;
+    double hotOpnFraction;
+    /// seeds every thread from this instead of the seed the server passes when not 0
+    unsigned long long seed;
+};
+
+enum key_distribution_t {
+    KEYS_UNIFORM, KEYS_ZIPFIAN, KEYS_LATEST, KEYS_HOTSPOT
+};
+
+YcsbWorkloadConfig ycsbWorkloadConfig;
+key_distribution_t keyDistribution;
+ZipfDistribution zipf;
+key_permutation_t scrambler;
+/// threads generating batches, set by the harness through setWorkloadThread
+std::atomic<int> workloadThreads{1};
+/// inserts of the calling thread, its n-th insert takes key recordCount + n * workloadThreads + workloadThread + 1
+thread_local unsigned long long threadInserts = 0;
+
+void setupWorkload() {
+    YcsbWorkloadConfig &c = ycsbWorkloadConfig;
+    if (c.recordCount == 0 || c.maxScanLength < 1) {
+        std::cerr << "recordCount and maxScanLength have to be at least 1" << std::endl;
+        exit(1);
+    }
+    if (c.distribution == "uniform") {
+        keyDistribution = KEYS_UNIFORM;
+    } else if (c.distribution == "zipfian") {
+        keyDistribution = KEYS_ZIPFIAN;
+    } else if (c.distribution == "latest") {
+        keyDistribution = KEYS_LATEST;
+    } else if (c.distribution == "hotspot") {
+        keyDistribution = KEYS_HOTSPOT;
+    } else {
+        std::cerr << "Unknown distribution " << c.distribution << std::endl;
+        exit(1);
+    }
+    zipf = ZipfDistribution(c.recordCount, c.theta);
+    scrambler = key_permutation_t(c.recordCount, c.seed + 1);
+}
+
+/**
+ * Keys the calling thread takes to exist, the records and the inserts of every thread up to its own count. The
+ * other threads insert at the same pace in the same mix, so a key past theirs is at most a few inserts away.
+ * @return
+ */
+unsigned long long insertedKeys() {
+    return ycsbWorkloadConfig.recordCount + threadInserts * workloadThreads.load(std::memory_order_relaxed);
+}
+
+/**
+ * An existing key drawn from the request distribution
+ * @param rng
+ * @return
+ */
+unsigned long long nextKey(zipf_rng_t &rng) {
+    YcsbWorkloadConfig &c = ycsbWorkloadConfig;
+    unsigned long long keys = insertedKeys();
+    switch (keyDistribution) {
+        case KEYS_ZIPFIAN: {
+            uint64_t rank = zipf.sample(rng);
+            return c.scramble ? scrambler(rank - 1) + 1 : rank;
+        }
+        case KEYS_LATEST:
+            // the most recent insert is the most popular
+            return keys - std::min<unsigned long long>(zipf.sample(rng), keys) + 1;
+        case KEYS_HOTSPOT: {
+            unsigned long long hot = std::max<unsigned long long>(1, keys * c.hotsetFraction);
+            if (hot >= keys || rng.uniform() < c.hotOpnFraction)
+                return rng.below(hot) + 1;
+            return hot + rng.below(keys - hot) + 1;
+        }
+        default:
+            return rng.below(keys) + 1;
+    }
+}
+
+extern "C" int getBatchesToRun() {
+    return ycsbWorkloadConfig.n;
+}
+
+extern "C" void initWorkload() {
+    setupWorkload();
+}
+
+extern "C" void initWorkloadFile(std::string filename) {
+    ycsbWorkloadConfig = YcsbWorkloadConfig(filename);
+    setupWorkload();
+}
+
+/**
+ * Names the calling thread before it generates its first batch
+ * @param thread index of the thread, from 0
+ * @param threads threads that generate batches
+ */
+extern "C" void setWorkloadThread(int thread, int threads) {
+    workloadThreads = threads;
+    nameWorkloadThread(thread);
+    threadInserts = 0;
+}
+
+/**
+ * Operations of the mix until the batch is full, a scan that does not fit is cut short
+ */
+extern "C" BatchWrapper generateWorkloadBatch(unsigned int *seed, unsigned batchsize) {
+    YcsbWorkloadConfig &c = ycsbWorkloadConfig;
+    zipf_rng_t &rng = threadRng(c.seed != 0 ? c.seed : *seed);
+
+    BatchWrapper vec;
+    vec.reserve(batchsize);
+
+    double read = c.readProportion;
+    double update = read + c.updateProportion;
+    double insert = update + c.insertProportion;
+    double scan = insert + c.scanProportion;
+    double total = scan + c.rmwProportion;
+
+    while (vec.size() < batchsize) {
+        double op = rng.uniform() * total;
+        if (op < read) {
+            vec.push_back({nextKey(rng), nullptr, REQUEST_GET});
+        } else if (op < update) {
+            vec.push_back({nextKey(rng), new data_t(c.valueSize), REQUEST_INSERT});
+        } else if (op < insert) {
+            unsigned long long key = c.recordCount + threadInserts++ * workloadThreads + workloadThread + 1;
+            vec.push_back({key, new data_t(c.valueSize), REQUEST_INSERT});
+        } else if (op < scan) {
+            unsigned long long start = nextKey(rng);
+            unsigned long long keys = insertedKeys();
+            unsigned long long length = rng.below(c.maxScanLength) + 1;
+            length = std::min<unsigned long long>({length, keys - start + 1, batchsize - vec.size()});
+            for (unsigned long long k = start; k < start + length; ++k) {
+                vec.push_back({k, nullptr, REQUEST_GET});
+            }
+        } else {
+            unsigned long long key = nextKey(rng);
+            vec.push_back({key, nullptr, REQUEST_GET});
+            if (vec.size() < batchsize)
+                vec.push_back({key, new data_t(c.valueSize), REQUEST_INSERT});
+        }
+    }
+    return vec;
+}
+
+/**
+ * The load phase, keys 1..recordCount in order, built by every hardware thread
+ */
+extern "C" std::vector<BatchWrapper> getPopulationBatches(unsigned int *seed, unsigned batchsize) {
+    size_t n = ycsbWorkloadConfig.recordCount;
+    size_t valueSize = ycsbWorkloadConfig.valueSize;
+
+    return buildPopulation<BatchWrapper>(n, batchsize, [&](size_t i) {
+        return BatchWrapper::value_type{i + 1, new data_t(valueSize), REQUEST_INSERT};
+    });
+}
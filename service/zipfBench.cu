@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2020-2021 dePaul Miller (dsm220@lehigh.edu)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <chrono>
+#include <climits>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+#include <unistd.h>
+#include <zipf.hh>
+#include "ZipfSampler.cuh"
+
+/*
+ * Times the setup and the sampling rate of ZipfDistribution against the zeta based betterstd sampler for ranges from
+ * 10^6 to 10^10. The zeta sampler is only timed up to the -z range since its setup sums over the whole range.
+ */
+
+void usage(char *command) {
+    std::cerr << command << ": [-t theta] [-s samples] [-z largest range for the zeta sampler]" << std::endl;
+}
+
+int main(int argc, char **argv) {
+    double theta = 0.99;
+    size_t samples = 10000000;
+    unsigned long long zetaLimit = 100000000;
+
+    int c;
+    while ((c = getopt(argc, argv, "t:s:z:")) != -1) {
+        switch (c) {
+            case 't':
+                theta = atof(optarg);
+                break;
+            case 's':
+                samples = strtoull(optarg, nullptr, 10);
+                break;
+            case 'z':
+                zetaLimit = strtoull(optarg, nullptr, 10);
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    using clock = std::chrono::steady_clock;
+    std::vector<uint64_t> keys(512);
+    uint64_t checksum = 0;
+
+    std::cout << "TABLE: Zipf" << std::endl;
+    std::cout << "Range\tTheta\tSetup (us)\tSamples/s\tBatch samples/s\tZeta setup (s)\tZeta samples/s" << std::endl;
+    for (unsigned long long range = 1000000; range <= 10000000000ULL; range *= 10) {
+        auto start = clock::now();
+        ZipfDistribution zipf(range, theta);
+        double setup = std::chrono::duration<double, std::micro>(clock::now() - start).count();
+
+        zipf_rng_t rng(range);
+        start = clock::now();
+        for (size_t i = 0; i < samples; ++i) {
+            checksum += zipf.sample(rng);
+        }
+        double scalar = samples / std::chrono::duration<double>(clock::now() - start).count();
+
+        start = clock::now();
+        for (size_t i = 0; i < samples; i += keys.size()) {
+            zipf.fill(rng, keys.data(), keys.size());
+            checksum += keys[0];
+        }
+        double batch = samples / std::chrono::duration<double>(clock::now() - start).count();
+
+        std::cout << range << "\t" << theta << "\t" << setup << "\t" << scalar << "\t" << batch << "\t";
+        if (range <= zetaLimit && range <= INT_MAX) {
+            start = clock::now();
+            double zetaN = betterstd::zeta(theta, (int) range);
+            double zetaSetup = std::chrono::duration<double>(clock::now() - start).count();
+            unsigned seed = range;
+            start = clock::now();
+            for (size_t i = 0; i < samples; ++i) {
+                checksum += betterstd::rand_zipf_r(&seed, (int) range, zetaN, theta);
+            }
+            double zeta = samples / std::chrono::duration<double>(clock::now() - start).count();
+            std::cout << zetaSetup << "\t" << zeta << std::endl;
+        } else {
+            std::cout << "-\t-" << std::endl;
+        }
+    }
+    std::cout << std::endl;
+    std::cerr << "Checksum " << checksum << std::endl;
+    return 0;
+}
@@ -26,18 +26,15 @@
 #include <atomic>
 #include <kvcg.cuh>
 #include <vector>
-#include <zipf.hh>
+#include "ZipfSampler.cuh"
 #include <boost/property_tree/ptree.hpp>
 #include <boost/property_tree/json_parser.hpp>
-#include <set>
 
 namespace pt = boost::property_tree;
 
 
 using BatchWrapper = std::vector<RequestWrapper<unsigned long long, data_t *>>;
 
-double zetaN = 0.1;
-
 struct ZipfianWorkloadConfig {
     ZipfianWorkloadConfig() {
         theta = 0.99;
@@ -46,61 +43,86 @@ struct ZipfianWorkloadConfig {
         ops = 10000;
         keysize = 8;
         ratio = 95;
+        seed = 0;
     }
 
     ZipfianWorkloadConfig(std::string filename) {
         pt::ptree root;
         pt::read_json(filename, root);
         theta = root.get<double>("theta", 0.99);
-        range = root.get<int>("range", 10000000);
+        range = root.get<unsigned long long>("range", 10000000);
         n = root.get<int>("n", 10000);
         ops = root.get<int>("ops", 10000);
         keysize = root.get<size_t>("keysize", 8);
         ratio = root.get<int>("ratio", 95);
+        seed = root.get<unsigned long long>("seed", 0);
     }
 
 
     ~ZipfianWorkloadConfig() {}
 
     double theta;
-    int range;
+    unsigned long long range;
     int n;
     int ops;
     size_t keysize;
     int ratio;
+    /// seeds every thread from this instead of the seed the server passes when not 0
+    unsigned long long seed;
 };
 
 ZipfianWorkloadConfig zipfianWorkloadConfig;
+ZipfDistribution zipf;
+
+/**
+ * The seed of the workload, the config seed or the seed the server passed when the config has none
+ * @param seed
+ * @return
+ */
+uint64_t workloadSeed(const unsigned *seed) {
+    return zipfianWorkloadConfig.seed != 0 ? zipfianWorkloadConfig.seed : *seed;
+}
+
+/**
+ * Names the calling thread before it generates its first batch
+ * @param thread index of the thread, from 0
+ * @param threads threads that generate batches
+ */
+extern "C" void setWorkloadThread(int thread, int threads) {
+    nameWorkloadThread(thread);
+}
 
 extern "C" int getBatchesToRun() {
     return zipfianWorkloadConfig.n;
 }
 
 extern "C" void initWorkload() {
-    zetaN = betterstd::zeta(zipfianWorkloadConfig.theta, zipfianWorkloadConfig.range);
+    zipf = ZipfDistribution(zipfianWorkloadConfig.range, zipfianWorkloadConfig.theta);
 }
 
 extern "C" void initWorkloadFile(std::string filename) {
     zipfianWorkloadConfig = ZipfianWorkloadConfig(filename);
-    zetaN = betterstd::zeta(zipfianWorkloadConfig.theta, zipfianWorkloadConfig.range);
+    zipf = ZipfDistribution(zipfianWorkloadConfig.range, zipfianWorkloadConfig.theta);
 }
 
 std::vector<RequestWrapper<unsigned long long, data_t *>>
-generateWorkloadZipfLargeKey(size_t keySize, int size, double theta, int n, double zetaN, unsigned *seed,
-                             int ratioOfReads) {
+generateWorkloadZipfLargeKey(size_t keySize, int size, unsigned *seed, int ratioOfReads) {
 
     std::vector<RequestWrapper<unsigned long long, data_t *>> vec;
+    vec.reserve(size);
+
+    zipf_rng_t &rng = threadRng(workloadSeed(seed));
+    std::vector<uint64_t> keys(size);
+    zipf.fill(rng, keys.data(), size);
 
     for (int i = 0; i < size; i++) {
-        if (rand_r(seed) % 100 < ratioOfReads) {
-            vec.push_back({(unsigned long long) betterstd::rand_zipf_r(seed, n, zetaN, theta), nullptr, REQUEST_GET});
+        if ((int) rng.below(100) < ratioOfReads) {
+            vec.push_back({keys[i], nullptr, REQUEST_GET});
         } else {
-            if (rand_r(seed) % 100 < 50) {
-                vec.push_back({(unsigned long long) betterstd::rand_zipf_r(seed, n, zetaN, theta), new data_t(keySize),
-                               REQUEST_INSERT});
+            if (rng.below(100) < 50) {
+                vec.push_back({keys[i], new data_t(keySize), REQUEST_INSERT});
             } else {
-                vec.push_back(
-                        {(unsigned long long) betterstd::rand_zipf_r(seed, n, zetaN, theta), nullptr, REQUEST_REMOVE});
+                vec.push_back({keys[i], nullptr, REQUEST_REMOVE});
             }
         }
 
@@ -110,33 +132,23 @@ generateWorkloadZipfLargeKey(size_t keySize, int size, double theta, int n, doub
 }
 
 extern "C" BatchWrapper generateWorkloadBatch(unsigned int *seed, unsigned batchsize) {
-    return generateWorkloadZipfLargeKey(zipfianWorkloadConfig.keysize, batchsize, zipfianWorkloadConfig.theta,
-                                        zipfianWorkloadConfig.range, zetaN, seed, zipfianWorkloadConfig.ratio);
+    return generateWorkloadZipfLargeKey(zipfianWorkloadConfig.keysize, batchsize, seed, zipfianWorkloadConfig.ratio);
 }
 
+/**
+ * n distinct keys in 1..range. The i-th key is where one random permutation of the range maps i, so the keys are
+ * distinct without a set and every hardware thread fills whole batches on its own.
+ */
 extern "C" std::vector<BatchWrapper> getPopulationBatches(unsigned int *seed, unsigned batchsize) {
 
-    std::set<unsigned long long> keys;
-
-    if (zipfianWorkloadConfig.range < zipfianWorkloadConfig.n) {
+    if (zipfianWorkloadConfig.range < (unsigned long long) zipfianWorkloadConfig.n) {
         exit(1);
     }
 
-    while (keys.size() < zipfianWorkloadConfig.n) {
-        keys.insert((rand_r(seed) % zipfianWorkloadConfig.range) + 1);
-    }
-
-    std::vector<BatchWrapper> batches;
-    auto iter = keys.begin();
-
-    while (iter != keys.end()) {
-        std::vector<RequestWrapper<unsigned long long, data_t *>> vec;
-        for (int i = 0; i < batchsize && iter != keys.end(); i++) {
-            vec.push_back({*iter, new data_t(zipfianWorkloadConfig.keysize), REQUEST_INSERT});
-            ++iter;
-        }
-        batches.push_back(vec);
-    }
+    size_t n = zipfianWorkloadConfig.n;
+    key_permutation_t permutation(zipfianWorkloadConfig.range, threadRng(workloadSeed(seed)).next());
 
-    return batches;
+    return buildPopulation<BatchWrapper>(n, batchsize, [&](size_t i) {
+        return BatchWrapper::value_type{permutation(i) + 1, new data_t(zipfianWorkloadConfig.keysize), REQUEST_INSERT};
+    });
 }